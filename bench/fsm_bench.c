@@ -0,0 +1,981 @@
+/*
+ *
+ * File: fsm_bench.c
+ *
+ * Microbenchmarks for event dispatch, transitions and event queues
+ *
+ *     usage: fsm_bench [-n events] [-o results.csv] [name_prefix ...]
+ *
+ * Each benchmark runs its operation in batches of BENCH_BATCH and times every batch, so the
+ * results give throughput and the distribution of per-event latency. Results are printed and,
+ * with -o, written as CSV (one row per benchmark) for comparing runs.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+
+#include "fsm.h"
+#include "fsm_mailbox.h"
+#include "fsm_pool.h"
+#include "fsm_def.h"
+#include "fsm_rt.h"
+#include "fsm_timer.h"
+#include "fsm_image.h"
+#include "fsm_example_gen.h"
+
+#define BENCH_BATCH			256
+#define BENCH_DEFAULT_N		2000000L
+
+// defined in fsm_example.c
+void MyFsmInit (void);
+void MyFsmRun(eFsmEvent eventId);
+
+/**************************************************************************************************/
+// Generic handlers
+/**************************************************************************************************/
+
+FSM_EVENT_HANDLER( BenchConsume )	{ pEvent->consumed = true; return NULL; }
+
+// States are laid out in pairs in each machine's state array; toggle between the pair
+#define BENCH_TOGGLE_HANDLER(name,stateArray)								\
+	FSM_EVENT_HANDLER( name )												\
+	{																		\
+		FsmState *pFirst = &stateArray[0][0];								\
+		pEvent->consumed = true;											\
+		return pFirst + ((pState - pFirst) ^ 1);							\
+	}
+
+/**************************************************************************************************/
+// Deep machine: DEEP_LEVELS nested regions, two states per level.
+// Every state at level i has the region for level i+1 nested in it.
+// BEVT(i) toggles the state at level i; BEVT(40) is consumed by the top level only.
+// BEVT(41) is handled by the leaf, which toggles the state at level DEEP_LCA_LEVEL.
+/**************************************************************************************************/
+#define DEEP_LEVELS		12
+#define DEEP_TOP_EVENT	BEVT(40)
+#define DEEP_LCA_EVENT	BEVT(41)
+#define DEEP_LCA_LEVEL	(DEEP_LEVELS / 2)
+
+static Fsm			deepFsm[DEEP_LEVELS];
+static FsmState		deepState[DEEP_LEVELS][2];
+static FsmEvent		deepToggle[DEEP_LEVELS][2];
+static FsmEvent		deepConsume[2];
+static FsmEvent		deepLca[2];
+static FsmEvent *	deepEventList[DEEP_LEVELS][2][3];
+static Fsm *		deepNested[DEEP_LEVELS][2];
+static FSM_DISPATCH_TABLE( deepTable[DEEP_LEVELS][2] );
+
+BENCH_TOGGLE_HANDLER( DeepToggle, deepState )
+
+// transition from the leaf to a state in a region further up
+FSM_EVENT_HANDLER( DeepLcaToggle )
+{
+	FsmState	*pFirst = deepState[DEEP_LCA_LEVEL];
+
+	pEvent->consumed = true;
+	return pFirst + ((deepFsm[DEEP_LCA_LEVEL].pState - pFirst) ^ 1);
+}
+
+/**************************************************************************************************/
+static void DeepBuild (bool compile)
+{
+	int	i, s;
+
+	for (i=0; i<DEEP_LEVELS; i++)
+	{
+		deepFsm[i].name = "Deep";
+		deepFsm[i].pState = NULL;
+		deepNested[i][0] = (i + 1 < DEEP_LEVELS) ? &deepFsm[i + 1] : NULL;
+		deepNested[i][1] = NULL;
+
+		for (s=0; s<2; s++)
+		{
+			int	n = 0;
+
+			deepToggle[i][s].id = BEVT(i);
+			deepToggle[i][s].pfnEvtHandler = DeepToggle;
+			deepEventList[i][s][n++] = &deepToggle[i][s];
+
+			if (0 == i)
+			{
+				deepConsume[s].id = DEEP_TOP_EVENT;
+				deepConsume[s].pfnEvtHandler = BenchConsume;
+				deepEventList[i][s][n++] = &deepConsume[s];
+			}
+			else if (DEEP_LEVELS - 1 == i)
+			{
+				deepLca[s].id = DEEP_LCA_EVENT;
+				deepLca[s].pfnEvtHandler = DeepLcaToggle;
+				deepEventList[i][s][n++] = &deepLca[s];
+			}
+			deepEventList[i][s][n] = &fsmNullEvent;
+
+			memset(&deepState[i][s], 0, sizeof(FsmState));
+			deepState[i][s].pFsm = &deepFsm[i];
+			deepState[i][s].nestedFsmList = (i + 1 < DEEP_LEVELS) ? deepNested[i] : NULL;
+			deepState[i][s].eventList = deepEventList[i][s];
+			deepState[i][s].name = s ? "B" : "A";
+			deepState[i][s].pfnStateHandler = FsmStateDefaultHandler;
+			deepState[i][s].notifyEventId = EVT_FSM_NULL;
+
+			if (compile)
+				FsmCompileState(&deepState[i][s], deepTable[i][s]);
+		}
+	}
+
+	// nested regions start in state A; only the top level gets an ENTRY dispatch
+	for (i=1; i<DEEP_LEVELS; i++)
+		deepFsm[i].pState = &deepState[i][0];
+	FsmInit(&deepFsm[0], &deepState[0][0]);
+}
+
+static void DeepSetupList (void)	{ DeepBuild(false); }
+static void DeepSetupTable (void)	{ DeepBuild(true); }
+
+static void DeepRunLeaf (long count)
+{
+	while (count--)
+		FsmRun(&deepFsm[0], BEVT(DEEP_LEVELS - 1));
+}
+
+static void DeepRunTop (long count)
+{
+	while (count--)
+		FsmRun(&deepFsm[0], BEVT(0));
+}
+
+static void DeepRunBubble (long count)
+{
+	while (count--)
+		FsmRun(&deepFsm[0], DEEP_TOP_EVENT);
+}
+
+static void DeepRunLca (long count)
+{
+	while (count--)
+		FsmRun(&deepFsm[0], DEEP_LCA_EVENT);
+}
+
+/**************************************************************************************************/
+// Wide machine: one top state with WIDE_REGIONS orthogonal regions, two states per region.
+// BEVT(i) toggles region i; BEVT(40) is consumed by every region.
+// BEVT(42) does WIDE_WORK loop iterations in every region, serially or on the worker pool.
+/**************************************************************************************************/
+#define WIDE_REGIONS	16
+#define WIDE_ALL_EVENT	BEVT(40)
+#define WIDE_WORK_EVENT	BEVT(42)
+#define WIDE_WORK		200
+#define WIDE_THREADS	4
+
+static Fsm			wideTop;
+static FsmState		wideTopState;
+static FsmEvent *	wideTopEventList[] = { &fsmNullEvent };
+static Fsm			wideFsm[WIDE_REGIONS];
+static FsmState		wideState[WIDE_REGIONS][2];
+static FsmEvent		wideToggle[WIDE_REGIONS][2];
+static FsmEvent		wideConsume[WIDE_REGIONS][2];
+static FsmEvent		wideWork[WIDE_REGIONS][2];
+static FsmEvent *	wideEventList[WIDE_REGIONS][2][4];
+static int			wideParallel;
+static bool			wideInterest;
+static FSM_INTEREST( wideFsmInterest[WIDE_REGIONS] );
+static FSM_INTEREST( wideStateInterest[WIDE_REGIONS][2] );
+static FSM_INTEREST( wideTopInterest );
+static FSM_INTEREST( wideTopStateInterest );
+static Fsm *		wideNested[WIDE_REGIONS + 1];
+static FSM_DISPATCH_TABLE( wideTable[WIDE_REGIONS][2] );
+static FSM_DISPATCH_TABLE( wideTopTable );
+
+BENCH_TOGGLE_HANDLER( WideToggle, wideState )
+
+FSM_EVENT_HANDLER( WideDoWork )
+{
+	volatile unsigned	x = 0;
+	int					i;
+
+	for (i=0; i<WIDE_WORK; i++)
+		x = x * 31 + (unsigned)i;
+
+	pEvent->consumed = true;
+	return NULL;
+}
+
+/**************************************************************************************************/
+static void WideBuild (bool compile)
+{
+	int	i, s;
+
+	for (i=0; i<WIDE_REGIONS; i++)
+	{
+		wideFsm[i].name = "Region";
+		wideNested[i] = &wideFsm[i];
+
+		for (s=0; s<2; s++)
+		{
+			wideToggle[i][s].id = BEVT(i);
+			wideToggle[i][s].pfnEvtHandler = WideToggle;
+			wideConsume[i][s].id = WIDE_ALL_EVENT;
+			wideConsume[i][s].pfnEvtHandler = BenchConsume;
+			wideWork[i][s].id = WIDE_WORK_EVENT;
+			wideWork[i][s].pfnEvtHandler = WideDoWork;
+			wideEventList[i][s][0] = &wideToggle[i][s];
+			wideEventList[i][s][1] = &wideConsume[i][s];
+			wideEventList[i][s][2] = &wideWork[i][s];
+			wideEventList[i][s][3] = &fsmNullEvent;
+
+			memset(&wideState[i][s], 0, sizeof(FsmState));
+			wideState[i][s].pFsm = &wideFsm[i];
+			wideState[i][s].eventList = wideEventList[i][s];
+			wideState[i][s].name = s ? "B" : "A";
+			wideState[i][s].pfnStateHandler = FsmStateDefaultHandler;
+			wideState[i][s].notifyEventId = EVT_FSM_NULL;
+
+			if (compile)
+				FsmCompileState(&wideState[i][s], wideTable[i][s]);
+			if (wideInterest)
+				FsmCompileInterest(&wideState[i][s], &wideStateInterest[i][s]);
+		}
+		wideFsm[i].pState = &wideState[i][0];
+		FsmSetInterest(&wideFsm[i], wideInterest ? &wideFsmInterest[i] : NULL);
+	}
+	wideNested[WIDE_REGIONS] = NULL;
+
+	memset(&wideTopState, 0, sizeof(FsmState));
+	wideTopState.pFsm = &wideTop;
+	wideTopState.nestedFsmList = wideNested;
+	wideTopState.eventList = wideTopEventList;
+	wideTopState.name = "Top";
+	wideTopState.pfnStateHandler = FsmStateDefaultHandler;
+	wideTopState.notifyEventId = EVT_FSM_NULL;
+	FsmSetParallel(&wideTopState, wideParallel);
+	if (compile)
+		FsmCompileState(&wideTopState, wideTopTable);
+	if (wideInterest)
+		FsmCompileInterest(&wideTopState, &wideTopStateInterest);
+	FsmSetInterest(&wideTop, wideInterest ? &wideTopInterest : NULL);
+
+	wideTop.name = "Wide";
+	FsmInit(&wideTop, &wideTopState);
+}
+
+static void WideSetupList (void)	{ wideParallel = 0; wideInterest = false; WideBuild(false); }
+static void WideSetupTable (void)	{ wideParallel = 0; wideInterest = false; WideBuild(true); }
+static void WideSetupInterest (void)	{ wideParallel = 0; wideInterest = true; WideBuild(true); }
+
+static void WideSetupPool (void)
+{
+	FsmPoolStart(WIDE_THREADS - 1);		// the FSM thread is the other one
+	wideParallel = WIDE_REGIONS;
+	wideInterest = false;
+	WideBuild(true);
+}
+
+static void WideRunOne (long count)
+{
+	int	i = 0;
+
+	while (count--)
+	{
+		FsmRun(&wideTop, BEVT(i));
+		i = (i + 1) % WIDE_REGIONS;
+	}
+}
+
+static void WideRunAll (long count)
+{
+	while (count--)
+		FsmRun(&wideTop, WIDE_ALL_EVENT);
+}
+
+static void WideRunWork (long count)
+{
+	while (count--)
+		FsmRun(&wideTop, WIDE_WORK_EVENT);
+}
+
+/**************************************************************************************************/
+// Large event list: one state that consumes BIG_EVENTS different events
+/**************************************************************************************************/
+#define BIG_EVENTS		60
+
+static Fsm			bigFsm;
+static FsmState		bigState;
+static FsmEvent		bigEvent[BIG_EVENTS];
+static FsmEvent *	bigEventList[BIG_EVENTS + 1];
+static FSM_DISPATCH_TABLE( bigTable );
+
+/**************************************************************************************************/
+static void BigBuild (bool compile)
+{
+	int	i;
+
+	for (i=0; i<BIG_EVENTS; i++)
+	{
+		bigEvent[i].id = BEVT(i);
+		bigEvent[i].pfnEvtHandler = BenchConsume;
+		bigEventList[i] = &bigEvent[i];
+	}
+	bigEventList[BIG_EVENTS] = &fsmNullEvent;
+
+	memset(&bigState, 0, sizeof(FsmState));
+	bigState.pFsm = &bigFsm;
+	bigState.eventList = bigEventList;
+	bigState.name = "Big";
+	bigState.pfnStateHandler = FsmStateDefaultHandler;
+	bigState.notifyEventId = EVT_FSM_NULL;
+	if (compile)
+		FsmCompileState(&bigState, bigTable);
+
+	bigFsm.name = "Big";
+	FsmInit(&bigFsm, &bigState);
+}
+
+static void BigSetupList (void)		{ BigBuild(false); }
+static void BigSetupTable (void)	{ BigBuild(true); }
+
+static void BigRun (long count)
+{
+	int	i = 0;
+
+	while (count--)
+	{
+		FsmRun(&bigFsm, BEVT(i));
+		i = (i + 1) % BIG_EVENTS;
+	}
+}
+
+// the same events through FsmRunBatch, BENCH_BATCH at a time
+static void BigRunBatch (long count)
+{
+	static int	events[BENCH_BATCH];
+	int			i;
+
+	for (i=0; i<BENCH_BATCH; i++)
+		events[i] = BEVT(i % BIG_EVENTS);
+
+	while (count > 0)
+	{
+		int	n = (count < BENCH_BATCH) ? (int)count : BENCH_BATCH;
+
+		FsmRunBatch(&bigFsm, events, n);
+		count -= n;
+	}
+}
+
+/**************************************************************************************************/
+// Instances: INST_COUNT instances of one definition, events sent round robin.
+// Top level states A and B, each with a nested region of states a and b.
+// BEVT(0) toggles the top level, BEVT(1) toggles the nested region.
+/**************************************************************************************************/
+#define INST_COUNT		100000
+
+enum { INST_A, INST_B, INST_A_A, INST_A_B, INST_B_A, INST_B_B };
+
+static int InstToggle (FsmInst *pInst, FsmInstEvent *pEvent)
+{
+	(void)pInst;
+	pEvent->consumed = true;
+	return pEvent->state ^ 1;
+}
+
+static const FsmDefEvent	instTopEvents[] = { FSM_DEF_EVENT(BEVT(0), InstToggle), FSM_DEF_EVENT_EOL };
+static const FsmDefEvent	instNestedEvents[] = { FSM_DEF_EVENT(BEVT(1), InstToggle), FSM_DEF_EVENT_EOL };
+static const uint16_t		instNestedA[] = { 1, FSM_DEF_NONE };
+static const uint16_t		instNestedB[] = { 2, FSM_DEF_NONE };
+
+static const FsmDefState	instStates[] = {
+	FSM_DEF_STATE("A",  0, instNestedA, instTopEvents),
+	FSM_DEF_STATE("B",  0, instNestedB, instTopEvents),
+	FSM_DEF_STATE("Aa", 1, NULL,        instNestedEvents),
+	FSM_DEF_STATE("Ab", 1, NULL,        instNestedEvents),
+	FSM_DEF_STATE("Ba", 2, NULL,        instNestedEvents),
+	FSM_DEF_STATE("Bb", 2, NULL,        instNestedEvents),
+};
+static const FsmDefRegion	instRegions[] = {
+	FSM_DEF_REGION("Top", FSM_DEF_NONE, INST_A),
+	FSM_DEF_REGION("A",   INST_A,       INST_A_A),
+	FSM_DEF_REGION("B",   INST_B,       INST_B_A),
+};
+static FSM_DEF( instDef, "Inst", instStates, instRegions );
+
+static char *	instMemory;
+static size_t	instSize;
+static long		instNext;
+
+#define INST(i)		((FsmInst *)(instMemory + (size_t)(i) * instSize))
+
+static void InstInitAll (const FsmDef *pDef)
+{
+	long	i;
+
+	instSize = FSM_INST_SIZE(pDef->nRegions);
+	free(instMemory);
+	instMemory = (char *)malloc(instSize * INST_COUNT);
+
+	for (i=0; i<INST_COUNT; i++)
+		FsmInstInit(INST(i), pDef, NULL, NULL, NULL);
+
+	instNext = 0;
+}
+
+static void InstSetup (void)
+{
+	FsmDefCheck(&instDef);
+	InstInitAll(&instDef);
+}
+
+// The same instances dispatching from the packed tables (FsmDefPack)
+static void *	instPacked[64];
+
+static void InstPackedSetup (void)
+{
+	InstInitAll(FsmDefPack(&instDef, instPacked, sizeof(instPacked)));
+}
+
+static void InstRun (long count)
+{
+	long	i = instNext;
+
+	while (count--)
+	{
+		FsmInstRun(INST(i % INST_COUNT), BEVT((i / INST_COUNT) & 1));
+		i++;
+	}
+
+	instNext = i;
+}
+
+// Restore BENCH_BATCH instances at a time from an image of their states. Counted per instance.
+static void *	instImage;
+static long		instImageSize;
+
+static void InstImageSetup (void)
+{
+	InstSetup();
+
+	instImageSize = FsmInstImageSize(&instDef, instMemory, instSize, BENCH_BATCH, NULL, 0);
+	free(instImage);
+	instImage = malloc(instImageSize);
+	FsmInstImageSave(&instDef, instMemory, instSize, BENCH_BATCH, NULL, 0, instImage, instImageSize);
+}
+
+static void InstImageRestore (long count)
+{
+	long	i = 0;
+
+	for ( ; count > 0; count -= BENCH_BATCH)
+	{
+		FsmInstImageRestore(&instDef, INST(i), instSize, BENCH_BATCH, NULL, 0, instImage, instImageSize);
+		i = (i + BENCH_BATCH) % (INST_COUNT - BENCH_BATCH);
+	}
+}
+
+/**************************************************************************************************/
+// Runtime: RT_TASKS instances of the instance definition above on RT_WORKERS workers.
+// Events are posted round robin from the bench thread; each batch waits until the workers
+// have run all of it.
+/**************************************************************************************************/
+#define RT_TASKS		10000
+#define RT_WORKERS		4
+
+typedef FSM_MAILBOX( RtMailbox, 16 );
+
+static RtMailbox	rtMailbox[RT_TASKS];
+static FsmRtTask	rtTask[RT_TASKS];
+static long			rtNext;
+static uint64_t		rtPosted;
+
+static uint64_t RtEventsRun (void)
+{
+	FsmRtStats	stats[RT_WORKERS];
+	uint64_t	total = 0;
+	int			i;
+	int			n = FsmRtGetStats(stats, RT_WORKERS);
+
+	for (i=0; i<n; i++)
+		total += stats[i].events;
+
+	return total;
+}
+
+static void RtSetup (void)
+{
+	int	i;
+
+	FsmRtStop();
+	InstSetup();
+
+	for (i=0; i<RT_TASKS; i++)
+	{
+		FSM_MAILBOX_INIT(rtMailbox[i]);
+		FsmRtTaskInit(&rtTask[i], NULL, INST(i), (FsmMailbox *)&rtMailbox[i]);
+	}
+
+	rtNext = 0;
+	rtPosted = 0;
+	FsmRtStart(RT_WORKERS, true);
+}
+
+static void RtRun (long count)
+{
+	long	i = rtNext;
+
+	while (count--)
+	{
+		while (FsmRtPost(&rtTask[i % RT_TASKS], BEVT((i / RT_TASKS) & 1)) != 0)
+			sched_yield();
+		rtPosted++;
+		i++;
+	}
+
+	rtNext = i;
+
+	while (RtEventsRun() < rtPosted)
+		sched_yield();
+}
+
+/**************************************************************************************************/
+// Timers: TIMER_COUNT timers armed on one wheel.
+// arm_cancel re-arms one timer per event (a cancel and an arm) with the others pending;
+// expire advances the wheel one tick per event, each tick running one periodic timer's event
+// on the large event list FSM.
+/**************************************************************************************************/
+#define TIMER_COUNT		100000
+
+static FsmTimerWheel	timerWheel;
+static FsmTimer *		timers;
+static long				timerNext;
+
+static void TimerSetup (void)
+{
+	long	i;
+
+	BigBuild(true);
+	FsmTimerWheelInit(&timerWheel);
+	free(timers);
+	timers = (FsmTimer *)calloc(TIMER_COUNT, sizeof(FsmTimer));
+
+	for (i=0; i<TIMER_COUNT; i++)
+		FsmTimerPost(&timerWheel, &timers[i], &bigFsm, BEVT(i % BIG_EVENTS), (uint64_t)(i + 1), TIMER_COUNT);
+
+	timerNext = 0;
+}
+
+static void TimerArmCancel (long count)
+{
+	long	i = timerNext;
+
+	while (count--)
+	{
+		// delays spread over the lower levels of the wheel
+		FsmTimerPost(&timerWheel, &timers[i % TIMER_COUNT], &bigFsm, BEVT(0), (uint64_t)((i * 7919) & 0x3FFFF) + 1, 0);
+		i++;
+	}
+
+	timerNext = i;
+}
+
+static void TimerExpire (long count)
+{
+	FsmTimerAdvance(&timerWheel, (uint64_t)count);
+}
+
+/**************************************************************************************************/
+// Example machine from fsm_example.c. The event cycle returns to the initial configuration and
+// every event is consumed.
+/**************************************************************************************************/
+static const eFsmEvent exampleCycle[] = { EVT_3, EVT_1, EVT_3, EVT_2, EVT_4, EVT_1, EVT_2 };
+
+static int exampleNext;		// position in the cycle, carried over between batches
+
+static void ExampleSetup (void)		{ MyFsmInit(); exampleNext = 0; }
+
+static void ExampleRun (long count)
+{
+	int	i = exampleNext;
+
+	while (count--)
+	{
+		MyFsmRun(exampleCycle[i]);
+		i = (i + 1) % (int)(sizeof(exampleCycle)/sizeof(exampleCycle[0]));
+	}
+
+	exampleNext = i;
+}
+
+/**************************************************************************************************/
+// The example machine generated by fsm_gen from fsm_example.fsm, same event cycle
+/**************************************************************************************************/
+static void ExampleGenSetup (void)	{ ExampleGenInit(); exampleNext = 0; }
+
+static void ExampleGenCycle (long count)
+{
+	int	i = exampleNext;
+
+	while (count--)
+	{
+		ExampleGenRun(exampleCycle[i]);
+		i = (i + 1) % (int)(sizeof(exampleCycle)/sizeof(exampleCycle[0]));
+	}
+
+	exampleNext = i;
+}
+
+/**************************************************************************************************/
+// Queues
+/**************************************************************************************************/
+FSM_Q( benchQ, 1024 )
+FSM_Q( benchDeferQ, 1024 )
+FSM_Q( benchRecallQ, 1024 )
+FSM( fsm_Queue, "Queue", NULL, &benchDeferQ, &benchRecallQ );
+FSM_MAILBOX( benchMailbox, 1024 );
+
+static void QueueSetup (void)
+{
+	FsmQSetExt((FsmQ *)&benchQ, NULL);
+	FSM_Q_INIT(benchQ);
+	FSM_Q_INIT(benchDeferQ);
+	FSM_Q_INIT(benchRecallQ);
+	FSM_MAILBOX_INIT(benchMailbox);
+}
+
+// one put and one get per event
+static void QueuePutGet (long count)
+{
+	while (count--)
+	{
+		FsmPutEvent((FsmQ *)&benchQ, EVT_1);
+		FsmGetEvent((FsmQ *)&benchQ);
+	}
+}
+
+// defer, recall, then take the recalled event off the recall queue
+static void QueueDeferRecall (long count)
+{
+	int	eventId;
+
+	while (count--)
+	{
+		FsmDeferEvent(&fsm_Queue, EVT_1);
+		FsmRecallEvent(&fsm_Queue, &eventId);
+		FsmGetEvent(fsm_Queue.recallQ);
+	}
+}
+
+// Selective recall: QUEUE_DEFERRED events deferred, every fourth one handled by the current state.
+// Each round recalls the handled events and defers them again. Counted per deferred event.
+#define QUEUE_DEFERRED	16
+
+FSM_EVENT( evt_QueueHandled, EVT_1, BenchConsume );
+static FsmEvent *	queueEventList[] = { &evt_QueueHandled, &fsmNullEvent };
+FSM_STATE( state_Queue, &fsm_Queue, NULL, queueEventList, "Queue", FsmStateDefaultHandler );
+
+static void QueueRecallSetup (void)
+{
+	int	i;
+
+	QueueSetup();
+	fsm_Queue.pState = &state_Queue;
+
+	for (i=0; i<QUEUE_DEFERRED; i++)
+		FsmDeferEvent(&fsm_Queue, (i % 4) ? EVT_2 : EVT_1);
+}
+
+// defer the recalled events again
+static void QueueRedefer (void)
+{
+	int	eventId;
+
+	while ((eventId = FsmGetEvent(fsm_Queue.recallQ)) != EVT_FSM_NULL)
+		FsmDeferEvent(&fsm_Queue, eventId);
+}
+
+// recall one event at a time, defer the ones the state doesn't handle again
+static void QueueRecallRotate (long count)
+{
+	int	eventId;
+	int	i;
+
+	for ( ; count > 0; count -= QUEUE_DEFERRED)
+	{
+		for (i=0; i<QUEUE_DEFERRED; i++)
+		{
+			FsmRecallEvent(&fsm_Queue, &eventId);
+			if (!FsmStateHandles(fsm_Queue.pState, eventId))
+			{
+				FsmGetEvent(fsm_Queue.recallQ);		// the last one recalled
+				FsmDeferEvent(&fsm_Queue, eventId);
+			}
+		}
+		QueueRedefer();
+	}
+}
+
+static void QueueRecallHandled (long count)
+{
+	for ( ; count > 0; count -= QUEUE_DEFERRED)
+	{
+		FsmRecallHandled(&fsm_Queue);
+		QueueRedefer();
+	}
+}
+
+// Lanes: one put and get of an urgent event per event, with QUEUE_BACKLOG bulk events waiting
+// in the lane below it
+#define QUEUE_BACKLOG	512
+
+FSM_Q( benchUrgentQ, 16 )
+static FsmLaneQ	benchLanes;
+
+static void QueueLanesSetup (void)
+{
+	FsmQ	*laneList[] = { (FsmQ *)&benchUrgentQ, (FsmQ *)&benchQ };
+	int		i;
+
+	QueueSetup();
+	FSM_Q_INIT(benchUrgentQ);
+	FsmLaneQInit(&benchLanes, laneList, 2);
+
+	for (i=0; i<QUEUE_BACKLOG; i++)
+		FsmPutLaneEvent(&benchLanes, 1, EVT_2, NULL);
+}
+
+static void QueueLanesUrgent (long count)
+{
+	FsmPayload	*pPayload;
+
+	while (count--)
+	{
+		FsmPutLaneEvent(&benchLanes, 0, EVT_1, NULL);
+		FsmGetLaneEvent(&benchLanes, &pPayload, NULL);
+	}
+}
+
+// Coalescing: a burst of QUEUE_BURST puts of one idempotent event, then the one get it left.
+// Counted per put.
+#define QUEUE_BURST		16
+
+static FsmQExt		benchQExt;
+static FsmEventSet	benchCoalesce;
+
+static void QueueCoalesceSetup (void)
+{
+	QueueSetup();
+	FsmQSetExt((FsmQ *)&benchQ, &benchQExt);
+	FSM_EVENT_SET_ADD(benchCoalesce, EVT_1);
+	FsmQSetCoalesce((FsmQ *)&benchQ, &benchCoalesce);
+}
+
+static void QueueCoalesceBurst (long count)
+{
+	int		i;
+
+	for ( ; count > 0; count -= QUEUE_BURST)
+	{
+		for (i=0; i<QUEUE_BURST; i++)
+			FsmPutEvent((FsmQ *)&benchQ, EVT_1);
+		FsmGetEvent((FsmQ *)&benchQ);
+	}
+}
+
+// one mailbox put and get per event, single thread
+static void QueueMailbox (long count)
+{
+	while (count--)
+	{
+		FsmMailboxPut((FsmMailbox *)&benchMailbox, EVT_1);
+		FsmMailboxGet((FsmMailbox *)&benchMailbox);
+	}
+}
+
+/**************************************************************************************************/
+// C++ front end (fsm_bench_cpp.cpp): the deep and large event list machines built with fsm.hpp
+/**************************************************************************************************/
+void CppDeepSetup (void);
+void CppDeepSetupAdapter (void);
+void CppDeepRunLeaf (long count);
+void CppDeepRunBubble (long count);
+void CppDeepRunLeafAdapter (long count);
+void CppBigSetup (void);
+void CppBigRun (long count);
+
+/**************************************************************************************************/
+// Coroutine handlers (fsm_bench_co.cpp): a toggle through fsm_co.hpp, without and with a wait
+/**************************************************************************************************/
+void CoSetup (void);
+void CoRunSync (long count);
+void CoRunSuspend (long count);
+
+/**************************************************************************************************/
+// Harness
+/**************************************************************************************************/
+typedef struct
+{
+	const char *	name;
+	void			(*pfnSetup)(void);
+	void			(*pfnRun)(long count);
+} FsmBench;
+
+static const FsmBench gBench[] =
+{
+	{ "example",					ExampleSetup,	ExampleRun },
+	{ "example_gen",				ExampleGenSetup, ExampleGenCycle },
+	{ "deep12_leaf_list",			DeepSetupList,	DeepRunLeaf },
+	{ "deep12_leaf_table",			DeepSetupTable,	DeepRunLeaf },
+	{ "deep12_top_transition_list",	DeepSetupList,	DeepRunTop },
+	{ "deep12_top_transition_table",DeepSetupTable,	DeepRunTop },
+	{ "deep12_bubble_list",			DeepSetupList,	DeepRunBubble },
+	{ "deep12_bubble_table",		DeepSetupTable,	DeepRunBubble },
+	{ "deep12_lca_transition_list",	DeepSetupList,	DeepRunLca },
+	{ "deep12_lca_transition_table",DeepSetupTable,	DeepRunLca },
+	{ "wide16_one_list",			WideSetupList,	WideRunOne },
+	{ "wide16_one_table",			WideSetupTable,	WideRunOne },
+	{ "wide16_one_interest",		WideSetupInterest, WideRunOne },
+	{ "wide16_all_list",			WideSetupList,	WideRunAll },
+	{ "wide16_all_table",			WideSetupTable,	WideRunAll },
+	{ "wide16_work_serial",			WideSetupTable,	WideRunWork },
+	{ "wide16_work_pool4",			WideSetupPool,	WideRunWork },
+	{ "cpp_deep12_leaf",			CppDeepSetup,	CppDeepRunLeaf },
+	{ "cpp_deep12_leaf_fsmrun",		CppDeepSetupAdapter, CppDeepRunLeafAdapter },
+	{ "cpp_deep12_bubble",			CppDeepSetup,	CppDeepRunBubble },
+	{ "events60_list",				BigSetupList,	BigRun },
+	{ "events60_table",				BigSetupTable,	BigRun },
+	{ "events60_table_batch",		BigSetupTable,	BigRunBatch },
+	{ "cpp_events60",				CppBigSetup,	CppBigRun },
+	{ "co_handler_sync",			CoSetup,		CoRunSync },
+	{ "co_handler_suspend",			CoSetup,		CoRunSuspend },
+	{ "inst100k_toggle",			InstSetup,		InstRun },
+	{ "inst100k_toggle_packed",		InstPackedSetup,	InstRun },
+	{ "inst_image_restore",			InstImageSetup,	InstImageRestore },
+	{ "rt10k_post_4workers",		RtSetup,		RtRun },
+	{ "timer100k_arm_cancel",		TimerSetup,		TimerArmCancel },
+	{ "timer100k_expire",			TimerSetup,		TimerExpire },
+	{ "queue_put_get",				QueueSetup,		QueuePutGet },
+	{ "queue_defer_recall",			QueueSetup,		QueueDeferRecall },
+	{ "queue_recall_rotate16",		QueueRecallSetup, QueueRecallRotate },
+	{ "queue_recall_handled16",		QueueRecallSetup, QueueRecallHandled },
+	{ "queue_lanes_urgent_backlog512",	QueueLanesSetup, QueueLanesUrgent },
+	{ "queue_coalesce_burst16",		QueueCoalesceSetup, QueueCoalesceBurst },
+	{ "mailbox_put_get",			QueueSetup,		QueueMailbox },
+};
+
+/**************************************************************************************************/
+static uint64_t BenchNow (void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static int CompareDouble (const void *a, const void *b)
+{
+	double	x = *(const double *)a;
+	double	y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/**************************************************************************************************/
+static void BenchRun (const FsmBench *pBench, long events, FILE *csv)
+{
+	long		batches = (events + BENCH_BATCH - 1) / BENCH_BATCH;
+	double		*pBatchNs = (double *)malloc(sizeof(double) * (size_t)batches);
+	uint64_t	total = 0;
+	long		b;
+	double		mean, p50, p99, rate;
+
+	if (NULL == pBatchNs)
+		return;
+
+	(*pBench->pfnSetup)();
+	(*pBench->pfnRun)(BENCH_BATCH * 16);	// warm up
+
+	for (b=0; b<batches; b++)
+	{
+		uint64_t	start = BenchNow();
+		uint64_t	elapsed;
+
+		(*pBench->pfnRun)(BENCH_BATCH);
+		elapsed = BenchNow() - start;
+
+		total += elapsed;
+		pBatchNs[b] = (double)elapsed / BENCH_BATCH;
+	}
+
+	qsort(pBatchNs, (size_t)batches, sizeof(double), CompareDouble);
+
+	events = batches * BENCH_BATCH;
+	mean = (double)total / (double)events;
+	p50 = pBatchNs[batches / 2];
+	p99 = pBatchNs[(batches * 99) / 100];
+	rate = (double)events * 1e9 / (double)total;
+
+	printf("%-30s %12.0f ev/s %9.1f ns mean %9.1f ns p50 %9.1f ns p99\n", pBench->name, rate, mean, p50, p99);
+
+	if (csv != NULL)
+		fprintf(csv, "%s,%ld,%llu,%.0f,%.2f,%.2f,%.2f\n", pBench->name, events,
+				(unsigned long long)total, rate, mean, p50, p99);
+
+	free(pBatchNs);
+}
+
+/**************************************************************************************************/
+int main (int argc, char *argv[])
+{
+	long		events = BENCH_DEFAULT_N;
+	const char	*csvPath = NULL;
+	FILE		*csv = NULL;
+	int			first = 1;
+	size_t		i;
+
+	while ( (first < argc) && (argv[first][0] == '-') )
+	{
+		if (!strcmp(argv[first], "-n") && (first + 1 < argc))
+			events = atol(argv[++first]);
+		else if (!strcmp(argv[first], "-o") && (first + 1 < argc))
+			csvPath = argv[++first];
+		else
+		{
+			fprintf(stderr, "usage: %s [-n events] [-o results.csv] [name_prefix ...]\n", argv[0]);
+			return 2;
+		}
+		first++;
+	}
+
+	if (events < BENCH_BATCH)
+		events = BENCH_BATCH;
+
+	if (csvPath != NULL)
+	{
+		csv = fopen(csvPath, "w");
+		if (NULL == csv)
+		{
+			perror(csvPath);
+			return 1;
+		}
+		fprintf(csv, "benchmark,events,total_ns,events_per_sec,mean_ns,p50_ns,p99_ns\n");
+	}
+
+	for (i=0; i<sizeof(gBench)/sizeof(gBench[0]); i++)
+	{
+		int		arg;
+		bool	selected = (first >= argc);
+
+		for (arg=first; arg<argc; arg++)
+			if (!strncmp(gBench[i].name, argv[arg], strlen(argv[arg])))
+				selected = true;
+
+		if (selected)
+			BenchRun(&gBench[i], events, csv);
+	}
+
+	if (csv != NULL)
+		fclose(csv);
+
+	return 0;
+}
@@ -0,0 +1,82 @@
+/*
+ *
+ * File: fsm_bench_co.cpp
+ *
+ * Benchmark machines with C++20 coroutine handlers (fsm_co.hpp): a two state toggle whose
+ * handler finishes at once, and one whose handler waits for a reply each time.
+ *
+ */
+
+#include "fsm_co.hpp"
+
+extern "C" {
+void CoSetup (void);
+void CoRunSync (long count);
+void CoRunSuspend (long count);
+}
+
+/**************************************************************************************************/
+// BEVT(0) toggles A and B. In the sync machine the handler co_returns the other state; in the
+// suspend machine it first waits for a reply, which the bench completes and the executor resumes.
+/**************************************************************************************************/
+static fsm::Executor *		gExecutor;
+static fsm::Reply<int> *	gPending;		// reply the suspended handler waits for
+
+extern FsmState	state_CoA;
+extern FsmState	state_CoB;
+extern FsmState	state_CoWaitA;
+extern FsmState	state_CoWaitB;
+
+static fsm::CoHandler CoToggle (FsmState *pState, FsmEvent *pEvent)
+{
+	pEvent->consumed = true;
+	co_return (pState == &state_CoA) ? &state_CoB : &state_CoA;
+}
+
+static fsm::CoHandler CoWaitToggle (FsmState *pState, FsmEvent *pEvent)
+{
+	fsm::Reply<int>	reply;
+
+	pEvent->consumed = true;
+	gPending = &reply;
+	(void)co_await reply;
+	co_return (pState == &state_CoWaitA) ? &state_CoWaitB : &state_CoWaitA;
+}
+
+FSM(fsm_Co, "Co", NULL, NULL, NULL);
+FSM_EVENT( evt_Co_Toggle, BEVT(0), FSM_CO_HANDLER(CoToggle) );
+static FsmEvent *	coEventList[] = { &evt_Co_Toggle, &fsmNullEvent };
+FSM_STATE( state_CoA, &fsm_Co, NULL, coEventList, "A", FsmStateDefaultHandler );
+FSM_STATE( state_CoB, &fsm_Co, NULL, coEventList, "B", FsmStateDefaultHandler );
+
+FSM(fsm_CoWait, "CoWait", NULL, NULL, NULL);
+FSM_EVENT( evt_CoWait_Toggle, BEVT(0), FSM_CO_HANDLER(CoWaitToggle) );
+static FsmEvent *	coWaitEventList[] = { &evt_CoWait_Toggle, &fsmNullEvent };
+FSM_STATE( state_CoWaitA, &fsm_CoWait, NULL, coWaitEventList, "A", FsmStateDefaultHandler );
+FSM_STATE( state_CoWaitB, &fsm_CoWait, NULL, coWaitEventList, "B", FsmStateDefaultHandler );
+
+void CoSetup (void)
+{
+	if (nullptr == gExecutor)
+		gExecutor = new fsm::Executor();
+
+	FsmInit(&fsm_Co, &state_CoA);
+	FsmInit(&fsm_CoWait, &state_CoWaitA);
+}
+
+void CoRunSync (long count)
+{
+	while (count--)
+		gExecutor->Run(&fsm_Co, BEVT(0));
+}
+
+// one event, its reply and the resume, transition included
+void CoRunSuspend (long count)
+{
+	while (count--)
+	{
+		gExecutor->Run(&fsm_CoWait, BEVT(0));
+		gPending->Complete(0);
+		gExecutor->Poll();
+	}
+}
@@ -0,0 +1,138 @@
+/*
+ *
+ * File: fsm_bench_cpp.cpp
+ *
+ * Benchmark machines built with the C++ front end (fsm.hpp), the same shapes as the C
+ * machines in fsm_bench.c, so the two can be compared event for event.
+ *
+ */
+
+#include "fsm.hpp"
+
+extern "C" {
+void CppDeepSetup (void);
+void CppDeepSetupAdapter (void);
+void CppDeepRunLeaf (long count);
+void CppDeepRunBubble (long count);
+void CppDeepRunLeafAdapter (long count);
+void CppBigSetup (void);
+void CppBigRun (long count);
+}
+
+struct BenchContext
+{
+	long	consumed;
+};
+
+static BenchContext	gContext;
+
+/**************************************************************************************************/
+// Deep machine: the A states form a DEEP_LEVELS deep chain, state A at level i enters A at
+// level i+1. B at each level is a leaf next to A.
+// BEVT(i) toggles A and B at level i; DEEP_TOP_EVENT is consumed by the top level only.
+// As in the C machine, the leaf event runs a handler at the bottom and the bubble event
+// goes through every level.
+/**************************************************************************************************/
+#define DEEP_LEVELS		12
+#define DEEP_TOP_EVENT	BEVT(40)
+
+constexpr int DeepLevel (int id)			{ return id / 2; }
+constexpr int DeepParent (int id)			{ return (DeepLevel(id) > 0) ? 2 * (DeepLevel(id) - 1) : fsm::None; }
+constexpr int DeepInitial (int id)			{ return ( ((id & 1) == 0) && (DeepLevel(id) + 1 < DEEP_LEVELS) ) ? id + 2 : fsm::None; }
+
+template <int Id>
+struct DeepState : fsm::State<Id, DeepParent(Id), DeepInitial(Id)>
+{
+	static fsm::Result On (BenchContext &ctx, int eventId)
+	{
+		switch (eventId)
+		{
+			case BEVT(DeepLevel(Id)):
+				return fsm::Go(Id ^ 1);
+
+			case DEEP_TOP_EVENT:
+				if (0 == DeepLevel(Id))
+				{
+					ctx.consumed++;
+					return fsm::Consumed;
+				}
+				break;
+		}
+		return fsm::Ignored;
+	}
+};
+
+template <typename Seq> struct DeepMachineOf;
+
+template <std::size_t... I>
+struct DeepMachineOf<std::index_sequence<I...>>
+{
+	using type = fsm::Machine<BenchContext, DeepState<(int)I>...>;
+};
+
+typedef DeepMachineOf<std::make_index_sequence<2 * DEEP_LEVELS>>::type DeepMachine;
+
+static DeepMachine					gDeep(gContext);
+
+FSM(fsm_CppDeep, "CppDeep", NULL, NULL, NULL);
+static fsm::Adapter<DeepMachine>	state_CppDeep(&fsm_CppDeep, gDeep, "Deep", 0);
+
+void CppDeepSetup (void)			{ gDeep.Init(0); }
+void CppDeepSetupAdapter (void)		{ FsmInit(&fsm_CppDeep, &state_CppDeep); }
+
+void CppDeepRunLeaf (long count)
+{
+	while (count--)
+		gDeep.Dispatch(BEVT(DEEP_LEVELS - 1));
+}
+
+void CppDeepRunBubble (long count)
+{
+	while (count--)
+		gDeep.Dispatch(DEEP_TOP_EVENT);
+}
+
+// the leaf event through FsmRun
+void CppDeepRunLeafAdapter (long count)
+{
+	while (count--)
+		FsmRun(&fsm_CppDeep, BEVT(DEEP_LEVELS - 1));
+}
+
+/**************************************************************************************************/
+// Large event list: one state that consumes BIG_EVENTS different events
+/**************************************************************************************************/
+#define BIG_CASE(i)		case BEVT(i):
+#define BIG_CASE_8(n)	BIG_CASE(n) BIG_CASE(n+1) BIG_CASE(n+2) BIG_CASE(n+3) BIG_CASE(n+4) BIG_CASE(n+5) BIG_CASE(n+6) BIG_CASE(n+7)
+#define BIG_EVENTS		60
+
+struct BigState : fsm::State<0>
+{
+	static fsm::Result On (BenchContext &ctx, int eventId)
+	{
+		switch (eventId)
+		{
+			BIG_CASE_8(0) BIG_CASE_8(8) BIG_CASE_8(16) BIG_CASE_8(24)
+			BIG_CASE_8(32) BIG_CASE_8(40) BIG_CASE_8(48)
+			BIG_CASE(56) BIG_CASE(57) BIG_CASE(58) BIG_CASE(59)
+				ctx.consumed++;
+				return fsm::Consumed;
+		}
+		return fsm::Ignored;
+	}
+};
+
+static fsm::Machine<BenchContext, BigState>	gBig(gContext);
+
+void CppBigSetup (void)			{ gBig.Init(0); }
+
+void CppBigRun (long count)
+{
+	int	i = 0;
+
+	while (count--)
+	{
+		gBig.Dispatch(BEVT(i));
+		i = (i + 1) % BIG_EVENTS;
+	}
+}
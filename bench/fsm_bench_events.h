@@ -0,0 +1,47 @@
+/*
+ *
+ * File: fsm_bench_events.h
+ *
+ * Event list for the benchmarks: the example's events plus 64 benchmark events,
+ * BEVT_00 .. BEVT_77 (numbered in octal, 8 per FSM_BENCH_EVENTS_8 group)
+ *
+ * The benchmark build selects this file with -DFSM_EVENTS_FILE='"fsm_bench_events.h"'
+ *
+ */
+
+#ifndef _FSM_BENCH_EVENTS_H_
+#define _FSM_BENCH_EVENTS_H_
+
+#define FSM_BENCH_EVENTS_8(n)		\
+	FSM_EVENT_ID(BEVT_##n##0)		\
+	FSM_EVENT_ID(BEVT_##n##1)		\
+	FSM_EVENT_ID(BEVT_##n##2)		\
+	FSM_EVENT_ID(BEVT_##n##3)		\
+	FSM_EVENT_ID(BEVT_##n##4)		\
+	FSM_EVENT_ID(BEVT_##n##5)		\
+	FSM_EVENT_ID(BEVT_##n##6)		\
+	FSM_EVENT_ID(BEVT_##n##7)
+
+#define FSM_USER_EVENTS			\
+	FSM_EVENT_ID(MYEVT_BOL)		\
+	FSM_EVENT_ID(EVT_1)			\
+	FSM_EVENT_ID(EVT_2)			\
+	FSM_EVENT_ID(EVT_3)			\
+	FSM_EVENT_ID(EVT_4)			\
+	FSM_EVENT_ID(MYEVT_EOL)		\
+	FSM_BENCH_EVENTS_8(0)		\
+	FSM_BENCH_EVENTS_8(1)		\
+	FSM_BENCH_EVENTS_8(2)		\
+	FSM_BENCH_EVENTS_8(3)		\
+	FSM_BENCH_EVENTS_8(4)		\
+	FSM_BENCH_EVENTS_8(5)		\
+	FSM_BENCH_EVENTS_8(6)		\
+	FSM_BENCH_EVENTS_8(7)
+
+#define IS_MY_EVENT(x)	((x<MYEVT_EOL) && (x>MYEVT_BOL))
+
+#define BEVT_FIRST		BEVT_00
+#define BEVT_COUNT		64
+#define BEVT(i)			(BEVT_FIRST + (i))
+
+#endif // _FSM_BENCH_EVENTS_H_
@@ -0,0 +1,21 @@
+/*
+ *
+ * File: fsm_example_gen_handlers.c
+ *
+ * Event handlers for the generated example machine (fsm_example.fsm). Transitions are
+ * generated; only the entry actions are written by hand.
+ *
+ */
+#ifndef FSM_TRACE
+	#define	FSM_TRACE	1	// undefine or set to 0 to disable fsm tracing, 2 for binary trace
+#endif
+
+#include "fsm_example_gen.h"
+
+/**************************************************************************************************/
+FSM_EVENT_HANDLER( Nested_State1_Entry )
+{
+	FSM_TRACE_RUN(pState, "entry_actions");
+	pEvent->consumed = true;
+	return NULL;
+}
@@ -7,10 +7,23 @@
  *
  */
 #define _FSM_C_
+#include <string.h>
+
 #include "fsm.h"
+#include "fsm_stats.h"
+
+FSM_STATIC_ASSERT(EVT_FSM_EOL - 1 <= FSM_Q_EVENT_MAX, FSM_Q_EVENT_BITS_too_small_for_the_events);
 
 FsmEvent fsmNullEvent = {DESIG_INIT(id,EVT_FSM_NULL), DESIG_INIT(pfnEvtHandler,NULL)};
 
+FsmParallelFcn	gpParallelFcn = NULL;
+FsmCancelTimersFcn	gpCancelTimersFcn = NULL;
+FsmParkedFcn	gpParkedFcn = NULL;
+
+#define FSM_MAX_PARALLEL_REGIONS	256		// states with more nested FSMs are dispatched serially
+
+static bool		gFsmInterest = false;		// a state's interest has been compiled
+
 /**************************************************************************************************/
 // C implementation of OOP Hierarchical State Machine class
 /**************************************************************************************************/
@@ -26,6 +39,8 @@ int FsmInsertBefore(eFsmEvent eventId, eFsmEvent insertId)
 {
 	FsmQ	*pQ = gFsmQInsertBefore[eventId];
 	int		result = FsmPutEvent(pQ, insertId);
+	if (0 == result)
+		gFsmInsertCount++;
 	return	result;
 }
 
@@ -34,6 +49,8 @@ int FsmInsertAfter(eFsmEvent eventId, eFsmEvent insertId)
 {
 	FsmQ	*pQ = gFsmQInsertAfter[eventId];
 	int		result = FsmPutEvent(pQ, insertId);
+	if (0 == result)
+		gFsmInsertCount++;
 	return	result;
 }
 
@@ -44,6 +61,7 @@ void FsmDoInsertedEvents(FsmQ *pQ, Fsm *pFsm, int eventId)
 
 	while ((insertEvent = FsmGetEvent(pQ)) != EVT_FSM_NULL)
 	{
+		gFsmInsertCount--;
 		if (!FsmDispatch(pFsm, insertEvent))
 			FSM_LOG("%s,%s,%s,ignored", pFsm->name, pFsm->pState->name, FSM_EVT_NAME(insertEvent))
 	}
@@ -98,40 +116,131 @@ int FsmDeferEvent(Fsm* pFsm, int eventId)
 }
 
 /**************************************************************************************************/
+// Defer an event along with its payload. The deferred event holds its own reference to the
+// payload, so a handler can defer the event it is handling: FsmDeferEventData(pFsm, id, pEvent->pPayload)
+int FsmDeferEventData(Fsm* pFsm, int eventId, FsmPayload *pPayload)
+{
+	int result = FsmPutEventData(pFsm->deferQ, eventId, pPayload);
+
+	if ((0 == result) && (pPayload != NULL) && (pFsm->deferQ != NULL))
+		FsmPayloadRetain(pPayload);
+
+	return result;
+}
+
+/**************************************************************************************************/
+// The payload reference moves from the defer queue to the recall queue
 int FsmRecallEvent(Fsm* pFsm, int *pEventId)
 {
-	int result;
+	int			result;
+	FsmPayload	*pPayload;
 
-	*pEventId = FsmGetEvent(pFsm->deferQ);
-	result = FsmPutEvent(pFsm->recallQ, *pEventId);
+	*pEventId = FsmGetEventData(pFsm->deferQ, &pPayload);
+	result = FsmPutEventData(pFsm->recallQ, *pEventId, pPayload);
+
+	if ((result != 0) && (pPayload != NULL))
+		FsmPayloadRelease(pPayload);	// event lost, drop its reference
 
 	return result;
 }
 
 /**************************************************************************************************/
-// Move an event to a queue
-// Returns -1 if queue is full, else 0
-int FsmPutEvent (FsmQ *q, int eventId)
+// true if the state, or a state active in one of its nested FSMs, has a handler for eventId
+// (or an EVT_FSM_DEFAULT handler). A state with its own state handler may handle anything.
+bool FsmStateHandles(FsmState *pState, int eventId)
 {
-	if (NULL == q)
-		return 0;
+	FsmEvent	**pList;
+	unsigned	index = (unsigned)(eventId - pState->dispatchBase);
+	int			i;
 
-	if (EVT_FSM_NULL == eventId)	// no event
-		return 0;
+	if (pState->pfnStateHandler != FsmStateDefaultHandler)
+		return true;
 
-	if (q->count >= q->size)	// queue full
+	if ( (pState->dispatchTable != NULL) && (index < (unsigned)pState->dispatchCount) )
 	{
-		FSM_LOG("Recall queue full - put event %d in queue failed", eventId);
-		return -1;
+		if (pState->dispatchTable[index]->id != EVT_FSM_NULL)
+			return true;
+	}
+	else if ( (pState->dispatchTable != NULL) && (pState->dispatchMiss != NULL) )
+	{
+		if (pState->dispatchMiss->id != EVT_FSM_NULL)
+			return true;
+	}
+	else
+	{
+		for (pList = pState->eventList; (*pList)->id != EVT_FSM_NULL; pList++)
+			if ( ((*pList)->id == eventId) || ((*pList)->id == EVT_FSM_DEFAULT) )
+				return true;
 	}
 
-	q->eventId[q->tail++] = eventId;
-	q->count++;
+	for (i=0; (pState->nestedFsmList != NULL) && (pState->nestedFsmList[i] != NULL); i++)
+	{
+		FsmState	*pNestedState = pState->nestedFsmList[i]->pState;
 
-	if (q->tail >= q->size)
-		q->tail = 0;
+		if ( (pNestedState != NULL) && FsmStateHandles(pNestedState, eventId) )
+			return true;
+	}
 
-	return 0;
+	return false;
+}
+
+/**************************************************************************************************/
+static bool FsmHandlesEvent(void *pContext, int eventId)
+{
+	return FsmStateHandles((FsmState *)pContext, eventId);
+}
+
+/**************************************************************************************************/
+// FsmRecallHandled calls made during a transition, run when it's done
+#define FSM_RECALL_PENDING	8
+
+static FSM_THREAD_LOCAL int	tTransitions;		// transitions (and FsmInit) running on the thread
+static FSM_THREAD_LOCAL int	tRecallCount;
+static FSM_THREAD_LOCAL Fsm *	tRecallFsm[FSM_RECALL_PENDING];
+
+static int FsmRecallNow(Fsm* pFsm)
+{
+	if (NULL == pFsm->pState)
+		return 0;
+
+	return FsmQRecallIf(pFsm->deferQ, pFsm->recallQ, FsmHandlesEvent, pFsm->pState);
+}
+
+/**************************************************************************************************/
+// Recall, in one pass, every deferred event the FSM's current state (or a state nested in it)
+// has a handler for. The other deferred events stay deferred, in order. Call it from an Entry
+// handler: FsmRun runs the recalled events, oldest first, after the current one.
+// An Entry handler runs before the FSMs nested in its state are entered, so during a transition
+// (or FsmInit) the recall waits until the transition is done and the nested FSMs are in their
+// new states; it returns 0 then. Otherwise returns the number of events recalled.
+int FsmRecallHandled(Fsm* pFsm)
+{
+	int		i;
+
+	if (tTransitions > 0)
+	{
+		for (i=0; i<tRecallCount; i++)
+			if (tRecallFsm[i] == pFsm)
+				return 0;
+
+		if (tRecallCount < FSM_RECALL_PENDING)
+		{
+			tRecallFsm[tRecallCount++] = pFsm;
+			return 0;
+		}
+
+		FSM_LOG("!!!! FSM ERROR !!!! FSM %s: too many recalls in one transition, recalled now", pFsm->name);
+	}
+
+	return FsmRecallNow(pFsm);
+}
+
+/**************************************************************************************************/
+// Move an event to a queue
+// Returns -1 if queue is full, else 0
+int FsmPutEvent (FsmQ *q, int eventId)
+{
+	return FsmPutEventData(q, eventId, NULL);
 
 } // FsmPutEvent
 
@@ -140,191 +249,1842 @@ int FsmPutEvent (FsmQ *q, int eventId)
 // returns EVT_FSM_NULL if no events in the queue, else the next eventId in the queue
 int FsmGetEvent (FsmQ *q)
 {
-	int	eventId;
+	FsmPayload	*pPayload;
+	int			eventId = FsmGetEventData(q, &pPayload);
 
-	if (NULL == q)
-		return EVT_FSM_NULL;
+	if (pPayload != NULL)
+		FsmPayloadRelease(pPayload);
 
-	if (q->count <= 0)
-		return EVT_FSM_NULL;
+	return eventId;
+
+} // FsmGetEvent
+
+/**************************************************************************************************/
+// Append an event to a queue that has room
+static void FsmQAppend (FsmQ *q, int eventId, FsmPayload *pPayload)
+{
+	if (q->payload != NULL)
+		q->payload[q->tail] = pPayload;
+
+	q->eventId[q->tail++] = (FsmQEventId)eventId;
+	q->count++;
+
+	if (q->tail >= q->size)
+		q->tail = 0;
+
+	if (q->count > q->hwm)
+	{
+		q->hwm = q->count;
+		FSM_STATS_QUEUE(q->count, false);
+	}
+}
+
+/**************************************************************************************************/
+// Take the oldest event off a queue that isn't empty
+static int FsmQTake (FsmQ *q, FsmPayload **ppPayload)
+{
+	int	eventId;
+
+	*ppPayload = (q->payload != NULL) ? q->payload[q->head] : NULL;
 
 	eventId = q->eventId[q->head++];
 	q->count--;
 
+	if ( (q->pExt != NULL) && (q->pExt->pCoalesce != NULL) && (eventId >= 0) && (eventId < EVT_FSM_EOL) )
+		FSM_EVENT_SET_DEL(q->pExt->pending, eventId);
+
 	if (q->head >= q->size)
 		q->head = 0;
 
 	return eventId;
-
-} // FsmGetEvent
+}
 
 /**************************************************************************************************/
-FsmEvent * FsmFindEvent( FsmEvent** pEventList, int eventId )
+// Move events back from the spill queue while there's room. The spill queue only holds events
+// newer than the ones in q, so they go on the end.
+static void FsmQRefill (FsmQ *q)
 {
-	int		i=0;
-	int		defaultEvt = -1;
+	FsmQ		*pSpill = FSM_Q_SPILL_Q(q);
+	FsmPayload	*pPayload;
+	int			eventId;
 
-	while (pEventList[i]->id != EVT_FSM_NULL)
+	while ( (pSpill != NULL) && (q->count < q->size) && (pSpill->count > 0) )
 	{
-		if (pEventList[i]->id == eventId)
-			break;
-		else if (pEventList[i]->id == EVT_FSM_DEFAULT)
-			defaultEvt = i;
-		i++;
+		eventId = FsmGetEventData(pSpill, &pPayload);
+		FsmQAppend(q, eventId, pPayload);
 	}
+}
 
-	if ( (pEventList[i]->id == EVT_FSM_NULL) && (defaultEvt >= 0) )
+/**************************************************************************************************/
+// The payload slot of a pending event, in q or its spill queue. NULL if q can't hold payloads.
+static FsmPayload ** FsmQPendingPayload (FsmQ *q, int eventId)
+{
+	int		i;
+
+	for ( ; (q != NULL) && (q->payload != NULL); q = FSM_Q_SPILL_Q(q))
 	{
-		i = defaultEvt;
-		pEventList[i]->altId = eventId;
+		for (i=0; i<q->count; i++)
+		{
+			int	slot = (q->head + i) % q->size;
+
+			if (q->eventId[slot] == eventId)
+				return &q->payload[slot];
+		}
 	}
 
-	return pEventList[i];
+	return NULL;
 }
 
 /**************************************************************************************************/
-bool FsmDispatch(Fsm *pFsm, int eventId)
+// Rebuild q's pending set from the events in it and its spill queue
+static void FsmQPendingRebuild (FsmQ *q)
 {
-	bool 		consumed;
-	FsmStatePtr pState = pFsm->pState;
+	FsmQExt	*pExt = q->pExt;
+	FsmQ	*pQ;
+	int		i;
 
-	if (EVT_FSM_NULL == eventId)	// no event
-		return true;
+	memset(&pExt->pending, 0, sizeof(FsmEventSet));
 
-	if (NULL == pFsm)
-	{
-		FSM_LOG("!!!! FSM ERROR !!!! fsm undefined");
-		return false;
-	}
+	if (NULL == pExt->pCoalesce)
+		return;
 
-	if (NULL == pState)
+	for (pQ = q; pQ != NULL; pQ = FSM_Q_SPILL_Q(pQ))
 	{
-		FSM_LOG("!!!! FSM ERROR !!!! FSM %s: state undefined", pFsm->name);
-		return false;
+		for (i=0; i<pQ->count; i++)
+		{
+			int	eventId = pQ->eventId[(pQ->head + i) % pQ->size];
+
+			if ( (eventId >= 0) && (eventId < EVT_FSM_EOL) && FSM_EVENT_SET_HAS(*pExt->pCoalesce, eventId) )
+				FSM_EVENT_SET_ADD(pExt->pending, eventId);
+		}
 	}
+}
 
-	if (NULL == pState->pfnStateHandler)
+/**************************************************************************************************/
+// Put a coalesced event that is already pending: count it, and replace the pending event's payload
+static void FsmQCoalesce (FsmQ *q, int eventId, FsmPayload *pPayload)
+{
+	FsmPayload	**ppPending;
+
+	q->pExt->coalesced++;
+	FSM_STATS_COALESCED();
+
+	if (NULL == pPayload)
+		return;
+
+	ppPending = FsmQPendingPayload(q, eventId);
+	if (NULL == ppPending)
 	{
-		FSM_LOG("!!!! FSM ERROR !!!! FSM %s: state %s handler undefined", pFsm->name, pState->name);
-		return false;
+		FsmPayloadRelease(pPayload);
+		return;
 	}
 
-	consumed = (*pFsm->pState->pfnStateHandler) (pState, eventId);
+	if (*ppPending != NULL)
+		FsmPayloadRelease(*ppPending);
+	*ppPending = pPayload;
+}
 
-	// Transition to next state if necessary
-	if (pState->pNextState)
-		FsmTransition(pState->pFsm, pState->pNextState);
+/**************************************************************************************************/
+// Give q the extension that holds its overflow policy and coalescing state, or take it away
+// (NULL): the queue then drops the newest event when full and coalesces nothing. Set it before
+// putting events in q.
+void FsmQSetExt (FsmQ *q, FsmQExt *pExt)
+{
+	if (pExt != NULL)
+		memset(pExt, 0, sizeof(FsmQExt));
 
-	return consumed;
+	q->pExt = pExt;
 }
 
-
 /**************************************************************************************************/
-// FSM Base Class State Handler function
-// returns true if no further processing for event (i.e., event consumed)
-// sets pState->pNextState = NULL if no transition, otherwise points to next state
-//
-// NB: State transitions can't occur in Exit actions. That's gotta be
-//     illegal, right? This implementation igores transitions in exit actions.
-
-bool FsmStateDefaultHandler(FsmState *pState, int eventId)
+// Set the events put in q at most once. Events already in q count as pending.
+void FsmQSetCoalesce (FsmQ *q, const FsmEventSet *pCoalesce)
 {
-	FsmState *		pNextState = NULL;
-	FsmEvent *		pEvent;
-	FsmEvtHandler	pfnEventHandler;
-	bool			consumed = false;
-	bool			isEntry = (EVT_FSM_ENTRY == eventId) || (EVT_FSM_SUPERSTATE_ENTRY == eventId);
-
-	FSM_NOTIFY(pState, eventId);
+	if (NULL == q->pExt)
+	{
+		if (pCoalesce != NULL)
+			FSM_LOG("!!!! FSM ERROR !!!! queue has no FsmQExt (FsmQSetExt) - coalescing not set");
+		return;
+	}
 
-	pEvent = FsmFindEvent( pState->eventList, eventId );	// returns pEvent->id == EVT_FSM_NULL if no handler found		
-	pfnEventHandler = pEvent->pfnEvtHandler;
-	pEvent->consumed = false;
+	q->pExt->pCoalesce = pCoalesce;
+	FsmQPendingRebuild(q);
+}
 
-	// Handle ENTRY events before passing to the substate; i.e., 
-	// ENTRY events are handled in top-down order, always consume
-	if ((pEvent->id == eventId) && isEntry )
+/**************************************************************************************************/
+// Set what FsmPutEvent does when q is full. pSpill is the queue full FSM_Q_SPILL queues put
+// events in; it must hold payloads if q does. Set it before putting events in q.
+void FsmQSetOverflow (FsmQ *q, int overflow, FsmQ *pSpill)
+{
+	if ( (FSM_Q_SPILL == overflow) && ( (NULL == pSpill) || (pSpill == q)
+	  || ((q->payload != NULL) && (NULL == pSpill->payload)) ) )
 	{
-		pNextState = (pfnEventHandler == NULL ? NULL : (*pfnEventHandler)(pState, pEvent) );
-		consumed = true;
+		FSM_LOG("!!!! FSM ERROR !!!! spill queue missing or can't hold payloads - overflow policy not changed");
+		return;
 	}
 
-	// Pass the event to the substate.
-	if (pState->nestedFsmList)
+	if (NULL == q->pExt)
 	{
-		bool	subStateConsumed = false;
-		int		subStateEventId = eventId;
-		int		i=0;
+		if (overflow != FSM_Q_DROP_NEWEST)
+			FSM_LOG("!!!! FSM ERROR !!!! queue has no FsmQExt (FsmQSetExt) - overflow policy not changed");
+		return;
+	}
+
+	q->pExt->overflow = overflow;
+	q->pExt->pSpill = (FSM_Q_SPILL == overflow) ? pSpill : NULL;
+
+} // FsmQSetOverflow
+
+/**************************************************************************************************/
+// Put an event in q, or its spill queue, as its overflow policy says
+static int FsmQPut (FsmQ *q, int eventId, FsmPayload *pPayload)
+{
+	FsmQ		*pSpill = FSM_Q_SPILL_Q(q);
+	FsmPayload	*pOldest;
+
+	// once events have spilled, new ones go after them
+	if ( (pSpill != NULL) && ((q->count >= q->size) || (pSpill->count > 0)) )
+		return FsmPutEventData(pSpill, eventId, pPayload);
 
-		if (EVT_FSM_ENTRY == eventId)
-			subStateEventId = EVT_FSM_SUPERSTATE_ENTRY;
-		else if (EVT_FSM_EXIT ==  eventId)
-			subStateEventId = EVT_FSM_SUPERSTATE_EXIT;
+	if (q->count >= q->size)	// queue full
+	{
+		q->drops++;
+		FSM_STATS_QUEUE(q->count, true);
 
-		while (pState->nestedFsmList[i] != NULL)
+		if ( (NULL == q->pExt) || (q->pExt->overflow != FSM_Q_DROP_OLDEST) || (q->size <= 0) )
 		{
-			// ignore transitions in the nested FSM
-			subStateConsumed = FsmDispatch(pState->nestedFsmList[i++], subStateEventId );
-			consumed = consumed || subStateConsumed;
+			FSM_LOG("Recall queue full - put event %d in queue failed", eventId);
+			return -1;
 		}
+
+		FsmQTake(q, &pOldest);
+		if (pOldest != NULL)
+			FsmPayloadRelease(pOldest);		// the queue's reference
 	}
 
-	// Handle non-ENTRY events not consumed by the substate
-	// NB: EXIT events are handled in bottom-up order
-	if ( (!consumed) && (pEvent->id != EVT_FSM_NULL) && (!isEntry) )
-	{
-		pNextState = (pfnEventHandler == NULL ? NULL : (*pfnEventHandler)(pState, pEvent) );
-		// ignore transitions in Exit actions (or else we'll wind up in an infinite recursive loop...)
-		pNextState = ( (EVT_FSM_EXIT == eventId) ? NULL : pNextState);
+	FsmQAppend(q, eventId, pPayload);
+
+	return 0;
+}
+
+/**************************************************************************************************/
+// FsmQPut for a queue that coalesces events
+static int FsmQPutCoalesce (FsmQ *q, int eventId, FsmPayload *pPayload)
+{
+	FsmQExt	*pExt = q->pExt;
+
+	if ( (eventId < 0) || (eventId >= EVT_FSM_EOL) || !FSM_EVENT_SET_HAS(*pExt->pCoalesce, eventId) )
+		return FsmQPut(q, eventId, pPayload);
 
-		consumed =  consumed || pEvent->consumed;
+	if (FSM_EVENT_SET_HAS(pExt->pending, eventId))
+	{
+		FsmQCoalesce(q, eventId, pPayload);
+		return 0;
 	}
 
-	pState->pNextState = pNextState;
+	if (FsmQPut(q, eventId, pPayload) != 0)
+		return -1;
 
-	return consumed;
+	FSM_EVENT_SET_ADD(pExt->pending, eventId);
 
-} // FsmDispatch
+	return 0;
+}
 
 /**************************************************************************************************/
-void FsmTransition(Fsm *pFsm, FsmStatePtr pNextState)
+// Move an event and its payload to a queue. On success the queue takes over the caller's
+// reference to the payload; on failure the caller still owns it.
+// A full queue fails, drops its oldest event or spills, depending on its overflow policy.
+// A coalesced event that is already pending isn't queued again (see FsmQSetCoalesce).
+// Returns -1 if queue is full or can't hold the payload, else 0
+int FsmPutEventData (FsmQ *q, int eventId, FsmPayload *pPayload)
 {
-	FsmDispatch(pFsm, EVT_FSM_EXIT);		// exit the source
-	pFsm->pState = pNextState;				// change current state
-	FsmDispatch(pFsm, EVT_FSM_ENTRY);		// enter the target
-}
+	if (NULL == q)
+		return 0;
+
+	if (EVT_FSM_NULL == eventId)	// no event
+		return 0;
+
+#if FSM_Q_EVENT_BITS < 32
+	if ( (eventId < EVT_FSM_NULL) || (eventId > FSM_Q_EVENT_MAX) )
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! event %d doesn't fit in a queue (FSM_Q_EVENT_BITS %d)", eventId, FSM_Q_EVENT_BITS);
+		return -1;
+	}
+#endif
+
+	if ( (NULL == q->payload) && (pPayload != NULL) )
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! queue has no payload slots - put event %d in queue failed", eventId);
+		return -1;
+	}
+
+	if ( (q->pExt != NULL) && (q->pExt->pCoalesce != NULL) )
+		return FsmQPutCoalesce(q, eventId, pPayload);
+
+	return FsmQPut(q, eventId, pPayload);
+
+} // FsmPutEventData
 
 /**************************************************************************************************/
-void FsmInit (Fsm *pFsm, FsmState *pState)
+// Retrieves an event and its payload from a queue. The caller gets the queue's payload reference.
+// returns EVT_FSM_NULL if no events in the queue, else the next eventId in the queue
+int FsmGetEventData (FsmQ *q, FsmPayload **ppPayload)
 {
-	pFsm->pState = pState;				// set initial state
-	FsmDispatch(pFsm, EVT_FSM_ENTRY);	// enter the initial state
+	int	eventId;
 
-} // FsmInit
+	*ppPayload = NULL;
+
+	if (NULL == q)
+		return EVT_FSM_NULL;
+
+	if (q->count <= 0)
+		return EVT_FSM_NULL;
+
+	eventId = FsmQTake(q, ppPayload);
+
+	if (q->pExt != NULL)
+		FsmQRefill(q);
+
+	return eventId;
+
+} // FsmGetEventData
 
 /**************************************************************************************************/
-void FsmRun(Fsm *pFsm, int eventId)
+// Move the events in q that pfnMatch accepts to recallQ, in one pass, oldest first. The events
+// left in q keep their order. If recallQ fills up, the rest stay in q.
+// Returns the number of events moved.
+int FsmQRecallIf (FsmQ *q, FsmQ *recallQ, FsmQMatchFcn pfnMatch, void *pContext)
 {
-	bool	consumed;
-	int		nextEvent = eventId;
+	int		count;
+	int		kept = 0;
+	int		moved = 0;
+	int		read;
+	int		write;
+	int		i;
+
+	if ( (NULL == q) || (NULL == recallQ) )
+		return 0;
 
-	FSM_INSERT_BEFORE(pFsm, eventId);
+	count = q->count;
+	read = q->head;
+	write = q->head;
 
-	do {
-		consumed = FsmDispatch(pFsm, nextEvent);
-		if (!consumed)
+	for (i=0; i<count; i++)
+	{
+		int			eventId = q->eventId[read];
+		FsmPayload	*pPayload = (q->payload != NULL) ? q->payload[read] : NULL;
+
+		if ( (*pfnMatch)(pContext, eventId) && (0 == FsmPutEventData(recallQ, eventId, pPayload)) )
+			moved++;
+		else
 		{
-			if (nextEvent >= EVT_FSM_EOL)
-				FSM_LOG(",%s,%s,%d,ignored", pFsm->name, pFsm->pState->name, nextEvent)
-			else
-				FSM_LOG(",%s,%s,%s,ignored", pFsm->name, pFsm->pState->name, FSM_EVT_NAME(nextEvent))
+			if (write != read)
+			{
+				q->eventId[write] = (FsmQEventId)eventId;
+				if (q->payload != NULL)
+					q->payload[write] = pPayload;
+			}
+			if (++write >= q->size)
+				write = 0;
+			kept++;
 		}
 
-		// look for any any deferred events that have been recalled
-		nextEvent = FsmGetEvent(pFsm->recallQ);
+		if (++read >= q->size)
+			read = 0;
+	}
 
-	} while (nextEvent != EVT_FSM_NULL);
-	
-	FSM_INSERT_AFTER(pFsm, eventId);
+	q->tail = write;
+	q->count = kept;
 
-} // CoordFsmRun
+	// the spilled events are newer, so they are recalled after these
+	if (FSM_Q_SPILL_Q(q) != NULL)
+	{
+		moved += FsmQRecallIf(q->pExt->pSpill, recallQ, pfnMatch, pContext);
+		FsmQRefill(q);
+	}
+
+	if ( (moved > 0) && (q->pExt != NULL) && (q->pExt->pCoalesce != NULL) )
+		FsmQPendingRebuild(q);
+
+	return moved;
+
+} // FsmQRecallIf
+
+/**************************************************************************************************/
+// Make a lane queue of nLanes queues, laneList[0] the most urgent. Events already in them count.
+// Returns -1 if there are more than FSM_LANES_MAX lanes
+int FsmLaneQInit (FsmLaneQ *pLanes, FsmQ **laneList, int nLanes)
+{
+	int		i;
+
+	if ( (nLanes <= 0) || (nLanes > FSM_LANES_MAX) )
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! lane queue can't have %d lanes", nLanes);
+		return -1;
+	}
+
+	memset(pLanes, 0, sizeof(FsmLaneQ));
+	pLanes->nLanes = nLanes;
+
+	for (i=0; i<nLanes; i++)
+	{
+		pLanes->lane[i] = laneList[i];
+		if (laneList[i]->count > 0)
+			pLanes->ready |= 1u << i;
+	}
+
+	return 0;
+
+} // FsmLaneQInit
+
+/**************************************************************************************************/
+// FsmPutEventData to one lane
+// Returns -1 if the lane is full or doesn't exist, else 0
+int FsmPutLaneEvent (FsmLaneQ *pLanes, int lane, int eventId, FsmPayload *pPayload)
+{
+	if ( (lane < 0) || (lane >= pLanes->nLanes) || (NULL == pLanes->lane[lane]) )
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! lane %d undefined - put event %d failed", lane, eventId);
+		return -1;
+	}
+
+	if (FsmPutEventData(pLanes->lane[lane], eventId, pPayload) != 0)
+		return -1;
+
+	if (pLanes->lane[lane]->count > 0)
+		pLanes->ready |= 1u << lane;
+
+	return 0;
+
+} // FsmPutLaneEvent
+
+/**************************************************************************************************/
+// FsmGetEventData from the highest lane that has events
+// returns EVT_FSM_NULL if every lane is empty
+int FsmGetLaneEvent (FsmLaneQ *pLanes, FsmPayload **ppPayload, int *pLane)
+{
+	*ppPayload = NULL;
+
+	while (pLanes->ready != 0)
+	{
+		int		lane = FsmCtz(pLanes->ready);
+		FsmQ	*q = pLanes->lane[lane];
+		int		eventId = FsmGetEventData(q, ppPayload);
+
+		if (q->count <= 0)
+			pLanes->ready &= ~(1u << lane);
+
+		if (eventId != EVT_FSM_NULL)
+		{
+			if (pLane != NULL)
+				*pLane = lane;
+			return eventId;
+		}
+	}
+
+	return EVT_FSM_NULL;
+
+} // FsmGetLaneEvent
+
+/**************************************************************************************************/
+int FsmLaneQCount (const FsmLaneQ *pLanes)
+{
+	int		count = 0;
+	int		i;
+
+	for (i=0; i<pLanes->nLanes; i++)
+		count += pLanes->lane[i]->count;
+
+	return count;
+}
+
+/**************************************************************************************************/
+FsmEvent * FsmFindEvent( FsmEvent** pEventList, int eventId )
+{
+	int		i=0;
+	int		defaultEvt = -1;
+
+	while (pEventList[i]->id != EVT_FSM_NULL)
+	{
+		if (pEventList[i]->id == eventId)
+			break;
+		else if (pEventList[i]->id == EVT_FSM_DEFAULT)
+			defaultEvt = i;
+		i++;
+	}
+
+	if ( (pEventList[i]->id == EVT_FSM_NULL) && (defaultEvt >= 0) )
+	{
+		i = defaultEvt;
+		pEventList[i]->altId = eventId;
+	}
+
+	return pEventList[i];
+}
+
+/**************************************************************************************************/
+// Build the dense dispatch table for a state from its event list.
+// pTable must have EVT_FSM_EOL entries (declare it with FSM_DISPATCH_TABLE). Each entry holds the
+// event FsmFindEvent would return for that id: the matching event, else the state's
+// EVT_FSM_DEFAULT event, else the list terminator. Call again if the event list changes.
+void FsmCompileState(FsmState *pState, FsmEvent **pTable)
+{
+	int		i;
+
+	for (i=0; i<EVT_FSM_EOL; i++)
+		pTable[i] = FsmFindEvent(pState->eventList, i);
+
+	pState->dispatchTable = pTable;
+	pState->dispatchBase = 0;
+	pState->dispatchCount = EVT_FSM_EOL;
+	pState->dispatchMiss = NULL;
+}
+
+/**************************************************************************************************/
+// Build a dispatch table that spans only the ids in the state's event list, lowest to highest,
+// plus one entry for the ids outside it (the state's EVT_FSM_DEFAULT event, else the list
+// terminator). pTable has size entries. Returns the number of entries used, or -1 if the
+// span doesn't fit and the state is left as it was.
+int FsmCompileStateRange(FsmState *pState, FsmEvent **pTable, int size)
+{
+	FsmEvent	**pList;
+	int			low = 0;
+	int			high = -1;
+	int			i;
+
+	for (pList = pState->eventList; (*pList)->id != EVT_FSM_NULL; pList++)
+	{
+		if ( (pList == pState->eventList) || ((*pList)->id < low) )
+			low = (*pList)->id;
+		if ( (pList == pState->eventList) || ((*pList)->id > high) )
+			high = (*pList)->id;
+	}
+
+	if ( (low < 0) || (high - low + 2 > size) )
+		return -1;
+
+	for (i=0; i<=high-low; i++)
+		pTable[i] = FsmFindEvent(pState->eventList, low + i);
+	pTable[i] = FsmFindEvent(pState->eventList, EVT_FSM_NULL);	// never matches
+
+	pState->dispatchTable = pTable;
+	pState->dispatchBase = low;
+	pState->dispatchCount = high - low + 1;
+	pState->dispatchMiss = pTable[i];
+
+	return high - low + 2;
+
+} // FsmCompileStateRange
+
+/**************************************************************************************************/
+// Build the interest set of a state from its event list in pSet (see FSM_EVENT_SET_HAS). A state
+// with an EVT_FSM_DEFAULT event handles every event. Call again if the event list changes, then
+// FsmUpdateInterest on the FSM if the state is active.
+void FsmCompileInterest(FsmState *pState, FsmEventSet *pSet)
+{
+	FsmEvent	**pList;
+
+	memset(pSet, 0, sizeof(FsmEventSet));
+
+	for (pList = pState->eventList; (*pList)->id != EVT_FSM_NULL; pList++)
+	{
+		unsigned	id = (unsigned)(*pList)->id;
+
+		if (EVT_FSM_DEFAULT == id)
+		{
+			memset(pSet, 0xFF, sizeof(FsmEventSet));
+			break;
+		}
+
+		if (id < EVT_FSM_EOL)
+			FSM_EVENT_SET_ADD(*pSet, id);
+	}
+
+	pState->pInterest = pSet;
+	gFsmInterest = true;
+}
+
+/**************************************************************************************************/
+// Give pFsm a set to keep its interest in. An FSM without one is dispatched every event.
+void FsmSetInterest(Fsm *pFsm, FsmEventSet *pSet)
+{
+	pFsm->pInterest = pSet;
+	pFsm->interestValid = false;
+}
+
+/**************************************************************************************************/
+// Set pFsm's interest from its current state's and the sets of the FSMs nested in it.
+// Returns true if the set changed.
+static bool FsmInterestCompute(Fsm *pFsm)
+{
+	FsmState	*pState = pFsm->pState;
+	FsmEventSet	interest;
+	bool		changed;
+	int			i=0;
+	int			w;
+
+	if (NULL == pFsm->pInterest)
+		return false;
+
+	if ( (NULL == pState) || (NULL == pState->pInterest) )
+		memset(&interest, 0xFF, sizeof(FsmEventSet));
+	else
+	{
+		interest = *pState->pInterest;
+
+		while ( (pState->nestedFsmList != NULL) && (pState->nestedFsmList[i] != NULL) )
+		{
+			Fsm	*pNested = pState->nestedFsmList[i++];
+
+			for (w=0; w<FSM_EVENT_SET_WORDS; w++)
+				interest.bits[w] |= pNested->interestValid ? pNested->pInterest->bits[w] : ~0u;
+		}
+	}
+
+	changed = !pFsm->interestValid || (memcmp(&interest, pFsm->pInterest, sizeof(FsmEventSet)) != 0);
+
+	*pFsm->pInterest = interest;
+	pFsm->interestValid = true;
+
+	return changed;
+}
+
+/**************************************************************************************************/
+// Update the interest of pFsm and the FSMs active below it, bottom-up
+static bool FsmInterestSubtree(Fsm *pFsm)
+{
+	FsmState	*pState = pFsm->pState;
+	int			i=0;
+
+	while ( (pState != NULL) && (pState->nestedFsmList != NULL) && (pState->nestedFsmList[i] != NULL) )
+		FsmInterestSubtree(pState->nestedFsmList[i++]);
+
+	return FsmInterestCompute(pFsm);
+}
+
+/**************************************************************************************************/
+// Update the interest of the FSMs above pFsm for as long as a set changes (changed: pFsm's did).
+// A region on the worker pool stops there, its siblings are running: it's marked dirty and
+// FsmDispatchParallel updates the FSMs above after the join.
+static void FsmInterestUpward(Fsm *pFsm, bool changed)
+{
+	while ( changed && (pFsm->pParentState != NULL) && (pFsm->pParentState->pFsm->pState == pFsm->pParentState) )
+	{
+		if (pFsm->parallel)
+		{
+			pFsm->interestDirty = true;
+			return;
+		}
+
+		pFsm = pFsm->pParentState->pFsm;
+		changed = FsmInterestCompute(pFsm);
+	}
+}
+
+/**************************************************************************************************/
+// Update the interest sets after pFsm's state changed: pFsm's, the FSMs active below it, and
+// the FSMs above it for as long as a set changes. FsmTransition and FsmInit call this once
+// a state's interest has been compiled.
+void FsmUpdateInterest(Fsm *pFsm)
+{
+	FsmInterestUpward(pFsm, FsmInterestSubtree(pFsm));
+}
+
+/**************************************************************************************************/
+// true if no state active in pFsm can react to eventId, so it needn't be dispatched
+static inline bool FsmInterestSkips(Fsm *pFsm, int eventId)
+{
+	return pFsm->interestValid && (eventId > EVT_FSM_SUPERSTATE_EXIT) && ((unsigned)eventId < EVT_FSM_EOL)
+		&& !FSM_EVENT_SET_HAS(*pFsm->pInterest, eventId);
+}
+
+/**************************************************************************************************/
+// Find the event handler for a state. Uses the state's dispatch table if it has been compiled.
+static FsmEvent * FsmStateFindEvent( FsmState *pState, int eventId )
+{
+	FsmEvent	*pEvent;
+	unsigned	index = (unsigned)(eventId - pState->dispatchBase);
+
+	if (NULL == pState->dispatchTable)
+		return FsmFindEvent(pState->eventList, eventId);
+
+	if (index < (unsigned)pState->dispatchCount)
+		pEvent = pState->dispatchTable[index];
+	else if (pState->dispatchMiss != NULL)
+		pEvent = pState->dispatchMiss;
+	else
+		return FsmFindEvent(pState->eventList, eventId);
+
+	if ( (pEvent->id == EVT_FSM_DEFAULT) && (eventId != EVT_FSM_DEFAULT) )
+		pEvent->altId = eventId;	// same as FsmFindEvent falling back to the default handler
+
+	return pEvent;
+}
+
+/**************************************************************************************************/
+// Dispatch engine
+/**************************************************************************************************/
+// The first FSM_DISPATCH_DEPTH levels of a dispatch recurse through the hierarchy: FsmDispatchData
+// calls the state handler, FsmStateDefaultHandler dispatches to the nested FSMs (FsmHandlerCall),
+// FsmTransition dispatches the Exit and Entry events (FsmTransitionCall). That's the fast path,
+// and all a machine of ordinary depth uses. Below that depth dispatching doesn't recurse. Each
+// step that calls into the level below is a frame on a per-thread stack, and FsmEngineRun runs
+// the frame on top until the frame it started with is done:
+//     FSM_FRAME_DISPATCH     an event to an FSM's current state (FsmDispatchData), then the
+//                            transition the state asked for. A state with FsmStateDefaultHandler
+//                            is handled in the frame (FsmHandlerRun): the Entry action, the
+//                            nested FSMs one frame at a time, then the state's own handler
+//                            (bottom-up bubbling)
+//     FSM_FRAME_HANDLER      FsmStateDefaultHandler called by a state's own handler
+//     FSM_FRAME_RESUME       a history FSM resuming its state: enters the FSMs nested in it
+//     FSM_FRAME_TRANSITION   FsmTransition: exit the source, set the path, enter the target
+// A frame that started a frame above it picks up at its next phase when that one is done, with
+// the result in tFrameResult. A new dispatch frame takes its first step at once (FsmDispatchNow),
+// so a leaf state that doesn't transition never goes round the engine. A state whose handler
+// isn't FsmStateDefaultHandler is called as a function; when it calls FsmStateDefaultHandler that
+// starts a new run on top of the same stack. So below FSM_DISPATCH_DEPTH a machine of default
+// handlers uses no C stack per level, and every thread's dispatch stack is FSM_DISPATCH_FRAMES
+// frames. Once the engine is running on a thread, everything it dispatches stays on it.
+
+typedef enum
+{
+	FSM_FRAME_DISPATCH,
+	FSM_FRAME_HANDLER,
+	FSM_FRAME_RESUME,
+	FSM_FRAME_TRANSITION
+} eFsmFrameKind;
+
+typedef struct
+{
+	unsigned char	kind;			// eFsmFrameKind
+	unsigned char	phase;			// where the frame picks up next
+	unsigned char	step;			// where FsmStateDefaultHandler picks up next (DISPATCH, HANDLER)
+	bool			consumed;
+	int				eventId;		// DISPATCH, HANDLER; history for RESUME
+	int				index;			// next nested FSM
+	Fsm *			pFsm;
+	FsmState *		pState;			// the state, the transition target
+	FsmPayload *	pPayload;		// the event's
+	FsmPayload *	pSavedPayload;	// DISPATCH: the FSM's payload to restore
+	FsmEvent *		pEvent;			// DISPATCH, HANDLER
+	FsmState *		pNextState;		// DISPATCH, HANDLER; TRANSITION: the LCA state
+	FsmState *		pPendingState;	// DISPATCH, HANDLER
+} FsmFrame;
+
+static FSM_THREAD_LOCAL FsmFrame	tFrames[FSM_DISPATCH_FRAMES];
+static FSM_THREAD_LOCAL int		tFrameTop;
+static FSM_THREAD_LOCAL bool		tFrameResult;	// result of the last frame done
+static FSM_THREAD_LOCAL int		tDepth;			// levels of the recursive dispatch running
+
+// true if the dispatch about to start recurses, false if it goes on the engine
+#define FSM_DISPATCH_RECURSES()		( (0 == tFrameTop) && (tDepth < FSM_DISPATCH_DEPTH) )
+
+/**************************************************************************************************/
+// Push a frame. If the stack is full, logs and returns NULL; the caller carries on as if the frame
+// had run and returned false.
+static FsmFrame * FsmFramePush(eFsmFrameKind kind)
+{
+	FsmFrame	*pFrame;
+
+	if (tFrameTop >= FSM_DISPATCH_FRAMES)
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! dispatch stack full (FSM_DISPATCH_FRAMES %d)", FSM_DISPATCH_FRAMES);
+		tFrameResult = false;
+		return NULL;
+	}
+
+	pFrame = &tFrames[tFrameTop++];
+	pFrame->kind = (unsigned char)kind;
+	pFrame->phase = 0;
+
+	return pFrame;
+}
+
+static void FsmFramePop(bool result)
+{
+	tFrameTop--;
+	tFrameResult = result;
+}
+
+static bool FsmPushDispatch(Fsm *pFsm, int eventId, FsmPayload *pPayload)
+{
+	FsmFrame	*pFrame = FsmFramePush(FSM_FRAME_DISPATCH);
+
+	if (NULL == pFrame)
+		return false;
+
+	pFrame->pFsm = pFsm;
+	pFrame->eventId = eventId;
+	pFrame->pPayload = pPayload;
+	return true;
+}
+
+static bool FsmPushHandler(FsmState *pState, int eventId)
+{
+	FsmFrame	*pFrame = FsmFramePush(FSM_FRAME_HANDLER);
+
+	if (NULL == pFrame)
+		return false;
+
+	pFrame->pState = pState;
+	pFrame->eventId = eventId;
+	pFrame->step = 0;
+	return true;
+}
+
+static bool FsmPushTransition(Fsm *pFsm, FsmState *pNextState)
+{
+	FsmFrame	*pFrame = FsmFramePush(FSM_FRAME_TRANSITION);
+
+	if (NULL == pFrame)
+		return false;
+
+	pFrame->pFsm = pFsm;
+	pFrame->pState = pNextState;
+	return true;
+}
+
+/**************************************************************************************************/
+// FsmStateDefaultHandler before the nested FSMs: finds the state's event and runs the Entry
+// action. Fills in pFrame's pEvent, pPayload, pNextState, pPendingState and consumed.
+static inline void FsmHandlerBegin(FsmFrame *pFrame, FsmState *pState, int eventId, bool isEntry)
+{
+	FsmEvent	*pEvent;
+
+	FSM_NOTIFY(pState, eventId);
+
+	pFrame->pPayload = pState->pFsm->pPayload;
+	pFrame->pNextState = NULL;
+	pFrame->pPendingState = NULL;
+	pFrame->consumed = false;
+
+	pEvent = FsmStateFindEvent( pState, eventId );	// returns pEvent->id == EVT_FSM_NULL if no handler found
+	pFrame->pEvent = pEvent;
+	if (pEvent->id != EVT_FSM_NULL)		// fsmNullEvent is shared, don't write to it
+	{
+		pEvent->consumed = false;
+		pEvent->pPayload = pFrame->pPayload;
+	}
+
+	// Handle ENTRY events before passing to the substate; i.e.,
+	// ENTRY events are handled in top-down order, always consume
+	if ((pEvent->id == eventId) && isEntry )
+	{
+		pFrame->pNextState = (pEvent->pfnEvtHandler == NULL ? NULL : (*pEvent->pfnEvtHandler)(pState, pEvent) );
+		pFrame->consumed = true;
+	}
+}
+
+/**************************************************************************************************/
+// FsmStateDefaultHandler after the nested FSMs: the state's own handling of events they didn't
+// consume, then the next state. Returns consumed.
+static inline bool FsmHandlerEnd(FsmFrame *pFrame, FsmState *pState, int eventId, bool isEntry)
+{
+	FsmEvent	*pEvent = pFrame->pEvent;
+	bool		isExit = (EVT_FSM_EXIT == eventId) || (EVT_FSM_SUPERSTATE_EXIT == eventId);
+
+	// a nested dispatch may have reused the event object
+	if ( (pState->nestedFsmList != NULL) && (pEvent->id != EVT_FSM_NULL) )
+		pEvent->pPayload = pFrame->pPayload;
+
+	// Handle non-ENTRY events not consumed by the substate
+	// NB: EXIT events are handled in bottom-up order
+	if ( (!pFrame->consumed) && (pEvent->id != EVT_FSM_NULL) && (!isEntry) )
+	{
+		pFrame->pNextState = (pEvent->pfnEvtHandler == NULL ? NULL : (*pEvent->pfnEvtHandler)(pState, pEvent) );
+		// ignore transitions in Exit actions (or else we'll wind up in an infinite recursive loop...)
+		pFrame->pNextState = ( (EVT_FSM_EXIT == eventId) ? NULL : pFrame->pNextState);
+
+		pFrame->consumed = pFrame->consumed || pEvent->consumed;
+	}
+
+	// timers armed in the state end when it exits
+	if ( isExit && (pState->pTimers != NULL) && (gpCancelTimersFcn != NULL) )
+		(*gpCancelTimersFcn)(pState);
+
+	// ignore transitions out of nested FSMs in Exit actions, as above
+	if ( (NULL == pFrame->pNextState) && (!isExit) )
+		pFrame->pNextState = pFrame->pPendingState;
+
+	pState->pNextState = pFrame->pNextState;
+
+	return pFrame->consumed;
+}
+
+static bool FsmHandlerRun(FsmFrame *pFrame);
+
+/**************************************************************************************************/
+// The state an event is dispatched to in pFsm. Logs and returns NULL if there's none.
+static inline FsmState * FsmDispatchTarget(Fsm *pFsm)
+{
+	FsmState	*pState;
+
+	if (NULL == pFsm)
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! fsm undefined");
+		return NULL;
+	}
+
+	pState = pFsm->pState;
+	if (NULL == pState)
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! FSM %s: state undefined", pFsm->name);
+		return NULL;
+	}
+
+	if (NULL == pState->pfnStateHandler)
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! FSM %s: state %s handler undefined", pFsm->name, pState->name);
+		return NULL;
+	}
+
+	return pState;
+}
+
+/**************************************************************************************************/
+// Recursive FsmDispatchData once the FSM and its state have been checked
+static bool FsmDispatchState(Fsm *pFsm, FsmStatePtr pState, int eventId, FsmPayload *pPayload)
+{
+	bool 		consumed;
+	FsmPayload	*pSavedPayload = pFsm->pPayload;
+
+	FSM_STATS_DISPATCH(pState, eventId);
+
+	pFsm->pPayload = pPayload;
+	tDepth++;
+
+	consumed = (*pState->pfnStateHandler) (pState, eventId);
+
+	pFsm->pPayload = pSavedPayload;
+
+	// Transition to next state if necessary
+	if (pState->pNextState)
+		FsmTransition(pState->pFsm, pState->pNextState);
+
+	tDepth--;
+
+	return consumed;
+}
+
+/**************************************************************************************************/
+// Dispatch frame: pFsm, eventId and pPayload. A state with the default handler is handled in the
+// frame itself (FsmHandlerRun); any other handler is called.
+static void FsmStepDispatch(FsmFrame *pFrame)
+{
+	Fsm			*pFsm = pFrame->pFsm;
+	FsmState	*pState;
+
+	switch (pFrame->phase)
+	{
+	case 0:
+		if (EVT_FSM_NULL == pFrame->eventId)	// no event
+		{
+			FsmFramePop(true);
+			return;
+		}
+
+		pState = FsmDispatchTarget(pFsm);
+		if (NULL == pState)
+		{
+			FsmFramePop(false);
+			return;
+		}
+
+		FSM_STATS_DISPATCH(pState, pFrame->eventId);
+
+		pFrame->pSavedPayload = pFsm->pPayload;
+		pFsm->pPayload = pFrame->pPayload;
+		pFrame->pState = pState;
+
+		if (pState->pfnStateHandler != FsmStateDefaultHandler)
+		{
+			pFrame->consumed = (*pState->pfnStateHandler) (pState, pFrame->eventId);
+			break;
+		}
+
+		pFrame->step = 0;
+		pFrame->phase = 1;
+
+		// the nested FSMs are run from the engine, so dispatching doesn't recurse
+		if (pState->nestedFsmList != NULL)
+			return;
+		// fall through
+
+	case 1:		// the default handler, until it's done
+		if (!FsmHandlerRun(pFrame))
+			return;
+		break;
+
+	default:	// the transition is done
+		FsmFramePop(pFrame->consumed);
+		return;
+	}
+
+	pFsm->pPayload = pFrame->pSavedPayload;
+	pState = pFrame->pState;
+
+	// Transition to next state if necessary
+	if (pState->pNextState)
+	{
+		pFrame->phase = 2;
+		FsmPushTransition(pState->pFsm, pState->pNextState);
+		return;
+	}
+
+	FsmFramePop(pFrame->consumed);
+}
+
+/**************************************************************************************************/
+// Push a dispatch frame and take its first step now, without going round the engine. Returns
+// true if the frame is already done (a leaf state that didn't transition), with its result in
+// tFrameResult.
+static bool FsmDispatchNow(Fsm *pFsm, int eventId, FsmPayload *pPayload)
+{
+	int		base = tFrameTop;
+
+	if (!FsmPushDispatch(pFsm, eventId, pPayload))
+		return true;
+
+	FsmStepDispatch(&tFrames[base]);
+
+	return (tFrameTop == base);
+}
+
+/**************************************************************************************************/
+// true if a nested FSM of pState has an initial state or history, or is on a transition's path,
+// so entering pState enters its nested FSMs one at a time (FsmEnterNested)
+static bool FsmStateHasHistory(FsmState *pState)
+{
+	int		i=0;
+
+	while (pState->nestedFsmList[i] != NULL)
+	{
+		Fsm	*pNested = pState->nestedFsmList[i++];
+
+		if ( (pNested->pInitialState != NULL) || (pNested->history != FSM_HISTORY_NONE) || pNested->onPath )
+			return true;
+	}
+
+	return false;
+}
+
+/**************************************************************************************************/
+// Start entering a nested FSM as its parent state is entered (eventId is EVT_FSM_SUPERSTATE_ENTRY),
+// see FSM_HISTORY. *pHistory is FSM_HISTORY_DEEP when an FSM above is resuming deep history.
+// Returns the event that enters pNested, or EVT_FSM_NULL if it resumes its history (*pHistory).
+// The states a transition goes through and its target are entered with EVT_FSM_ENTRY.
+static int FsmEnterEvent(FsmState *pParentState, Fsm *pNested, int eventId, int *pHistory)
+{
+	bool	onPath = pNested->onPath;
+
+	pNested->pParentState = pParentState;		// the nested FSM is active in this state
+	pNested->pPendingState = NULL;
+	pNested->onPath = false;
+
+	if (*pHistory < pNested->history)
+		*pHistory = pNested->history;
+
+	// FsmTransition set the state
+	if (onPath)
+		return EVT_FSM_ENTRY;
+
+	// the application sets the state
+	if ( (NULL == pNested->pInitialState) && (FSM_HISTORY_NONE == *pHistory) )
+		return eventId;
+
+	if ( (FSM_HISTORY_NONE == *pHistory) || (NULL == pNested->pState) )
+	{
+		pNested->pState = pNested->pInitialState;
+		return EVT_FSM_ENTRY;
+	}
+
+	return EVT_FSM_NULL;
+}
+
+static bool FsmEnterNestedCall(FsmState *pParentState, Fsm *pNested, int eventId, FsmPayload *pPayload, int history);
+
+/**************************************************************************************************/
+// Recursive resume: a history FSM resumes the state it was in. The FSMs nested in that state are
+// entered, with nothing dispatched to the state itself. history is FSM_HISTORY_DEEP to resume
+// them too.
+static void FsmResume(Fsm *pFsm, int history, FsmPayload *pPayload)
+{
+	FsmState	*pState = pFsm->pState;
+	int			i=0;
+
+	if (NULL == pState->nestedFsmList)
+		return;
+
+	while (pState->nestedFsmList[i] != NULL)
+	{
+		Fsm	*pNested = pState->nestedFsmList[i++];
+
+		FsmEnterNestedCall(pState, pNested, EVT_FSM_SUPERSTATE_ENTRY, pPayload,
+						   (FSM_HISTORY_DEEP == history) ? FSM_HISTORY_DEEP : FSM_HISTORY_NONE);
+
+		// an Entry action below transitioned out of pNested, take it as pState's handler would
+		if (pNested->pPendingState != NULL)
+		{
+			FsmTransition(pFsm, pNested->pPendingState);
+			break;
+		}
+	}
+}
+
+/**************************************************************************************************/
+// Recursive FsmEnterNested. Returns whether the entry was consumed; a transition to a state
+// outside pNested is left in pNested->pPendingState.
+static bool FsmEnterNestedCall(FsmState *pParentState, Fsm *pNested, int eventId, FsmPayload *pPayload, int history)
+{
+	int		entryId = FsmEnterEvent(pParentState, pNested, eventId, &history);
+
+	if (entryId != EVT_FSM_NULL)
+		return FsmDispatchData(pNested, entryId, pPayload);
+
+	FsmResume(pNested, history, pPayload);
+
+	return true;
+}
+
+/**************************************************************************************************/
+// Enter a nested FSM as its parent state is entered, on the engine: pushes the dispatch that
+// enters it, or the frame that resumes its history. The frame returns whether the entry was
+// consumed, and a transition to a state outside pNested is left in pNested->pPendingState.
+// Returns true if that frame is already done, as FsmDispatchNow.
+static bool FsmEnterNested(FsmState *pParentState, Fsm *pNested, int eventId, FsmPayload *pPayload, int history)
+{
+	FsmFrame	*pFrame;
+	int			entryId = FsmEnterEvent(pParentState, pNested, eventId, &history);
+
+	if (entryId != EVT_FSM_NULL)
+		return FsmDispatchNow(pNested, entryId, pPayload);
+
+	pFrame = FsmFramePush(FSM_FRAME_RESUME);
+	if (NULL == pFrame)
+		return true;
+
+	pFrame->pFsm = pNested;
+	pFrame->pState = pNested->pState;
+	pFrame->eventId = history;
+	pFrame->pPayload = pPayload;
+	pFrame->index = 0;
+	return false;
+}
+
+/**************************************************************************************************/
+// Resume frame: a history FSM resumes the state it was in. The FSMs nested in that state are
+// entered, with nothing dispatched to the state itself. history (eventId) is FSM_HISTORY_DEEP
+// to resume them too.
+static void FsmStepResume(FsmFrame *pFrame)
+{
+	FsmState	*pState = pFrame->pState;
+	Fsm			*pNested;
+
+	// an Entry action below transitioned out of the last one, take it as pState's handler would
+	if ( (pFrame->index > 0) && (pState->nestedFsmList[pFrame->index - 1]->pPendingState != NULL) )
+	{
+		pNested = pState->nestedFsmList[pFrame->index - 1];
+		FsmFramePop(true);
+		FsmPushTransition(pFrame->pFsm, pNested->pPendingState);	// reuses the frame
+		return;
+	}
+
+	if ( (NULL == pState->nestedFsmList) || (NULL == pState->nestedFsmList[pFrame->index]) )
+	{
+		FsmFramePop(true);
+		return;
+	}
+
+	pNested = pState->nestedFsmList[pFrame->index++];
+	(void)FsmEnterNested(pState, pNested, EVT_FSM_SUPERSTATE_ENTRY, pFrame->pPayload,
+				   (FSM_HISTORY_DEEP == pFrame->eventId) ? FSM_HISTORY_DEEP : FSM_HISTORY_NONE);
+}
+
+/**************************************************************************************************/
+// Dispatch an event to a state's nested FSMs on the worker pool (gpParallelFcn), serially if the
+// pool doesn't take them. Results are combined in list order, as in FsmStateDefaultHandler.
+static bool FsmDispatchParallel(FsmState *pState, int eventId, FsmPayload *pPayload, bool isEntry,
+								FsmState **ppPendingState)
+{
+	Fsm		*regionList[FSM_MAX_PARALLEL_REGIONS];
+	bool	regionConsumed[FSM_MAX_PARALLEL_REGIONS];
+	bool	consumed = false;
+	bool	pooled = false;
+	bool	dirty = false;
+	int		count = 0;
+	int		i=0;
+
+	while (pState->nestedFsmList[i] != NULL)
+	{
+		Fsm	*pNested = pState->nestedFsmList[i++];
+
+		if (isEntry)
+		{
+			pNested->pParentState = pState;
+			pNested->onPath = false;
+		}
+		pNested->pPendingState = NULL;
+
+		// only the regions that can react to the event go to the pool
+		if ( (count < FSM_MAX_PARALLEL_REGIONS) && !FsmInterestSkips(pNested, eventId) )
+			regionList[count++] = pNested;
+	}
+
+	if (i > FSM_MAX_PARALLEL_REGIONS)	// too many for the pool, dispatch them one at a time
+	{
+		for (i=0; pState->nestedFsmList[i] != NULL; i++)
+		{
+			Fsm	*pNested = pState->nestedFsmList[i];
+
+			if (FsmInterestSkips(pNested, eventId))
+				continue;
+
+			consumed = FsmDispatchData(pNested, eventId, pPayload) || consumed;
+			if (NULL == *ppPendingState)
+				*ppPendingState = pNested->pPendingState;
+		}
+		return consumed;
+	}
+
+	if ( (count >= pState->parallelMin) && (gpParallelFcn != NULL) )
+	{
+		for (i=0; i<count; i++)
+			regionList[i]->parallel = true;
+
+		pooled = (*gpParallelFcn)(regionList, count, eventId, pPayload, regionConsumed);
+
+		// the regions' transitions left the interest above them to update here
+		for (i=0; i<count; i++)
+		{
+			dirty = dirty || regionList[i]->interestDirty;
+			regionList[i]->parallel = false;
+			regionList[i]->interestDirty = false;
+		}
+
+		if (dirty)
+			FsmInterestUpward(pState->pFsm, FsmInterestCompute(pState->pFsm));
+	}
+
+	if (!pooled)
+	{
+		for (i=0; i<count; i++)
+			regionConsumed[i] = FsmDispatchData(regionList[i], eventId, pPayload);
+	}
+
+	for (i=0; i<count; i++)
+	{
+		consumed = consumed || regionConsumed[i];
+
+		if (NULL == *ppPendingState)
+			*ppPendingState = regionList[i]->pPendingState;
+	}
+
+	return consumed;
+}
+
+/**************************************************************************************************/
+// Recursive FsmStateDefaultHandler for a state with nested FSMs
+static bool FsmHandlerCall(FsmState *pState, int eventId)
+{
+	FsmFrame	frame;
+	int			subStateEventId = eventId;
+	bool		isEntry = (EVT_FSM_ENTRY == eventId) || (EVT_FSM_SUPERSTATE_ENTRY == eventId);
+	bool		subStateConsumed;
+	int			i=0;
+
+	if (EVT_FSM_ENTRY == eventId)
+		subStateEventId = EVT_FSM_SUPERSTATE_ENTRY;
+	else if (EVT_FSM_EXIT ==  eventId)
+		subStateEventId = EVT_FSM_SUPERSTATE_EXIT;
+
+	FsmHandlerBegin(&frame, pState, eventId, isEntry);
+
+	// Pass the event to the substate.
+	if ( (pState->parallelMin > 0) && (gpParallelFcn != NULL)
+	  && !(isEntry && FsmStateHasHistory(pState)) )
+	{
+		frame.consumed = FsmDispatchParallel(pState, subStateEventId, frame.pPayload, isEntry,
+											 &frame.pPendingState) || frame.consumed;
+	}
+	else while (pState->nestedFsmList[i] != NULL)
+	{
+		Fsm	*pNested = pState->nestedFsmList[i++];
+
+		// transitions inside the nested FSM are taken by the nested FSM
+		if (isEntry)
+			subStateConsumed = FsmEnterNestedCall(pState, pNested, subStateEventId, frame.pPayload, FSM_HISTORY_NONE);
+		else
+		{
+			pNested->pPendingState = NULL;
+			if (FsmInterestSkips(pNested, subStateEventId))
+				continue;		// nothing active in it handles the event
+			subStateConsumed = FsmDispatchData(pNested, subStateEventId, frame.pPayload);
+		}
+		frame.consumed = frame.consumed || subStateConsumed;
+
+		// a transition to a state outside the nested FSM is taken here (or further up)
+		if (NULL == frame.pPendingState)
+			frame.pPendingState = pNested->pPendingState;
+	}
+
+	return FsmHandlerEnd(&frame, pState, eventId, isEntry);
+}
+
+/**************************************************************************************************/
+// FsmStateDefaultHandler for pFrame's pState and eventId. Returns true when it's done, with
+// the result in pFrame->consumed, false when it has started a frame for a nested FSM.
+static bool FsmHandlerRun(FsmFrame *pFrame)
+{
+	FsmState	*pState = pFrame->pState;
+	int			eventId = pFrame->eventId;
+	int			subStateEventId = eventId;
+	bool		isEntry = (EVT_FSM_ENTRY == eventId) || (EVT_FSM_SUPERSTATE_ENTRY == eventId);
+	Fsm			*pNested;
+
+	if (EVT_FSM_ENTRY == eventId)
+		subStateEventId = EVT_FSM_SUPERSTATE_ENTRY;
+	else if (EVT_FSM_EXIT ==  eventId)
+		subStateEventId = EVT_FSM_SUPERSTATE_EXIT;
+
+	for (;;) switch (pFrame->step)
+	{
+	case 0:
+		FsmHandlerBegin(pFrame, pState, eventId, isEntry);
+
+		// Pass the event to the substate.
+		pFrame->step = 3;
+		if (pState->nestedFsmList)
+		{
+			if ( (pState->parallelMin > 0) && (gpParallelFcn != NULL)
+			  && !(isEntry && FsmStateHasHistory(pState)) )
+			{
+				pFrame->consumed = FsmDispatchParallel(pState, subStateEventId, pFrame->pPayload, isEntry,
+													   &pFrame->pPendingState) || pFrame->consumed;
+			}
+			else
+			{
+				pFrame->index = 0;
+				pFrame->step = 1;
+			}
+		}
+		break;
+
+	case 1:		// the next nested FSM
+		pNested = pState->nestedFsmList[pFrame->index];
+		if (NULL == pNested)
+		{
+			pFrame->step = 3;
+			break;
+		}
+		pFrame->index++;
+
+		// transitions inside the nested FSM are taken by the nested FSM
+		pFrame->step = 2;
+		if (isEntry)
+		{
+			if (!FsmEnterNested(pState, pNested, subStateEventId, pFrame->pPayload, FSM_HISTORY_NONE))
+				return false;
+			break;
+		}
+
+		pNested->pPendingState = NULL;
+		if (FsmInterestSkips(pNested, subStateEventId))
+		{
+			pFrame->step = 1;
+			break;		// nothing active in it handles the event
+		}
+
+		if (!FsmDispatchNow(pNested, subStateEventId, pFrame->pPayload))
+			return false;
+		break;
+
+	case 2:		// the nested FSM is done
+		pFrame->consumed = pFrame->consumed || tFrameResult;
+
+		// a transition to a state outside the nested FSM is taken here (or further up)
+		if (NULL == pFrame->pPendingState)
+			pFrame->pPendingState = pState->nestedFsmList[pFrame->index - 1]->pPendingState;
+		pFrame->step = 1;
+		break;
+
+	default:
+		FsmHandlerEnd(pFrame, pState, eventId, isEntry);
+		return true;
+	}
+}
+
+/**************************************************************************************************/
+// Handler frame: FsmStateDefaultHandler called by a state's own handler
+static void FsmStepHandler(FsmFrame *pFrame)
+{
+	if (FsmHandlerRun(pFrame))
+		FsmFramePop(pFrame->consumed);
+}
+
+/**************************************************************************************************/
+// The state in pFsm that holds pNextState (see FsmTransition), or NULL if pFsm doesn't: the
+// transition is left in pFsm->pPendingState for the FSM above.
+static FsmState * FsmTransitionLca(Fsm *pFsm, FsmState *pNextState)
+{
+	FsmState	*pLcaState = pNextState;
+
+	while ( (pLcaState != NULL) && (pLcaState->pFsm != pFsm) )
+		pLcaState = pLcaState->pFsm->pParentState;
+
+	if (NULL == pLcaState)
+	{
+		if (pFsm->pParentState != NULL)
+			pFsm->pPendingState = pNextState;	// the LCA is further up
+		else
+			FSM_LOG("!!!! FSM ERROR !!!! FSM %s: transition target %s not found (see FsmLinkState)",
+					pFsm->name, pNextState->name);
+		return NULL;
+	}
+
+	FSM_STATS_TRANSITION(pFsm->pState, pNextState);
+
+	return pLcaState;
+}
+
+/**************************************************************************************************/
+// Set the FSMs between pLcaState and pNextState to the states on the path, and pFsm to pLcaState
+static inline void FsmTransitionPath(Fsm *pFsm, FsmState *pNextState, FsmState *pLcaState)
+{
+	FsmState	*pPathState;
+
+	for (pPathState = pNextState; pPathState != pLcaState; pPathState = pPathState->pFsm->pParentState)
+	{
+		pPathState->pFsm->pState = pPathState;
+		pPathState->pFsm->onPath = true;
+	}
+
+	pFsm->pState = pLcaState;				// change current state
+}
+
+/**************************************************************************************************/
+// A transition in pFsm (or FsmInit) is done: update the interest sets, and once the outermost
+// transition on the thread is done, run the recalls its Entry handlers asked for
+static void FsmTransitionEnd(Fsm *pFsm)
+{
+	int		i;
+
+	if (gFsmInterest)
+		FsmUpdateInterest(pFsm);
+
+	if ( (--tTransitions > 0) || (0 == tRecallCount) )
+		return;
+
+	for (i=0; i<tRecallCount; i++)
+		FsmRecallNow(tRecallFsm[i]);
+	tRecallCount = 0;
+}
+
+/**************************************************************************************************/
+// Recursive FsmTransition
+static void FsmTransitionCall(Fsm *pFsm, FsmState *pNextState)
+{
+	FsmState	*pLcaState = FsmTransitionLca(pFsm, pNextState);
+
+	if (NULL == pLcaState)
+		return;
+
+	tTransitions++;
+	FsmDispatch(pFsm, EVT_FSM_EXIT);		// exit the source
+	FsmTransitionPath(pFsm, pNextState, pLcaState);
+	FsmDispatch(pFsm, EVT_FSM_ENTRY);		// enter the target
+	FsmTransitionEnd(pFsm);
+}
+
+/**************************************************************************************************/
+// Transition frame: pFsm to pState, see FsmTransition
+static void FsmStepTransition(FsmFrame *pFrame)
+{
+	Fsm			*pFsm = pFrame->pFsm;
+	FsmState	*pNextState = pFrame->pState;
+	FsmState	*pLcaState;
+
+	for (;;) switch (pFrame->phase)
+	{
+	case 0:
+		pLcaState = FsmTransitionLca(pFsm, pNextState);
+		if (NULL == pLcaState)
+		{
+			FsmFramePop(true);
+			return;
+		}
+
+		tTransitions++;
+		pFrame->pNextState = pLcaState;
+		pFrame->phase = 1;
+		if (!FsmDispatchNow(pFsm, EVT_FSM_EXIT, NULL))	// exit the source
+			return;
+		break;
+
+	case 1:
+		FsmTransitionPath(pFsm, pNextState, pFrame->pNextState);
+		pFrame->phase = 2;
+		if (!FsmDispatchNow(pFsm, EVT_FSM_ENTRY, NULL))	// enter the target
+			return;
+		break;
+
+	default:
+		FsmTransitionEnd(pFsm);
+		FsmFramePop(true);
+		return;
+	}
+}
+
+/**************************************************************************************************/
+// Run the frames above base until they're done. Returns the result of the frame at base.
+static bool FsmEngineRun(int base)
+{
+	while (tFrameTop > base)
+	{
+		FsmFrame	*pFrame = &tFrames[tFrameTop - 1];
+
+		switch (pFrame->kind)
+		{
+		case FSM_FRAME_DISPATCH:	FsmStepDispatch(pFrame);	break;
+		case FSM_FRAME_HANDLER:		FsmStepHandler(pFrame);		break;
+		case FSM_FRAME_RESUME:		FsmStepResume(pFrame);		break;
+		default:					FsmStepTransition(pFrame);	break;
+		}
+	}
+
+	return tFrameResult;
+}
+
+/**************************************************************************************************/
+bool FsmDispatch(Fsm *pFsm, int eventId)
+{
+	return FsmDispatchData(pFsm, eventId, NULL);
+}
+
+/**************************************************************************************************/
+bool FsmDispatchData(Fsm *pFsm, int eventId, FsmPayload *pPayload)
+{
+	int			base = tFrameTop;
+	FsmState	*pState;
+
+	if (FSM_DISPATCH_RECURSES())
+	{
+		if (EVT_FSM_NULL == eventId)	// no event
+			return true;
+
+		pState = FsmDispatchTarget(pFsm);
+		if (NULL == pState)
+			return false;
+
+		return FsmDispatchState(pFsm, pState, eventId, pPayload);
+	}
+
+	if (FsmDispatchNow(pFsm, eventId, pPayload))
+		return tFrameResult;
+
+	return FsmEngineRun(base);
+}
+
+/**************************************************************************************************/
+// FSM Base Class State Handler function
+// returns true if no further processing for event (i.e., event consumed)
+// sets pState->pNextState = NULL if no transition, otherwise points to next state
+//
+// NB: State transitions can't occur in Exit actions. That's gotta be
+//     illegal, right? This implementation igores transitions in exit actions.
+//
+// Below FSM_DISPATCH_DEPTH, states that use this as their handler are run by the dispatch engine
+// without calling it; an overriding handler calls it to get the default handling.
+
+bool FsmStateDefaultHandler(FsmState *pState, int eventId)
+{
+	int		base = tFrameTop;
+
+	if (NULL == pState->nestedFsmList)		// a leaf state is done in one step, on a frame of its own
+	{
+		FsmFrame	leaf;
+		bool		isEntry = (EVT_FSM_ENTRY == eventId) || (EVT_FSM_SUPERSTATE_ENTRY == eventId);
+
+		FsmHandlerBegin(&leaf, pState, eventId, isEntry);
+		return FsmHandlerEnd(&leaf, pState, eventId, isEntry);
+	}
+
+	if (0 == base)						// recursing
+		return FsmHandlerCall(pState, eventId);
+
+	if (!FsmPushHandler(pState, eventId))
+		return false;
+
+	return FsmEngineRun(base);
+
+} // FsmDispatch
+
+/**************************************************************************************************/
+// Transition to pNextState, which may be in pFsm or in any FSM nested below or above it.
+//
+// The transition is taken in the least common ancestor (LCA) FSM of the source and the target:
+// the lowest FSM that holds both the source state and an ancestor of the target (pLcaState).
+// If pNextState isn't below pFsm it is passed up to the FSM pFsm is nested in, so only the
+// states below the LCA get Exit and Entry events:
+//     - pFsm's current state and the states nested in it are exited, bottom-up
+//     - the FSMs between pLcaState and pNextState are set to the states on the path, and
+//       entered in them rather than their initial state or history
+//     - pLcaState is entered, top-down. The path states are entered on the way down, other
+//       nested FSMs enter their current state as before.
+//
+// Finding the LCA just follows pParentState links up from the target, no events are dispatched.
+void FsmTransition(Fsm *pFsm, FsmStatePtr pNextState)
+{
+	int		base = tFrameTop;
+
+	if (FSM_DISPATCH_RECURSES())
+	{
+		FsmTransitionCall(pFsm, pNextState);
+		return;
+	}
+
+	if (FsmPushTransition(pFsm, pNextState))
+		FsmEngineRun(base);
+}
+
+/**************************************************************************************************/
+// Link the FSMs nested in a state to the state.
+// A nested FSM is linked when its state is entered. A transition to a state in a nested FSM that
+// hasn't been entered yet needs the links up to the top FSM, so call this at init for each state
+// that has nested FSMs, top-down. A nested FSM listed in more than one state follows the state
+// that entered it last.
+void FsmLinkState(FsmState *pState)
+{
+	int		i=0;
+
+	if (NULL == pState->nestedFsmList)
+		return;
+
+	while (pState->nestedFsmList[i] != NULL)
+		pState->nestedFsmList[i++]->pParentState = pState;
+}
+
+/**************************************************************************************************/
+void FsmInit (Fsm *pFsm, FsmState *pState)
+{
+	pFsm->pState = pState;				// set initial state
+	tTransitions++;
+	FsmDispatch(pFsm, EVT_FSM_ENTRY);	// enter the initial state
+	FsmTransitionEnd(pFsm);
+
+} // FsmInit
+
+/**************************************************************************************************/
+// The top level FSM of pFsm's machine, found through the parent states of the FSMs that have
+// been entered (or linked, FsmLinkState)
+Fsm * FsmTop(Fsm *pFsm)
+{
+	while ( (pFsm != NULL) && (pFsm->pParentState != NULL) )
+		pFsm = pFsm->pParentState->pFsm;
+	return pFsm;
+}
+
+/**************************************************************************************************/
+void FsmRun(Fsm *pFsm, int eventId)
+{
+	FsmRunData(pFsm, eventId, NULL);
+
+} // FsmRun
+
+/**************************************************************************************************/
+// Run an event with a payload. The caller keeps its reference to the payload.
+void FsmRunData(Fsm *pFsm, int eventId, FsmPayload *pPayload)
+{
+	FsmStatePtr	pState;
+	bool		consumed;
+	bool		recalled = false;
+	int			nextEvent = eventId;
+	FsmPayload	*pNextPayload = pPayload;
+
+	FSM_INSERT_BEFORE(pFsm, eventId);
+	FSM_STATS_RUN();
+
+	do {
+		pState = pFsm->pState;
+		consumed = !FsmInterestSkips(pFsm, nextEvent) && FsmDispatchData(pFsm, nextEvent, pNextPayload);
+		if (!consumed)
+		{
+			FSM_STATS_IGNORED(pState, nextEvent);
+			FSM_TRACE_IGNORED(pFsm, nextEvent);
+		}
+
+		// drop the recall queue's reference to the recalled event we just ran
+		if ( recalled && (pNextPayload != NULL) )
+			FsmPayloadRelease(pNextPayload);
+
+		// a coroutine handler parked the machine: the recalled events wait for it
+		if ( (gpParkedFcn != NULL) && (*gpParkedFcn)(pFsm) )
+			break;
+
+		// look for any any deferred events that have been recalled
+		nextEvent = FsmGetEventData(pFsm->recallQ, &pNextPayload);
+		recalled = true;
+
+	} while (nextEvent != EVT_FSM_NULL);
+	
+	FSM_INSERT_AFTER(pFsm, eventId);
+
+} // CoordFsmRun
+
+/**************************************************************************************************/
+// FsmDispatchData for the batch runners, which have checked pFsm and the event id
+static inline bool FsmDispatchChecked(Fsm *pFsm, int eventId, FsmPayload *pPayload)
+{
+	FsmState	*pState = pFsm->pState;
+
+	if ( FSM_DISPATCH_RECURSES() && (pState != NULL) && (pState->pfnStateHandler != NULL) )
+		return FsmDispatchState(pFsm, pState, eventId, pPayload);
+
+	return FsmDispatchData(pFsm, eventId, pPayload);	// logs a missing state, or runs on the engine
+}
+
+/**************************************************************************************************/
+// FsmRunData for one event of a batch: counts the event and the events it recalls in pResult
+// instead of logging the ignored ones. The batch runner counts the runs, and looks once for test
+// hooks (inserts) to run around each event.
+static void FsmRunCounted(Fsm *pFsm, int eventId, FsmPayload *pPayload, FsmRunResult *pResult, bool inserts)
+{
+	FsmStatePtr	pState;
+	bool		consumed;
+	bool		recalled = false;
+	int			nextEvent = eventId;
+	FsmPayload	*pNextPayload = pPayload;
+
+	if (inserts)
+	{
+		FSM_INSERT_BEFORE(pFsm, eventId);
+	}
+
+	for (;;)
+	{
+		pState = pFsm->pState;
+		consumed = !FsmInterestSkips(pFsm, nextEvent) && FsmDispatchChecked(pFsm, nextEvent, pNextPayload);
+
+		if (consumed)
+			pResult->consumed++;
+		else
+		{
+			pResult->ignored++;
+			FSM_STATS_IGNORED(pState, nextEvent);
+		}
+
+		if ( recalled && (pNextPayload != NULL) )
+			FsmPayloadRelease(pNextPayload);
+
+		if ( (NULL == pFsm->recallQ) || (pFsm->recallQ->count <= 0) )
+			break;
+		if ( (gpParkedFcn != NULL) && (*gpParkedFcn)(pFsm) )
+			break;
+
+		nextEvent = FsmGetEventData(pFsm->recallQ, &pNextPayload);
+		recalled = true;
+	}
+
+	if (inserts)
+	{
+		FSM_INSERT_AFTER(pFsm, eventId);
+	}
+}
+
+/**************************************************************************************************/
+// Run count events, one after another. Each event (and the deferred events it recalls) runs to
+// completion before the next, as with FsmRun. EVT_FSM_NULL entries are skipped.
+// Returns the number of events consumed and ignored; ignored events are not logged.
+FsmRunResult FsmRunBatch(Fsm *pFsm, const int *pEvents, int count)
+{
+	FsmRunResult	result = { 0, 0 };
+	bool			inserts = FSM_INSERT_PENDING();
+	int				runs = 0;
+	int				i;
+
+	if (NULL == pFsm)
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! fsm undefined");
+		return result;
+	}
+
+	for (i=0; i<count; i++)
+	{
+		if (pEvents[i] != EVT_FSM_NULL)
+		{
+			FsmRunCounted(pFsm, pEvents[i], NULL, &result, inserts);
+			runs++;
+		}
+	}
+
+	FSM_STATS_RUNS(runs);
+
+	return result;
+
+} // FsmRunBatch
+
+/**************************************************************************************************/
+// Run the events in queue q, oldest first, with their payloads. Stops after maxEvents
+// (<= 0 for no limit) or when the queue is empty, so events the FSM puts in q are run too.
+// Returns the number of events consumed and ignored, as FsmRunBatch.
+FsmRunResult FsmRunQueue(Fsm *pFsm, FsmQ *q, int maxEvents)
+{
+	FsmRunResult	result = { 0, 0 };
+	FsmPayload		*pPayload;
+	bool			inserts = FSM_INSERT_PENDING();
+	int				eventId;
+	int				count = 0;
+
+	if ( (NULL == pFsm) || (NULL == q) )
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! fsm or queue undefined");
+		return result;
+	}
+
+	while ( ((maxEvents <= 0) || (count < maxEvents))
+		 && ((eventId = FsmGetEventData(q, &pPayload)) != EVT_FSM_NULL) )
+	{
+		FsmRunCounted(pFsm, eventId, pPayload, &result, inserts);
+
+		if (pPayload != NULL)
+			FsmPayloadRelease(pPayload);	// the queue's reference
+		count++;
+	}
+
+	FSM_STATS_RUNS(count);
+
+	return result;
+
+} // FsmRunQueue
+
+/**************************************************************************************************/
+// FsmRunQueue for a lane queue: each event is taken from the highest lane that has one when the
+// event before it finishes, so events put in a higher lane meanwhile run next.
+FsmRunResult FsmRunLanes(Fsm *pFsm, FsmLaneQ *pLanes, int maxEvents)
+{
+	FsmRunResult	result = { 0, 0 };
+	FsmPayload		*pPayload;
+	bool			inserts = FSM_INSERT_PENDING();
+	int				eventId;
+	int				count = 0;
+
+	if ( (NULL == pFsm) || (NULL == pLanes) )
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! fsm or lane queue undefined");
+		return result;
+	}
+
+	while ( ((maxEvents <= 0) || (count < maxEvents))
+		 && ((eventId = FsmGetLaneEvent(pLanes, &pPayload, NULL)) != EVT_FSM_NULL) )
+	{
+		FsmRunCounted(pFsm, eventId, pPayload, &result, inserts);
+
+		if (pPayload != NULL)
+			FsmPayloadRelease(pPayload);	// the queue's reference
+		count++;
+	}
+
+	FSM_STATS_RUNS(count);
+
+	return result;
+
+} // FsmRunLanes
@@ -10,7 +10,9 @@
 #ifndef _FSM_H_
 #define _FSM_H_
 
-#define	FSM_TEST	1	// set to 0 to disable test functions and objects
+#ifndef FSM_TEST
+	#define	FSM_TEST	1	// set to 0 to disable test functions and objects
+#endif
 
 #ifndef __cplusplus
 typedef unsigned char	bool;
@@ -18,6 +20,30 @@ typedef unsigned char	bool;
 #define false			0
 #endif
 
+#include <string.h>		// FSM_Q_INIT
+
+// Compiler differences: MSVC has no _Thread_local before C11 mode and no __builtin_ctz, and
+// VS2013 compiles C without the inline keyword.
+// FsmCtz and FsmCtz64 count the trailing zero bits of a value that isn't 0.
+#if defined(_MSC_VER)
+	#include <intrin.h>
+	#if !defined(__cplusplus) && (_MSC_VER < 1900)
+		#define inline						__inline
+	#endif
+	#define FSM_THREAD_LOCAL				__declspec(thread)
+	#define FSM_STATIC_ASSERT(cond, msg)	typedef char FsmStaticAssert_##msg[(cond) ? 1 : -1]
+	static __inline int FsmCtz (unsigned int x)	{ unsigned long bit; _BitScanForward(&bit, x); return (int)bit; }
+	static __inline int FsmCtz64 (unsigned long long x)
+	{
+		return ((unsigned int)x != 0) ? FsmCtz((unsigned int)x) : 32 + FsmCtz((unsigned int)(x >> 32));
+	}
+#else
+	#define FSM_THREAD_LOCAL				_Thread_local
+	#define FSM_STATIC_ASSERT(cond, msg)	_Static_assert(cond, #msg)
+	#define FsmCtz(x)						__builtin_ctz(x)
+	#define FsmCtz64(x)						__builtin_ctzll(x)
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -97,7 +123,12 @@ extern "C" {
 //      your events.
 
 // Define the event identifier lists
-#include "fsm_events.h"		// user should define FSM_USER_EVENTS in here
+// Build with -DFSM_EVENTS_FILE='"my_events.h"' to take the list from a different file.
+#ifdef FSM_EVENTS_FILE
+	#include FSM_EVENTS_FILE
+#else
+	#include "fsm_events.h"		// user should define FSM_USER_EVENTS in here
+#endif
 #ifndef FSM_USER_EVENTS
 	#define FSM_USER_EVENTS FSM_EVENT_ID(EVT_USER)
 #endif
@@ -137,6 +168,18 @@ const char * gFsmEventNames[] = {
 #define FSM_EVT_NAME(x) gFsmEventNames[x]
 
 
+// Event interest sets: a bit per event id below EVT_FSM_EOL, see FsmCompileInterest
+#define FSM_EVENT_SET_WORDS		((EVT_FSM_EOL + 31) / 32)
+
+typedef struct
+{
+	unsigned		bits[FSM_EVENT_SET_WORDS];
+} FsmEventSet;
+
+#define FSM_EVENT_SET_HAS(set,id)	(((set).bits[(id) >> 5] >> ((id) & 31)) & 1)
+#define FSM_EVENT_SET_ADD(set,id)	((set).bits[(id) >> 5] |= 1u << ((id) & 31))
+#define FSM_EVENT_SET_DEL(set,id)	((set).bits[(id) >> 5] &= ~(1u << ((id) & 31)))
+
 // Finite State Machine base class
 typedef struct Fsm Fsm;
 typedef struct FsmEvent FsmEvent;
@@ -144,6 +187,10 @@ typedef struct FsmState FsmState, *FsmStatePtr;
 typedef FsmStatePtr (*FsmEvtHandler)(FsmState* pState, FsmEvent * pEvent);		// returns state ptr to transition to, NULL if no transition
 typedef bool (*FsmStateHandler)(FsmState *pState, int eventId);	// returns true if no further event processing (i.e., event was consumed)
 typedef struct FsmQ FsmQ;
+typedef struct FsmLaneQ FsmLaneQ;
+typedef struct FsmMailbox FsmMailbox;
+typedef struct FsmPayload FsmPayload;
+typedef struct FsmTimer FsmTimer;
 
 struct Fsm
 {
@@ -151,6 +198,18 @@ struct Fsm
 	FsmStatePtr		pState; /* the current state */
 	FsmQ *			deferQ;
 	FsmQ *			recallQ;
+	FsmMailbox *	mailbox;	// optional cross-thread input queue, see fsm_mailbox.h
+	FsmPayload *	pPayload;	// payload of the event being dispatched (NULL if none)
+	FsmState *		pParentState;	// state this FSM is nested in, NULL for a top level FSM
+	FsmState *		pPendingState;	// transition target outside this FSM, passed up to pParentState
+	FsmState *		pInitialState;	// state entered with pParentState, NULL if the application sets pState
+	int				history;		// FSM_HISTORY_xxx, see FSM_HISTORY
+	bool			onPath;			// FsmTransition is entering a state in this FSM, don't resume it
+	bool			interestValid;	// interest is up to date, see FsmCompileInterest
+	bool			parallel;		// region being dispatched on the worker pool (FsmDispatchParallel)
+	bool			interestDirty;	// parallel, and its interest changed: the FSMs above need updating
+	FsmEventSet *	pInterest;		// events the current state and the FSMs active below it handle,
+									// NULL if the FSM doesn't keep them (see FsmSetInterest)
 };
 
 // State base class
@@ -163,6 +222,13 @@ struct FsmState
 	FsmStateHandler	pfnStateHandler;
 	int				notifyEventId;
 	FsmStatePtr		pNextState;
+	FsmEvent**		dispatchTable;	// optional dense table indexed by event id, see FsmCompileState
+	int				dispatchBase;	// event id of dispatchTable[0]
+	int				dispatchCount;	// event ids in dispatchTable
+	FsmEvent*		dispatchMiss;	// event for ids outside the table, NULL to search the list
+	int				parallelMin;	// dispatch nested FSMs in parallel if at least this many, see fsm_pool.h
+	FsmTimer *		pTimers;		// timers cancelled when the state exits, see fsm_timer.h
+	const FsmEventSet *	pInterest;	// events in eventList, NULL until compiled (see FsmCompileInterest)
 };
 
 // Event base Class
@@ -174,32 +240,215 @@ struct FsmEvent
 	bool			consumed;
 	int 			altId;		// used by FSM to store real id when processing "default" event
 								// don't set this field! Read it when handling a EVT_FSM_DEFAULT event
+	FsmPayload *	pPayload;	// payload of the event being handled, NULL if none
+								// don't set this field! Read it (or use FSM_EVENT_DATA) in the handler
 };
 
 
+// Dispatch levels run by plain recursion on the C stack before the dispatch engine (fsm.c) takes
+// over the levels below. 0 runs every dispatch on the engine.
+#ifndef FSM_DISPATCH_DEPTH
+	#define FSM_DISPATCH_DEPTH	16
+#endif
+
+// Frames in each thread's dispatch stack (see the dispatch engine in fsm.c), for the levels
+// below FSM_DISPATCH_DEPTH. A level of the hierarchy takes a frame to dispatch an event (two if
+// its state handler wraps FsmStateDefaultHandler), a transition or a history resume one more, so
+// the default covers about 50 levels more. Running out logs an error and drops the rest of the
+// dispatch.
+#ifndef FSM_DISPATCH_FRAMES
+	#define FSM_DISPATCH_FRAMES	64
+#endif
+
+// Counts returned by the batch run functions
+typedef struct
+{
+	int				consumed;
+	int				ignored;
+} FsmRunResult;
+
+// How a nested FSM with an initial state is entered, see FSM_HISTORY
+#define FSM_HISTORY_NONE	0	// enter pInitialState every time
+#define FSM_HISTORY_SHALLOW	1	// resume the last state; FSMs nested in it are entered their own way
+#define FSM_HISTORY_DEEP	2	// resume the last state and every FSM nested below it
+
 // Base class methods
 void FsmInit (Fsm *pFsm, FsmState *pState);
 void FsmRun(Fsm *pFsm, int eventId);
+void FsmRunData(Fsm *pFsm, int eventId, FsmPayload *pPayload);
+FsmRunResult FsmRunBatch(Fsm *pFsm, const int *pEvents, int count);
+FsmRunResult FsmRunQueue(Fsm *pFsm, FsmQ *q, int maxEvents);
+FsmRunResult FsmRunLanes(Fsm *pFsm, FsmLaneQ *pLanes, int maxEvents);
 bool FsmDispatch(Fsm *pFsm, int eventId);
+bool FsmDispatchData(Fsm *pFsm, int eventId, FsmPayload *pPayload);
 void FsmTransition(Fsm *pFsm, FsmStatePtr pNextState);
+void FsmLinkState(FsmState *pState);
 bool FsmStateDefaultHandler(FsmState *pState, int eventId);
 int  FsmDeferEvent(Fsm* pFsm, int eventId);
+int  FsmDeferEventData(Fsm* pFsm, int eventId, FsmPayload *pPayload);
 int  FsmRecallEvent(Fsm* pFsm, int *pEventId);
+int  FsmRecallHandled(Fsm* pFsm);
+bool FsmStateHandles(FsmState *pState, int eventId);
+void FsmCompileState(FsmState *pState, FsmEvent **pTable);
+int  FsmCompileStateRange(FsmState *pState, FsmEvent **pTable, int size);
+void FsmCompileInterest(FsmState *pState, FsmEventSet *pSet);
+void FsmSetInterest(Fsm *pFsm, FsmEventSet *pSet);
+void FsmUpdateInterest(Fsm *pFsm);
+FsmEvent * FsmFindEvent(FsmEvent** pEventList, int eventId);
+// The top level FSM above pFsm. Timers (fsm_timer.h) and FsmDrain run their events on it, so a
+// nested FSM can be named as the owner: the event bubbles up through the active states and
+// transitions out of the nested FSM are taken. FsmRun runs on the FSM it is given.
+Fsm * FsmTop(Fsm *pFsm);
 
 // Base class data members
 extern FsmEvent fsmNullEvent;
 
+// Parallel dispatch of nested FSMs (fsm_pool.c sets this when its pool is running).
+// Dispatches eventId to count FSMs, pConsumed[i] gets each result. Returns false if it
+// didn't dispatch, and the FSMs are dispatched serially.
+typedef bool (*FsmParallelFcn)(Fsm **pFsmList, int count, int eventId, FsmPayload *pPayload, bool *pConsumed);
+extern FsmParallelFcn	gpParallelFcn;
+
+// Cancels the timers armed in a state when it exits (fsm_timer.c sets this when it arms one)
+typedef void (*FsmCancelTimersFcn)(FsmState *pState);
+extern FsmCancelTimersFcn	gpCancelTimersFcn;
+
+// True if a suspended coroutine handler has parked pFsm's machine (fsm_co.hpp sets this). FsmRun
+// leaves the recalled events in the recall queue for the executor to run when the handler finishes.
+typedef bool (*FsmParkedFcn)(Fsm *pFsm);
+extern FsmParkedFcn	gpParkedFcn;
+
 // FSM event queues
+// What FsmPutEvent does when a queue is full (see FsmQSetOverflow):
+//     FSM_Q_DROP_NEWEST   fail, and log, the new event (the default)
+//     FSM_Q_DROP_OLDEST   drop the oldest event to make room
+//     FSM_Q_SPILL         put the event in a second queue, pSpill. Events come back from it, in
+//                         order, as the queue drains. pSpill applies its own policy when it fills.
+// Only a queue with an FsmQExt (FsmQSetExt) can change its policy or coalesce events.
+#define FSM_Q_DROP_NEWEST	0
+#define FSM_Q_DROP_OLDEST	1
+#define FSM_Q_SPILL			2
+
+// Queued event ids are FsmQEventId. Build with -DFSM_Q_EVENT_BITS=16 (or 8) to shrink them
+// when every event id fits: a 64 event queue then takes 128 (or 64) bytes of ids instead of
+// 256. FsmPutEvent fails, and logs, an id that doesn't fit.
+#ifndef FSM_Q_EVENT_BITS
+	#define FSM_Q_EVENT_BITS	32
+#endif
+
+#if FSM_Q_EVENT_BITS == 8
+	typedef signed char		FsmQEventId;
+	#define FSM_Q_EVENT_MAX		127
+#elif FSM_Q_EVENT_BITS == 16
+	typedef short			FsmQEventId;
+	#define FSM_Q_EVENT_MAX		32767
+#else
+	typedef int				FsmQEventId;
+	#define FSM_Q_EVENT_MAX		0x7FFFFFFF
+#endif
+
+#define FSM_Q_FIELDS				\
+	int				size;			\
+	int				head;			\
+	int				tail;			\
+	int				count;			\
+	FsmPayload **	payload;		/* payload slots, NULL if the queue can't hold payloads */	\
+	int				hwm;			/* most events the queue has held */						\
+	int				drops;			/* events not queued, or dropped, because it was full */	\
+	FsmQExt *		pExt;			/* overflow policy and coalescing, NULL for the defaults */
+
+// The parts of a queue most queues don't use, see FsmQSetExt
+typedef struct FsmQExt
+{
+	int					overflow;	// FSM_Q_DROP_NEWEST, FSM_Q_DROP_OLDEST or FSM_Q_SPILL
+	FsmQ *				pSpill;		// FSM_Q_SPILL queue
+	const FsmEventSet *	pCoalesce;	// events queued at most once, NULL if none
+	int					coalesced;	// events not queued because they were already pending
+	FsmEventSet			pending;	// pCoalesce events in the queue or its spill queue
+} FsmQExt;
+
 struct FsmQ {
-	int size;
-	int	head;
-	int	tail;
-	int	count;
-	int	eventId[];
+	FSM_Q_FIELDS
+	FsmQEventId	eventId[];
 };
 
+#define FSM_Q_SPILL_Q(q)	(((q)->pExt != NULL) ? (q)->pExt->pSpill : NULL)
+
+// Returns true if eventId should be taken by FsmQRecallIf
+typedef bool (*FsmQMatchFcn)(void *pContext, int eventId);
+
 int  FsmPutEvent (FsmQ *q, int eventId);
 int  FsmGetEvent (FsmQ *q);
+int  FsmPutEventData (FsmQ *q, int eventId, FsmPayload *pPayload);
+int  FsmGetEventData (FsmQ *q, FsmPayload **ppPayload);
+void FsmQSetExt (FsmQ *q, FsmQExt *pExt);	// clears *pExt; NULL goes back to the defaults
+void FsmQSetOverflow (FsmQ *q, int overflow, FsmQ *pSpill);
+int  FsmQRecallIf (FsmQ *q, FsmQ *recallQ, FsmQMatchFcn pfnMatch, void *pContext);
+
+// Coalescing
+// Putting an event in pCoalesce that is already in the queue (or its spill queue) doesn't queue
+// it again: without a payload the put does nothing, with one the new payload replaces the
+// pending event's. Either way the put succeeds and counts in q->pExt->coalesced. Use it for idempotent
+// events such as poll or refresh ticks, so a backlog of them runs once. Whether an event is
+// pending is one bit test; replacing a payload finds the pending event with a scan. Only ids
+// below EVT_FSM_EOL can be coalesced.
+//
+//       static FsmQExt		ext_Input;
+//       static FsmEventSet	coalesce_Input;
+//       ...
+//       FsmQSetExt((FsmQ *)&q_Input, &ext_Input);
+//       FSM_EVENT_SET_ADD(coalesce_Input, EVT_POLL);
+//       FsmQSetCoalesce((FsmQ *)&q_Input, &coalesce_Input);
+void FsmQSetCoalesce (FsmQ *q, const FsmEventSet *pCoalesce);	// NULL to queue every event
+
+// Priority lanes
+// A lane queue is a set of FsmQs, lane 0 the most urgent. FsmGetLaneEvent (and FsmRunLanes)
+// takes the oldest event of the highest lane that has one, so a shutdown or fault put in lane 0
+// waits for the event running now, not for the bulk events ahead of it. Each lane is an
+// ordinary FsmQ with its own size and overflow policy, and its count, hwm and drops show how
+// deep it runs. A bit per non-empty lane keeps put and get O(1). A lane queue with one lane
+// works like its FsmQ. Once a queue is a lane, put and take its events through the lane functions.
+//
+//       FSM_Q( q_Urgent, 8 );
+//       FSM_Q( q_Bulk, 1024 );
+//       FSM_LANE_Q( lanes_Top, (FsmQ *)&q_Urgent, (FsmQ *)&q_Bulk );
+//       ...
+//       FsmPutLaneEvent(&lanes_Top, 1, EVT_DATA, NULL);
+//       FsmPutLaneEvent(&lanes_Top, 0, EVT_SHUTDOWN, NULL);
+//       FsmRunLanes(&fsm_Top, &lanes_Top, 0);		// EVT_SHUTDOWN runs first
+#define FSM_LANES_MAX		8
+
+struct FsmLaneQ {
+	int			nLanes;
+	unsigned	ready;					// bit per lane that has events
+	FsmQ *		lane[FSM_LANES_MAX];	// lane 0 first
+};
+
+#define FSM_LANE_Q(obj,...)											\
+	FsmQ * obj##_laneList[] = { __VA_ARGS__ };						\
+	FsmLaneQ obj = { (int)(sizeof(obj##_laneList)/sizeof(FsmQ *)), 0, { __VA_ARGS__ } }
+
+int  FsmLaneQInit (FsmLaneQ *pLanes, FsmQ **laneList, int nLanes);	// returns -1 if more than FSM_LANES_MAX
+int  FsmPutLaneEvent (FsmLaneQ *pLanes, int lane, int eventId, FsmPayload *pPayload);	// returns -1 if the lane is full or undefined
+int  FsmGetLaneEvent (FsmLaneQ *pLanes, FsmPayload **ppPayload, int *pLane);	// pLane gets the lane, may be NULL
+int  FsmLaneQCount (const FsmLaneQ *pLanes);		// events in all lanes
+
+// Event payloads (fsm_payload.c)
+// Payloads are reference counted blocks from a fixed size slab, see fsm_payload.h.
+// Queues and mailboxes own one reference for each queued event. Dispatch borrows the reference,
+// so handlers must FsmPayloadRetain a payload they keep after returning.
+void	FsmPayloadRetain (FsmPayload *pPayload);
+void	FsmPayloadRelease (FsmPayload *pPayload);
+void *	FsmPayloadData (FsmPayload *pPayload);
+
+#define FSM_EVENT_DATA(pEvent)	((pEvent)->pPayload == NULL ? NULL : FsmPayloadData((pEvent)->pPayload))
+
+// FSM mailbox (fsm_mailbox.c)
+// Any thread may post to an FSM that has a mailbox. Only the thread that runs the FSM may drain it.
+int  FsmPost (Fsm *pFsm, int eventId);		// returns -1 if mailbox full, else 0
+int  FsmPostWait (Fsm *pFsm, int eventId);	// waits for room in the mailbox
+int  FsmDrain (Fsm *pFsm, int maxEvents);	// runs up to maxEvents (<= 0 for all), returns count
+int  FsmPostData (Fsm *pFsm, int eventId, FsmPayload *pPayload);	// mailbox takes the reference
 
 // test function
 void	TestFsm(void);
@@ -212,14 +461,14 @@ void	TestFsm(void);
 		extern FILE * csvFile;
 		#define FSM_LOG(format, ...)											\
 		{																		\
-			printf( "%s,"format"\n", __FUNCTION__, ##__VA_ARGS__);				\
+			printf( "%s," format "\n", __FUNCTION__, ##__VA_ARGS__);				\
 			if (csvFile != NULL)												\
-				fprintf(csvFile, "%s,"format"\n", __FUNCTION__, ##__VA_ARGS__);	\
+				fprintf(csvFile, "%s," format "\n", __FUNCTION__, ##__VA_ARGS__);	\
 		}
 	#elif defined(__GNUC__)
-		#define FSM_LOG(format, ...)	{printf( "%s,"format"\n\r", __func__, ##__VA_ARGS__);}
+		#define FSM_LOG(format, ...)	{printf( "%s," format "\n\r", __func__, ##__VA_ARGS__);}
 	#else
-		#define FSM_LOG(format, ...)	{printf( "%s,"format"\n\r","xxx", ##__VA_ARGS__);}
+		#define FSM_LOG(format, ...)	{printf( "%s," format "\n\r","xxx", ##__VA_ARGS__);}
 	#endif
 #endif
 
@@ -227,15 +476,53 @@ void	TestFsm(void);
 // #define FSM_TRACE 1 in your .c module before including fsm.h to turn on tracing
 // This way you can enable tracing for selected state machines, as long as they are
 // implemented in separate files.
+//
+// #define FSM_TRACE 2 to record the FSM_TRACE_xxx trace points in the binary trace instead
+// (see fsm_trace.h). That's cheap enough to leave on in production. The printf style
+// FSM_xxx_LOG macros are compiled out in that mode.
 
-#if FSM_TRACE
-	#define FSM_RUN_LOG(format, ...)	FSM_LOG("run,"format, ##__VA_ARGS__)
-	#define FSM_ENTER_LOG(format, ...)	FSM_LOG("begin,"format, ##__VA_ARGS__)
-	#define FSM_EXIT_LOG(format, ...)	FSM_LOG("end,"format, ##__VA_ARGS__)
-#else
+#define FSM_TRACE_BINARY	2
+
+#if FSM_TRACE == FSM_TRACE_BINARY
+	#include "fsm_trace.h"
 	#define FSM_RUN_LOG(format, ...)	{;}
 	#define FSM_ENTER_LOG(format, ...)	{;}
 	#define FSM_EXIT_LOG(format, ...)	{;}
+	#define FSM_TRACE_ENTER(pState,eventId)				\
+		FSM_TRACE_POINT(FSM_TRACE_PHASE_ENTER, (pState)->pFsm->name, (pState)->name, eventId, false)
+	#define FSM_TRACE_EXIT(pState,eventId,consumed)		\
+		FSM_TRACE_POINT(FSM_TRACE_PHASE_EXIT, (pState)->pFsm->name, (pState)->name, eventId, consumed)
+	#define FSM_TRACE_RUN(pState,tag)					\
+		FSM_TRACE_POINT(FSM_TRACE_PHASE_RUN, (pState)->pFsm->name, (pState)->name, FsmTraceName(tag), false)
+	#define FSM_TRACE_IGNORED(pFsm,eventId)				\
+		FSM_TRACE_POINT_AT("FsmRun", FSM_TRACE_PHASE_IGNORED, (pFsm)->name, (pFsm)->pState->name, eventId, false)
+#else
+	#if FSM_TRACE
+		#define FSM_RUN_LOG(format, ...)	FSM_LOG("run," format, ##__VA_ARGS__)
+		#define FSM_ENTER_LOG(format, ...)	FSM_LOG("begin," format, ##__VA_ARGS__)
+		#define FSM_EXIT_LOG(format, ...)	FSM_LOG("end," format, ##__VA_ARGS__)
+	#else
+		#define FSM_RUN_LOG(format, ...)	{;}
+		#define FSM_ENTER_LOG(format, ...)	{;}
+		#define FSM_EXIT_LOG(format, ...)	{;}
+	#endif
+
+	// Trace points for a state handler and its event handlers
+	#define FSM_TRACE_ENTER(pState,eventId)				\
+		FSM_ENTER_LOG("%s,%s,%s", (pState)->pFsm->name, (pState)->name, FSM_EVT_NAME(eventId))
+	#define FSM_TRACE_EXIT(pState,eventId,consumed)		\
+		FSM_EXIT_LOG("%s,%s,%s,%sconsumed", (pState)->pFsm->name, (pState)->name, FSM_EVT_NAME(eventId), ((consumed)==0? "not_" : ""))
+	#define FSM_TRACE_RUN(pState,tag)					\
+		FSM_RUN_LOG("%s,%s,%s", (pState)->pFsm->name, (pState)->name, tag)
+
+	// FsmRun logs events the FSM didn't consume whether or not tracing is on
+	#define FSM_TRACE_IGNORED(pFsm,eventId)																\
+	{																									\
+		if ((eventId) >= EVT_FSM_EOL)																	\
+			FSM_LOG(",%s,%s,%d,ignored", (pFsm)->name, (pFsm)->pState->name, (eventId))				\
+		else																							\
+			FSM_LOG(",%s,%s,%s,ignored", (pFsm)->name, (pFsm)->pState->name, FSM_EVT_NAME(eventId))	\
+	}
 #endif
 
 // Macros for object initialization
@@ -261,6 +548,32 @@ void	TestFsm(void);
 		DESIG_INIT(recallQ,(FsmQ*)recall_Q)		\
 		}
 
+// ... Nested FSM objects entered by the framework
+// A nested FSM declared with FSM is dispatched EVT_FSM_SUPERSTATE_ENTRY in whatever state it's in
+// when its parent state is entered, so the application sets its state (FsmInit, or pState) in
+// the parent's Entry action. FSM_HISTORY gives the nested FSM an initial state and a history
+// kind, and the parent state's entry takes care of it:
+//     FSM_HISTORY_NONE     pInitialState is entered (EVT_FSM_ENTRY) every time
+//     FSM_HISTORY_SHALLOW  the first time pInitialState is entered; after that the FSM resumes the
+//                          state it was in when the parent exited. The resumed state gets no
+//                          events; the FSMs nested in it are entered as they're declared.
+//     FSM_HISTORY_DEEP     as SHALLOW, but every FSM nested below the resumed state is resumed
+//                          too, whatever it's declared with
+// Resuming sets the parent links of the resumed FSMs and dispatches nothing, so resuming a deep
+// configuration costs a step per resumed FSM. Resumed states don't run Entry actions; timers
+// cancelled when they exited aren't armed again. A transition to a state inside a history FSM
+// enters that state, not the history. tools/fsm_history_demo.c runs both kinds side by side.
+//       FSM_HISTORY(fsm_Nested1, "Nested1", &state_Nested1_State1, FSM_HISTORY_SHALLOW, NULL, NULL);
+#define FSM_HISTORY(obj,name_str,initial_state,history_kind,defer_Q,recall_Q)	\
+	Fsm obj = {									\
+		DESIG_INIT(name,name_str),				\
+		DESIG_INIT(pState,NULL),				\
+		DESIG_INIT(deferQ,(FsmQ*)defer_Q),		\
+		DESIG_INIT(recallQ,(FsmQ*)recall_Q),	\
+		DESIG_INIT(pInitialState,initial_state),\
+		DESIG_INIT(history,history_kind)		\
+		}
+
 // ... Event Handlers
 #define FSM_EVENT_HANDLER(handler)	FsmStatePtr handler(FsmState* pState, FsmEvent * pEvent)
 
@@ -279,20 +592,56 @@ void	TestFsm(void);
 		DESIG_INIT(notifyEventId,EVT_FSM_NULL)		\
 		}
 
+// ... Dispatch tables (optional, see FsmCompileState)
+// A state's event list is searched linearly on every dispatch. For states with long event lists,
+// declare a table and compile the state once at init:
+//       FSM_DISPATCH_TABLE(table_MyState);
+//       ...
+//       FsmCompileState(&state_MyState, table_MyState);
+// The table has one entry per event id below EVT_FSM_EOL; ids >= EVT_FSM_EOL still use the list.
+// FsmCompileStateRange builds a smaller table that only spans the ids in the state's own list.
+#define FSM_DISPATCH_TABLE(obj)	FsmEvent * obj[EVT_FSM_EOL]
+
+// ... Event interest (optional, see FsmCompileInterest)
+// Every event is passed down to every FSM nested in the current state, whether or not any state
+// below can handle it. Compile the interest of each state, and give each FSM a set, at init
+// before FsmInit:
+//       FSM_INTEREST(interest_MyState);
+//       FSM_INTEREST(interest_MyFsm);
+//       ...
+//       FsmCompileInterest(&state_MyState, &interest_MyState);
+//       FsmSetInterest(&fsm_MyFsm, &interest_MyFsm);
+// Each FSM with a set then keeps the events its current state and the FSMs active below it have
+// in their event lists, updated as it transitions. A nested FSM whose set doesn't have the event
+// isn't dispatched it, and FsmRun drops an event the whole machine doesn't handle with one bit
+// test (it's ignored, as if no state had consumed it). Entry and Exit events, and ids
+// >= EVT_FSM_EOL, are always dispatched. An FSM without a set, or in a state that isn't
+// compiled, gets every event.
+// Only compile states whose handlers react to nothing but their event lists: a skipped state's
+// handler isn't called at all, so it doesn't trace or notify the event either. If the
+// application sets an FSM's pState itself, call FsmUpdateInterest on the FSM afterwards.
+#define FSM_INTEREST(obj)	FsmEventSet obj
+
 // ... Event Queues
 #define	FSM_Q(obj,qsize)	\
 	struct obj##_tag {		\
-		int	size;			\
-		int	head;			\
-		int	tail;			\
-		int	count;			\
-		int	eventId[qsize];	\
-	} obj = { qsize, 0, 0, 0 };
+		FSM_Q_FIELDS		\
+		FsmQEventId	eventId[qsize];	\
+	} obj = { qsize, 0, 0, 0, NULL };
+
+// ... Event Queues that can hold event payloads
+#define	FSM_PQ(obj,qsize)				\
+	FsmPayload * obj##_payload[qsize];	\
+	struct obj##_tag {					\
+		FSM_Q_FIELDS					\
+		FsmQEventId	eventId[qsize];		\
+	} obj = { qsize, 0, 0, 0, obj##_payload };
 
-#define FSM_Q_INIT(obj)	{ obj.head = 0; obj.tail = 0; obj.count = 0;}
+#define FSM_Q_INIT(obj)	{ obj.head = 0; obj.tail = 0; obj.count = 0; if (obj.pExt != NULL) memset(&obj.pExt->pending, 0, sizeof(FsmEventSet)); }
 
 // Create the event insertion queues for testing
 #if !FSM_TEST
+	#define FSM_INSERT_PENDING()		false
 	#define FSM_INSERT_BEFORE(pFsm,x)
 	#define FSM_INSERT_AFTER(pFsm,x)
 	#define FSM_NOTIFY(pState,x)
@@ -307,6 +656,7 @@ void	TestFsm(void);
 	int FsmInsertAfter(eFsmEvent eventId, eFsmEvent insertId);
 	void FsmNotify(void);
 
+	#define FSM_INSERT_PENDING()		(gFsmInsertCount > 0)	// the batch runners look once per batch
 	#define FSM_INSERT_BEFORE(pFsm,x)	FsmDoInsertedBefore(pFsm,x)
 	#define FSM_INSERT_AFTER(pFsm,x)	FsmDoInsertedAfter(pFsm,x)
 	#define FSM_NOTIFY(pState,x)		if (pState->notifyEventId == x) (*gpNotifyFcn)()
@@ -317,12 +667,14 @@ void	TestFsm(void);
 
 	extern FsmQ * gFsmQInsertBefore[];
 	extern FsmQ * gFsmQInsertAfter[];
+	extern int	gFsmInsertCount;		// events waiting in the insertion queues
 
 	typedef void (*FsmNotifyFcn)(void);		// this is called when state sees a specified event
 	extern FsmNotifyFcn	gpNotifyFcn;
 
 	#ifdef _FSM_C_
 		FsmNotifyFcn	gpNotifyFcn = FsmNotify;
+		int				gFsmInsertCount = 0;
 		// instantiate the queues
 		#undef  FSM_EVENT_ID
 		#define FSM_EVENT_ID(x)        FSM_Q(fsmQ_insertBefore_##x,FSM_MAX_INSERT_EVENTS)
@@ -0,0 +1,400 @@
+/*
+ *
+ * File: fsm.hpp
+ *
+ * C++17 front end: hierarchical state machines declared as types and dispatched with switches
+ *
+ *
+ */
+
+#ifndef _FSM_HPP_
+#define _FSM_HPP_
+
+#include <cstddef>
+#include <tuple>
+#include <utility>
+
+#include "fsm.h"
+
+/**************************************************************************************************/
+// FSM templates
+/**************************************************************************************************/
+
+// The C framework builds a machine from pointers (FSM_STATE, FSM_EVENT, FsmEvent* lists) and
+// calls every handler through a function pointer, so the compiler can't inline or optimize
+// across any of it. This header declares the same kind of machine as types. Each state is a
+// struct with static handlers, and the machine is a template over its states, so dispatch is
+// a switch on the current state and a switch on the event, with the handlers inlined.
+//
+// Event ids are the same ints (eFsmEvent) as in the C framework. States are numbered by an
+// enum; each state names its parent and, if it has substates, the one entered with it:
+//
+//       enum { S_ON, S_IDLE, S_BUSY, S_OFF };
+//
+//       struct Powered : fsm::State<S_ON, fsm::None, S_IDLE>	// top level, enters Idle
+//       {
+//           static fsm::Result On (Ctx &ctx, int eventId)
+//           {
+//               switch (eventId)
+//               {
+//                   case EVT_2:  return fsm::Go(S_OFF);
+//               }
+//               return fsm::Ignored;
+//           }
+//       };
+//       struct Idle : fsm::State<S_IDLE, S_ON>
+//       {
+//           static void Entry (Ctx &ctx)					{ ctx.idle++; }
+//           static fsm::Result On (Ctx &ctx, int eventId)
+//           {
+//               return (EVT_1 == eventId) ? fsm::Go(S_BUSY) : fsm::Ignored;
+//           }
+//       };
+//       ...
+//       fsm::Machine<Ctx, Powered, Idle, Busy, Off>   machine(ctx);
+//
+//       machine.Init(S_ON);				// enters Powered, then Idle
+//       machine.Dispatch(EVT_1);
+//
+// The state types must be listed in id order. Entry, Exit and On are optional.
+//
+// Semantics follow FsmStateDefaultHandler for a single region: the event goes to the leaf
+// state first and on up through its parents until one consumes it or returns a transition.
+// A transition exits the active states up to the least common ancestor of the state that
+// returned it and the target (a state transitioning to itself or to one of its parents is
+// exited and entered again), enters the states down to the target, then the target's initial
+// substates. Entry and Exit are actions only; they can't transition.
+//
+// Machines with orthogonal regions stay on the C API. To migrate a machine one at a time,
+// fsm::Adapter wraps a Machine as an FsmState, so FsmInit / FsmRun (or a parent state's
+// nestedFsmList) run it like any other C machine.
+
+namespace fsm
+{
+
+constexpr int	None = -1;
+
+// What an On handler returns: the state to transition to (None if none), and whether it
+// consumed the event. An event that isn't consumed, with no transition, goes to the parent state.
+struct Result
+{
+	int		next;
+	bool	consumed;
+};
+
+constexpr Result	Ignored = { None, false };
+constexpr Result	Consumed = { None, true };
+
+constexpr Result Go (int state)		{ return { state, true }; }
+
+/**************************************************************************************************/
+// Base for state types. Id is the state's index in its Machine, ParentId the state it is nested
+// in (None at the top level), InitialId the substate entered with it (None for a leaf).
+// A state's own Entry, Exit and On hide these defaults.
+template <int Id, int ParentId = None, int InitialId = None>
+struct State
+{
+	static constexpr int	id = Id;
+	static constexpr int	parent = ParentId;
+	static constexpr int	initial = InitialId;
+
+	template <typename Context> static void Entry (Context &)				{}
+	template <typename Context> static void Exit (Context &)				{}
+	template <typename Context> static Result On (Context &, int)			{ return Ignored; }
+};
+
+/**************************************************************************************************/
+namespace detail
+{
+
+template <std::size_t N>
+struct Tree
+{
+	int		parent[N];
+	int		initial[N];
+	int		depth[N];		// 0 at the top level
+	bool	valid;
+};
+
+// A machine's parent, initial and depth tables, checked at compile time
+template <typename... States>
+constexpr Tree<sizeof...(States)> MakeTree ()
+{
+	constexpr int	count = (int)sizeof...(States);
+	constexpr int	ids[] = { States::id... };
+	constexpr int	parents[] = { States::parent... };
+	constexpr int	initials[] = { States::initial... };
+	Tree<sizeof...(States)>	tree = {};
+
+	tree.valid = true;
+	for (int i = 0; i < count; i++)
+	{
+		tree.parent[i] = parents[i];
+		tree.initial[i] = initials[i];
+		if ( (ids[i] != i) || (parents[i] < None) || (parents[i] >= count) || (initials[i] < None) || (initials[i] >= count) )
+			tree.valid = false;
+		else if ( (initials[i] != None) && (parents[initials[i]] != i) )
+			tree.valid = false;
+	}
+
+	for (int i = 0; (i < count) && tree.valid; i++)
+	{
+		int		depth = 0;
+
+		for (int s = tree.parent[i]; (s != None) && (depth <= count); s = tree.parent[s])
+			depth++;
+		tree.depth[i] = depth;
+		if (depth > count)
+			tree.valid = false;		// parents loop
+	}
+
+	return tree;
+}
+
+} // namespace detail
+
+/**************************************************************************************************/
+template <typename Context, typename... States>
+class Machine
+{
+public:
+	static constexpr int	count = (int)sizeof...(States);
+
+	explicit Machine (Context &context) : context_(context) {}
+
+	// Enter state, the states above it and its initial substates
+	void Init (int state)
+	{
+		Exit();
+		if (Valid(state))
+			Enter(None, state);
+	}
+
+	// Exit every active state, leaf first
+	void Exit ()
+	{
+		for (int s = state_; s != None; s = tree_.parent[s])
+			CallExit(s, Indices());
+		state_ = None;
+	}
+
+	// Returns true if the event was consumed. pPayload is borrowed, see Payload().
+	bool Dispatch (int eventId, FsmPayload *pPayload = nullptr)
+	{
+		Result	result = Ignored;
+		int		source = None;
+
+		if (None == state_)
+			return false;
+
+		pPayload_ = pPayload;
+		result = DispatchLeaf(eventId, source, Indices());
+		pPayload_ = nullptr;
+
+		if ( (result.next != None) && Valid(result.next) )
+			Transition(source, result.next);
+
+		return result.consumed;
+	}
+
+	int  Leaf () const					{ return state_; }		// None before Init
+	FsmPayload * Payload () const		{ return pPayload_; }	// payload of the event being dispatched
+	Context & GetContext ()				{ return context_; }
+
+	// true if state is the leaf or one of its parents
+	bool In (int state) const
+	{
+		for (int s = state_; s != None; s = tree_.parent[s])
+			if (s == state)
+				return true;
+		return false;
+	}
+
+private:
+	static_assert(count > 0, "fsm::Machine needs at least one state");
+
+	using Indices = std::make_index_sequence<sizeof...(States)>;
+
+	template <int I>
+	using StateAt = std::tuple_element_t<I, std::tuple<States...>>;
+
+	static constexpr detail::Tree<sizeof...(States)>	tree_ = detail::MakeTree<States...>();
+	static_assert(tree_.valid, "fsm::Machine states must be listed in id order, with parents and initial substates in the machine");
+
+	static int Depth (int state)		{ return (None == state) ? -1 : tree_.depth[state]; }
+
+	static bool Valid (int state)
+	{
+		if ( (state >= 0) && (state < count) )
+			return true;
+
+		FSM_LOG("!!!! FSM ERROR !!!! fsm::Machine: transition to undefined state %d", state);
+		return false;
+	}
+
+	// The deepest state above target that is source or above source
+	static int LeastCommonAncestor (int source, int target)
+	{
+		int	a = source;
+		int	b = tree_.parent[target];
+
+		while (Depth(a) > Depth(b))
+			a = tree_.parent[a];
+		while (Depth(b) > Depth(a))
+			b = tree_.parent[b];
+		while (a != b)
+		{
+			a = tree_.parent[a];
+			b = tree_.parent[b];
+		}
+
+		return a;
+	}
+
+	// On handlers from state I up, until one consumes the event or transitions
+	template <int I>
+	Result Bubble (int eventId, int &source)
+	{
+		Result	result = StateAt<I>::On(context_, eventId);
+
+		if ( result.consumed || (result.next != None) )
+		{
+			source = I;
+			return result;
+		}
+
+		if constexpr (tree_.parent[I] != None)
+			return Bubble<tree_.parent[I]>(eventId, source);
+		else
+			return result;
+	}
+
+	// switch on the leaf state
+	template <std::size_t... I>
+	Result DispatchLeaf (int eventId, int &source, std::index_sequence<I...>)
+	{
+		Result	result = Ignored;
+
+		(void)( ( (state_ == (int)I) && ((result = Bubble<(int)I>(eventId, source)), true) ) || ... );
+		return result;
+	}
+
+	template <std::size_t... I>
+	void CallEntry (int state, std::index_sequence<I...>)
+	{
+		(void)( ( (state == (int)I) && (StateAt<(int)I>::Entry(context_), true) ) || ... );
+	}
+
+	template <std::size_t... I>
+	void CallExit (int state, std::index_sequence<I...>)
+	{
+		(void)( ( (state == (int)I) && (StateAt<(int)I>::Exit(context_), true) ) || ... );
+	}
+
+	// Enter the states from below lca down to target, then target's initial substates
+	void Enter (int lca, int target)
+	{
+		int	path[sizeof...(States)];
+		int	n = 0;
+		int	s;
+
+		for (s = target; s != lca; s = tree_.parent[s])
+			path[n++] = s;
+		while (n > 0)
+			CallEntry(path[--n], Indices());
+
+		for (s = target; tree_.initial[s] != None; )
+		{
+			s = tree_.initial[s];
+			CallEntry(s, Indices());
+		}
+
+		state_ = s;
+	}
+
+	void Transition (int source, int target)
+	{
+		int	lca = LeastCommonAncestor(source, target);
+
+		for (int s = state_; s != lca; s = tree_.parent[s])
+			CallExit(s, Indices());
+
+		Enter(lca, target);
+	}
+
+	Context &		context_;
+	int				state_ = None;		// leaf state
+	FsmPayload *	pPayload_ = nullptr;
+};
+
+/**************************************************************************************************/
+// A Machine as a C state: the Fsm's only state, with a handler that runs the Machine.
+//
+//       FSM(fsm_Session, "Session", NULL, NULL, NULL);
+//       SessionMachine   machine(ctx);
+//       fsm::Adapter<SessionMachine>   state_Session(&fsm_Session, machine, "Session", S_IDLE);
+//       ...
+//       FsmInit(&fsm_Session, &state_Session);		// machine.Init(S_IDLE)
+//       FsmRun(&fsm_Session, EVT_1);				// machine.Dispatch(EVT_1)
+//
+// Put the Fsm in a C state's nestedFsmList to nest the Machine in a C machine. As with a nested
+// C machine, EVT_FSM_SUPERSTATE_ENTRY resumes the leaf state it was in when its parent exited.
+template <typename MachineType>
+class Adapter : public FsmState
+{
+public:
+	Adapter (Fsm *pStateFsm, MachineType &machine, const char *stateName, int initialState)
+		: FsmState(), machine_(machine), initial_(initialState), resume_(None)
+	{
+		static FsmEvent *	noEvents[] = { &fsmNullEvent };
+
+		pFsm = pStateFsm;
+		eventList = noEvents;
+		name = stateName;
+		pfnStateHandler = &Adapter::Handler;
+		notifyEventId = EVT_FSM_NULL;
+	}
+
+	MachineType & GetMachine ()		{ return machine_; }
+
+private:
+	static bool Handler (FsmState *pState, int eventId)
+	{
+		Adapter	*pAdapter = static_cast<Adapter *>(pState);
+		bool	consumed = true;
+
+		switch (eventId)
+		{
+			case EVT_FSM_ENTRY:
+				pAdapter->machine_.Init(pAdapter->initial_);
+				break;
+
+			case EVT_FSM_SUPERSTATE_ENTRY:
+				pAdapter->machine_.Init( (pAdapter->resume_ != None) ? pAdapter->resume_ : pAdapter->initial_ );
+				break;
+
+			case EVT_FSM_EXIT:
+			case EVT_FSM_SUPERSTATE_EXIT:
+				pAdapter->resume_ = pAdapter->machine_.Leaf();
+				pAdapter->machine_.Exit();
+				consumed = false;		// the parent state still runs its own exit
+				break;
+
+			default:
+				consumed = pAdapter->machine_.Dispatch(eventId, pState->pFsm->pPayload);
+				break;
+		}
+
+		pState->pNextState = NULL;		// transitions stay inside the machine
+
+		return consumed;
+	}
+
+	MachineType &	machine_;
+	int				initial_;
+	int				resume_;		// leaf state to resume on superstate entry
+};
+
+} // namespace fsm
+
+#endif // _FSM_HPP_
@@ -0,0 +1,427 @@
+/*
+ *
+ * File: fsm_co.hpp
+ *
+ * C++20 coroutine event handlers: handlers that wait for a reply without blocking the FSM thread
+ *
+ *
+ */
+
+#ifndef _FSM_CO_HPP_
+#define _FSM_CO_HPP_
+
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "fsm.h"
+
+/**************************************************************************************************/
+// Coroutine handlers
+/**************************************************************************************************/
+
+// An FsmEvtHandler runs to completion, so a handler that needs a reply from another component
+// either blocks the FSM thread or is split by hand into a request state and a reply event.
+// A coroutine handler does the waiting itself: it co_awaits the reply and co_returns the next
+// state, and FSM_CO_HANDLER makes it an FsmEvtHandler for FSM_EVENT:
+//
+//       fsm::CoHandler Idle_Fetch (FsmState *pState, FsmEvent *pEvent)
+//       {
+//           fsm::Reply<int>	reply;
+//
+//           pEvent->consumed = true;
+//           StartFetch(pState->pFsm, &reply);			// calls reply.Complete(status) later
+//           int status = co_await reply;
+//           co_return (0 == status) ? &state_Ready : &state_Failed;
+//       }
+//
+//       FSM_EVENT( evt_Idle_Fetch, EVT_1, FSM_CO_HANDLER(Idle_Fetch) );
+//       ...
+//       fsm::Executor	executor;						// one per FSM thread
+//       ...
+//       executor.Run(&fsm_Top, EVT_1);					// instead of FsmRun
+//       executor.Poll();								// in the thread's loop: resume handlers with replies
+//
+// A handler that finishes without suspending is an ordinary handler: its next state goes back
+// to FsmStateDefaultHandler. A handler that suspends parks its machine (the top level FSM of
+// its state) on the thread's Executor. The dispatch returns at once with the event consumed,
+// and the thread goes on to other machines. Events Run on a parked machine wait, in order, in
+// the executor. When the handler is resumed and co_returns, its next state is taken with
+// FsmTransition from the handler's state, passed up to the FSM the transition belongs in as
+// FsmDispatch does, the machine's recall queue is run, and then the waiting events. A machine
+// still sees one event at a time: the suspended one finishes, transition included, before the
+// next starts.
+//
+// Run every event of a machine with coroutine handlers through its executor (timers and
+// mailboxes included), or the events reach a parked machine. pEvent and the event's payload are
+// only valid until the handler first suspends; read them, or FsmPayloadRetain the payload,
+// before that. An Entry or Exit handler may suspend, but the transition that ran it doesn't
+// wait for it, and the state it co_returns is ignored. Handlers run on the executor's thread,
+// so don't suspend in FSMs dispatched by the thread pool (fsm_pool.h).
+//
+// Requires C++20 (-std=c++20).
+
+namespace fsm
+{
+
+class Executor;
+
+/**************************************************************************************************/
+// What a coroutine handler returns. co_return the state to transition to, nullptr if none.
+class CoHandler
+{
+public:
+	struct promise_type;
+	using Handle = std::coroutine_handle<promise_type>;
+
+	// A finished handler waits to be destroyed; a parked one tells its executor first
+	struct FinalAwaiter
+	{
+		bool await_ready () noexcept			{ return false; }
+		void await_suspend (Handle handle) noexcept;
+		void await_resume () noexcept			{}
+	};
+
+	struct promise_type
+	{
+		FsmStatePtr		pNextState = nullptr;
+		FsmState *		pState = nullptr;		// state whose handler this is
+		Executor *		pExecutor = nullptr;	// set when the handler parks its machine
+		bool			entryExit = false;		// Entry or Exit handler: pNextState is ignored
+
+		CoHandler get_return_object ()					{ return CoHandler(Handle::from_promise(*this)); }
+		std::suspend_always initial_suspend () noexcept	{ return {}; }
+		FinalAwaiter final_suspend () noexcept			{ return {}; }
+		void return_value (FsmStatePtr pNext)			{ pNextState = pNext; }
+		void unhandled_exception ()						{ std::terminate(); }
+	};
+
+	CoHandler (CoHandler &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+	CoHandler (const CoHandler &) = delete;
+	CoHandler & operator= (const CoHandler &) = delete;
+	~CoHandler ()						{ if (handle_) handle_.destroy(); }
+
+	Handle Release ()					{ return std::exchange(handle_, nullptr); }
+
+private:
+	explicit CoHandler (Handle handle) : handle_(handle) {}
+
+	Handle		handle_;
+};
+
+/**************************************************************************************************/
+// Runs the machines of one thread that have coroutine handlers. Constructing it makes it the
+// thread's executor (Current); construct it on the thread that runs the machines.
+class Executor
+{
+public:
+	Executor () : pPrevious_(tCurrent_)
+	{
+		tCurrent_ = this;
+		gpParkedFcn = IsParked;
+	}
+
+	// Parked handlers are destroyed, the events waiting for them dropped
+	~Executor ()
+	{
+		for (auto &park : parked_)
+		{
+			for (auto handle : park.second.handles)
+				handle.destroy();
+			for (auto &event : park.second.backlog)
+				if (event.pPayload != nullptr)
+					FsmPayloadRelease(event.pPayload);
+		}
+		tCurrent_ = pPrevious_;
+	}
+
+	Executor (const Executor &) = delete;
+	Executor & operator= (const Executor &) = delete;
+
+	static Executor * Current ()		{ return tCurrent_; }
+
+	// FsmRunData, or, if the machine is parked, after the handler it's parked on and the events
+	// before this one. Takes over the caller's payload reference.
+	void Run (Fsm *pFsm, int eventId, FsmPayload *pPayload = nullptr)
+	{
+		if (!parked_.empty())
+		{
+			auto	park = parked_.find(FsmTop(pFsm));
+
+			if (park != parked_.end())
+			{
+				park->second.backlog.push_back({ pFsm, eventId, pPayload });
+				return;
+			}
+		}
+
+		FsmRunData(pFsm, eventId, pPayload);
+		if (pPayload != nullptr)
+			FsmPayloadRelease(pPayload);
+	}
+
+	// Resume handle on the executor's thread, in the next Poll. Any thread.
+	void Schedule (std::coroutine_handle<> handle)
+	{
+		std::lock_guard<std::mutex>	guard(lock_);
+
+		ready_.push_back(handle);
+	}
+
+	// Resume the scheduled handlers, and finish the ones that co_return. Returns the number resumed.
+	int Poll ()
+	{
+		std::deque<std::coroutine_handle<>>	ready;
+		int									count = 0;
+
+		{
+			std::lock_guard<std::mutex>	guard(lock_);
+
+			ready.swap(ready_);
+		}
+
+		for (auto handle : ready)
+		{
+			handle.resume();
+			count++;
+
+			while (!finished_.empty())
+			{
+				CoHandler::Handle	done = finished_.front();
+
+				finished_.pop_front();
+				Finish(done);
+			}
+		}
+
+		return count;
+	}
+
+	bool Parked (Fsm *pFsm) const		{ return parked_.count(FsmTop(pFsm)) != 0; }
+	int  ParkedCount () const			{ return (int)parked_.size(); }
+
+	// Backs FSM_CO_HANDLER: start the handler, and park its machine if it suspends
+	static FsmStatePtr Start (CoHandler handler, FsmState *pState, FsmEvent *pEvent)
+	{
+		CoHandler::Handle	handle = handler.Release();
+		Executor			*pExecutor = tCurrent_;
+		FsmStatePtr			pNextState;
+
+		handle.promise().pState = pState;
+		handle.promise().entryExit = (EVT_FSM_ENTRY == pEvent->id) || (EVT_FSM_EXIT == pEvent->id);
+		handle.resume();
+
+		if (handle.done())
+		{
+			pNextState = handle.promise().pNextState;
+			handle.destroy();
+			return pNextState;
+		}
+
+		if (nullptr == pExecutor)
+		{
+			FSM_LOG("!!!! FSM ERROR !!!! FSM %s: handler suspended with no executor on the thread", pState->pFsm->name);
+			handle.destroy();
+			return nullptr;
+		}
+
+		handle.promise().pExecutor = pExecutor;
+		pExecutor->parked_[FsmTop(pState->pFsm)].handles.push_back(handle);
+		pEvent->consumed = true;
+
+		return nullptr;
+	}
+
+private:
+	friend struct CoHandler::FinalAwaiter;
+
+	// An event Run while its machine was parked, for the FSM it was Run on
+	struct Waiting
+	{
+		Fsm *			pFsm;
+		int				eventId;
+		FsmPayload *	pPayload;
+	};
+
+	struct Park
+	{
+		std::vector<CoHandler::Handle>	handles;	// suspended handlers (one per region)
+		std::deque<Waiting>				backlog;	// events Run while parked
+	};
+
+	// gpParkedFcn: FsmRun stops running recalled events on a parked machine, Finish runs them
+	static bool IsParked (Fsm *pFsm)
+	{
+		return (tCurrent_ != nullptr) && !tCurrent_->parked_.empty() && tCurrent_->Parked(pFsm);
+	}
+
+	// FsmTransition from pFsm's current state, passed up until an FSM holds the target
+	static void Transition (Fsm *pFsm, FsmStatePtr pNextState)
+	{
+		while (pFsm != nullptr)
+		{
+			pFsm->pPendingState = nullptr;
+			FsmTransition(pFsm, pNextState);
+			if (nullptr == pFsm->pPendingState)
+				return;
+
+			pFsm->pPendingState = nullptr;
+			pFsm = (pFsm->pParentState != nullptr) ? pFsm->pParentState->pFsm : nullptr;
+		}
+	}
+
+	// A parked handler co_returned: take its transition, then, when the machine has no other
+	// handlers suspended, run what waited for it
+	void Finish (CoHandler::Handle handle)
+	{
+		Fsm			*pFsm = handle.promise().pState->pFsm;
+		Fsm			*pTop = FsmTop(pFsm);
+		FsmStatePtr	pNextState = handle.promise().entryExit ? nullptr : handle.promise().pNextState;
+		auto		park = parked_.find(pTop);
+		std::deque<Waiting>	backlog;
+		FsmPayload	*pPayload;
+		int			eventId;
+
+		handle.destroy();
+		if (park == parked_.end())
+			return;
+
+		std::erase(park->second.handles, handle);
+		if (park->second.handles.empty())
+		{
+			backlog.swap(park->second.backlog);
+			parked_.erase(park);
+		}
+
+		if (pNextState != nullptr)
+			Transition(pFsm, pNextState);
+
+		if (parked_.count(pTop) != 0)
+			return;
+
+		// the events the transition recalled, as FsmRunData would
+		while ( (0 == parked_.count(pTop)) && ((eventId = FsmGetEventData(pTop->recallQ, &pPayload)) != EVT_FSM_NULL) )
+		{
+			FsmRunData(pTop, eventId, pPayload);
+			if (pPayload != nullptr)
+				FsmPayloadRelease(pPayload);
+		}
+
+		while (!backlog.empty())
+		{
+			auto	park = parked_.find(pTop);
+
+			// parked again: the rest wait, ahead of events Run since
+			if (park != parked_.end())
+			{
+				park->second.backlog.insert(park->second.backlog.begin(), backlog.begin(), backlog.end());
+				return;
+			}
+
+			auto	event = backlog.front();
+
+			backlog.pop_front();
+			FsmRunData(event.pFsm, event.eventId, event.pPayload);
+			if (event.pPayload != nullptr)
+				FsmPayloadRelease(event.pPayload);
+		}
+	}
+
+	std::unordered_map<Fsm *, Park>		parked_;	// by top level FSM
+	std::deque<CoHandler::Handle>		finished_;	// parked handlers that co_returned in this Poll
+	std::mutex							lock_;
+	std::deque<std::coroutine_handle<>>	ready_;		// scheduled, under lock_
+	Executor *							pPrevious_;
+
+	static inline thread_local Executor *	tCurrent_ = nullptr;
+};
+
+inline void CoHandler::FinalAwaiter::await_suspend (Handle handle) noexcept
+{
+	if (handle.promise().pExecutor != nullptr)
+		handle.promise().pExecutor->finished_.push_back(handle);
+}
+
+/**************************************************************************************************/
+// A value a handler waits for. The handler co_awaits it; the component it asked completes it,
+// from any thread, and the executor resumes the handler in its next Poll.
+template <typename T>
+class Reply
+{
+public:
+	Reply () = default;
+	Reply (const Reply &) = delete;
+	Reply & operator= (const Reply &) = delete;
+
+	bool await_ready ()
+	{
+		std::lock_guard<std::mutex>	guard(lock_);
+
+		return value_.has_value();
+	}
+
+	bool await_suspend (std::coroutine_handle<> handle)
+	{
+		std::lock_guard<std::mutex>	guard(lock_);
+
+		if (value_.has_value())
+			return false;		// completed meanwhile
+
+		pExecutor_ = Executor::Current();
+		if (nullptr == pExecutor_)
+		{
+			FSM_LOG("!!!! FSM ERROR !!!! reply awaited with no executor on the thread");
+			return false;		// resumes now with T{}
+		}
+
+		handle_ = handle;
+		return true;
+	}
+
+	T await_resume ()
+	{
+		std::lock_guard<std::mutex>	guard(lock_);
+
+		return value_.has_value() ? std::move(*value_) : T{};
+	}
+
+	void Complete (T value)
+	{
+		std::coroutine_handle<>	handle;
+
+		{
+			std::lock_guard<std::mutex>	guard(lock_);
+
+			value_ = std::move(value);
+			handle = std::exchange(handle_, nullptr);
+		}
+
+		if (handle)
+			pExecutor_->Schedule(handle);
+	}
+
+private:
+	std::mutex					lock_;
+	std::optional<T>			value_;
+	std::coroutine_handle<>		handle_;
+	Executor *					pExecutor_ = nullptr;
+};
+
+/**************************************************************************************************/
+// A coroutine handler as an FsmEvtHandler
+template <CoHandler (*Handler)(FsmState *, FsmEvent *)>
+FsmStatePtr CoEvtHandler (FsmState *pState, FsmEvent *pEvent)
+{
+	return Executor::Start(Handler(pState, pEvent), pState, pEvent);
+}
+
+} // namespace fsm
+
+#define FSM_CO_HANDLER(handler)		(&fsm::CoEvtHandler<handler>)
+
+#endif // _FSM_CO_HPP_
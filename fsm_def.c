@@ -0,0 +1,616 @@
+/*
+ *
+ * File: fsm_def.c
+ *
+ * Shared state machine definitions and compact FSM instances
+ *
+ *
+ */
+#include <string.h>
+
+#include "fsm_def.h"
+
+static bool FsmInstDispatchRegion (FsmInst *pInst, uint16_t region, int eventId, FsmPayload *pPayload,
+								   uint16_t *pPendingState);
+
+/**************************************************************************************************/
+// Check a definition's indices. Call once for each definition, at init.
+int FsmDefCheck (const FsmDef *pDef)
+{
+	int		i;
+	int		result = 0;
+
+	if ( (0 == pDef->nRegions) || (pDef->regions[0].parentState != FSM_DEF_NONE) )
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! FSM def %s: region 0 must be the top level", pDef->name);
+		return -1;
+	}
+
+	for (i=0; i<pDef->nRegions; i++)
+	{
+		const FsmDefRegion	*pRegion = &pDef->regions[i];
+
+		if ( (pRegion->initialState >= pDef->nStates) || (pDef->states[pRegion->initialState].region != i) )
+		{
+			FSM_LOG("!!!! FSM ERROR !!!! FSM def %s: region %s initial state not in the region", pDef->name, pRegion->name);
+			result = -1;
+		}
+
+		if ( (i > 0) && (pRegion->parentState >= pDef->nStates) )
+		{
+			FSM_LOG("!!!! FSM ERROR !!!! FSM def %s: region %s has no parent state", pDef->name, pRegion->name);
+			result = -1;
+		}
+	}
+
+	for (i=0; i<pDef->nStates; i++)
+	{
+		const FsmDefState	*pState = &pDef->states[i];
+		const uint16_t		*pNested;
+
+		if (pState->region >= pDef->nRegions)
+		{
+			FSM_LOG("!!!! FSM ERROR !!!! FSM def %s: state %s region %d undefined", pDef->name, pState->name, pState->region);
+			result = -1;
+			continue;
+		}
+
+		for (pNested = pState->nestedRegions; (pNested != NULL) && (*pNested != FSM_DEF_NONE); pNested++)
+		{
+			if ( (*pNested >= pDef->nRegions) || (pDef->regions[*pNested].parentState != i) )
+			{
+				FSM_LOG("!!!! FSM ERROR !!!! FSM def %s: state %s nested region %d is not nested in it", pDef->name, pState->name, *pNested);
+				result = -1;
+			}
+		}
+	}
+
+	return result;
+
+} // FsmDefCheck
+
+/**************************************************************************************************/
+// Same search as FsmFindEvent: the event's handler, else the state's default handler, else the terminator
+static const FsmDefEvent * FsmDefFindEvent (const FsmDefEvent *pEventList, int eventId)
+{
+	const FsmDefEvent	*pDefault = NULL;
+
+	for ( ; pEventList->id != EVT_FSM_NULL; pEventList++)
+	{
+		if (pEventList->id == eventId)
+			return pEventList;
+		else if (pEventList->id == EVT_FSM_DEFAULT)
+			pDefault = pEventList;
+	}
+
+	return (pDefault != NULL) ? pDefault : pEventList;
+}
+
+/**************************************************************************************************/
+// Definition lookups, from the packed tables if the definition has them
+
+static inline uint16_t FsmDefStateRegion (const FsmDef *pDef, uint16_t state)
+{
+	return (pDef->pPacked != NULL) ? pDef->pPacked->states[state].region : pDef->states[state].region;
+}
+
+static inline uint16_t FsmDefRegionParent (const FsmDef *pDef, uint16_t region)
+{
+	return (pDef->pPacked != NULL) ? pDef->pPacked->parents[region] : pDef->regions[region].parentState;
+}
+
+// regions nested in the state, FSM_DEF_NONE terminated, NULL if none
+static inline const uint16_t * FsmDefNestedRegions (const FsmDef *pDef, uint16_t state)
+{
+	const FsmDefPacked	*pPacked = pDef->pPacked;
+
+	if (NULL == pPacked)
+		return pDef->states[state].nestedRegions;
+
+	return (FSM_DEF_NONE == pPacked->states[state].nested) ? NULL : &pPacked->lists[pPacked->states[state].nested];
+}
+
+// FsmDefFindEvent: *pId gets the id of the event found, EVT_FSM_NULL if none
+static inline FsmInstHandler FsmDefFindHandler (const FsmDef *pDef, uint16_t state, int eventId, int *pId)
+{
+	const FsmDefPacked		*pPacked = pDef->pPacked;
+	const FsmPackedState	*pState;
+	const FsmPackedEvent	*pEvent;
+	const FsmPackedEvent	*pEnd;
+
+	if (NULL == pPacked)
+	{
+		const FsmDefEvent	*pDefEvent = FsmDefFindEvent(pDef->states[state].eventList, eventId);
+
+		*pId = pDefEvent->id;
+		return pDefEvent->pfnEvtHandler;
+	}
+
+	pState = &pPacked->states[state];
+	pEvent = &pPacked->events[pState->event];
+	pEnd = pEvent + pState->count;
+
+	for ( ; pEvent < pEnd; pEvent++)
+		if (pEvent->id == eventId)
+			break;
+
+	// the default handler is last
+	if ( (pEvent == pEnd) && ((0 == pState->count) || (pEnd[-1].id != EVT_FSM_DEFAULT)) )
+	{
+		*pId = EVT_FSM_NULL;
+		return NULL;
+	}
+	if (pEvent == pEnd)
+		pEvent--;
+
+	*pId = pEvent->id;
+	return (FSM_DEF_NONE == pEvent->handler) ? NULL : pPacked->handlers[pEvent->handler];
+
+} // FsmDefFindHandler
+
+/**************************************************************************************************/
+// FsmStateDefaultHandler for a state of an instance.
+// *pNextState gets the state to transition to, FSM_DEF_NONE if none.
+static bool FsmInstStateHandler (FsmInst *pInst, uint16_t state, int eventId, FsmPayload *pPayload,
+								 uint16_t *pNextState)
+{
+	const uint16_t		*pNestedRegions = FsmDefNestedRegions(pInst->pDef, state);
+	FsmInstEvent		event;
+	FsmInstHandler		pfnEventHandler = FsmDefFindHandler(pInst->pDef, state, eventId, &event.id);
+	uint16_t			nextState = FSM_DEF_NONE;
+	uint16_t			pendingState = FSM_DEF_NONE;
+	bool				consumed = false;
+	bool				isEntry = (EVT_FSM_ENTRY == eventId) || (EVT_FSM_SUPERSTATE_ENTRY == eventId);
+	bool				isExit = (EVT_FSM_EXIT == eventId) || (EVT_FSM_SUPERSTATE_EXIT == eventId);
+
+	event.altId = eventId;
+	event.consumed = false;
+	event.state = state;
+	event.pPayload = pPayload;
+
+	// Entry events top-down, always consumed
+	if ( (event.id == eventId) && isEntry )
+	{
+		nextState = (pfnEventHandler == NULL) ? FSM_DEF_NONE : (uint16_t)(*pfnEventHandler)(pInst, &event);
+		consumed = true;
+	}
+
+	// Pass the event to the nested regions. Entering the state enters the state each region is
+	// in (its initial state, or a transition's path) with EVT_FSM_ENTRY.
+	if (pNestedRegions != NULL)
+	{
+		const uint16_t	*pNested;
+		int				nestedEventId = eventId;
+
+		if (EVT_FSM_EXIT == eventId)
+			nestedEventId = EVT_FSM_SUPERSTATE_EXIT;
+
+		for (pNested = pNestedRegions; *pNested != FSM_DEF_NONE; pNested++)
+		{
+			uint16_t	regionPending = FSM_DEF_NONE;
+			bool		regionConsumed = FsmInstDispatchRegion(pInst, *pNested, nestedEventId, pPayload, &regionPending);
+
+			consumed = consumed || regionConsumed;
+			if (FSM_DEF_NONE == pendingState)
+				pendingState = regionPending;
+
+			// the region starts from its initial state next time the state is entered
+			if (isExit)
+				pInst->state[*pNested] = pInst->pDef->regions[*pNested].initialState;
+		}
+	}
+
+	// Other events bottom-up, if not consumed by a nested region
+	if ( (!consumed) && (event.id != EVT_FSM_NULL) && (!isEntry) )
+	{
+		nextState = (pfnEventHandler == NULL) ? FSM_DEF_NONE : (uint16_t)(*pfnEventHandler)(pInst, &event);
+		// ignore transitions in Exit actions
+		nextState = (EVT_FSM_EXIT == eventId) ? FSM_DEF_NONE : nextState;
+
+		consumed = event.consumed;
+	}
+
+	if ( (FSM_DEF_NONE == nextState) && (!isExit) )
+		nextState = pendingState;
+
+	*pNextState = nextState;
+
+	return consumed;
+
+} // FsmInstStateHandler
+
+/**************************************************************************************************/
+// FsmTransition for an instance: the transition is taken in region if it is the least common
+// ancestor of the region's current state and nextState, else *pPendingState gets nextState.
+static void FsmInstTransition (FsmInst *pInst, uint16_t region, uint16_t nextState, uint16_t *pPendingState)
+{
+	const FsmDef	*pDef = pInst->pDef;
+	uint16_t		lcaState = nextState;
+	uint16_t		pathState;
+	uint16_t		ignored = FSM_DEF_NONE;
+
+	if (nextState >= pDef->nStates)
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! FSM %s: transition to undefined state %d", pDef->name, nextState);
+		return;
+	}
+
+	while ( (lcaState != FSM_DEF_NONE) && (FsmDefStateRegion(pDef, lcaState) != region) )
+		lcaState = FsmDefRegionParent(pDef, FsmDefStateRegion(pDef, lcaState));
+
+	if (FSM_DEF_NONE == lcaState)
+	{
+		*pPendingState = nextState;		// the LCA is further up
+		return;
+	}
+
+	FsmInstDispatchRegion(pInst, region, EVT_FSM_EXIT, NULL, &ignored);		// exit the source
+
+	for (pathState = nextState; pathState != lcaState; pathState = FsmDefRegionParent(pDef, FsmDefStateRegion(pDef, pathState)))
+		pInst->state[FsmDefStateRegion(pDef, pathState)] = pathState;
+
+	pInst->state[region] = lcaState;
+	FsmInstDispatchRegion(pInst, region, EVT_FSM_ENTRY, NULL, pPendingState);	// enter the target
+
+} // FsmInstTransition
+
+/**************************************************************************************************/
+// FsmDispatchData for one region of an instance
+static bool FsmInstDispatchRegion (FsmInst *pInst, uint16_t region, int eventId, FsmPayload *pPayload,
+								   uint16_t *pPendingState)
+{
+	uint16_t	nextState;
+	bool		consumed = FsmInstStateHandler(pInst, pInst->state[region], eventId, pPayload, &nextState);
+
+	if (nextState != FSM_DEF_NONE)
+		FsmInstTransition(pInst, region, nextState, pPendingState);
+
+	return consumed;
+}
+
+/**************************************************************************************************/
+bool FsmInstDispatch (FsmInst *pInst, int eventId, FsmPayload *pPayload)
+{
+	uint16_t	pendingState = FSM_DEF_NONE;
+	bool		consumed;
+
+	if (EVT_FSM_NULL == eventId)	// no event
+		return true;
+
+	consumed = FsmInstDispatchRegion(pInst, 0, eventId, pPayload, &pendingState);
+
+	if (pendingState != FSM_DEF_NONE)
+		FSM_LOG("!!!! FSM ERROR !!!! FSM %s: transition target %s not found", pInst->pDef->name,
+				pInst->pDef->states[pendingState].name);
+
+	return consumed;
+}
+
+/**************************************************************************************************/
+// Set every region to its initial state and enter the top level
+void FsmInstInit (FsmInst *pInst, const FsmDef *pDef, FsmQ *deferQ, FsmQ *recallQ, void *pContext)
+{
+	int		i;
+
+	pInst->pDef = pDef;
+	pInst->deferQ = deferQ;
+	pInst->recallQ = recallQ;
+	pInst->pContext = pContext;
+
+	for (i=0; i<pDef->nRegions; i++)
+		pInst->state[i] = pDef->regions[i].initialState;
+
+	FsmInstDispatch(pInst, EVT_FSM_ENTRY, NULL);
+
+} // FsmInstInit
+
+/**************************************************************************************************/
+void FsmInstRun (FsmInst *pInst, int eventId)
+{
+	FsmInstRunData(pInst, eventId, NULL);
+}
+
+/**************************************************************************************************/
+// FsmRunData for an instance
+void FsmInstRunData (FsmInst *pInst, int eventId, FsmPayload *pPayload)
+{
+	bool		consumed;
+	bool		recalled = false;
+	int			nextEvent = eventId;
+	FsmPayload	*pNextPayload = pPayload;
+
+	do {
+		consumed = FsmInstDispatch(pInst, nextEvent, pNextPayload);
+		if (!consumed)
+		{
+			if (nextEvent >= EVT_FSM_EOL)
+				FSM_LOG(",%s,%s,%d,ignored", pInst->pDef->name, FsmInstStateName(pInst, 0), nextEvent)
+			else
+				FSM_LOG(",%s,%s,%s,ignored", pInst->pDef->name, FsmInstStateName(pInst, 0), FSM_EVT_NAME(nextEvent))
+		}
+
+		if ( recalled && (pNextPayload != NULL) )
+			FsmPayloadRelease(pNextPayload);
+
+		nextEvent = FsmGetEventData(pInst->recallQ, &pNextPayload);
+		recalled = true;
+
+	} while (nextEvent != EVT_FSM_NULL);
+
+} // FsmInstRunData
+
+/**************************************************************************************************/
+// FsmDeferEventData for an instance
+int FsmInstDeferEvent (FsmInst *pInst, int eventId, FsmPayload *pPayload)
+{
+	int result = FsmPutEventData(pInst->deferQ, eventId, pPayload);
+
+	if ((0 == result) && (pPayload != NULL) && (pInst->deferQ != NULL))
+		FsmPayloadRetain(pPayload);
+
+	return result;
+}
+
+/**************************************************************************************************/
+// FsmRecallEvent for an instance
+int FsmInstRecallEvent (FsmInst *pInst, int *pEventId)
+{
+	int			result;
+	FsmPayload	*pPayload;
+
+	*pEventId = FsmGetEventData(pInst->deferQ, &pPayload);
+	result = FsmPutEventData(pInst->recallQ, *pEventId, pPayload);
+
+	if ((result != 0) && (pPayload != NULL))
+		FsmPayloadRelease(pPayload);
+
+	return result;
+}
+
+/**************************************************************************************************/
+// true if the state, or a state active in a region nested in it, has a handler for eventId
+static bool FsmInstStateHandles (FsmInst *pInst, uint16_t state, int eventId)
+{
+	const uint16_t		*pNestedRegions = FsmDefNestedRegions(pInst->pDef, state);
+	int					id;
+	int					i;
+
+	FsmDefFindHandler(pInst->pDef, state, eventId, &id);
+	if (id != EVT_FSM_NULL)
+		return true;
+
+	for (i=0; (pNestedRegions != NULL) && (pNestedRegions[i] != FSM_DEF_NONE); i++)
+		if (FsmInstStateHandles(pInst, pInst->state[pNestedRegions[i]], eventId))
+			return true;
+
+	return false;
+}
+
+static bool FsmInstHandlesEvent (void *pContext, int eventId)
+{
+	FsmInst	*pInst = (FsmInst *)pContext;
+
+	return FsmInstStateHandles(pInst, pInst->state[0], eventId);
+}
+
+/**************************************************************************************************/
+// FsmRecallHandled for an instance
+int FsmInstRecallHandled (FsmInst *pInst)
+{
+	return FsmQRecallIf(pInst->deferQ, pInst->recallQ, FsmInstHandlesEvent, pInst);
+}
+
+/**************************************************************************************************/
+const char * FsmInstStateName (FsmInst *pInst, int region)
+{
+	if ( (region < 0) || (region >= pInst->pDef->nRegions) )
+		return "?";
+
+	return pInst->pDef->states[pInst->state[region]].name;
+}
+
+/**************************************************************************************************/
+// Packed definitions
+/**************************************************************************************************/
+
+typedef struct
+{
+	int		nHandlers;		// distinct handlers
+	int		nEvents;		// events, one default handler per state
+	int		nLists;			// nested region list entries, terminators included
+} FsmDefPackCounts;
+
+#define FSM_DEF_PACK_ALIGN(n)	(((n) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+/**************************************************************************************************/
+// true if pEvent's handler is also the handler of an event listed before it
+static bool FsmDefHandlerSeen (const FsmDef *pDef, int state, const FsmDefEvent *pEvent)
+{
+	const FsmDefEvent	*pOther;
+	int					i;
+
+	for (i=0; i<=state; i++)
+		for (pOther = pDef->states[i].eventList; (pOther->id != EVT_FSM_NULL) && (pOther != pEvent); pOther++)
+			if (pOther->pfnEvtHandler == pEvent->pfnEvtHandler)
+				return true;
+
+	return false;
+}
+
+/**************************************************************************************************/
+static int FsmDefPackCount (const FsmDef *pDef, FsmDefPackCounts *pCounts)
+{
+	int		i;
+
+	memset(pCounts, 0, sizeof(FsmDefPackCounts));
+
+	if (FsmDefCheck(pDef) != 0)
+		return -1;
+
+	for (i=0; i<pDef->nStates; i++)
+	{
+		const FsmDefState	*pState = &pDef->states[i];
+		const FsmDefEvent	*pEvent;
+		const uint16_t		*pNested;
+		bool				hasDefault = false;
+
+		for (pEvent = pState->eventList; pEvent->id != EVT_FSM_NULL; pEvent++)
+		{
+			if ( (pEvent->id < 0) || (pEvent->id >= FSM_DEF_NONE) )
+			{
+				FSM_LOG("!!!! FSM ERROR !!!! FSM def %s: state %s event %d can't be packed", pDef->name, pState->name, pEvent->id);
+				return -1;
+			}
+
+			if ( (pEvent->pfnEvtHandler != NULL) && !FsmDefHandlerSeen(pDef, i, pEvent) )
+				pCounts->nHandlers++;
+
+			if (pEvent->id != EVT_FSM_DEFAULT)
+				pCounts->nEvents++;
+			else
+				hasDefault = true;
+		}
+		pCounts->nEvents += hasDefault ? 1 : 0;
+
+		if (pState->nestedRegions != NULL)
+		{
+			for (pNested = pState->nestedRegions; *pNested != FSM_DEF_NONE; pNested++)
+				pCounts->nLists++;
+			pCounts->nLists++;
+		}
+	}
+
+	if ( (pCounts->nHandlers >= FSM_DEF_NONE) || (pCounts->nEvents >= FSM_DEF_NONE) || (pCounts->nLists >= FSM_DEF_NONE) )
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! FSM def %s: too many events to pack", pDef->name);
+		return -1;
+	}
+
+	return 0;
+
+} // FsmDefPackCount
+
+/**************************************************************************************************/
+static size_t FsmDefPackBytes (const FsmDef *pDef, const FsmDefPackCounts *pCounts)
+{
+	return FSM_DEF_PACK_ALIGN(sizeof(FsmDef)) + FSM_DEF_PACK_ALIGN(sizeof(FsmDefPacked))
+		 + pCounts->nHandlers * sizeof(FsmInstHandler)
+		 + pDef->nStates * sizeof(FsmPackedState)
+		 + pCounts->nEvents * sizeof(FsmPackedEvent)
+		 + (pDef->nRegions + pCounts->nLists) * sizeof(uint16_t);
+}
+
+/**************************************************************************************************/
+long FsmDefPackSize (const FsmDef *pDef)
+{
+	FsmDefPackCounts	counts;
+
+	if (FsmDefPackCount(pDef, &counts) != 0)
+		return -1;
+
+	return (long)FsmDefPackBytes(pDef, &counts);
+}
+
+/**************************************************************************************************/
+// Pack pDef into pBuffer. The returned definition lives in pBuffer and points at pDef's
+// states and regions for their names, so both must outlive the instances using it.
+const FsmDef * FsmDefPack (const FsmDef *pDef, void *pBuffer, size_t size)
+{
+	FsmDefPackCounts	counts;
+	char				*pNext = (char *)pBuffer;
+	FsmDef				*pPackedDef;
+	FsmDefPacked		*pPacked;
+	FsmInstHandler		*pHandlers;
+	FsmPackedState		*pStates;
+	FsmPackedEvent		*pEvents;
+	uint16_t			*pParents;
+	uint16_t			*pLists;
+	int					nHandlers = 0;
+	int					nEvents = 0;
+	int					nLists = 0;
+	int					i;
+
+	if (FsmDefPackCount(pDef, &counts) != 0)
+		return NULL;
+
+	if ( (FsmDefPackBytes(pDef, &counts) > size) || (((uintptr_t)pBuffer & (sizeof(void *) - 1)) != 0) )
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! FSM def %s: pack buffer too small or not aligned", pDef->name);
+		return NULL;
+	}
+
+	pPackedDef = (FsmDef *)pNext;			pNext += FSM_DEF_PACK_ALIGN(sizeof(FsmDef));
+	pPacked = (FsmDefPacked *)pNext;		pNext += FSM_DEF_PACK_ALIGN(sizeof(FsmDefPacked));
+	pHandlers = (FsmInstHandler *)pNext;	pNext += counts.nHandlers * sizeof(FsmInstHandler);
+	pStates = (FsmPackedState *)pNext;		pNext += pDef->nStates * sizeof(FsmPackedState);
+	pEvents = (FsmPackedEvent *)pNext;		pNext += counts.nEvents * sizeof(FsmPackedEvent);
+	pParents = (uint16_t *)pNext;			pNext += pDef->nRegions * sizeof(uint16_t);
+	pLists = (uint16_t *)pNext;
+
+	for (i=0; i<pDef->nStates; i++)
+	{
+		const FsmDefState	*pState = &pDef->states[i];
+		const FsmDefEvent	*pEvent;
+		const FsmDefEvent	*pDefault = NULL;
+		const uint16_t		*pNested;
+
+		pStates[i].region = pState->region;
+		pStates[i].nested = FSM_DEF_NONE;
+		pStates[i].event = (uint16_t)nEvents;
+
+		// events in order, the state's default handler (the last one listed, as FsmDefFindEvent) after them
+		for (pEvent = pState->eventList; ; pEvent++)
+		{
+			const FsmDefEvent	*pCopy = pEvent;
+			int					h;
+
+			if (EVT_FSM_NULL == pEvent->id)
+			{
+				if (NULL == pDefault)
+					break;
+				pCopy = pDefault;
+			}
+			else if (EVT_FSM_DEFAULT == pEvent->id)
+			{
+				pDefault = pEvent;
+				continue;
+			}
+
+			for (h=0; (h < nHandlers) && (pHandlers[h] != pCopy->pfnEvtHandler); h++)
+				;
+			if ( (h == nHandlers) && (pCopy->pfnEvtHandler != NULL) )
+				pHandlers[nHandlers++] = pCopy->pfnEvtHandler;
+
+			pEvents[nEvents].id = (uint16_t)pCopy->id;
+			pEvents[nEvents].handler = (NULL == pCopy->pfnEvtHandler) ? FSM_DEF_NONE : (uint16_t)h;
+			nEvents++;
+
+			if (pCopy == pDefault)
+				break;
+		}
+		pStates[i].count = (uint16_t)(nEvents - pStates[i].event);
+
+		if (pState->nestedRegions != NULL)
+		{
+			pStates[i].nested = (uint16_t)nLists;
+			for (pNested = pState->nestedRegions; *pNested != FSM_DEF_NONE; pNested++)
+				pLists[nLists++] = *pNested;
+			pLists[nLists++] = FSM_DEF_NONE;
+		}
+	}
+
+	for (i=0; i<pDef->nRegions; i++)
+		pParents[i] = pDef->regions[i].parentState;
+
+	pPacked->handlers = pHandlers;
+	pPacked->states = pStates;
+	pPacked->events = pEvents;
+	pPacked->lists = pLists;
+	pPacked->parents = pParents;
+
+	*pPackedDef = *pDef;
+	pPackedDef->pPacked = pPacked;
+
+	return pPackedDef;
+
+} // FsmDefPack
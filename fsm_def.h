@@ -0,0 +1,233 @@
+/*
+ *
+ * File: fsm_def.h
+ *
+ * Shared state machine definitions and compact FSM instances
+ *
+ *
+ */
+
+#ifndef _FSM_DEF_H_
+#define _FSM_DEF_H_
+
+#include <stdint.h>
+
+#include "fsm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**************************************************************************************************/
+// FSM definitions and instances
+/**************************************************************************************************/
+
+// The Fsm/FsmState/FsmEvent objects in fsm.h make up one live state machine: a state points at
+// its FSM, and dispatch writes to the state and event objects. Running N copies of a machine
+// means N copies of the whole object graph.
+//
+// A definition (FsmDef) is the same graph as read-only tables: states, the events each state
+// handles, and regions (the nested FSMs). States and regions are referred to by index.
+// An instance (FsmInst) holds the current state of every region, its queues and a pointer to
+// the application's data - a few tens of bytes. Any number of instances can share one
+// definition, and instances sharing a definition can be run on different threads at once.
+// Everything dispatch writes is on the stack or in the instance.
+//
+// Region 0 is the top level FSM. Every other region is nested in a state (its parentState).
+// Dispatch works like FsmStateDefaultHandler: Entry events top-down, other events bubble up
+// from the innermost state, EVT_FSM_SUPERSTATE_EXIT to nested regions and EVT_FSM_DEFAULT
+// handlers. A handler may return a state in any region; the transition is taken in the least
+// common ancestor region, as FsmTransition does. Entering a state enters each of its regions
+// with EVT_FSM_ENTRY, at the region's initial state or at the state a transition goes to, as a
+// nested FSM with an initial state and FSM_HISTORY_NONE is.
+//
+//       enum { ST_IDLE, ST_BUSY, ST_BUSY_A, ST_BUSY_B };			// state indices
+//       enum { RG_TOP, RG_BUSY };								// region indices
+//
+//       int Idle_Evt1 (FsmInst *pInst, FsmInstEvent *pEvent)
+//       {
+//           MySession *pSession = (MySession *)pInst->pContext;
+//           ...
+//           pEvent->consumed = true;
+//           return ST_BUSY;								// or FSM_DEF_NONE for no transition
+//       }
+//
+//       static const FsmDefEvent events_Idle[] = {
+//           FSM_DEF_EVENT(EVT_1, Idle_Evt1),
+//           FSM_DEF_EVENT_EOL
+//       };
+//       ...
+//       static const uint16_t nested_Busy[] = { RG_BUSY, FSM_DEF_NONE };
+//
+//       static const FsmDefState states_My[] = {
+//           FSM_DEF_STATE("Idle",  RG_TOP,  NULL,        events_Idle),
+//           FSM_DEF_STATE("Busy",  RG_TOP,  nested_Busy, events_Busy),
+//           FSM_DEF_STATE("BusyA", RG_BUSY, NULL,        events_BusyA),
+//           FSM_DEF_STATE("BusyB", RG_BUSY, NULL,        events_BusyB),
+//       };
+//       static const FsmDefRegion regions_My[] = {
+//           FSM_DEF_REGION("Top",  FSM_DEF_NONE, ST_IDLE),
+//           FSM_DEF_REGION("Busy", ST_BUSY,      ST_BUSY_A),
+//       };
+//       FSM_DEF(def_My, "My", states_My, regions_My);
+//       ...
+//       FSM_INST(inst_Session1, 2);					// or malloc(FSM_INST_SIZE(def_My.nRegions))
+//       FsmInstInit((FsmInst *)&inst_Session1, &def_My, NULL, NULL, pSession1);
+//       FsmInstRun((FsmInst *)&inst_Session1, EVT_1);
+
+#define FSM_DEF_NONE	0xFFFF		// no state / no region
+
+typedef struct FsmInst FsmInst;
+typedef struct FsmInstEvent FsmInstEvent;
+typedef struct FsmDefPacked FsmDefPacked;
+typedef int (*FsmInstHandler)(FsmInst *pInst, FsmInstEvent *pEvent);	// returns state index to transition to, FSM_DEF_NONE if no transition
+
+typedef struct
+{
+	int					id;
+	FsmInstHandler		pfnEvtHandler;
+} FsmDefEvent;
+
+typedef struct
+{
+	const char *		name;
+	uint16_t			region;			// region the state is in
+	const uint16_t *	nestedRegions;	// regions nested in this state, FSM_DEF_NONE terminated, NULL if none
+	const FsmDefEvent *	eventList;		// events handled by this state, EVT_FSM_NULL terminated
+} FsmDefState;
+
+typedef struct
+{
+	const char *		name;
+	uint16_t			parentState;	// state the region is nested in, FSM_DEF_NONE for region 0
+	uint16_t			initialState;
+} FsmDefRegion;
+
+typedef struct
+{
+	const char *			name;
+	const FsmDefState *		states;
+	const FsmDefRegion *	regions;
+	uint16_t				nStates;
+	uint16_t				nRegions;
+	const FsmDefPacked *	pPacked;		// packed tables dispatch uses, NULL if none (see FsmDefPack)
+} FsmDef;
+
+// The event being handled. Lives on the dispatching thread's stack.
+struct FsmInstEvent
+{
+	int				id;			// id of the handler's event (EVT_FSM_DEFAULT for a default handler)
+	int				altId;		// id of the event being dispatched; read it in a default handler
+	bool			consumed;	// set by handlers of non-Entry events
+	uint16_t		state;		// state handling the event
+	FsmPayload *	pPayload;	// NULL if none; use FSM_EVENT_DATA(pEvent)
+};
+
+#define FSM_INST_FIELDS								\
+	const FsmDef *	pDef;							\
+	FsmQ *			deferQ;							\
+	FsmQ *			recallQ;						\
+	void *			pContext;	/* application data for this instance */
+
+struct FsmInst
+{
+	FSM_INST_FIELDS
+	uint16_t		state[];	// current state of each region
+};
+
+// ... Definition objects
+#define FSM_DEF_EVENT(event_id,handler)		{ (event_id), (handler) }
+#define FSM_DEF_EVENT_EOL					{ EVT_FSM_NULL, NULL }
+
+#define FSM_DEF_STATE(name_str,region,nested_regions,event_list)	\
+	{ (name_str), (region), (nested_regions), (event_list) }
+
+#define FSM_DEF_REGION(name_str,parent_state,initial_state)	\
+	{ (name_str), (parent_state), (initial_state) }
+
+#define FSM_DEF(obj,name_str,state_array,region_array)						\
+	const FsmDef obj = {													\
+		(name_str), (state_array), (region_array),							\
+		(uint16_t)(sizeof(state_array)/sizeof(state_array[0])),			\
+		(uint16_t)(sizeof(region_array)/sizeof(region_array[0]))			\
+		}
+
+// ... Instance objects
+#define FSM_INST(obj,n_regions)		\
+	struct obj##_tag {				\
+		FSM_INST_FIELDS				\
+		uint16_t	state[n_regions];	\
+	} obj
+
+// bytes for one instance with n_regions, rounded so instances can be packed in an array
+#define FSM_INST_SIZE(n_regions)	\
+	((sizeof(FsmInst) + (n_regions) * sizeof(uint16_t) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+int  FsmDefCheck (const FsmDef *pDef);		// returns -1 (and logs) if the tables are inconsistent, else 0
+void FsmInstInit (FsmInst *pInst, const FsmDef *pDef, FsmQ *deferQ, FsmQ *recallQ, void *pContext);
+void FsmInstRun (FsmInst *pInst, int eventId);
+void FsmInstRunData (FsmInst *pInst, int eventId, FsmPayload *pPayload);
+bool FsmInstDispatch (FsmInst *pInst, int eventId, FsmPayload *pPayload);
+int  FsmInstDeferEvent (FsmInst *pInst, int eventId, FsmPayload *pPayload);
+int  FsmInstRecallEvent (FsmInst *pInst, int *pEventId);
+int  FsmInstRecallHandled (FsmInst *pInst);
+const char * FsmInstStateName (FsmInst *pInst, int region);
+
+/**************************************************************************************************/
+// Packed definitions
+/**************************************************************************************************/
+
+// The definition tables are laid out for writing by hand: 32 byte states with their names,
+// 16 byte events, and lists scattered wherever the compiler put them. FsmDefPack copies what
+// dispatch reads into one block, addressed by 16-bit indices:
+//     states     8 bytes each: region, first nested region, first event, event count
+//     events     4 bytes each: id and handler index, a state's events one after another
+//                (its EVT_FSM_DEFAULT handler last)
+//     handlers   each distinct handler once
+//     lists      the nested region lists, FSM_DEF_NONE terminated, and each region's parent state
+// The names stay in the original tables, which dispatch doesn't touch. A machine of a few dozen
+// states and events fits in a few cache lines.
+//
+// The block starts with a copy of the definition with pPacked set. Initialize instances with
+// the definition FsmDefPack returns and they dispatch from the packed tables; everything else
+// (images, FsmInstStateName) treats it as the original.
+//
+//       static void *	packMy[64];			// at least FsmDefPackSize(&def_My) bytes, pointer aligned
+//       const FsmDef	*pDef = FsmDefPack(&def_My, packMy, sizeof(packMy));
+//       ...
+//       FsmInstInit((FsmInst *)&inst_Session1, pDef, NULL, NULL, pSession1);
+//
+// Event ids must be below FSM_DEF_NONE, and a definition can have fewer than FSM_DEF_NONE
+// events and handlers.
+
+typedef struct
+{
+	uint16_t		region;			// region the state is in
+	uint16_t		nested;			// its nested regions in lists, FSM_DEF_NONE if none
+	uint16_t		event;			// its first event in events
+	uint16_t		count;			// its events
+} FsmPackedState;
+
+typedef struct
+{
+	uint16_t		id;
+	uint16_t		handler;		// index in handlers, FSM_DEF_NONE if no handler
+} FsmPackedEvent;
+
+struct FsmDefPacked
+{
+	const FsmInstHandler *	handlers;
+	const FsmPackedState *	states;
+	const FsmPackedEvent *	events;
+	const uint16_t *		lists;			// nested region lists
+	const uint16_t *		parents;		// parent state of each region
+};
+
+long			FsmDefPackSize (const FsmDef *pDef);		// returns -1 (and logs) if it can't be packed
+const FsmDef *	FsmDefPack (const FsmDef *pDef, void *pBuffer, size_t size);	// returns NULL (and logs) on error
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _FSM_DEF_H_
@@ -1,5 +1,7 @@
 
-#define	FSM_TRACE		1	// undefine or set to 0 to disable fsm tracing
+#ifndef FSM_TRACE
+	#define	FSM_TRACE	1	// undefine or set to 0 to disable fsm tracing, 2 for binary trace
+#endif
 #define _FSM_EXAMPLE_C_
 
 #include "fsm.h"
@@ -154,6 +156,17 @@ Fsm* nestedFsmList_Top_State2[] = {
 };
 FSM_STATE( state_Top_State2, &fsm_Top, nestedFsmList_Top_State2, eventList_Top_State2, "State2", MyFsmStateHandler );
 
+//=======================
+// State dispatch tables
+//=======================
+
+FSM_DISPATCH_TABLE( table_Nested1_State1 );
+FSM_DISPATCH_TABLE( table_Nested1_State2 );
+FSM_DISPATCH_TABLE( table_Nested2_State1 );
+FSM_DISPATCH_TABLE( table_Nested2_State2 );
+FSM_DISPATCH_TABLE( table_Top_State1 );
+FSM_DISPATCH_TABLE( table_Top_State2 );
+
 //===============
 // Event Handlers
 //===============
@@ -179,14 +192,14 @@ FSM_EVENT_HANDLER( Top_State2_EVT2 )     { pEvent->consumed = true; return &stat
 
 FSM_EVENT_HANDLER( Nested1_State1_Entry )
 {
-	FSM_RUN_LOG("%s,%s,entry_actions", pState->pFsm->name, pState->name);
+	FSM_TRACE_RUN(pState, "entry_actions");
 	pEvent->consumed = true;
 	return NULL;
 }
 
 FSM_EVENT_HANDLER( Nested2_State1_Entry )
 {
-	FSM_RUN_LOG("%s,%s,entry_actions", pState->pFsm->name, pState->name);
+	FSM_TRACE_RUN(pState, "entry_actions");
 	pEvent->consumed = true;
 	return NULL;
 }
@@ -204,11 +217,11 @@ bool MyFsmStateHandler(FsmState *pState, int eventId)
 {
 	bool consumed;
 
-	FSM_ENTER_LOG("%s,%s,%s", pState->pFsm->name, pState->name, FSM_EVT_NAME(eventId));
+	FSM_TRACE_ENTER(pState, eventId);
 
 	consumed = FsmStateDefaultHandler(pState, eventId);
 
-	FSM_EXIT_LOG("%s,%s,%s,%sconsumed", pState->pFsm->name, pState->name, FSM_EVT_NAME(eventId), (consumed==0? "not_" : ""));
+	FSM_TRACE_EXIT(pState, eventId, consumed);
 
 	return consumed;
 
@@ -222,7 +235,15 @@ void MyFsmInit (void)
 	Fsm			*pFsm = &fsm_Top;
 	FsmState	*pState = &state_Top_State1;
 
-	FSM_RUN_LOG("%s,%s,init", pState->pFsm->name, pState->name);
+	FSM_TRACE_RUN(pState, "init");
+
+	// build the dispatch tables before the first event
+	FsmCompileState(&state_Nested1_State1, table_Nested1_State1);
+	FsmCompileState(&state_Nested1_State2, table_Nested1_State2);
+	FsmCompileState(&state_Nested2_State1, table_Nested2_State1);
+	FsmCompileState(&state_Nested2_State2, table_Nested2_State2);
+	FsmCompileState(&state_Top_State1,     table_Top_State1);
+	FsmCompileState(&state_Top_State2,     table_Top_State2);
 
 	FsmInit(pFsm, pState);
 
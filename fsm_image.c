@@ -0,0 +1,686 @@
+/*
+ *
+ * File: fsm_image.c
+ *
+ * FSM images: the active configuration of FSMs or instances saved as a binary image, and restored
+ *
+ *
+ */
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "fsm_image.h"
+
+#define FSM_IMAGE_ALIGN(n)		(((n) + 3) & ~(size_t)3)
+#define FSM_IMAGE_MAX_EVENTS	0xFFFF		// events per saved queue
+
+// Image being written. With no buffer (or once it's full) only the size is counted.
+typedef struct
+{
+	unsigned char *	pBase;
+	size_t			size;
+	size_t			at;
+	uint32_t		queues;
+	FsmSlab **		slabList;
+	int				nSlabs;
+} FsmImageWriter;
+
+// Image being read
+typedef struct
+{
+	const unsigned char *	pBase;
+	size_t					size;
+	size_t					at;
+	FsmSlab **				slabList;
+	int						nSlabs;
+} FsmImageReader;
+
+/**************************************************************************************************/
+// FNV-1a, over the names that give the states their indices
+static uint32_t FsmImageHash (uint32_t hash, const char *name)
+{
+	if (NULL == name)
+		name = "";
+
+	do {
+		hash = (hash ^ (unsigned char)*name) * 16777619u;
+	} while (*name++ != '\0');
+
+	return hash;
+}
+
+static uint32_t FsmImageHashInt (uint32_t hash, uint32_t value)
+{
+	int	i;
+
+	for (i=0; i<4; i++, value >>= 8)
+		hash = (hash ^ (value & 0xFF)) * 16777619u;
+
+	return hash;
+}
+
+static uint32_t FsmImageLayoutFsm (const FsmImageMap *pMap)
+{
+	uint32_t	hash = FsmImageHashInt(2166136261u, FSM_IMAGE_FSM);
+	int			i;
+
+	for (i=0; i<pMap->nFsms; i++)
+		hash = FsmImageHash(hash, pMap->fsmList[i]->name);
+
+	for (i=0; i<pMap->nStates; i++)
+	{
+		hash = FsmImageHash(hash, (pMap->stateList[i]->pFsm != NULL) ? pMap->stateList[i]->pFsm->name : NULL);
+		hash = FsmImageHash(hash, pMap->stateList[i]->name);
+	}
+
+	return hash;
+}
+
+static uint32_t FsmImageLayoutInst (const FsmDef *pDef)
+{
+	uint32_t	hash = FsmImageHashInt(2166136261u, FSM_IMAGE_INST);
+	int			i;
+
+	hash = FsmImageHash(hash, pDef->name);
+
+	for (i=0; i<pDef->nStates; i++)
+	{
+		hash = FsmImageHash(hash, pDef->states[i].name);
+		hash = FsmImageHashInt(hash, pDef->states[i].region);
+	}
+
+	for (i=0; i<pDef->nRegions; i++)
+	{
+		hash = FsmImageHash(hash, pDef->regions[i].name);
+		hash = FsmImageHashInt(hash, pDef->regions[i].parentState);
+	}
+
+	return hash;
+}
+
+/**************************************************************************************************/
+// Writing
+/**************************************************************************************************/
+static void FsmImagePut (FsmImageWriter *pWriter, const void *pData, size_t length)
+{
+	if ( (pWriter->pBase != NULL) && (pWriter->at + length <= pWriter->size) )
+		memcpy(pWriter->pBase + pWriter->at, pData, length);
+
+	pWriter->at += length;
+}
+
+static void FsmImagePad (FsmImageWriter *pWriter)
+{
+	static const unsigned char	zero[4];
+
+	FsmImagePut(pWriter, zero, FSM_IMAGE_ALIGN(pWriter->at) - pWriter->at);
+}
+
+/**************************************************************************************************/
+static int FsmImageSlabIndex (FsmImageWriter *pWriter, FsmSlab *pSlab)
+{
+	int	i;
+
+	for (i=0; i<pWriter->nSlabs; i++)
+		if (pWriter->slabList[i] == pSlab)
+			return i;
+
+	return -1;
+}
+
+/**************************************************************************************************/
+// Write a queue's events (spilled ones included) as an FsmImageQueue record. Empty queues
+// aren't written.
+static int FsmImagePutQueue (FsmImageWriter *pWriter, uint32_t owner, int which, FsmQ *q)
+{
+	FsmImageQueue	record;
+	FsmQ			*pQ;
+	int				count = 0;
+	int				i;
+
+	for (pQ = q; pQ != NULL; pQ = FSM_Q_SPILL_Q(pQ))
+		count += pQ->count;
+
+	if (0 == count)
+		return 0;
+
+	if (count > FSM_IMAGE_MAX_EVENTS)
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! %d queued events, an image queue holds %d", count, FSM_IMAGE_MAX_EVENTS);
+		return -1;
+	}
+
+	record.owner = owner;
+	record.which = (uint16_t)which;
+	record.count = (uint16_t)count;
+	FsmImagePut(pWriter, &record, sizeof(record));
+	pWriter->queues++;
+
+	for (pQ = q; pQ != NULL; pQ = FSM_Q_SPILL_Q(pQ))
+	{
+		for (i=0; i<pQ->count; i++)
+		{
+			int				slot = (pQ->head + i) % pQ->size;
+			FsmPayload		*pPayload = (pQ->payload != NULL) ? pQ->payload[slot] : NULL;
+			FsmImageEvent	event;
+
+			event.eventId = pQ->eventId[slot];
+			event.slab = FSM_IMAGE_NONE;
+			event.length = 0;
+
+			if (pPayload != NULL)
+			{
+				int	slab = FsmImageSlabIndex(pWriter, pPayload->pSlab);
+
+				if ( (slab < 0) || (pPayload->pSlab->dataSize > 0xFFFF) )
+				{
+					FSM_LOG("!!!! FSM ERROR !!!! event %d payload slab not in the image's slab list", event.eventId);
+					return -1;
+				}
+				event.slab = (uint16_t)slab;
+				event.length = (uint16_t)pPayload->pSlab->dataSize;
+			}
+
+			FsmImagePut(pWriter, &event, sizeof(event));
+			if (pPayload != NULL)
+			{
+				FsmImagePut(pWriter, pPayload->data, event.length);
+				FsmImagePad(pWriter);
+			}
+		}
+	}
+
+	return 0;
+}
+
+/**************************************************************************************************/
+// Fill in the header once the rest is written. Returns the image size, -1 if it didn't fit.
+static long FsmImageFinish (FsmImageWriter *pWriter, uint32_t kind, uint32_t layout, uint32_t count, uint32_t width)
+{
+	FsmImageHeader	header;
+
+	if ( (pWriter->pBase != NULL) && (pWriter->at > pWriter->size) )
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! image needs %zu bytes, buffer has %zu", pWriter->at, pWriter->size);
+		return -1;
+	}
+
+	if (pWriter->pBase != NULL)
+	{
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, FSM_IMAGE_MAGIC, sizeof(header.magic));
+		header.version = FSM_IMAGE_VERSION;
+		header.kind = kind;
+		header.layout = layout;
+		header.count = count;
+		header.width = width;
+		header.queues = pWriter->queues;
+		header.size = pWriter->at;
+		memcpy(pWriter->pBase, &header, sizeof(header));
+	}
+
+	return (long)pWriter->at;
+}
+
+/**************************************************************************************************/
+// Reading
+/**************************************************************************************************/
+static const void * FsmImageGet (FsmImageReader *pReader, size_t length)
+{
+	const void	*pData = pReader->pBase + pReader->at;
+
+	if (length > pReader->size - pReader->at)
+		return NULL;
+
+	pReader->at += length;
+
+	return pData;
+}
+
+/**************************************************************************************************/
+// Check an image's header against the machine it is restored into
+static const FsmImageHeader * FsmImageCheck (FsmImageReader *pReader, uint32_t kind, uint32_t layout,
+											 uint32_t count, uint32_t width)
+{
+	const FsmImageHeader	*pHeader = (const FsmImageHeader *)FsmImageGet(pReader, sizeof(FsmImageHeader));
+
+	if ( (NULL == pHeader) || memcmp(pHeader->magic, FSM_IMAGE_MAGIC, sizeof(pHeader->magic)) )
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! not an FSM image");
+		return NULL;
+	}
+
+	if ( (pHeader->version != FSM_IMAGE_VERSION) || (pHeader->kind != kind) || (pHeader->size > pReader->size) )
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! FSM image version %u kind %u size %llu not supported",
+				pHeader->version, pHeader->kind, (unsigned long long)pHeader->size);
+		return NULL;
+	}
+
+	if ( (pHeader->layout != layout) || (pHeader->count != count) || (pHeader->width != width) )
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! FSM image was saved from a different machine");
+		return NULL;
+	}
+
+	pReader->size = (size_t)pHeader->size;
+
+	return pHeader;
+}
+
+/**************************************************************************************************/
+// Empty a queue (and its spill queue), releasing the payloads
+static void FsmImageClearQueue (FsmQ *q)
+{
+	FsmPayload	*pPayload;
+
+	if (NULL == q)
+		return;
+
+	while (FsmGetEventData(q, &pPayload) != EVT_FSM_NULL)
+	{
+		if (pPayload != NULL)
+			FsmPayloadRelease(pPayload);
+	}
+}
+
+/**************************************************************************************************/
+// Read a queue's events into q
+static int FsmImageGetQueue (FsmImageReader *pReader, const FsmImageQueue *pRecord, FsmQ *q)
+{
+	int		i;
+
+	for (i=0; i<pRecord->count; i++)
+	{
+		const FsmImageEvent	*pEvent = (const FsmImageEvent *)FsmImageGet(pReader, sizeof(FsmImageEvent));
+		FsmPayload			*pPayload = NULL;
+
+		if (NULL == pEvent)
+			return -1;
+
+		if (pEvent->slab != FSM_IMAGE_NONE)
+		{
+			const void	*pData = FsmImageGet(pReader, FSM_IMAGE_ALIGN(pEvent->length));
+
+			if ( (NULL == pData) || (pEvent->slab >= pReader->nSlabs)
+			  || (pEvent->length > pReader->slabList[pEvent->slab]->dataSize) )
+			{
+				FSM_LOG("!!!! FSM ERROR !!!! FSM image event %d payload doesn't fit its slab", pEvent->eventId);
+				return -1;
+			}
+
+			pPayload = FsmPayloadAlloc(pReader->slabList[pEvent->slab]);
+			if (NULL == pPayload)
+			{
+				FSM_LOG("!!!! FSM ERROR !!!! slab empty - FSM image event %d payload not restored", pEvent->eventId);
+				return -1;
+			}
+			memcpy(pPayload->data, pData, pEvent->length);
+		}
+
+		if (NULL == q)
+		{
+			FSM_LOG("!!!! FSM ERROR !!!! FSM image has events for a queue that doesn't exist");
+			if (pPayload != NULL)
+				FsmPayloadRelease(pPayload);
+			return -1;
+		}
+
+		if (FsmPutEventData(q, pEvent->eventId, pPayload) != 0)
+		{
+			if (pPayload != NULL)
+				FsmPayloadRelease(pPayload);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**************************************************************************************************/
+// Read the queue records. pfnQueue returns the queue for an owner and FSM_IMAGE_xxx_Q.
+static int FsmImageGetQueues (FsmImageReader *pReader, const FsmImageHeader *pHeader, uint32_t count,
+							  FsmQ * (*pfnQueue)(void *pContext, uint32_t owner, int which), void *pContext)
+{
+	uint32_t	i;
+
+	for (i=0; i<pHeader->queues; i++)
+	{
+		const FsmImageQueue	*pRecord = (const FsmImageQueue *)FsmImageGet(pReader, sizeof(FsmImageQueue));
+
+		if ( (NULL == pRecord) || (pRecord->owner >= count) || (pRecord->which > FSM_IMAGE_RECALL_Q) )
+		{
+			FSM_LOG("!!!! FSM ERROR !!!! FSM image queue records damaged");
+			return -1;
+		}
+
+		if (FsmImageGetQueue(pReader, pRecord, (*pfnQueue)(pContext, pRecord->owner, pRecord->which)) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/**************************************************************************************************/
+// Fsm/FsmState machines
+/**************************************************************************************************/
+static long FsmImageWrite (const FsmImageMap *pMap, void *pImage, size_t size)
+{
+	FsmImageWriter	writer = { (unsigned char *)pImage, size, sizeof(FsmImageHeader), 0, pMap->slabList, pMap->nSlabs };
+	int				i;
+	int				j;
+
+	for (i=0; i<pMap->nFsms; i++)
+	{
+		FsmState	*pState = pMap->fsmList[i]->pState;
+		uint16_t	index = FSM_IMAGE_NONE;
+
+		for (j=0; (j<pMap->nStates) && (pState != NULL); j++)
+		{
+			if (pMap->stateList[j] == pState)
+			{
+				index = (uint16_t)j;
+				break;
+			}
+		}
+
+		if ( (pState != NULL) && (FSM_IMAGE_NONE == index) )
+		{
+			FSM_LOG("!!!! FSM ERROR !!!! FSM %s: state %s not in the image's state list", pMap->fsmList[i]->name, pState->name);
+			return -1;
+		}
+
+		FsmImagePut(&writer, &index, sizeof(index));
+	}
+	FsmImagePad(&writer);
+
+	for (i=0; i<pMap->nFsms; i++)
+	{
+		if ( (FsmImagePutQueue(&writer, (uint32_t)i, FSM_IMAGE_DEFER_Q, pMap->fsmList[i]->deferQ) != 0)
+		  || (FsmImagePutQueue(&writer, (uint32_t)i, FSM_IMAGE_RECALL_Q, pMap->fsmList[i]->recallQ) != 0) )
+			return -1;
+	}
+
+	return FsmImageFinish(&writer, FSM_IMAGE_FSM, FsmImageLayoutFsm(pMap), (uint32_t)pMap->nFsms, 1);
+}
+
+/**************************************************************************************************/
+long FsmImageSize (const FsmImageMap *pMap)
+{
+	return FsmImageWrite(pMap, NULL, 0);
+}
+
+/**************************************************************************************************/
+long FsmImageSave (const FsmImageMap *pMap, void *pImage, size_t size)
+{
+	if ( (NULL == pImage) || (pMap->nStates >= FSM_IMAGE_NONE) )
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! no image buffer, or more than %d states", FSM_IMAGE_NONE - 1);
+		return -1;
+	}
+
+	return FsmImageWrite(pMap, pImage, size);
+}
+
+/**************************************************************************************************/
+static FsmQ * FsmImageFsmQueue (void *pContext, uint32_t owner, int which)
+{
+	Fsm		*pFsm = ((const FsmImageMap *)pContext)->fsmList[owner];
+
+	return (FSM_IMAGE_DEFER_Q == which) ? pFsm->deferQ : pFsm->recallQ;
+}
+
+/**************************************************************************************************/
+// Set every FSM's state and queues from an image. No events are dispatched.
+// The states are checked before anything is changed; if the queues can't be filled
+// (a slab or queue is too small) the FSMs are left with the queued events restored so far.
+int FsmImageRestore (const FsmImageMap *pMap, const void *pImage, size_t size)
+{
+	FsmImageReader			reader = { (const unsigned char *)pImage, size, 0, pMap->slabList, pMap->nSlabs };
+	const FsmImageHeader	*pHeader;
+	const uint16_t			*pStates;
+	int						i;
+
+	pHeader = FsmImageCheck(&reader, FSM_IMAGE_FSM, FsmImageLayoutFsm(pMap), (uint32_t)pMap->nFsms, 1);
+	if (NULL == pHeader)
+		return -1;
+
+	pStates = (const uint16_t *)FsmImageGet(&reader, FSM_IMAGE_ALIGN(pMap->nFsms * sizeof(uint16_t)));
+	if (NULL == pStates)
+		return -1;
+
+	for (i=0; i<pMap->nFsms; i++)
+	{
+		if ( (pStates[i] != FSM_IMAGE_NONE)
+		  && ( (pStates[i] >= pMap->nStates) || (pMap->stateList[pStates[i]]->pFsm != pMap->fsmList[i]) ) )
+		{
+			FSM_LOG("!!!! FSM ERROR !!!! FSM image: state %u isn't a state of FSM %s", pStates[i], pMap->fsmList[i]->name);
+			return -1;
+		}
+	}
+
+	for (i=0; i<pMap->nFsms; i++)
+	{
+		Fsm	*pFsm = pMap->fsmList[i];
+
+		pFsm->pState = (FSM_IMAGE_NONE == pStates[i]) ? NULL : pMap->stateList[pStates[i]];
+		pFsm->pPendingState = NULL;
+		FsmImageClearQueue(pFsm->deferQ);
+		FsmImageClearQueue(pFsm->recallQ);
+	}
+
+	// link the nested FSMs to their states, the active states last
+	for (i=0; i<pMap->nStates; i++)
+		FsmLinkState(pMap->stateList[i]);
+	for (i=0; i<pMap->nFsms; i++)
+	{
+		if (pMap->fsmList[i]->pState != NULL)
+			FsmLinkState(pMap->fsmList[i]->pState);
+	}
+
+	// the event interest of the restored configuration (FsmCompileInterest), from the top FSMs down
+	for (i=0; i<pMap->nFsms; i++)
+	{
+		Fsm	*pFsm = pMap->fsmList[i];
+
+		if ( pFsm->interestValid && (NULL == pFsm->pParentState) )
+			FsmUpdateInterest(pFsm);
+	}
+
+	return FsmImageGetQueues(&reader, pHeader, (uint32_t)pMap->nFsms, FsmImageFsmQueue, (void *)pMap);
+
+} // FsmImageRestore
+
+/**************************************************************************************************/
+// Instances
+/**************************************************************************************************/
+#define FSM_IMAGE_INST_AT(base,stride,i)	((FsmInst *)((base) + (size_t)(i) * (stride)))
+
+static long FsmInstImageWrite (const FsmDef *pDef, const void *pInstances, size_t stride, int count,
+							   FsmSlab **slabList, int nSlabs, void *pImage, size_t size)
+{
+	FsmImageWriter	writer = { (unsigned char *)pImage, size, sizeof(FsmImageHeader), 0, slabList, nSlabs };
+	const char		*pBase = (const char *)pInstances;
+	size_t			stateBytes = pDef->nRegions * sizeof(uint16_t);
+	int				i;
+
+	for (i=0; i<count; i++)
+	{
+		FsmInst	*pInst = FSM_IMAGE_INST_AT(pBase, stride, i);
+
+		if (pInst->pDef != pDef)
+		{
+			FSM_LOG("!!!! FSM ERROR !!!! instance %d isn't an instance of %s", i, pDef->name);
+			return -1;
+		}
+		FsmImagePut(&writer, pInst->state, stateBytes);
+	}
+	FsmImagePad(&writer);
+
+	for (i=0; i<count; i++)
+	{
+		FsmInst	*pInst = FSM_IMAGE_INST_AT(pBase, stride, i);
+
+		if ( (FsmImagePutQueue(&writer, (uint32_t)i, FSM_IMAGE_DEFER_Q, pInst->deferQ) != 0)
+		  || (FsmImagePutQueue(&writer, (uint32_t)i, FSM_IMAGE_RECALL_Q, pInst->recallQ) != 0) )
+			return -1;
+	}
+
+	return FsmImageFinish(&writer, FSM_IMAGE_INST, FsmImageLayoutInst(pDef), (uint32_t)count, pDef->nRegions);
+}
+
+/**************************************************************************************************/
+long FsmInstImageSize (const FsmDef *pDef, const void *pInstances, size_t stride, int count, FsmSlab **slabList, int nSlabs)
+{
+	return FsmInstImageWrite(pDef, pInstances, stride, count, slabList, nSlabs, NULL, 0);
+}
+
+/**************************************************************************************************/
+long FsmInstImageSave (const FsmDef *pDef, const void *pInstances, size_t stride, int count,
+					   FsmSlab **slabList, int nSlabs, void *pImage, size_t size)
+{
+	if (NULL == pImage)
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! no image buffer");
+		return -1;
+	}
+
+	return FsmInstImageWrite(pDef, pInstances, stride, count, slabList, nSlabs, pImage, size);
+}
+
+/**************************************************************************************************/
+typedef struct
+{
+	char *		pBase;
+	size_t		stride;
+} FsmImageInstances;
+
+static FsmQ * FsmImageInstQueue (void *pContext, uint32_t owner, int which)
+{
+	FsmImageInstances	*pInstances = (FsmImageInstances *)pContext;
+	FsmInst				*pInst = FSM_IMAGE_INST_AT(pInstances->pBase, pInstances->stride, owner);
+
+	return (FSM_IMAGE_DEFER_Q == which) ? pInst->deferQ : pInst->recallQ;
+}
+
+/**************************************************************************************************/
+// Set the state of every region of count instances, and their queues, from an image. No events
+// are dispatched. The states are checked before any instance is changed.
+int FsmInstImageRestore (const FsmDef *pDef, void *pInstances, size_t stride, int count,
+						 FsmSlab **slabList, int nSlabs, const void *pImage, size_t size)
+{
+	FsmImageReader			reader = { (const unsigned char *)pImage, size, 0, slabList, nSlabs };
+	FsmImageInstances		instances = { (char *)pInstances, stride };
+	const FsmImageHeader	*pHeader;
+	const uint16_t			*pStates;
+	int						nRegions = pDef->nRegions;
+	int						i;
+	int						r;
+
+	pHeader = FsmImageCheck(&reader, FSM_IMAGE_INST, FsmImageLayoutInst(pDef), (uint32_t)count, (uint32_t)nRegions);
+	if (NULL == pHeader)
+		return -1;
+
+	pStates = (const uint16_t *)FsmImageGet(&reader, FSM_IMAGE_ALIGN((size_t)count * nRegions * sizeof(uint16_t)));
+	if (NULL == pStates)
+		return -1;
+
+	for (i=0; i<count; i++)
+	{
+		for (r=0; r<nRegions; r++)
+		{
+			uint16_t	state = pStates[(size_t)i * nRegions + r];
+
+			if ( (state >= pDef->nStates) || (pDef->states[state].region != r) )
+			{
+				FSM_LOG("!!!! FSM ERROR !!!! FSM image: instance %d region %d state %u isn't in the region", i, r, state);
+				return -1;
+			}
+		}
+	}
+
+	for (i=0; i<count; i++)
+	{
+		FsmInst	*pInst = FSM_IMAGE_INST_AT(instances.pBase, stride, i);
+
+		pInst->pDef = pDef;
+		memcpy(pInst->state, &pStates[(size_t)i * nRegions], nRegions * sizeof(uint16_t));
+		if (pInst->deferQ != NULL)
+			FsmImageClearQueue(pInst->deferQ);
+		if (pInst->recallQ != NULL)
+			FsmImageClearQueue(pInst->recallQ);
+	}
+
+	return FsmImageGetQueues(&reader, pHeader, (uint32_t)count, FsmImageInstQueue, &instances);
+
+} // FsmInstImageRestore
+
+/**************************************************************************************************/
+// Files
+/**************************************************************************************************/
+const void * FsmImageMapFile (const char *path, size_t *pSize)
+{
+	struct stat	info;
+	void		*pImage;
+	int			fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! can't open FSM image %s", path);
+		return NULL;
+	}
+
+	if ( (fstat(fd, &info) != 0) || (info.st_size < (off_t)sizeof(FsmImageHeader)) )
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! FSM image %s is too short", path);
+		close(fd);
+		return NULL;
+	}
+
+	pImage = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (MAP_FAILED == pImage)
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! can't map FSM image %s", path);
+		return NULL;
+	}
+
+	*pSize = (size_t)info.st_size;
+
+	return pImage;
+}
+
+/**************************************************************************************************/
+void FsmImageUnmapFile (const void *pImage, size_t size)
+{
+	if (pImage != NULL)
+		munmap((void *)pImage, size);
+}
+
+/**************************************************************************************************/
+int FsmImageWriteFile (const char *path, const void *pImage, size_t size)
+{
+	FILE	*pFile = fopen(path, "wb");
+	int		result = 0;
+
+	if (NULL == pFile)
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! can't create FSM image %s", path);
+		return -1;
+	}
+
+	if (fwrite(pImage, 1, size, pFile) != size)
+		result = -1;
+	if (fclose(pFile) != 0)
+		result = -1;
+
+	if (result != 0)
+		FSM_LOG("!!!! FSM ERROR !!!! can't write FSM image %s", path);
+
+	return result;
+}
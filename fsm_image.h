@@ -0,0 +1,133 @@
+/*
+ *
+ * File: fsm_image.h
+ *
+ * FSM images: the active configuration of FSMs or instances saved as a binary image, and restored
+ *
+ *
+ */
+
+#ifndef _FSM_IMAGE_H_
+#define _FSM_IMAGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fsm.h"
+#include "fsm_payload.h"
+#include "fsm_def.h"
+
+/**************************************************************************************************/
+// FSM images
+/**************************************************************************************************/
+
+// An image holds the current state of every FSM (or every region of every instance) and the
+// events in their defer and recall queues, so a restarted process can pick up where it left
+// off without FsmInit and replaying events. Restoring sets the states and refills the queues;
+// it doesn't run Entry or Exit actions. Timers aren't in the image; arm them again after restoring.
+//
+// States are saved as indices. For Fsm/FsmState machines the application lists its FSMs and
+// states in an FsmImageMap, and the indices are positions in those lists, so keep the lists
+// in a fixed order. FsmInst instances already use the state indices of their FsmDef.
+//
+//       static Fsm *		fsmList[] = { &fsm_Top, &fsm_Nested1, &fsm_Nested2 };
+//       static FsmState *	stateList[] = { &state_Top1, &state_Top2, &state_Nested1_1, ... };
+//       static FsmSlab *	slabList[] = { &slab_Msg };
+//       static const FsmImageMap	map = FSM_IMAGE_MAP_PAYLOADS(fsmList, stateList, slabList);
+//       ...
+//       size = FsmImageSave(&map, pBuffer, bufferSize);
+//       ...
+//       FsmImageRestore(&map, pImage, size);
+//
+// Queued payloads are saved as their data bytes and restored into a new block from the same
+// slab, so they must not hold pointers. Their slabs must be in the map's slab list
+// (FSM_IMAGE_MAP for machines that don't queue payloads).
+//
+// The image is a flat, versioned block with no pointers, in native byte order:
+//       header:   FsmImageHeader
+//       states:   uint16 per FSM (per region of each instance), FSM_IMAGE_NONE if none,
+//                 padded to 4 bytes
+//       queues:   FsmImageQueue records, each followed by its events: FsmImageEvent, then the
+//                 payload data (padded to 4 bytes) if it has one
+// The layout field is a hash of the FSM, state and region names, so an image is only restored
+// into the machine it was saved from. Restore reads the image in place, so it can be restored
+// straight from a file mapped with FsmImageMapFile. For instances the states are copied a
+// region array at a time.
+
+#define FSM_IMAGE_MAGIC			"FSMIMAGE"
+#define FSM_IMAGE_VERSION		1
+
+#define FSM_IMAGE_FSM			1		// image kinds
+#define FSM_IMAGE_INST			2
+
+#define FSM_IMAGE_DEFER_Q		0		// FsmImageQueue which
+#define FSM_IMAGE_RECALL_Q		1
+
+#define FSM_IMAGE_NONE			0xFFFF	// no state, no payload
+
+typedef struct
+{
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	kind;
+	uint32_t	layout;		// hash of the FSM, state and region names
+	uint32_t	count;		// FSMs or instances
+	uint32_t	width;		// states per FSM (1) or instance (regions)
+	uint32_t	queues;		// FsmImageQueue records
+	uint64_t	size;		// image bytes, header included
+} FsmImageHeader;
+
+typedef struct
+{
+	uint32_t	owner;		// FSM or instance index
+	uint16_t	which;		// FSM_IMAGE_DEFER_Q or FSM_IMAGE_RECALL_Q
+	uint16_t	count;		// events
+} FsmImageQueue;
+
+typedef struct
+{
+	int32_t		eventId;
+	uint16_t	slab;		// index in the slab list, FSM_IMAGE_NONE if no payload
+	uint16_t	length;		// payload bytes
+} FsmImageEvent;
+
+typedef struct
+{
+	Fsm **			fsmList;
+	int				nFsms;
+	FsmState **		stateList;
+	int				nStates;
+	FsmSlab **		slabList;		// slabs of queued payloads, NULL if none
+	int				nSlabs;
+} FsmImageMap;
+
+#define FSM_IMAGE_ARRAY_COUNT(a)	((int)(sizeof(a)/sizeof((a)[0])))
+
+#define FSM_IMAGE_MAP(fsm_list,state_list)											\
+	{ (fsm_list), FSM_IMAGE_ARRAY_COUNT(fsm_list), (state_list), FSM_IMAGE_ARRAY_COUNT(state_list), NULL, 0 }
+
+#define FSM_IMAGE_MAP_PAYLOADS(fsm_list,state_list,slab_list)						\
+	{ (fsm_list), FSM_IMAGE_ARRAY_COUNT(fsm_list), (state_list), FSM_IMAGE_ARRAY_COUNT(state_list),	\
+	  (slab_list), FSM_IMAGE_ARRAY_COUNT(slab_list) }
+
+// Fsm/FsmState machines. Save returns the image size, or -1 (and logs) if it doesn't fit
+// in size bytes or a state isn't in the map. FsmImageSize is the size the image would be now.
+long	FsmImageSize (const FsmImageMap *pMap);
+long	FsmImageSave (const FsmImageMap *pMap, void *pImage, size_t size);
+int		FsmImageRestore (const FsmImageMap *pMap, const void *pImage, size_t size);	// returns -1 if the image doesn't fit the map
+
+// count instances of pDef, stride bytes apart (FSM_INST_SIZE for a packed array).
+// Restore sets pDef and the states of each instance; set each instance's deferQ, recallQ and
+// pContext before restoring, its queues are emptied and refilled from the image.
+long	FsmInstImageSize (const FsmDef *pDef, const void *pInstances, size_t stride, int count, FsmSlab **slabList, int nSlabs);
+long	FsmInstImageSave (const FsmDef *pDef, const void *pInstances, size_t stride, int count,
+						  FsmSlab **slabList, int nSlabs, void *pImage, size_t size);
+int		FsmInstImageRestore (const FsmDef *pDef, void *pInstances, size_t stride, int count,
+							 FsmSlab **slabList, int nSlabs, const void *pImage, size_t size);
+
+// Map an image file read-only. Returns NULL (and logs) if it can't be mapped.
+const void *	FsmImageMapFile (const char *path, size_t *pSize);
+void			FsmImageUnmapFile (const void *pImage, size_t size);
+int				FsmImageWriteFile (const char *path, const void *pImage, size_t size);	// returns -1 on error
+
+#endif // _FSM_IMAGE_H_
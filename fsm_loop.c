@@ -0,0 +1,445 @@
+/*
+ *
+ * File: fsm_loop.c
+ *
+ * Linux event loop: a thread that runs FSMs from their mailboxes, file descriptors and timers
+ *
+ *
+ */
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "fsm_loop.h"
+
+#define FSM_LOOP_EPOLL_EVENTS	64		// descriptors taken per epoll_wait
+#define FSM_POST_SPIN			64		// busy retries before FsmLoopPostWait starts yielding the CPU
+
+/**************************************************************************************************/
+static uint64_t FsmLoopClockNs (void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/**************************************************************************************************/
+static int FsmLoopEpollAdd (FsmLoop *pLoop, int fd, uint32_t events)
+{
+	struct epoll_event	ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = fd;
+
+	if (epoll_ctl(pLoop->epollFd, EPOLL_CTL_ADD, fd, &ev) != 0)
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! loop can't watch fd %d: %s", fd, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/**************************************************************************************************/
+// tickNs is the length of a wheel tick; the wheel's current tick is taken to be now.
+// Returns -1 (and logs) if the loop's descriptors can't be created.
+int FsmLoopInit (FsmLoop *pLoop, FsmTimerWheel *pWheel, uint64_t tickNs)
+{
+	memset(pLoop, 0, sizeof(FsmLoop));
+
+	pLoop->wakeFd = -1;
+	pLoop->timerFd = -1;
+	pLoop->pWheel = pWheel;
+	pLoop->tickNs = (tickNs > 0) ? tickNs : 1;
+	pLoop->timerArmed = FSM_TIMER_NEVER;
+	pLoop->startNs = FsmLoopClockNs();
+	if (pWheel != NULL)
+		pLoop->startNs -= pWheel->now * pLoop->tickNs;
+
+	atomic_init(&pLoop->run, true);		// FsmLoopRun doesn't set it, so a stop before it runs isn't lost
+	atomic_init(&pLoop->sleeping, 0);
+
+	pLoop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+	if (pLoop->epollFd < 0)
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! loop epoll: %s", strerror(errno));
+		return -1;
+	}
+
+	pLoop->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if ( (pLoop->wakeFd < 0) || (FsmLoopEpollAdd(pLoop, pLoop->wakeFd, EPOLLIN) != 0) )
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! loop eventfd: %s", strerror(errno));
+		FsmLoopClose(pLoop);
+		return -1;
+	}
+
+	if (pWheel != NULL)
+	{
+		pLoop->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if ( (pLoop->timerFd < 0) || (FsmLoopEpollAdd(pLoop, pLoop->timerFd, EPOLLIN) != 0) )
+		{
+			FSM_LOG("!!!! FSM ERROR !!!! loop timerfd: %s", strerror(errno));
+			FsmLoopClose(pLoop);
+			return -1;
+		}
+	}
+
+	return 0;
+
+} // FsmLoopInit
+
+/**************************************************************************************************/
+// Closes the loop's own descriptors, not the watched ones
+void FsmLoopClose (FsmLoop *pLoop)
+{
+	if (pLoop->timerFd >= 0)
+		close(pLoop->timerFd);
+	if (pLoop->wakeFd >= 0)
+		close(pLoop->wakeFd);
+	if (pLoop->epollFd >= 0)
+		close(pLoop->epollFd);
+
+	pLoop->timerFd = -1;
+	pLoop->wakeFd = -1;
+	pLoop->epollFd = -1;
+}
+
+/**************************************************************************************************/
+// Add an FSM before the loop runs. Its mailbox is drained by the loop thread.
+int FsmLoopAdd (FsmLoop *pLoop, Fsm *pFsm)
+{
+	if (NULL == pFsm->mailbox)
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! FSM %s: no mailbox", pFsm->name);
+		return -1;
+	}
+
+	if (pLoop->nFsms >= FSM_LOOP_MAX_FSMS)
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! loop is full, can't add FSM %s", pFsm->name);
+		return -1;
+	}
+
+	pLoop->fsm[pLoop->nFsms++] = pFsm;
+
+	return 0;
+}
+
+/**************************************************************************************************/
+// Call handler on the loop thread each time fd has one of events (EPOLLIN, EPOLLOUT, ...).
+// Level triggered: the handler is called again on the next pass if it leaves data unread.
+int FsmLoopWatch (FsmLoop *pLoop, int fd, uint32_t events, FsmLoopFdHandler handler, void *pContext)
+{
+	FsmLoopWatcher	*pWatcher;
+
+	if (pLoop->nWatchers >= FSM_LOOP_MAX_FDS)
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! loop is full, can't watch fd %d", fd);
+		return -1;
+	}
+
+	if (FsmLoopEpollAdd(pLoop, fd, events) != 0)
+		return -1;
+
+	pWatcher = &pLoop->watcher[pLoop->nWatchers++];
+	pWatcher->fd = fd;
+	pWatcher->handler = handler;
+	pWatcher->pContext = pContext;
+
+	return 0;
+}
+
+/**************************************************************************************************/
+static FsmLoopWatcher * FsmLoopFindWatcher (FsmLoop *pLoop, int fd)
+{
+	int	i;
+
+	for (i=0; i<pLoop->nWatchers; i++)
+		if (pLoop->watcher[i].fd == fd)
+			return &pLoop->watcher[i];
+
+	return NULL;
+}
+
+/**************************************************************************************************/
+// Stop watching fd. Call before closing it. Returns -1 if fd isn't watched.
+int FsmLoopUnwatch (FsmLoop *pLoop, int fd)
+{
+	FsmLoopWatcher	*pWatcher = FsmLoopFindWatcher(pLoop, fd);
+
+	if (NULL == pWatcher)
+		return -1;
+
+	epoll_ctl(pLoop->epollFd, EPOLL_CTL_DEL, fd, NULL);
+	*pWatcher = pLoop->watcher[--pLoop->nWatchers];
+
+	return 0;
+}
+
+/**************************************************************************************************/
+uint64_t FsmLoopNow (const FsmLoop *pLoop)
+{
+	return (FsmLoopClockNs() - pLoop->startNs) / pLoop->tickNs;
+}
+
+/**************************************************************************************************/
+// Wake the loop if it is asleep. The fence pairs with the one in FsmLoopIdle: either the loop
+// sees the event in the mailbox, or the poster sees the loop asleep. Only the poster that
+// clears sleeping writes the eventfd.
+static void FsmLoopWake (FsmLoop *pLoop)
+{
+	uint64_t	one = 1;
+
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if ( (0 == atomic_load_explicit(&pLoop->sleeping, memory_order_relaxed)) ||
+		 (0 == atomic_exchange_explicit(&pLoop->sleeping, 0, memory_order_relaxed)) )
+		return;
+
+	if (write(pLoop->wakeFd, &one, sizeof(one)) != sizeof(one))
+		FSM_LOG("!!!! FSM ERROR !!!! loop wakeup: %s", strerror(errno));
+
+	atomic_fetch_add_explicit(&pLoop->signals, 1, memory_order_relaxed);
+}
+
+/**************************************************************************************************/
+// Post an event to one of the loop's FSMs from any thread.
+// Returns -1 if the FSM has no mailbox or the mailbox is full, else 0
+int FsmLoopPost (FsmLoop *pLoop, Fsm *pFsm, int eventId)
+{
+	return FsmLoopPostData(pLoop, pFsm, eventId, NULL);
+}
+
+/**************************************************************************************************/
+// On success the mailbox takes over the caller's reference to the payload
+int FsmLoopPostData (FsmLoop *pLoop, Fsm *pFsm, int eventId, FsmPayload *pPayload)
+{
+	if (FsmPostData(pFsm, eventId, pPayload) != 0)
+		return -1;
+
+	FsmLoopWake(pLoop);
+
+	return 0;
+}
+
+/**************************************************************************************************/
+// Never call this from the loop thread: only the loop makes room in the mailbox.
+int FsmLoopPostWait (FsmLoop *pLoop, Fsm *pFsm, int eventId)
+{
+	int	spin = 0;
+
+	if (NULL == pFsm->mailbox)
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! FSM %s: no mailbox", pFsm->name);
+		return -1;
+	}
+
+	while (FsmMailboxPut(pFsm->mailbox, eventId) != 0)
+	{
+		// the loop may be asleep on an earlier post that hasn't woken it yet
+		FsmLoopWake(pLoop);
+
+		if (spin < FSM_POST_SPIN)
+			spin++;
+		else
+			sched_yield();
+	}
+
+	FsmLoopWake(pLoop);
+
+	return 0;
+}
+
+/**************************************************************************************************/
+// Any thread. FsmLoopRun returns after its current pass, or after its first one if the loop
+// thread hasn't got to it yet. The loop stays stopped until FsmLoopInit.
+void FsmLoopStop (FsmLoop *pLoop)
+{
+	uint64_t	one = 1;
+
+	atomic_store_explicit(&pLoop->run, false, memory_order_release);
+
+	if (write(pLoop->wakeFd, &one, sizeof(one)) != sizeof(one))
+		FSM_LOG("!!!! FSM ERROR !!!! loop wakeup: %s", strerror(errno));
+}
+
+/**************************************************************************************************/
+// Drain the mailboxes, FSM_LOOP_BUDGET events per FSM at a time so one busy FSM doesn't hold
+// up the others, until a round finds them all empty. Returns the number of events run.
+static uint64_t FsmLoopDrain (FsmLoop *pLoop)
+{
+	uint64_t	total = 0;
+	int			count;
+	int			i;
+
+	do
+	{
+		count = 0;
+		for (i=0; i<pLoop->nFsms; i++)
+			count += FsmDrain(pLoop->fsm[i], FSM_LOOP_BUDGET);
+		total += (uint64_t)count;
+
+	} while (count > 0);
+
+	return total;
+}
+
+/**************************************************************************************************/
+// Run the timers that are due and arm the timerfd for the next one. The timerfd is only
+// reset when the next expiry moves.
+static void FsmLoopTimers (FsmLoop *pLoop)
+{
+	FsmTimerWheel		*pWheel = pLoop->pWheel;
+	struct itimerspec	its;
+	uint64_t			next;
+	uint64_t			ns;
+	int					expired;
+
+	if (NULL == pWheel)
+		return;
+
+	expired = FsmTimerAdvanceTo(pWheel, FsmLoopNow(pLoop));
+	if (expired > 0)
+		atomic_fetch_add_explicit(&pLoop->timers, (uint64_t)expired, memory_order_relaxed);
+
+	next = FsmTimerNextExpiry(pWheel);
+	if (next != FSM_TIMER_NEVER)
+		next += pWheel->now;
+
+	if (next == pLoop->timerArmed)
+		return;
+
+	memset(&its, 0, sizeof(its));
+	if (next != FSM_TIMER_NEVER)
+	{
+		ns = pLoop->startNs + next * pLoop->tickNs;
+		its.it_value.tv_sec = (time_t)(ns / 1000000000ull);
+		its.it_value.tv_nsec = (long)(ns % 1000000000ull);
+	}
+
+	if (timerfd_settime(pLoop->timerFd, TFD_TIMER_ABSTIME, &its, NULL) != 0)
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! loop timerfd: %s", strerror(errno));
+		return;
+	}
+
+	pLoop->timerArmed = next;
+
+} // FsmLoopTimers
+
+/**************************************************************************************************/
+// Tell posters the loop is about to sleep, then look at the mailboxes once more.
+// Returns true if the loop can sleep.
+static bool FsmLoopIdle (FsmLoop *pLoop)
+{
+	int	i;
+
+	atomic_store_explicit(&pLoop->sleeping, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (!atomic_load_explicit(&pLoop->run, memory_order_acquire))
+		goto busy;
+
+	for (i=0; i<pLoop->nFsms; i++)
+		if (FsmMailboxCount(pLoop->fsm[i]->mailbox) > 0)
+			goto busy;
+
+	return true;
+
+busy:
+	atomic_store_explicit(&pLoop->sleeping, 0, memory_order_relaxed);
+	return false;
+}
+
+/**************************************************************************************************/
+// One read of an eventfd or timerfd clears all the posts (or expiries) since the last one
+static void FsmLoopClear (int fd)
+{
+	uint64_t	value;
+
+	if (read(fd, &value, sizeof(value)) != sizeof(value))
+		return;		// already cleared
+}
+
+/**************************************************************************************************/
+// The loop thread's body. Runs until FsmLoopStop; returns -1 if epoll fails.
+int FsmLoopRun (FsmLoop *pLoop)
+{
+	struct epoll_event	ev[FSM_LOOP_EPOLL_EVENTS];
+	uint64_t			count;
+	int					n;
+	int					i;
+
+	while (true)
+	{
+		count = FsmLoopDrain(pLoop);
+		FsmLoopTimers(pLoop);
+
+		atomic_fetch_add_explicit(&pLoop->passes, 1, memory_order_relaxed);
+		if (count > 0)
+			atomic_fetch_add_explicit(&pLoop->events, count, memory_order_relaxed);
+
+		if (!atomic_load_explicit(&pLoop->run, memory_order_acquire))
+			break;
+
+		if (!FsmLoopIdle(pLoop))
+			continue;
+
+		n = epoll_wait(pLoop->epollFd, ev, FSM_LOOP_EPOLL_EVENTS, -1);
+
+		atomic_store_explicit(&pLoop->sleeping, 0, memory_order_relaxed);
+		atomic_fetch_add_explicit(&pLoop->wakeups, 1, memory_order_relaxed);
+
+		if (n < 0)
+		{
+			if (EINTR == errno)
+				continue;
+
+			FSM_LOG("!!!! FSM ERROR !!!! loop epoll_wait: %s", strerror(errno));
+			return -1;
+		}
+
+		for (i=0; i<n; i++)
+		{
+			int				fd = ev[i].data.fd;
+			FsmLoopWatcher	*pWatcher;
+
+			if ( (fd == pLoop->wakeFd) || (fd == pLoop->timerFd) )
+			{
+				FsmLoopClear(fd);
+				continue;
+			}
+
+			pWatcher = FsmLoopFindWatcher(pLoop, fd);
+			if (NULL == pWatcher)
+				continue;		// unwatched by an earlier handler in this batch
+
+			pWatcher->handler(pLoop, fd, ev[i].events, pWatcher->pContext);
+			atomic_fetch_add_explicit(&pLoop->fdEvents, 1, memory_order_relaxed);
+		}
+	}
+
+	return 0;
+
+} // FsmLoopRun
+
+/**************************************************************************************************/
+void FsmLoopGetStats (FsmLoop *pLoop, FsmLoopStats *pStats)
+{
+	pStats->events = atomic_load_explicit(&pLoop->events, memory_order_relaxed);
+	pStats->passes = atomic_load_explicit(&pLoop->passes, memory_order_relaxed);
+	pStats->wakeups = atomic_load_explicit(&pLoop->wakeups, memory_order_relaxed);
+	pStats->signals = atomic_load_explicit(&pLoop->signals, memory_order_relaxed);
+	pStats->timers = atomic_load_explicit(&pLoop->timers, memory_order_relaxed);
+	pStats->fdEvents = atomic_load_explicit(&pLoop->fdEvents, memory_order_relaxed);
+}
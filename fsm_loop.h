@@ -0,0 +1,126 @@
+/*
+ *
+ * File: fsm_loop.h
+ *
+ * Linux event loop: a thread that runs FSMs from their mailboxes, file descriptors and timers
+ *
+ *
+ */
+
+#ifndef _FSM_LOOP_H_
+#define _FSM_LOOP_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "fsm.h"
+#include "fsm_mailbox.h"
+#include "fsm_timer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**************************************************************************************************/
+// FSM event loop
+/**************************************************************************************************/
+
+// An event loop is the body of a thread that owns some FSMs. It sleeps in epoll_wait until one
+// of its FSMs is posted to, a watched file descriptor is ready, or a timer on its wheel is due,
+// then runs everything that is ready before it sleeps again:
+//
+//       FSM_MAILBOX(mailbox_Top, 256);
+//       FsmLoop         loop_Top;
+//       FsmTimerWheel   timerWheel;
+//       ...
+//       FSM_MAILBOX_INIT(mailbox_Top);
+//       fsm_Top.mailbox = (FsmMailbox *)&mailbox_Top;
+//       FsmTimerWheelInit(&timerWheel);
+//       FsmLoopInit(&loop_Top, &timerWheel, 1000000);	// 1 ms ticks
+//       FsmLoopAdd(&loop_Top, &fsm_Top);
+//       FsmLoopWatch(&loop_Top, sock, EPOLLIN, SocketReady, pContext);
+//       ...
+//       FsmLoopRun(&loop_Top);						// on the FSM thread, until FsmLoopStop
+//       ...
+//       FsmLoopPost(&loop_Top, &fsm_Top, EVT_1);		// from any thread
+//
+// Posts from other threads go through the FSM's mailbox. The loop only needs waking when it is
+// asleep: it says so before it sleeps, and a post writes the loop's eventfd only if it finds the
+// loop asleep. A loop that is busy picks up new posts on its next pass without a system call, so
+// under load there are far fewer wakeups than events (FsmLoopStats).
+//
+// Each pass drains the mailboxes round robin, FSM_LOOP_BUDGET events per FSM at a time, until
+// they are all empty. Watched descriptors call their handler on the loop thread; the handler
+// reads the descriptor and runs events on the loop's FSMs with FsmRun. The timer wheel is
+// advanced from CLOCK_MONOTONIC on each pass and a timerfd is armed for FsmTimerNextExpiry, so
+// FsmTimerArm/FsmTimerPost timers run on the loop thread.
+//
+// Requires Linux (epoll, eventfd, timerfd) and C11 atomics.
+
+#define FSM_LOOP_MAX_FSMS	64			// FSMs per loop
+#define FSM_LOOP_MAX_FDS	64			// watched descriptors per loop
+#define FSM_LOOP_BUDGET		64			// events per FSM before the loop moves to the next one
+
+typedef struct FsmLoop FsmLoop;
+
+typedef void (*FsmLoopFdHandler)(FsmLoop *pLoop, int fd, uint32_t events, void *pContext);
+
+// Loop counters, written by the loop thread (FsmLoopGetStats reads them from any thread)
+typedef struct
+{
+	uint64_t	events;			// mailbox events run
+	uint64_t	passes;			// times the loop drained its mailboxes
+	uint64_t	wakeups;		// times the loop slept and woke up
+	uint64_t	signals;		// eventfd writes by posting threads
+	uint64_t	timers;			// timers that expired
+	uint64_t	fdEvents;		// watched descriptor handler calls
+} FsmLoopStats;
+
+typedef struct
+{
+	int					fd;
+	FsmLoopFdHandler	handler;
+	void *				pContext;
+} FsmLoopWatcher;
+
+struct FsmLoop
+{
+	int					epollFd;
+	int					wakeFd;			// eventfd, written by posts to a sleeping loop
+	int					timerFd;		// timerfd for the next timer wheel expiry
+	FsmTimerWheel *		pWheel;			// NULL if the loop has no timers
+	uint64_t			tickNs;			// nanoseconds per wheel tick
+	uint64_t			startNs;		// CLOCK_MONOTONIC time of wheel tick 0
+	uint64_t			timerArmed;		// wheel tick the timerfd is armed for, FSM_TIMER_NEVER if none
+	int					nFsms;
+	Fsm *				fsm[FSM_LOOP_MAX_FSMS];
+	int					nWatchers;
+	FsmLoopWatcher		watcher[FSM_LOOP_MAX_FDS];
+	atomic_bool			run;
+	_Alignas(FSM_CACHE_LINE) atomic_int		sleeping;	// loop is in, or about to be in, epoll_wait
+	atomic_uint_least64_t	signals;
+	_Alignas(FSM_CACHE_LINE) atomic_uint_least64_t	events;
+	atomic_uint_least64_t	passes;
+	atomic_uint_least64_t	wakeups;
+	atomic_uint_least64_t	timers;
+	atomic_uint_least64_t	fdEvents;
+};
+
+int  FsmLoopInit (FsmLoop *pLoop, FsmTimerWheel *pWheel, uint64_t tickNs);	// pWheel NULL: no timers. Returns -1 on error
+void FsmLoopClose (FsmLoop *pLoop);
+int  FsmLoopAdd (FsmLoop *pLoop, Fsm *pFsm);		// FSM must have a mailbox. Returns -1 on error
+int  FsmLoopWatch (FsmLoop *pLoop, int fd, uint32_t events, FsmLoopFdHandler handler, void *pContext);	// EPOLLxxx events
+int  FsmLoopUnwatch (FsmLoop *pLoop, int fd);		// loop thread only
+int  FsmLoopRun (FsmLoop *pLoop);					// returns when stopped, -1 on error
+void FsmLoopStop (FsmLoop *pLoop);					// any thread
+int  FsmLoopPost (FsmLoop *pLoop, Fsm *pFsm, int eventId);		// any thread, returns -1 if the mailbox is full
+int  FsmLoopPostData (FsmLoop *pLoop, Fsm *pFsm, int eventId, FsmPayload *pPayload);	// mailbox takes the reference
+int  FsmLoopPostWait (FsmLoop *pLoop, Fsm *pFsm, int eventId);	// waits for room in the mailbox
+uint64_t FsmLoopNow (const FsmLoop *pLoop);			// current wheel tick by the loop's clock
+void FsmLoopGetStats (FsmLoop *pLoop, FsmLoopStats *pStats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _FSM_LOOP_H_
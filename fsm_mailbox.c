@@ -0,0 +1,217 @@
+/*
+ *
+ * File: fsm_mailbox.c
+ *
+ * Lock-free multi-producer / single-consumer FSM mailbox
+ *
+ *
+ */
+#include <sched.h>
+
+#include "fsm_mailbox.h"
+
+#define FSM_POST_SPIN	64		// busy retries before FsmPostWait starts yielding the CPU
+
+/**************************************************************************************************/
+// size must be a power of 2
+// Returns -1 if it isn't, else 0
+int FsmMailboxInit (FsmMailbox *pMb, int size)
+{
+	int	i;
+
+	if ( (size <= 0) || (size & (size - 1)) )
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! mailbox size %d is not a power of 2", size);
+		return -1;
+	}
+
+	pMb->mask = (size_t)size - 1;
+
+	for (i=0; i<size; i++)
+		atomic_init(&pMb->cell[i].seq, (size_t)i);
+
+	atomic_init(&pMb->tail, 0);
+	atomic_init(&pMb->head, 0);
+
+	return 0;
+}
+
+/**************************************************************************************************/
+// Put an event in a mailbox. Safe to call from any thread.
+// Returns -1 if the mailbox is full, else 0
+int FsmMailboxPut (FsmMailbox *pMb, int eventId)
+{
+	return FsmMailboxPutData(pMb, eventId, NULL);
+}
+
+/**************************************************************************************************/
+// Put an event and its payload in a mailbox. Safe to call from any thread.
+// On success the mailbox takes over the caller's reference to the payload.
+// Returns -1 if the mailbox is full, else 0
+int FsmMailboxPutData (FsmMailbox *pMb, int eventId, FsmPayload *pPayload)
+{
+	FsmMailboxCell	*pCell;
+	size_t			pos;
+	size_t			seq;
+
+	if (EVT_FSM_NULL == eventId)	// no event
+		return 0;
+
+	pos = atomic_load_explicit(&pMb->tail, memory_order_relaxed);
+
+	for (;;)
+	{
+		pCell = &pMb->cell[pos & pMb->mask];
+		seq = atomic_load_explicit(&pCell->seq, memory_order_acquire);
+
+		if (seq == pos)		// slot is free, try to claim it
+		{
+			if (atomic_compare_exchange_weak_explicit(&pMb->tail, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		else if ((ptrdiff_t)(seq - pos) < 0)	// slot still holds an event from the last lap
+			return -1;
+		else
+			pos = atomic_load_explicit(&pMb->tail, memory_order_relaxed);
+	}
+
+	pCell->eventId = eventId;
+	pCell->pPayload = pPayload;
+	atomic_store_explicit(&pCell->seq, pos + 1, memory_order_release);
+
+	return 0;
+
+} // FsmMailboxPutData
+
+/**************************************************************************************************/
+// Retrieve an event from a mailbox. Only the thread running the FSM may call this.
+// returns EVT_FSM_NULL if the mailbox is empty, else the next eventId
+int FsmMailboxGet (FsmMailbox *pMb)
+{
+	FsmPayload	*pPayload;
+	int			eventId = FsmMailboxGetData(pMb, &pPayload);
+
+	if (pPayload != NULL)
+		FsmPayloadRelease(pPayload);
+
+	return eventId;
+}
+
+/**************************************************************************************************/
+// Retrieve an event and its payload from a mailbox. The caller gets the mailbox's reference.
+// Only the thread running the FSM may call this.
+// returns EVT_FSM_NULL if the mailbox is empty, else the next eventId
+int FsmMailboxGetData (FsmMailbox *pMb, FsmPayload **ppPayload)
+{
+	FsmMailboxCell	*pCell;
+	size_t			pos;
+	int				eventId;
+
+	*ppPayload = NULL;
+
+	pos = atomic_load_explicit(&pMb->head, memory_order_relaxed);
+	pCell = &pMb->cell[pos & pMb->mask];
+
+	if (atomic_load_explicit(&pCell->seq, memory_order_acquire) != pos + 1)
+		return EVT_FSM_NULL;
+
+	eventId = pCell->eventId;
+	*ppPayload = pCell->pPayload;
+	atomic_store_explicit(&pCell->seq, pos + pMb->mask + 1, memory_order_release);
+	atomic_store_explicit(&pMb->head, pos + 1, memory_order_relaxed);
+
+	return eventId;
+
+} // FsmMailboxGetData
+
+/**************************************************************************************************/
+int FsmMailboxCount (FsmMailbox *pMb)
+{
+	size_t	tail = atomic_load_explicit(&pMb->tail, memory_order_relaxed);
+	size_t	head = atomic_load_explicit(&pMb->head, memory_order_relaxed);
+
+	return (int)(tail - head);
+}
+
+/**************************************************************************************************/
+// Post an event to an FSM from any thread.
+// Returns -1 if the FSM has no mailbox or the mailbox is full, else 0
+int FsmPost (Fsm *pFsm, int eventId)
+{
+	if (NULL == pFsm->mailbox)
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! FSM %s: no mailbox", pFsm->name);
+		return -1;
+	}
+
+	return FsmMailboxPut(pFsm->mailbox, eventId);
+}
+
+/**************************************************************************************************/
+// Post an event with a payload to an FSM from any thread.
+// On success the mailbox takes over the caller's reference to the payload.
+// Returns -1 if the FSM has no mailbox or the mailbox is full, else 0
+int FsmPostData (Fsm *pFsm, int eventId, FsmPayload *pPayload)
+{
+	if (NULL == pFsm->mailbox)
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! FSM %s: no mailbox", pFsm->name);
+		return -1;
+	}
+
+	return FsmMailboxPutData(pFsm->mailbox, eventId, pPayload);
+}
+
+/**************************************************************************************************/
+// Post an event to an FSM from any thread, waiting for room if the mailbox is full.
+// Never call this from the thread that drains the mailbox.
+int FsmPostWait (Fsm *pFsm, int eventId)
+{
+	int	spin = 0;
+
+	if (NULL == pFsm->mailbox)
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! FSM %s: no mailbox", pFsm->name);
+		return -1;
+	}
+
+	while (FsmMailboxPut(pFsm->mailbox, eventId) != 0)
+	{
+		if (spin < FSM_POST_SPIN)
+			spin++;
+		else
+			sched_yield();
+	}
+
+	return 0;
+}
+
+/**************************************************************************************************/
+// Run the events waiting in an FSM's mailbox. Call this from the thread that runs the FSM.
+// Processes at most maxEvents events (all available events if maxEvents <= 0).
+// Returns the number of events processed.
+int FsmDrain (Fsm *pFsm, int maxEvents)
+{
+	int			eventId;
+	int			count = 0;
+	FsmPayload	*pPayload;
+
+	if (NULL == pFsm->mailbox)
+		return 0;
+
+	while ( (maxEvents <= 0) || (count < maxEvents) )
+	{
+		eventId = FsmMailboxGetData(pFsm->mailbox, &pPayload);
+		if (EVT_FSM_NULL == eventId)
+			break;
+
+		FsmRunData(FsmTop(pFsm), eventId, pPayload);
+		if (pPayload != NULL)
+			FsmPayloadRelease(pPayload);
+		count++;
+	}
+
+	return count;
+
+} // FsmDrain
@@ -0,0 +1,78 @@
+/*
+ *
+ * File: fsm_mailbox.h
+ *
+ * Lock-free multi-producer / single-consumer FSM mailbox
+ *
+ *
+ */
+
+#ifndef _FSM_MAILBOX_H_
+#define _FSM_MAILBOX_H_
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "fsm.h"
+
+/**************************************************************************************************/
+// FSM mailbox
+/**************************************************************************************************/
+
+// The FsmQ event queues are not synchronized and may only be used by the thread running the FSM.
+// A mailbox is a bounded queue that any number of threads can post to while the FSM thread
+// drains it. Attach one to an Fsm, then use FsmPost/FsmPostWait from the producers and FsmDrain
+// from the FSM thread. FsmDrain runs the events on the top level FSM above it (FsmTop), so a
+// mailbox can be attached to a nested FSM:
+//
+//       FSM_MAILBOX(mailbox_Top, 256);		// size must be a power of 2
+//       ...
+//       FSM_MAILBOX_INIT(mailbox_Top);
+//       fsm_Top.mailbox = (FsmMailbox *)&mailbox_Top;
+//
+// Each slot carries a sequence number (Vyukov's bounded queue). Producers claim a slot with a
+// compare-and-swap on the tail, the consumer owns the head. The head and tail are on separate
+// cache lines so producers don't bounce the consumer's line.
+//
+// Requires C11 atomics.
+
+#ifndef FSM_CACHE_LINE
+	#define FSM_CACHE_LINE	64
+#endif
+
+typedef struct FsmMailboxCell
+{
+	atomic_size_t	seq;
+	int				eventId;
+	FsmPayload *	pPayload;
+} FsmMailboxCell;
+
+#define FSM_MAILBOX_FIELDS										\
+	size_t									mask;		\
+	_Alignas(FSM_CACHE_LINE) atomic_size_t	tail;		\
+	_Alignas(FSM_CACHE_LINE) atomic_size_t	head;
+
+struct FsmMailbox
+{
+	FSM_MAILBOX_FIELDS
+	_Alignas(FSM_CACHE_LINE) FsmMailboxCell	cell[];
+};
+
+// ... Mailbox objects
+#define FSM_MAILBOX(obj,mbsize)										\
+	struct obj##_tag {												\
+		FSM_STATIC_ASSERT(((mbsize) > 0) && (((mbsize) & ((mbsize) - 1)) == 0), mailbox_size_not_power_of_2);	\
+		FSM_MAILBOX_FIELDS											\
+		_Alignas(FSM_CACHE_LINE) FsmMailboxCell	cell[mbsize];		\
+	} obj
+
+#define FSM_MAILBOX_INIT(obj)	FsmMailboxInit((FsmMailbox *)&obj, sizeof(obj.cell)/sizeof(obj.cell[0]))
+
+int  FsmMailboxInit (FsmMailbox *pMb, int size);	// returns -1 if size isn't a power of 2
+int  FsmMailboxPut (FsmMailbox *pMb, int eventId);	// any thread, returns -1 if full
+int  FsmMailboxGet (FsmMailbox *pMb);				// consumer only, EVT_FSM_NULL if empty
+int  FsmMailboxPutData (FsmMailbox *pMb, int eventId, FsmPayload *pPayload);
+int  FsmMailboxGetData (FsmMailbox *pMb, FsmPayload **ppPayload);
+int  FsmMailboxCount (FsmMailbox *pMb);				// approximate when producers are active
+
+#endif // _FSM_MAILBOX_H_
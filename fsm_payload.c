@@ -0,0 +1,127 @@
+/*
+ *
+ * File: fsm_payload.c
+ *
+ * Reference counted event payloads allocated from fixed size slabs
+ *
+ *
+ */
+#include "fsm_payload.h"
+
+#define FSM_SLAB_BLOCK(pSlab,i)	((FsmPayload *)((pSlab)->pool + (size_t)(i) * (pSlab)->blockSize))
+
+#define FSM_SLAB_TAG(head)		((head) >> 32)
+#define FSM_SLAB_INDEX(head)	((int)((head) & 0xFFFFFFFFu))	// index+1, 0 if list empty
+
+// Atomic operations on the FsmAtomicInt and FsmAtomic64 fields. The Interlocked intrinsics are
+// full barriers, and volatile loads and stores have acquire and release semantics on MSVC.
+#if defined(_MSC_VER)
+	#define FSM_ATOMIC_INIT(p,v)			(*(p) = (v))
+	#define FSM_ATOMIC_LOAD(p,order)		(*(p))
+	#define FSM_ATOMIC_LOAD64(p,order)		_InterlockedCompareExchange64((p), 0, 0)	// one read on Win32 too
+	#define FSM_ATOMIC_STORE(p,v,order)		(*(p) = (v))
+	#define FSM_ATOMIC_ADD(p,n,order)		_InterlockedExchangeAdd((p), (n))	// returns the old value
+
+	static bool FsmAtomicCas64 (FsmAtomic64 *pHead, uint_least64_t *pExpected, uint_least64_t desired)
+	{
+		long long	old = _InterlockedCompareExchange64(pHead, (long long)desired, (long long)*pExpected);
+
+		if ((uint_least64_t)old == *pExpected)
+			return true;
+
+		*pExpected = (uint_least64_t)old;
+		return false;
+	}
+	#define FSM_ATOMIC_CAS64(p,pExpected,desired,success,failure)	FsmAtomicCas64((p), (pExpected), (desired))
+#else
+	#define FSM_ATOMIC_INIT(p,v)			atomic_init((p), (v))
+	#define FSM_ATOMIC_LOAD(p,order)		atomic_load_explicit((p), (order))
+	#define FSM_ATOMIC_LOAD64(p,order)		atomic_load_explicit((p), (order))
+	#define FSM_ATOMIC_STORE(p,v,order)		atomic_store_explicit((p), (v), (order))
+	#define FSM_ATOMIC_ADD(p,n,order)		atomic_fetch_add_explicit((p), (n), (order))
+	#define FSM_ATOMIC_CAS64(p,pExpected,desired,success,failure)	\
+		atomic_compare_exchange_weak_explicit((p), (pExpected), (desired), (success), (failure))
+#endif
+
+/**************************************************************************************************/
+// Put every block on the free list. Don't call while payloads from the slab are in use.
+void FsmSlabInit (FsmSlab *pSlab)
+{
+	int	i;
+
+	for (i=0; i<pSlab->nBlocks; i++)
+	{
+		FsmPayload	*pPayload = FSM_SLAB_BLOCK(pSlab, i);
+
+		pPayload->pSlab = pSlab;
+		FSM_ATOMIC_INIT(&pPayload->refCount, 0);
+		FSM_ATOMIC_INIT(&pPayload->nextFree, (i + 1 < pSlab->nBlocks) ? i + 2 : 0);
+	}
+
+	FSM_ATOMIC_INIT(&pSlab->freeHead, (pSlab->nBlocks > 0) ? 1 : 0);
+}
+
+/**************************************************************************************************/
+// Take a block from the slab's free list. The payload starts with one reference.
+// Returns NULL if the slab is empty.
+FsmPayload * FsmPayloadAlloc (FsmSlab *pSlab)
+{
+	uint_least64_t	head = FSM_ATOMIC_LOAD64(&pSlab->freeHead, memory_order_acquire);
+	uint_least64_t	next;
+	FsmPayload		*pPayload;
+
+	do {
+		if (FSM_SLAB_INDEX(head) == 0)
+		{
+			FSM_LOG("Payload slab empty - alloc failed");
+			return NULL;
+		}
+
+		pPayload = FSM_SLAB_BLOCK(pSlab, FSM_SLAB_INDEX(head) - 1);
+		next = ((FSM_SLAB_TAG(head) + 1) << 32)
+			 | (uint_least64_t)FSM_ATOMIC_LOAD(&pPayload->nextFree, memory_order_relaxed);
+
+	} while (!FSM_ATOMIC_CAS64(&pSlab->freeHead, &head, next,
+				memory_order_acquire, memory_order_acquire));
+
+	FSM_ATOMIC_STORE(&pPayload->refCount, 1, memory_order_relaxed);
+
+	return pPayload;
+
+} // FsmPayloadAlloc
+
+/**************************************************************************************************/
+static void FsmPayloadFree (FsmPayload *pPayload)
+{
+	FsmSlab			*pSlab = pPayload->pSlab;
+	int				index = (int)(((unsigned char *)pPayload - pSlab->pool) / pSlab->blockSize);
+	uint_least64_t	head = FSM_ATOMIC_LOAD64(&pSlab->freeHead, memory_order_relaxed);
+	uint_least64_t	next;
+
+	do {
+		FSM_ATOMIC_STORE(&pPayload->nextFree, FSM_SLAB_INDEX(head), memory_order_relaxed);
+		next = ((FSM_SLAB_TAG(head) + 1) << 32) | (uint_least64_t)(index + 1);
+
+	} while (!FSM_ATOMIC_CAS64(&pSlab->freeHead, &head, next,
+				memory_order_release, memory_order_relaxed));
+}
+
+/**************************************************************************************************/
+void FsmPayloadRetain (FsmPayload *pPayload)
+{
+	FSM_ATOMIC_ADD(&pPayload->refCount, 1, memory_order_relaxed);
+}
+
+/**************************************************************************************************/
+// Drop a reference. The block goes back to its slab when the last reference is dropped.
+void FsmPayloadRelease (FsmPayload *pPayload)
+{
+	if (FSM_ATOMIC_ADD(&pPayload->refCount, -1, memory_order_acq_rel) == 1)
+		FsmPayloadFree(pPayload);
+}
+
+/**************************************************************************************************/
+void * FsmPayloadData (FsmPayload *pPayload)
+{
+	return pPayload->data;
+}
@@ -0,0 +1,100 @@
+/*
+ *
+ * File: fsm_payload.h
+ *
+ * Reference counted event payloads allocated from fixed size slabs
+ *
+ *
+ */
+
+#ifndef _FSM_PAYLOAD_H_
+#define _FSM_PAYLOAD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fsm.h"
+
+// MSVC before VS2022 has no C11 atomics or _Alignas, so there the counters and the free list
+// head use the Interlocked intrinsics and blocks are aligned to 8 bytes.
+#if defined(_MSC_VER)
+	typedef volatile long			FsmAtomicInt;
+	typedef volatile long long		FsmAtomic64;
+	#define FSM_ALIGN_MAX			__declspec(align(8))
+	#define FSM_ALIGNOF_MAX			8
+#else
+	#include <stdatomic.h>
+	typedef atomic_int				FsmAtomicInt;
+	typedef atomic_uint_least64_t	FsmAtomic64;
+	#define FSM_ALIGN_MAX			_Alignas(max_align_t)
+	#define FSM_ALIGNOF_MAX			_Alignof(max_align_t)
+#endif
+
+/**************************************************************************************************/
+// Event payloads
+/**************************************************************************************************/
+
+// An event id can carry a payload through the event queues, the mailbox, deferral and dispatch.
+// Payloads come from a slab of fixed size blocks declared up front, so nothing is malloc'd per
+// event, and the data is never copied: queues pass a reference along and handlers read the data
+// in place.
+//
+//       FSM_SLAB(slab_Msg, sizeof(MyMsg), 64);		// 64 payloads of sizeof(MyMsg) bytes
+//       ...
+//       FSM_SLAB_INIT(slab_Msg);
+//       ...
+//       FsmPayload	*pPayload = FsmPayloadAlloc(&slab_Msg);	// reference count is 1
+//       MyMsg		*pMsg = FsmPayloadData(pPayload);
+//       ... fill in *pMsg ...
+//       FsmRunData(&fsm_Top, EVT_1, pPayload);			// or FsmPostData, FsmPutEventData
+//       FsmPayloadRelease(pPayload);						// FsmRunData borrows the reference
+//
+// In a handler:
+//       FSM_EVENT_HANDLER( Top_State1_EVT1 )
+//       {
+//           MyMsg	*pMsg = FSM_EVENT_DATA(pEvent);
+//           ...
+//           FsmDeferEventData(pState->pFsm, pEvent->id, pEvent->pPayload);	// no copy
+//       }
+//
+// The block returns to its slab when the last reference is released. Allocation and release
+// are lock-free, so payloads may be allocated on one thread and released on another.
+
+typedef struct FsmSlab FsmSlab;
+
+struct FsmPayload
+{
+	FsmSlab *		pSlab;		// slab the block belongs to
+	FsmAtomicInt	refCount;
+	FsmAtomicInt	nextFree;	// index+1 of the next free block, only used while on the free list
+	FSM_ALIGN_MAX unsigned char	data[];
+};
+
+struct FsmSlab
+{
+	int						blockSize;	// bytes per block, header included
+	int						dataSize;	// payload bytes per block
+	int						nBlocks;
+	unsigned char *			pool;
+	FsmAtomic64				freeHead;	// ABA tag in the upper 32 bits, index+1 of first free block below
+};
+
+#define FSM_SLAB_BLOCK_SIZE(data_size)	\
+	((sizeof(FsmPayload) + (data_size) + FSM_ALIGNOF_MAX - 1) & ~(FSM_ALIGNOF_MAX - 1))
+
+// ... Slab objects
+#define FSM_SLAB(obj,data_size,n_blocks)											\
+	FSM_ALIGN_MAX unsigned char obj##_pool[(n_blocks) * FSM_SLAB_BLOCK_SIZE(data_size)];	\
+	FsmSlab obj = {																\
+		DESIG_INIT(blockSize,FSM_SLAB_BLOCK_SIZE(data_size)),					\
+		DESIG_INIT(dataSize,(data_size)),										\
+		DESIG_INIT(nBlocks,(n_blocks)),											\
+		DESIG_INIT(pool,obj##_pool)												\
+		}
+
+#define FSM_SLAB_INIT(obj)	FsmSlabInit(&obj)
+
+void			FsmSlabInit (FsmSlab *pSlab);
+FsmPayload *	FsmPayloadAlloc (FsmSlab *pSlab);	// returns NULL if the slab is empty
+
+#endif // _FSM_PAYLOAD_H_
@@ -0,0 +1,206 @@
+/*
+ *
+ * File: fsm_pool.c
+ *
+ * Worker pool for dispatching a state's orthogonal regions in parallel
+ *
+ *
+ */
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "fsm_pool.h"
+
+// The current fork. The fields are written by the forking thread before it publishes the
+// fork in gClaim, and don't change until every region of the fork is done.
+typedef struct
+{
+	Fsm **			pFsmList;
+	int				eventId;
+	FsmPayload *	pPayload;
+	bool *			pConsumed;
+	atomic_int		done;			// regions dispatched
+} FsmPoolFork;
+
+// Regions are claimed with a CAS on one word holding the fork's generation (bits 63..32), its
+// region count (31..16) and the next region to claim (15..0). A worker that wakes up late can't
+// claim a region of an old fork, or of a new fork it hasn't seen the fields of.
+#define CLAIM(gen,count,next)	(((uint64_t)(gen) << 32) | ((uint64_t)(count) << 16) | (uint64_t)(next))
+#define CLAIM_GEN(c)			((uint32_t)((c) >> 32))
+#define CLAIM_COUNT(c)			((int)(((c) >> 16) & 0xFFFF))
+#define CLAIM_NEXT(c)			((int)((c) & 0xFFFF))
+
+static FsmPoolFork				gFork;
+static _Alignas(64) atomic_uint_least64_t	gClaim;
+static atomic_flag				gBusy = ATOMIC_FLAG_INIT;
+static uint32_t					gGeneration;		// forking thread only, under gBusy
+
+static pthread_t				gThread[FSM_POOL_MAX_THREADS];
+static int						gThreadCount;
+static atomic_bool				gRun;
+static atomic_int				gSleeping;
+static pthread_mutex_t			gLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t			gWake = PTHREAD_COND_INITIALIZER;
+
+static _Thread_local bool		tWorker;
+
+/**************************************************************************************************/
+// Claim and dispatch regions of fork gen until there are none left
+static void FsmPoolWork (uint32_t gen)
+{
+	uint64_t	claim = atomic_load_explicit(&gClaim, memory_order_acquire);
+
+	while ( (CLAIM_GEN(claim) == gen) && (CLAIM_NEXT(claim) < CLAIM_COUNT(claim)) )
+	{
+		int	i = CLAIM_NEXT(claim);
+
+		if (atomic_compare_exchange_weak_explicit(&gClaim, &claim, claim + 1,
+				memory_order_acquire, memory_order_acquire))
+		{
+			gFork.pConsumed[i] = FsmDispatchData(gFork.pFsmList[i], gFork.eventId, gFork.pPayload);
+			atomic_fetch_add_explicit(&gFork.done, 1, memory_order_release);
+			claim = atomic_load_explicit(&gClaim, memory_order_acquire);
+		}
+	}
+}
+
+/**************************************************************************************************/
+static void * FsmPoolWorker (void *pArg)
+{
+	uint32_t	seen = 0;
+
+	(void)pArg;
+	tWorker = true;
+
+	while (atomic_load_explicit(&gRun, memory_order_relaxed))
+	{
+		uint32_t	gen = CLAIM_GEN(atomic_load_explicit(&gClaim, memory_order_acquire));
+		int			spin;
+
+		for (spin=0; (gen == seen) && (spin < FSM_POOL_SPIN); spin++)
+			gen = CLAIM_GEN(atomic_load_explicit(&gClaim, memory_order_acquire));
+
+		if (gen == seen)
+		{
+			pthread_mutex_lock(&gLock);
+			atomic_fetch_add(&gSleeping, 1);
+			while ( (CLAIM_GEN(atomic_load(&gClaim)) == seen) && atomic_load(&gRun) )
+				pthread_cond_wait(&gWake, &gLock);
+			atomic_fetch_sub(&gSleeping, 1);
+			pthread_mutex_unlock(&gLock);
+			continue;
+		}
+
+		seen = gen;
+		FsmPoolWork(gen);
+	}
+
+	return NULL;
+}
+
+/**************************************************************************************************/
+// gpParallelFcn: dispatch eventId to count FSMs on the pool, pConsumed[i] gets each result.
+// Returns false, without dispatching, if the pool can't take the fork.
+static bool FsmPoolDispatch (Fsm **pFsmList, int count, int eventId, FsmPayload *pPayload, bool *pConsumed)
+{
+	uint32_t	gen;
+
+	if ( tWorker || (count > 0xFFFF) )
+		return false;
+
+	if (atomic_flag_test_and_set_explicit(&gBusy, memory_order_acquire))
+		return false;
+
+	gFork.pFsmList = pFsmList;
+	gFork.eventId = eventId;
+	gFork.pPayload = pPayload;
+	gFork.pConsumed = pConsumed;
+	atomic_store_explicit(&gFork.done, 0, memory_order_relaxed);
+
+	gen = ++gGeneration;
+	atomic_store(&gClaim, CLAIM(gen, count, 0));	// publish the fork
+
+	if (atomic_load(&gSleeping) > 0)
+	{
+		pthread_mutex_lock(&gLock);
+		pthread_cond_broadcast(&gWake);
+		pthread_mutex_unlock(&gLock);
+	}
+
+	// take a share ourselves, then join
+	FsmPoolWork(gen);
+	while (atomic_load_explicit(&gFork.done, memory_order_acquire) < count)
+		sched_yield();
+
+	atomic_flag_clear_explicit(&gBusy, memory_order_release);
+
+	return true;
+
+} // FsmPoolDispatch
+
+/**************************************************************************************************/
+// Start nThreads workers and route parallel states to them
+int FsmPoolStart (int nThreads)
+{
+	int	i;
+
+	if (gThreadCount > 0)
+		return -1;
+
+	if (nThreads > FSM_POOL_MAX_THREADS)
+		nThreads = FSM_POOL_MAX_THREADS;
+
+	atomic_store(&gRun, true);
+
+	for (i=0; i<nThreads; i++)
+	{
+		if (pthread_create(&gThread[i], NULL, FsmPoolWorker, NULL) != 0)
+		{
+			FSM_LOG("!!!! FSM ERROR !!!! can't start pool worker %d", i);
+			break;
+		}
+	}
+
+	gThreadCount = i;
+	if (0 == gThreadCount)
+		return -1;
+
+	gpParallelFcn = FsmPoolDispatch;
+
+	return 0;
+
+} // FsmPoolStart
+
+/**************************************************************************************************/
+// Stop the workers. Parallel states are dispatched serially until the pool is started again.
+// Don't call while an FSM is running.
+void FsmPoolStop (void)
+{
+	int	i;
+
+	if (0 == gThreadCount)
+		return;
+
+	gpParallelFcn = NULL;
+
+	pthread_mutex_lock(&gLock);
+	atomic_store(&gRun, false);
+	pthread_cond_broadcast(&gWake);
+	pthread_mutex_unlock(&gLock);
+
+	for (i=0; i<gThreadCount; i++)
+		pthread_join(gThread[i], NULL);
+
+	gThreadCount = 0;
+}
+
+/**************************************************************************************************/
+// Dispatch the state's nested FSMs on the pool when it has at least minRegions of them.
+// Use a threshold that keeps states with a few small nested FSMs serial; a fork costs
+// about as much as waking the workers.
+void FsmSetParallel (FsmState *pState, int minRegions)
+{
+	pState->parallelMin = (minRegions > 0) ? minRegions : 0;
+}
@@ -0,0 +1,47 @@
+/*
+ *
+ * File: fsm_pool.h
+ *
+ * Worker pool for dispatching a state's orthogonal regions in parallel
+ *
+ *
+ */
+
+#ifndef _FSM_POOL_H_
+#define _FSM_POOL_H_
+
+#include "fsm.h"
+
+/**************************************************************************************************/
+// FSM worker pool
+/**************************************************************************************************/
+
+// FsmStateDefaultHandler passes an event to a state's nested FSMs one after another. A state
+// whose nested FSMs are independent (they share no data and don't post to each other) can have
+// them dispatched at the same time on the worker pool instead:
+//
+//       FsmPoolStart(4);						// once, at init
+//       ...
+//       FsmSetParallel(&state_Top, 8);			// parallel when the state has >= 8 nested FSMs
+//
+// The thread running the FSM takes a share of the nested FSMs itself and waits for the rest
+// before the state's own handler runs, so the event still runs to completion. Consumed results
+// and transitions out of the nested FSMs are combined in nestedFsmList order, the same as the
+// serial loop.
+//
+// States in the nested FSMs, and below them, can't arm timers: the timer wheel isn't locked, and
+// a state's timers are cancelled by the thread that exits it (fsm_timer.h).
+//
+// The pool handles one state's nested FSMs at a time. If it is busy (another FSM thread, or a
+// nested FSM that is itself parallel) the nested FSMs are dispatched serially.
+//
+// Requires C11 atomics and POSIX threads.
+
+#define FSM_POOL_MAX_THREADS	64
+#define FSM_POOL_SPIN			4096	// polls before an idle worker sleeps
+
+int  FsmPoolStart (int nThreads);	// returns -1 if already running or no threads started, else 0
+void FsmPoolStop (void);
+void FsmSetParallel (FsmState *pState, int minRegions);	// 0 to dispatch serially
+
+#endif // _FSM_POOL_H_
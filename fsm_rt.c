@@ -0,0 +1,571 @@
+/*
+ *
+ * File: fsm_rt.c
+ *
+ * Multi-core runtime: worker threads that run FSMs from their mailboxes
+ *
+ *
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "fsm_rt.h"
+
+// Chase-Lev work-stealing deque with a fixed size. The owner pushes and pops at the bottom,
+// thieves take from the top.
+typedef struct
+{
+	_Alignas(FSM_CACHE_LINE) atomic_long	top;
+	_Alignas(FSM_CACHE_LINE) atomic_long	bottom;
+	_Atomic(FsmRtTask *)					task[FSM_RT_DEQUE_SIZE];
+} FsmRtDeque;
+
+typedef struct
+{
+	FsmRtDeque		deque;
+	pthread_t		thread;
+	unsigned		seed;		// victim selection
+
+	// counters, written by the worker only
+	_Alignas(FSM_CACHE_LINE) atomic_uint_least64_t	events;
+	atomic_uint_least64_t	runs;
+	atomic_uint_least64_t	steals;
+	atomic_uint_least64_t	sleeps;
+} FsmRtWorker;
+
+// Injection queue: bounded multi-producer / multi-consumer (Vyukov)
+typedef struct
+{
+	atomic_size_t	seq;
+	FsmRtTask *		pTask;
+} FsmRtCell;
+
+static FsmRtCell						gInject[FSM_RT_INJECT_SIZE];
+static _Alignas(FSM_CACHE_LINE) atomic_size_t	gInjectTail;
+static _Alignas(FSM_CACHE_LINE) atomic_size_t	gInjectHead;
+static bool								gInjectReady;	// set up by the first FsmRtStart, kept after
+
+static FsmRtWorker *			gWorker;
+static int						gWorkerCount;
+static atomic_bool				gRun;
+static atomic_int				gSleeping;
+static pthread_mutex_t			gLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t			gWake = PTHREAD_COND_INITIALIZER;
+
+static _Thread_local FsmRtWorker *	tWorker;
+
+/**************************************************************************************************/
+// deque
+/**************************************************************************************************/
+
+/**************************************************************************************************/
+static int FsmRtDequePush (FsmRtDeque *pDeque, FsmRtTask *pTask)
+{
+	long	b = atomic_load_explicit(&pDeque->bottom, memory_order_relaxed);
+	long	t = atomic_load_explicit(&pDeque->top, memory_order_acquire);
+
+	if (b - t >= FSM_RT_DEQUE_SIZE)
+		return -1;
+
+	atomic_store_explicit(&pDeque->task[b & (FSM_RT_DEQUE_SIZE - 1)], pTask, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&pDeque->bottom, b + 1, memory_order_relaxed);
+
+	return 0;
+}
+
+/**************************************************************************************************/
+static FsmRtTask * FsmRtDequePop (FsmRtDeque *pDeque)
+{
+	long		b = atomic_load_explicit(&pDeque->bottom, memory_order_relaxed) - 1;
+	long		t;
+	FsmRtTask	*pTask = NULL;
+
+	atomic_store_explicit(&pDeque->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	t = atomic_load_explicit(&pDeque->top, memory_order_relaxed);
+
+	if (t <= b)
+	{
+		pTask = atomic_load_explicit(&pDeque->task[b & (FSM_RT_DEQUE_SIZE - 1)], memory_order_relaxed);
+		if (t == b)		// last one, race the thieves for it
+		{
+			if (!atomic_compare_exchange_strong_explicit(&pDeque->top, &t, t + 1,
+					memory_order_seq_cst, memory_order_relaxed))
+				pTask = NULL;
+			atomic_store_explicit(&pDeque->bottom, b + 1, memory_order_relaxed);
+		}
+	}
+	else
+		atomic_store_explicit(&pDeque->bottom, b + 1, memory_order_relaxed);
+
+	return pTask;
+}
+
+/**************************************************************************************************/
+static FsmRtTask * FsmRtDequeSteal (FsmRtDeque *pDeque)
+{
+	long		t = atomic_load_explicit(&pDeque->top, memory_order_acquire);
+	long		b;
+	FsmRtTask	*pTask;
+
+	atomic_thread_fence(memory_order_seq_cst);
+	b = atomic_load_explicit(&pDeque->bottom, memory_order_acquire);
+
+	if (t >= b)
+		return NULL;
+
+	pTask = atomic_load_explicit(&pDeque->task[t & (FSM_RT_DEQUE_SIZE - 1)], memory_order_relaxed);
+	if (!atomic_compare_exchange_strong_explicit(&pDeque->top, &t, t + 1,
+			memory_order_seq_cst, memory_order_relaxed))
+		return NULL;	// lost to the owner or another thief
+
+	return pTask;
+}
+
+/**************************************************************************************************/
+static int FsmRtDequeDepth (FsmRtDeque *pDeque)
+{
+	long	depth = atomic_load_explicit(&pDeque->bottom, memory_order_relaxed)
+				  - atomic_load_explicit(&pDeque->top, memory_order_relaxed);
+
+	return (depth > 0) ? (int)depth : 0;
+}
+
+/**************************************************************************************************/
+// injection queue
+/**************************************************************************************************/
+
+/**************************************************************************************************/
+static int FsmRtInject (FsmRtTask *pTask)
+{
+	size_t		pos = atomic_load_explicit(&gInjectTail, memory_order_relaxed);
+	FsmRtCell	*pCell;
+
+	for (;;)
+	{
+		size_t		seq;
+		intptr_t	diff;
+
+		pCell = &gInject[pos & (FSM_RT_INJECT_SIZE - 1)];
+		seq = atomic_load_explicit(&pCell->seq, memory_order_acquire);
+		diff = (intptr_t)seq - (intptr_t)pos;
+
+		if (0 == diff)
+		{
+			if (atomic_compare_exchange_weak_explicit(&gInjectTail, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		else if (diff < 0)
+			return -1;		// full
+		else
+			pos = atomic_load_explicit(&gInjectTail, memory_order_relaxed);
+	}
+
+	pCell->pTask = pTask;
+	atomic_store_explicit(&pCell->seq, pos + 1, memory_order_release);
+
+	return 0;
+}
+
+/**************************************************************************************************/
+static FsmRtTask * FsmRtTakeInjected (void)
+{
+	size_t		pos = atomic_load_explicit(&gInjectHead, memory_order_relaxed);
+	FsmRtCell	*pCell;
+	FsmRtTask	*pTask;
+
+	for (;;)
+	{
+		size_t		seq;
+		intptr_t	diff;
+
+		pCell = &gInject[pos & (FSM_RT_INJECT_SIZE - 1)];
+		seq = atomic_load_explicit(&pCell->seq, memory_order_acquire);
+		diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+		if (0 == diff)
+		{
+			if (atomic_compare_exchange_weak_explicit(&gInjectHead, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		else if (diff < 0)
+			return NULL;	// empty
+		else
+			pos = atomic_load_explicit(&gInjectHead, memory_order_relaxed);
+	}
+
+	pTask = pCell->pTask;
+	atomic_store_explicit(&pCell->seq, pos + FSM_RT_INJECT_SIZE, memory_order_release);
+
+	return pTask;
+}
+
+/**************************************************************************************************/
+int FsmRtInjectDepth (void)
+{
+	size_t	tail = atomic_load_explicit(&gInjectTail, memory_order_relaxed);
+	size_t	head = atomic_load_explicit(&gInjectHead, memory_order_relaxed);
+
+	return (tail > head) ? (int)(tail - head) : 0;
+}
+
+/**************************************************************************************************/
+// scheduling
+/**************************************************************************************************/
+
+/**************************************************************************************************/
+static bool FsmRtHasWork (void)
+{
+	int	i;
+
+	if (FsmRtInjectDepth() > 0)
+		return true;
+
+	for (i=0; i<gWorkerCount; i++)
+		if (FsmRtDequeDepth(&gWorker[i].deque) > 0)
+			return true;
+
+	return false;
+}
+
+/**************************************************************************************************/
+// Put a task that has just become FSM_RT_SCHEDULED on a queue and wake a worker for it
+static void FsmRtSchedule (FsmRtTask *pTask)
+{
+	FsmRtWorker	*pSelf = tWorker;
+
+	if ( (NULL == pSelf) || (FsmRtDequePush(&pSelf->deque, pTask) != 0) )
+	{
+		while (FsmRtInject(pTask) != 0)
+			sched_yield();		// every queue full: wait for the workers to catch up
+	}
+
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&gSleeping, memory_order_relaxed) > 0)
+	{
+		pthread_mutex_lock(&gLock);
+		pthread_cond_signal(&gWake);
+		pthread_mutex_unlock(&gLock);
+	}
+}
+
+/**************************************************************************************************/
+// Run up to FSM_RT_BUDGET events from the task's mailbox, then put it back to sleep or back on
+// this worker's deque
+static void FsmRtRunTask (FsmRtWorker *pSelf, FsmRtTask *pTask)
+{
+	int			count = 0;
+	int			eventId;
+	FsmPayload	*pPayload;
+	int			state;
+
+	atomic_store_explicit(&pTask->state, FSM_RT_RUNNING, memory_order_seq_cst);
+
+	while ( (count < FSM_RT_BUDGET)
+		 && ((eventId = FsmMailboxGetData(pTask->mailbox, &pPayload)) != EVT_FSM_NULL) )
+	{
+		if (pTask->pFsm != NULL)
+			FsmRunData(pTask->pFsm, eventId, pPayload);
+		else
+			FsmInstRunData(pTask->pInst, eventId, pPayload);
+
+		if (pPayload != NULL)
+			FsmPayloadRelease(pPayload);
+		count++;
+	}
+
+	atomic_store_explicit(&pSelf->events, atomic_load_explicit(&pSelf->events, memory_order_relaxed) + (uint64_t)count,
+						  memory_order_relaxed);
+
+	if (count < FSM_RT_BUDGET)
+	{
+		// mailbox was empty. Go idle unless there was a post since we started.
+		state = FSM_RT_RUNNING;
+		if (atomic_compare_exchange_strong(&pTask->state, &state, FSM_RT_IDLE))
+			return;
+	}
+
+	atomic_store_explicit(&pTask->state, FSM_RT_SCHEDULED, memory_order_seq_cst);
+	FsmRtSchedule(pTask);
+}
+
+/**************************************************************************************************/
+static FsmRtTask * FsmRtFindTask (FsmRtWorker *pSelf)
+{
+	FsmRtTask	*pTask = FsmRtDequePop(&pSelf->deque);
+	int			i;
+
+	if (pTask != NULL)
+		return pTask;
+
+	pTask = FsmRtTakeInjected();
+	if (pTask != NULL)
+		return pTask;
+
+	// steal, starting from a random victim
+	if (gWorkerCount > 1)
+	{
+		int	start = (int)(rand_r(&pSelf->seed) % (unsigned)gWorkerCount);
+
+		for (i=0; i<gWorkerCount; i++)
+		{
+			FsmRtWorker	*pVictim = &gWorker[(start + i) % gWorkerCount];
+
+			if (pVictim == pSelf)
+				continue;
+
+			pTask = FsmRtDequeSteal(&pVictim->deque);
+			if (pTask != NULL)
+			{
+				atomic_store_explicit(&pSelf->steals, atomic_load_explicit(&pSelf->steals, memory_order_relaxed) + 1,
+									  memory_order_relaxed);
+				return pTask;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/**************************************************************************************************/
+static void * FsmRtWorkerThread (void *pArg)
+{
+	FsmRtWorker	*pSelf = (FsmRtWorker *)pArg;
+	int			idle = 0;
+
+	tWorker = pSelf;
+
+	while (atomic_load_explicit(&gRun, memory_order_relaxed))
+	{
+		FsmRtTask	*pTask = FsmRtFindTask(pSelf);
+
+		if (pTask != NULL)
+		{
+			idle = 0;
+			atomic_store_explicit(&pSelf->runs, atomic_load_explicit(&pSelf->runs, memory_order_relaxed) + 1,
+								  memory_order_relaxed);
+			FsmRtRunTask(pSelf, pTask);
+			continue;
+		}
+
+		if (++idle < FSM_RT_SPIN)
+			continue;
+
+		pthread_mutex_lock(&gLock);
+		atomic_fetch_add(&gSleeping, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+		while ( !FsmRtHasWork() && atomic_load(&gRun) )
+			pthread_cond_wait(&gWake, &gLock);
+		atomic_fetch_sub(&gSleeping, 1);
+		pthread_mutex_unlock(&gLock);
+
+		atomic_store_explicit(&pSelf->sleeps, atomic_load_explicit(&pSelf->sleeps, memory_order_relaxed) + 1,
+							  memory_order_relaxed);
+		idle = 0;
+	}
+
+	tWorker = NULL;
+
+	return NULL;
+}
+
+/**************************************************************************************************/
+// API
+/**************************************************************************************************/
+
+/**************************************************************************************************/
+void FsmRtTaskInit (FsmRtTask *pTask, Fsm *pFsm, FsmInst *pInst, FsmMailbox *mailbox)
+{
+	pTask->pFsm = pFsm;
+	pTask->pInst = pInst;
+	pTask->mailbox = ( (NULL == mailbox) && (pFsm != NULL) ) ? pFsm->mailbox : mailbox;
+	atomic_init(&pTask->state, FSM_RT_IDLE);
+
+	if (NULL == pTask->mailbox)
+		FSM_LOG("!!!! FSM ERROR !!!! runtime task %s has no mailbox", (pFsm != NULL) ? pFsm->name : "");
+
+	if ( (pFsm != NULL) && (FsmTop(pFsm) != pFsm) )
+		FSM_LOG("!!!! FSM ERROR !!!! runtime task %s is a nested FSM, use its top level FSM %s", pFsm->name, FsmTop(pFsm)->name);
+}
+
+/**************************************************************************************************/
+// Post an event to a task's mailbox, and schedule the task if it is idle. Safe from any thread.
+// Returns -1 if the mailbox is full, else 0
+int FsmRtPostData (FsmRtTask *pTask, int eventId, FsmPayload *pPayload)
+{
+	int	state;
+
+	if (FsmMailboxPutData(pTask->mailbox, eventId, pPayload) != 0)
+		return -1;
+
+	state = atomic_load(&pTask->state);
+	for (;;)
+	{
+		if (FSM_RT_IDLE == state)
+		{
+			if (atomic_compare_exchange_weak(&pTask->state, &state, FSM_RT_SCHEDULED))
+			{
+				FsmRtSchedule(pTask);
+				break;
+			}
+		}
+		else if (FSM_RT_RUNNING == state)
+		{
+			// tell the worker running it to look again before going idle
+			if (atomic_compare_exchange_weak(&pTask->state, &state, FSM_RT_NOTIFIED))
+				break;
+		}
+		else
+			break;		// already scheduled or notified
+	}
+
+	return 0;
+}
+
+/**************************************************************************************************/
+int FsmRtPost (FsmRtTask *pTask, int eventId)
+{
+	return FsmRtPostData(pTask, eventId, NULL);
+}
+
+/**************************************************************************************************/
+// Start nWorkers threads (0 for one per online core). With pin, worker i is bound to core i.
+int FsmRtStart (int nWorkers, bool pin)
+{
+	long	cores = sysconf(_SC_NPROCESSORS_ONLN);
+	int		i;
+
+	if (gWorkerCount > 0)
+		return -1;
+
+	if (cores < 1)
+		cores = 1;
+	if (nWorkers <= 0)
+		nWorkers = (int)cores;
+	if (nWorkers > FSM_RT_MAX_WORKERS)
+		nWorkers = FSM_RT_MAX_WORKERS;
+
+	gWorker = (FsmRtWorker *)aligned_alloc(_Alignof(FsmRtWorker), sizeof(FsmRtWorker) * (size_t)nWorkers);
+	if (NULL == gWorker)
+		return -1;
+
+	// the injection queue keeps the tasks FsmRtStop left on it
+	if (!gInjectReady)
+	{
+		for (i=0; i<FSM_RT_INJECT_SIZE; i++)
+			atomic_init(&gInject[i].seq, (size_t)i);
+		atomic_init(&gInjectTail, 0);
+		atomic_init(&gInjectHead, 0);
+		gInjectReady = true;
+	}
+
+	for (i=0; i<nWorkers; i++)
+	{
+		FsmRtWorker	*pWorker = &gWorker[i];
+
+		atomic_init(&pWorker->deque.top, 0);
+		atomic_init(&pWorker->deque.bottom, 0);
+		atomic_init(&pWorker->events, 0);
+		atomic_init(&pWorker->runs, 0);
+		atomic_init(&pWorker->steals, 0);
+		atomic_init(&pWorker->sleeps, 0);
+		pWorker->seed = (unsigned)i * 2654435761u + 1;
+	}
+
+	gWorkerCount = nWorkers;
+	atomic_store(&gRun, true);
+
+	for (i=0; i<nWorkers; i++)
+	{
+		if (pthread_create(&gWorker[i].thread, NULL, FsmRtWorkerThread, &gWorker[i]) != 0)
+		{
+			FSM_LOG("!!!! FSM ERROR !!!! can't start runtime worker %d", i);
+			break;
+		}
+
+		if (pin)
+		{
+			cpu_set_t	cpus;
+
+			CPU_ZERO(&cpus);
+			CPU_SET(i % cores, &cpus);
+			pthread_setaffinity_np(gWorker[i].thread, sizeof(cpus), &cpus);
+		}
+	}
+
+	if (i < nWorkers)
+	{
+		gWorkerCount = i;		// the started workers keep running
+		if (0 == i)
+		{
+			free(gWorker);
+			gWorker = NULL;
+			return -1;
+		}
+	}
+
+	return 0;
+
+} // FsmRtStart
+
+/**************************************************************************************************/
+void FsmRtStop (void)
+{
+	FsmRtTask	*pTask;
+	int			i;
+
+	if (0 == gWorkerCount)
+		return;
+
+	pthread_mutex_lock(&gLock);
+	atomic_store(&gRun, false);
+	pthread_cond_broadcast(&gWake);
+	pthread_mutex_unlock(&gLock);
+
+	for (i=0; i<gWorkerCount; i++)
+		pthread_join(gWorker[i].thread, NULL);
+
+	// the tasks on the workers' deques stay scheduled, on the injection queue, oldest first
+	for (i=0; i<gWorkerCount; i++)
+	{
+		while ( (pTask = FsmRtDequeSteal(&gWorker[i].deque)) != NULL )
+		{
+			if (FsmRtInject(pTask) != 0)
+			{
+				FSM_LOG("!!!! FSM ERROR !!!! runtime injection queue full, task %s idle until posted to",
+						(pTask->pFsm != NULL) ? pTask->pFsm->name : "");
+				atomic_store(&pTask->state, FSM_RT_IDLE);
+			}
+		}
+	}
+
+	gWorkerCount = 0;
+	free(gWorker);
+	gWorker = NULL;
+}
+
+/**************************************************************************************************/
+// Copy each worker's counters to pStats. The counters are read without stopping the workers.
+int FsmRtGetStats (FsmRtStats *pStats, int maxWorkers)
+{
+	int	i;
+
+	for (i=0; (i<gWorkerCount) && (i<maxWorkers); i++)
+	{
+		FsmRtWorker	*pWorker = &gWorker[i];
+
+		pStats[i].events = atomic_load_explicit(&pWorker->events, memory_order_relaxed);
+		pStats[i].runs = atomic_load_explicit(&pWorker->runs, memory_order_relaxed);
+		pStats[i].steals = atomic_load_explicit(&pWorker->steals, memory_order_relaxed);
+		pStats[i].sleeps = atomic_load_explicit(&pWorker->sleeps, memory_order_relaxed);
+		pStats[i].queued = FsmRtDequeDepth(&pWorker->deque);
+	}
+
+	return gWorkerCount;
+}
@@ -0,0 +1,86 @@
+/*
+ *
+ * File: fsm_rt.h
+ *
+ * Multi-core runtime: worker threads that run FSMs from their mailboxes
+ *
+ *
+ */
+
+#ifndef _FSM_RT_H_
+#define _FSM_RT_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "fsm.h"
+#include "fsm_mailbox.h"
+#include "fsm_def.h"
+
+/**************************************************************************************************/
+// FSM runtime
+/**************************************************************************************************/
+
+// Instead of a thread per FSM, the runtime runs any number of FSMs on a fixed set of worker
+// threads, one per core. Each FSM (an Fsm or an FsmInst) is wrapped in a task with a mailbox.
+// Posting an event to an idle task schedules it; a worker runs the task until its mailbox is
+// empty or it has run FSM_RT_BUDGET events, then moves on.
+//
+//       FSM_MAILBOX(mailbox_Session, 16);
+//       FsmRtTask   task_Session;
+//       ...
+//       FSM_MAILBOX_INIT(mailbox_Session);
+//       FsmRtTaskInit(&task_Session, NULL, pInst, (FsmMailbox *)&mailbox_Session);
+//       FsmRtStart(0, true);						// a worker per core, pinned
+//       ...
+//       FsmRtPost(&task_Session, EVT_1);			// from any thread
+//
+// Each worker has a work-stealing deque (Chase-Lev). Tasks posted by a worker's own FSMs go on
+// its deque, tasks posted from other threads go on a shared injection queue, and a worker with
+// nothing to do steals from the others. A task's state (idle, scheduled, running) makes sure it
+// is on at most one queue and is never run by two workers at once, so its FSM still runs to
+// completion on one thread at a time - just not always the same thread. That holds for a machine
+// only if it has one task: give the task the top level FSM, and post the events for the FSMs
+// nested in it to that task.
+//
+// Requires C11 atomics and POSIX threads. Pinning uses the Linux affinity calls.
+
+#define FSM_RT_MAX_WORKERS	256
+#define FSM_RT_DEQUE_SIZE	4096		// tasks per worker deque, power of 2
+#define FSM_RT_INJECT_SIZE	65536		// tasks in the injection queue, power of 2
+#define FSM_RT_BUDGET		64			// events a task runs before the worker moves on
+#define FSM_RT_SPIN			1024		// polls before an idle worker sleeps
+
+// task states
+#define FSM_RT_IDLE			0			// no events, on no queue
+#define FSM_RT_SCHEDULED	1			// on a queue
+#define FSM_RT_RUNNING		2			// on a worker
+#define FSM_RT_NOTIFIED		3			// on a worker, and posted to since it started
+
+typedef struct FsmRtTask
+{
+	Fsm *			pFsm;		// FSM to run, or NULL
+	FsmInst *		pInst;		// instance to run if pFsm is NULL
+	FsmMailbox *	mailbox;
+	atomic_int		state;		// FSM_RT_xxx
+} FsmRtTask;
+
+// Per-worker counters
+typedef struct
+{
+	uint64_t	events;			// events run
+	uint64_t	runs;			// times a task was taken off a queue and run
+	uint64_t	steals;			// tasks taken from another worker's deque
+	uint64_t	sleeps;			// times the worker ran out of work and slept
+	int			queued;			// tasks on the worker's deque now
+} FsmRtStats;
+
+void FsmRtTaskInit (FsmRtTask *pTask, Fsm *pFsm, FsmInst *pInst, FsmMailbox *mailbox);	// mailbox NULL: pFsm->mailbox
+int  FsmRtStart (int nWorkers, bool pin);	// nWorkers 0: one per core. Returns -1 if running or no workers started
+void FsmRtStop (void);						// returns when the workers have stopped, queued tasks stay queued for the next FsmRtStart
+int  FsmRtPost (FsmRtTask *pTask, int eventId);		// returns -1 if the mailbox is full, else 0
+int  FsmRtPostData (FsmRtTask *pTask, int eventId, FsmPayload *pPayload);	// mailbox takes the reference
+int  FsmRtGetStats (FsmRtStats *pStats, int maxWorkers);	// returns number of workers
+int  FsmRtInjectDepth (void);				// tasks waiting in the injection queue
+
+#endif // _FSM_RT_H_
@@ -0,0 +1,287 @@
+/*
+ *
+ * File: fsm_stats.c
+ *
+ * FSM counters: per-thread dispatch, transition, ignored event and queue counts, and snapshots
+ *
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "fsm_stats.h"
+
+static const char * const		gKindNames[] = { "dispatch", "ignored", "transition" };
+
+#if FSM_STATS
+
+#include <pthread.h>
+
+#define FSM_STATS_KIND_MASK		((uintptr_t)3)
+
+FSM_THREAD_LOCAL FsmStatsBlock *	tFsmStats;
+
+static _Atomic(FsmStatsBlock *)	gBlockList;
+
+static pthread_once_t			gBlockKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t			gBlockKey;		// the thread's table, to give it up when the thread exits
+
+/**************************************************************************************************/
+// Thread exit: the table stays on the list, so its counts stay in the snapshots, and the next
+// thread that counts takes it over
+static void FsmStatsBlockExit (void *pArg)
+{
+	FsmStatsBlock	*pBlock = (FsmStatsBlock *)pArg;
+
+	tFsmStats = NULL;		// a later destructor that counts takes a table again
+	atomic_store_explicit(&pBlock->inUse, false, memory_order_release);
+}
+
+/**************************************************************************************************/
+static void FsmStatsBlockKeyCreate (void)
+{
+	pthread_key_create(&gBlockKey, FsmStatsBlockExit);
+}
+
+/**************************************************************************************************/
+// First count on a thread takes a table whose thread has exited, or allocates one
+FsmStatsBlock * FsmStatsBlockCreate (void)
+{
+	FsmStatsBlock	*pBlock;
+
+	for (pBlock = atomic_load_explicit(&gBlockList, memory_order_acquire); pBlock != NULL; pBlock = pBlock->pNext)
+	{
+		bool	inUse = false;
+
+		if (atomic_compare_exchange_strong_explicit(&pBlock->inUse, &inUse, true,
+				memory_order_acquire, memory_order_relaxed))
+			break;
+	}
+
+	if (NULL == pBlock)
+	{
+		pBlock = (FsmStatsBlock *)calloc(1, sizeof(FsmStatsBlock));
+		if (NULL == pBlock)
+		{
+			FSM_LOG("!!!! FSM ERROR !!!! no memory for the thread's FSM counters");
+			return NULL;
+		}
+
+		atomic_init(&pBlock->inUse, true);
+		pBlock->pNext = atomic_load_explicit(&gBlockList, memory_order_relaxed);
+		while (!atomic_compare_exchange_weak_explicit(&gBlockList, &pBlock->pNext, pBlock,
+					memory_order_release, memory_order_relaxed))
+			;
+	}
+
+	pthread_once(&gBlockKeyOnce, FsmStatsBlockKeyCreate);
+	pthread_setspecific(gBlockKey, pBlock);
+	tFsmStats = pBlock;
+
+	return pBlock;
+}
+
+#endif // FSM_STATS
+
+/**************************************************************************************************/
+static int FsmStatsCompare (const void *p1, const void *p2)
+{
+	const FsmStatsEntry	*pA = (const FsmStatsEntry *)p1;
+	const FsmStatsEntry	*pB = (const FsmStatsEntry *)p2;
+
+	if (pA->kind != pB->kind)
+		return (pA->kind < pB->kind) ? -1 : 1;
+	if (pA->pState != pB->pState)
+		return ((uintptr_t)pA->pState < (uintptr_t)pB->pState) ? -1 : 1;
+	if (pA->eventId != pB->eventId)
+		return (pA->eventId < pB->eventId) ? -1 : 1;
+	if (pA->pNextState != pB->pNextState)
+		return ((uintptr_t)pA->pNextState < (uintptr_t)pB->pNextState) ? -1 : 1;
+	return 0;
+}
+
+/**************************************************************************************************/
+#if !FSM_STATS
+
+// Built without the counters: the snapshot is empty
+int FsmStatsSnapshotTake (FsmStatsSnapshot *pSnap)
+{
+	memset(pSnap, 0, sizeof(FsmStatsSnapshot));
+	return 0;
+}
+
+#else
+
+// Add up every thread's counters. The counts are read while other threads keep counting, so
+// each one is current to within a few events. Free the snapshot with FsmStatsSnapshotFree.
+int FsmStatsSnapshotTake (FsmStatsSnapshot *pSnap)
+{
+	FsmStatsBlock	*pList = atomic_load_explicit(&gBlockList, memory_order_acquire);
+	FsmStatsBlock	*pBlock;
+	int				size = 0;
+	int				count = 0;
+	int				i;
+
+	memset(pSnap, 0, sizeof(FsmStatsSnapshot));
+
+	for (pBlock = pList; pBlock != NULL; pBlock = pBlock->pNext)
+		size += FSM_STATS_SLOTS;
+
+	if (0 == size)
+		return 0;
+
+	pSnap->pEntries = (FsmStatsEntry *)malloc(size * sizeof(FsmStatsEntry));
+	if (NULL == pSnap->pEntries)
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! no memory for an FSM counter snapshot");
+		return -1;
+	}
+
+	for (pBlock = pList; pBlock != NULL; pBlock = pBlock->pNext)
+	{
+		int	hwm = atomic_load_explicit(&pBlock->queueHwm, memory_order_relaxed);
+
+		pSnap->threads++;
+		pSnap->runs += atomic_load_explicit(&pBlock->runs, memory_order_relaxed);
+		pSnap->queueDrops += atomic_load_explicit(&pBlock->queueDrops, memory_order_relaxed);
+		pSnap->queueCoalesced += atomic_load_explicit(&pBlock->queueCoalesced, memory_order_relaxed);
+		pSnap->lost += atomic_load_explicit(&pBlock->lost, memory_order_relaxed);
+		if (hwm > pSnap->queueHwm)
+			pSnap->queueHwm = hwm;
+
+		for (i=0; i<FSM_STATS_SLOTS; i++)
+		{
+			FsmStatsSlot	*pSlot = &pBlock->slot[i];
+			uintptr_t		key = atomic_load_explicit(&pSlot->key, memory_order_acquire);
+			FsmStatsEntry	*pEntry = &pSnap->pEntries[count];
+
+			if (0 == key)
+				continue;
+
+			pEntry->kind = (eFsmStatsKind)(key & FSM_STATS_KIND_MASK);
+			pEntry->pState = (const FsmState *)(key & ~FSM_STATS_KIND_MASK);
+			pEntry->pNextState = NULL;
+			pEntry->eventId = EVT_FSM_NULL;
+			if (FSM_STATS_TRANSITION == pEntry->kind)
+				pEntry->pNextState = (const FsmState *)pSlot->other;
+			else
+				pEntry->eventId = (int)(intptr_t)pSlot->other;
+			pEntry->count = atomic_load_explicit(&pSlot->count, memory_order_relaxed);
+			count++;
+		}
+	}
+
+	// merge the threads' counts for the same key
+	qsort(pSnap->pEntries, count, sizeof(FsmStatsEntry), FsmStatsCompare);
+
+	for (i=0; i<count; i++)
+	{
+		FsmStatsEntry	*pEntry = &pSnap->pEntries[i];
+
+		if ( (pSnap->count > 0) && (0 == FsmStatsCompare(&pSnap->pEntries[pSnap->count - 1], pEntry)) )
+			pSnap->pEntries[pSnap->count - 1].count += pEntry->count;
+		else
+			pSnap->pEntries[pSnap->count++] = *pEntry;
+
+		if (FSM_STATS_DISPATCH == pEntry->kind)
+			pSnap->dispatches += pEntry->count;
+		else if (FSM_STATS_IGNORED == pEntry->kind)
+			pSnap->ignored += pEntry->count;
+		else
+			pSnap->transitions += pEntry->count;
+	}
+
+	return 0;
+
+} // FsmStatsSnapshotTake
+
+#endif // FSM_STATS
+
+/**************************************************************************************************/
+void FsmStatsSnapshotFree (FsmStatsSnapshot *pSnap)
+{
+	free(pSnap->pEntries);
+	memset(pSnap, 0, sizeof(FsmStatsSnapshot));
+}
+
+/**************************************************************************************************/
+static uint64_t FsmStatsFind (const FsmStatsSnapshot *pSnap, eFsmStatsKind kind, const FsmState *pState,
+							  int eventId, const FsmState *pNextState)
+{
+	FsmStatsEntry	key;
+	FsmStatsEntry	*pEntry;
+
+	if (0 == pSnap->count)
+		return 0;
+
+	key.kind = kind;
+	key.pState = pState;
+	key.pNextState = pNextState;
+	key.eventId = eventId;
+
+	pEntry = (FsmStatsEntry *)bsearch(&key, pSnap->pEntries, pSnap->count, sizeof(FsmStatsEntry), FsmStatsCompare);
+
+	return (pEntry != NULL) ? pEntry->count : 0;
+}
+
+/**************************************************************************************************/
+uint64_t FsmStatsDispatchCount (const FsmStatsSnapshot *pSnap, const FsmState *pState, int eventId)
+{
+	return FsmStatsFind(pSnap, FSM_STATS_DISPATCH, pState, eventId, NULL);
+}
+
+/**************************************************************************************************/
+uint64_t FsmStatsIgnoredCount (const FsmStatsSnapshot *pSnap, const FsmState *pState, int eventId)
+{
+	return FsmStatsFind(pSnap, FSM_STATS_IGNORED, pState, eventId, NULL);
+}
+
+/**************************************************************************************************/
+uint64_t FsmStatsTransitionCount (const FsmStatsSnapshot *pSnap, const FsmState *pState, const FsmState *pNextState)
+{
+	return FsmStatsFind(pSnap, FSM_STATS_TRANSITION, pState, EVT_FSM_NULL, pNextState);
+}
+
+/**************************************************************************************************/
+static void FsmStatsWriteEvent (FILE *pFile, int eventId)
+{
+	if ( (eventId >= 0) && (eventId < EVT_FSM_EOL) )
+		fprintf(pFile, "%s", FSM_EVT_NAME(eventId));
+	else if (eventId != EVT_FSM_NULL)
+		fprintf(pFile, "%d", eventId);
+}
+
+/**************************************************************************************************/
+// One line per counter: kind,fsm,state,event,next_fsm,next_state,count
+// The totals follow as kind,,,,,,count lines.
+int FsmStatsWriteCsv (const FsmStatsSnapshot *pSnap, FILE *pFile)
+{
+	int	i;
+
+	fprintf(pFile, "kind,fsm,state,event,next_fsm,next_state,count\n");
+
+	for (i=0; i<pSnap->count; i++)
+	{
+		const FsmStatsEntry	*pEntry = &pSnap->pEntries[i];
+		const FsmState		*pState = pEntry->pState;
+		const FsmState		*pNext = pEntry->pNextState;
+
+		fprintf(pFile, "%s,%s,%s,", gKindNames[pEntry->kind],
+				(pState->pFsm != NULL) ? pState->pFsm->name : "", pState->name);
+		FsmStatsWriteEvent(pFile, pEntry->eventId);
+		fprintf(pFile, ",%s,%s,%" PRIu64 "\n",
+				( (pNext != NULL) && (pNext->pFsm != NULL) ) ? pNext->pFsm->name : "",
+				(pNext != NULL) ? pNext->name : "", pEntry->count);
+	}
+
+	fprintf(pFile, "runs,,,,,,%" PRIu64 "\n", pSnap->runs);
+	fprintf(pFile, "queue_drops,,,,,,%" PRIu64 "\n", pSnap->queueDrops);
+	fprintf(pFile, "queue_coalesced,,,,,,%" PRIu64 "\n", pSnap->queueCoalesced);
+	fprintf(pFile, "queue_hwm,,,,,,%d\n", pSnap->queueHwm);
+	fprintf(pFile, "lost,,,,,,%" PRIu64 "\n", pSnap->lost);
+
+	return ferror(pFile) ? -1 : 0;
+
+} // FsmStatsWriteCsv
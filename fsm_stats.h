@@ -0,0 +1,224 @@
+/*
+ *
+ * File: fsm_stats.h
+ *
+ * FSM counters: per-thread dispatch, transition, ignored event and queue counts, and snapshots
+ *
+ *
+ */
+
+#ifndef _FSM_STATS_H_
+#define _FSM_STATS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "fsm.h"
+
+/**************************************************************************************************/
+// FSM counters
+/**************************************************************************************************/
+
+// fsm.c counts, on every thread that runs an FSM:
+//     - events dispatched to each state, by event id (FsmDispatch)
+//     - transitions taken on each edge (FsmTransition)
+//     - events an FSM didn't consume, by state and event id (FsmRun, FsmRunBatch, FsmRunQueue)
+//     - events run (FsmRun and the batch functions)
+//     - queue-full drops, coalesced events and the deepest queue seen (FsmPutEvent)
+// Each queue also keeps its own high-water mark, drop and coalesced counts (FsmQ hwm, drops, coalesced).
+//
+// Counters live in a table owned by the calling thread, so a count is a hash probe and a
+// relaxed add, with no locks or shared cache lines. FsmStatsSnapshotTake adds up every thread's
+// table. Counts only go up; diff two snapshots for rates.
+//
+//       FsmStatsSnapshot   snap;
+//       ...
+//       FsmStatsSnapshotTake(&snap);
+//       FsmStatsWriteCsv(&snap, pFile);
+//       FsmStatsSnapshotFree(&snap);
+//
+// A transition edge is counted in the FSM that takes it (see FsmTransition): from that FSM's
+// current state to the target. For a transition out of a nested FSM the source is the superstate.
+//
+// The counters are off by default. Build the framework (fsm.c and fsm_stats.c) with
+// -DFSM_STATS=1 to count; snapshots are empty without it. Counting requires C11 atomics and
+// POSIX threads. A thread's table goes back to a free list when the thread exits, and the next
+// thread that counts takes it over, so thread-per-connection hosts don't pile up tables.
+
+#ifndef FSM_STATS
+	#define FSM_STATS			0
+#endif
+
+#ifndef FSM_STATS_SLOTS
+	#define FSM_STATS_SLOTS		4096		// (state, event) and edge counters per thread, power of 2
+#endif
+
+#define FSM_STATS_PROBES		16			// slots tried before a count is lost
+
+typedef enum
+{
+	FSM_STATS_DISPATCH,		// pState got eventId
+	FSM_STATS_IGNORED,		// pState's FSM didn't consume eventId
+	FSM_STATS_TRANSITION	// pState transitioned to pNextState
+} eFsmStatsKind;
+
+/**************************************************************************************************/
+// Merged counters
+typedef struct
+{
+	eFsmStatsKind		kind;
+	const FsmState *	pState;
+	const FsmState *	pNextState;		// FSM_STATS_TRANSITION only
+	int					eventId;		// EVT_FSM_NULL for FSM_STATS_TRANSITION
+	uint64_t			count;
+} FsmStatsEntry;
+
+typedef struct
+{
+	uint64_t			dispatches;
+	uint64_t			ignored;
+	uint64_t			transitions;
+	uint64_t			runs;
+	uint64_t			queueDrops;
+	uint64_t			queueCoalesced;
+	int					queueHwm;
+	uint64_t			lost;
+	int					threads;		// tables: the most threads that have counted at once
+	int					count;			// entries
+	FsmStatsEntry *		pEntries;		// sorted by kind, state, event id, target
+} FsmStatsSnapshot;
+
+int			FsmStatsSnapshotTake (FsmStatsSnapshot *pSnap);		// returns -1 if out of memory
+void		FsmStatsSnapshotFree (FsmStatsSnapshot *pSnap);
+uint64_t	FsmStatsDispatchCount (const FsmStatsSnapshot *pSnap, const FsmState *pState, int eventId);
+uint64_t	FsmStatsIgnoredCount (const FsmStatsSnapshot *pSnap, const FsmState *pState, int eventId);
+uint64_t	FsmStatsTransitionCount (const FsmStatsSnapshot *pSnap, const FsmState *pState, const FsmState *pNextState);
+int			FsmStatsWriteCsv (const FsmStatsSnapshot *pSnap, FILE *pFile);	// returns -1 on a write error
+
+/**************************************************************************************************/
+// Counting, called from fsm.c
+#if FSM_STATS
+
+#include <stdatomic.h>
+
+// Per-thread table slot. The key is the state pointer with the kind in its low bits, 0 if the
+// slot is free; other is the event id or target state. Only the owning thread writes a slot.
+typedef struct
+{
+	atomic_uintptr_t		key;
+	uintptr_t				other;
+	atomic_uint_least64_t	count;
+} FsmStatsSlot;
+
+typedef struct FsmStatsBlock FsmStatsBlock;
+struct FsmStatsBlock
+{
+	FsmStatsBlock *			pNext;			// list of all threads' blocks
+	atomic_bool				inUse;			// a thread counts in it; false once that thread exits
+	atomic_uint_least64_t	runs;
+	atomic_uint_least64_t	queueDrops;
+	atomic_uint_least64_t	queueCoalesced;
+	atomic_int				queueHwm;
+	atomic_uint_least64_t	lost;			// counts that found no free slot
+	FsmStatsSlot			slot[FSM_STATS_SLOTS];
+};
+
+extern FSM_THREAD_LOCAL FsmStatsBlock *	tFsmStats;
+
+FsmStatsBlock *	FsmStatsBlockCreate (void);		// first count on a thread
+
+// add n to a counter only this thread writes
+static inline void FsmStatsInc (atomic_uint_least64_t *pCounter, uint64_t n)
+{
+	atomic_store_explicit(pCounter, atomic_load_explicit(pCounter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline FsmStatsBlock * FsmStatsThread (void)
+{
+	FsmStatsBlock	*pBlock = tFsmStats;
+
+	return (pBlock != NULL) ? pBlock : FsmStatsBlockCreate();
+}
+
+static inline void FsmStatsCount (eFsmStatsKind kind, const FsmState *pState, uintptr_t other)
+{
+	FsmStatsBlock	*pBlock = FsmStatsThread();
+	uintptr_t		key = (uintptr_t)pState | (uintptr_t)kind;
+	unsigned		hash;
+	int				probe;
+
+	if (NULL == pBlock)
+		return;
+
+	hash = (unsigned)(((key ^ (other * 0x9E3779B97F4A7C15ull)) * 0x9E3779B97F4A7C15ull) >> 40);
+
+	for (probe=0; probe<FSM_STATS_PROBES; probe++)
+	{
+		FsmStatsSlot	*pSlot = &pBlock->slot[(hash + probe) & (FSM_STATS_SLOTS - 1)];
+		uintptr_t		slotKey = atomic_load_explicit(&pSlot->key, memory_order_relaxed);
+
+		if ( (slotKey == key) && (pSlot->other == other) )
+		{
+			FsmStatsInc(&pSlot->count, 1);
+			return;
+		}
+
+		if (0 == slotKey)
+		{
+			pSlot->other = other;
+			atomic_store_explicit(&pSlot->count, 1, memory_order_relaxed);
+			atomic_store_explicit(&pSlot->key, key, memory_order_release);	// publish to snapshots
+			return;
+		}
+	}
+
+	FsmStatsInc(&pBlock->lost, 1);
+}
+
+static inline void FsmStatsQueue (int depth, bool dropped)
+{
+	FsmStatsBlock	*pBlock = FsmStatsThread();
+
+	if (NULL == pBlock)
+		return;
+
+	if (dropped)
+		FsmStatsInc(&pBlock->queueDrops, 1);
+	else if (depth > atomic_load_explicit(&pBlock->queueHwm, memory_order_relaxed))
+		atomic_store_explicit(&pBlock->queueHwm, depth, memory_order_relaxed);
+}
+
+static inline void FsmStatsCoalesced (void)
+{
+	FsmStatsBlock	*pBlock = FsmStatsThread();
+
+	if (pBlock != NULL)
+		FsmStatsInc(&pBlock->queueCoalesced, 1);
+}
+
+static inline void FsmStatsRun (uint64_t count)
+{
+	FsmStatsBlock	*pBlock = FsmStatsThread();
+
+	if ( (pBlock != NULL) && (count > 0) )
+		FsmStatsInc(&pBlock->runs, count);
+}
+
+	#define FSM_STATS_DISPATCH(pState,eventId)		FsmStatsCount(FSM_STATS_DISPATCH, (pState), (uintptr_t)(eventId))
+	#define FSM_STATS_IGNORED(pState,eventId)		{ if ((pState) != NULL) FsmStatsCount(FSM_STATS_IGNORED, (pState), (uintptr_t)(eventId)); }
+	#define FSM_STATS_TRANSITION(pState,pNextState)	{ if ((pState) != NULL) FsmStatsCount(FSM_STATS_TRANSITION, (pState), (uintptr_t)(pNextState)); }
+	#define FSM_STATS_QUEUE(depth,dropped)			FsmStatsQueue((depth), (dropped))
+	#define FSM_STATS_COALESCED()					FsmStatsCoalesced()
+	#define FSM_STATS_RUN()							FsmStatsRun(1)
+	#define FSM_STATS_RUNS(count)					FsmStatsRun((uint64_t)(count))
+#else
+	#define FSM_STATS_DISPATCH(pState,eventId)		{;}
+	#define FSM_STATS_IGNORED(pState,eventId)		{ (void)(pState); }
+	#define FSM_STATS_TRANSITION(pState,pNextState)	{;}
+	#define FSM_STATS_QUEUE(depth,dropped)			{;}
+	#define FSM_STATS_COALESCED()					{;}
+	#define FSM_STATS_RUN()							{;}
+	#define FSM_STATS_RUNS(count)					{;}
+#endif
+
+#endif // _FSM_STATS_H_
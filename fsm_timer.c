@@ -0,0 +1,325 @@
+/*
+ *
+ * File: fsm_timer.c
+ *
+ * Time events: timers that run an event on an FSM, on a hierarchical timing wheel
+ *
+ *
+ */
+#include <string.h>
+
+#include "fsm_timer.h"
+
+#define SLOT_MASK		(FSM_TIMER_SLOTS - 1)
+#define LEVEL_SHIFT(l)	((l) * FSM_TIMER_BITS)
+#define WHEEL_RANGE		((uint64_t)1 << (FSM_TIMER_LEVELS * FSM_TIMER_BITS))
+
+/**************************************************************************************************/
+void FsmTimerWheelInit (FsmTimerWheel *pWheel)
+{
+	memset(pWheel, 0, sizeof(FsmTimerWheel));
+}
+
+/**************************************************************************************************/
+// Put an armed timer in the slot for its expiry time
+static void FsmTimerInsert (FsmTimerWheel *pWheel, FsmTimer *pTimer)
+{
+	uint64_t	expires = pTimer->expires;
+	uint64_t	delta;
+	int			level = 0;
+	int			index;
+
+	if (expires < pWheel->now)
+		expires = pWheel->now;
+	delta = expires - pWheel->now;			// 0 when a cascade brings it down on its own tick
+
+	if (delta >= WHEEL_RANGE)
+	{
+		expires = pWheel->now + WHEEL_RANGE - 1;	// wait at the top level, placed again when it comes due
+		delta = WHEEL_RANGE - 1;
+	}
+
+	while (delta >= ((uint64_t)FSM_TIMER_SLOTS << LEVEL_SHIFT(level)))
+		level++;
+
+	index = (int)((expires >> LEVEL_SHIFT(level)) & SLOT_MASK);
+
+	pTimer->ppSlot = &pWheel->slot[level][index];
+	pTimer->pPrev = NULL;
+	pTimer->pNext = *pTimer->ppSlot;
+	if (pTimer->pNext != NULL)
+		pTimer->pNext->pPrev = pTimer;
+	*pTimer->ppSlot = pTimer;
+
+	pWheel->occupied[level] |= (uint64_t)1 << index;
+}
+
+/**************************************************************************************************/
+// Take a timer out of its wheel slot
+static void FsmTimerRemove (FsmTimerWheel *pWheel, FsmTimer *pTimer)
+{
+	if (pTimer->pPrev != NULL)
+		pTimer->pPrev->pNext = pTimer->pNext;
+	else
+		*pTimer->ppSlot = pTimer->pNext;
+
+	if (pTimer->pNext != NULL)
+		pTimer->pNext->pPrev = pTimer->pPrev;
+
+	if (NULL == *pTimer->ppSlot)
+	{
+		int	offset = (int)(pTimer->ppSlot - &pWheel->slot[0][0]);
+
+		pWheel->occupied[offset / FSM_TIMER_SLOTS] &= ~((uint64_t)1 << (offset % FSM_TIMER_SLOTS));
+	}
+
+	pTimer->ppSlot = NULL;
+	pTimer->pNext = NULL;
+	pTimer->pPrev = NULL;
+}
+
+/**************************************************************************************************/
+static void FsmTimerStart (FsmTimerWheel *pWheel, FsmTimer *pTimer, Fsm *pFsm, FsmState *pState,
+						   int eventId, uint64_t delay, uint64_t period)
+{
+	if (pTimer->ppSlot != NULL)
+		FsmTimerCancel(pTimer);
+
+	pTimer->pWheel = pWheel;
+	pTimer->pFsm = pFsm;
+	pTimer->pState = pState;
+	pTimer->eventId = eventId;
+	pTimer->expires = pWheel->now + (delay ? delay : 1);	// the current tick has already run
+	pTimer->period = period;
+
+	FsmTimerInsert(pWheel, pTimer);
+	pWheel->count++;
+
+	if (pState != NULL)
+	{
+		gpCancelTimersFcn = FsmTimerCancelState;
+
+		pTimer->pStatePrev = NULL;
+		pTimer->pStateNext = pState->pTimers;
+		if (pTimer->pStateNext != NULL)
+			pTimer->pStateNext->pStatePrev = pTimer;
+		pState->pTimers = pTimer;
+	}
+}
+
+/**************************************************************************************************/
+// true if pState is inside a state whose nested FSMs may be dispatched on the worker pool
+static bool FsmTimerInParallel (FsmState *pState)
+{
+	Fsm	*pFsm = pState->pFsm;
+
+	while (pFsm->pParentState != NULL)
+	{
+		if (pFsm->pParentState->parallelMin > 0)
+			return true;
+		pFsm = pFsm->pParentState->pFsm;
+	}
+
+	return false;
+}
+
+/**************************************************************************************************/
+// Run eventId on the state's FSM after delay ticks (and every period ticks after that, if period
+// isn't 0), until the state exits. Re-arming an armed timer cancels it first.
+void FsmTimerArm (FsmTimerWheel *pWheel, FsmTimer *pTimer, FsmState *pState, int eventId, uint64_t delay, uint64_t period)
+{
+	if (FsmTimerInParallel(pState))
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! FSM %s: state %s is in a parallel region, timer not armed",
+				pState->pFsm->name, pState->name);
+		return;
+	}
+
+	FsmTimerStart(pWheel, pTimer, pState->pFsm, pState, eventId, delay, period);
+}
+
+/**************************************************************************************************/
+// Run eventId on an FSM after delay ticks (and every period ticks after that, if period isn't 0).
+// Re-arming an armed timer cancels it first.
+void FsmTimerPost (FsmTimerWheel *pWheel, FsmTimer *pTimer, Fsm *pFsm, int eventId, uint64_t delay, uint64_t period)
+{
+	FsmTimerStart(pWheel, pTimer, pFsm, NULL, eventId, delay, period);
+}
+
+/**************************************************************************************************/
+// Does nothing if the timer isn't armed
+void FsmTimerCancel (FsmTimer *pTimer)
+{
+	FsmState	*pState = pTimer->pState;
+
+	if (NULL == pTimer->ppSlot)
+		return;
+
+	FsmTimerRemove(pTimer->pWheel, pTimer);
+	pTimer->pWheel->count--;
+
+	if (pState != NULL)
+	{
+		if (pTimer->pStatePrev != NULL)
+			pTimer->pStatePrev->pStateNext = pTimer->pStateNext;
+		else
+			pState->pTimers = pTimer->pStateNext;
+
+		if (pTimer->pStateNext != NULL)
+			pTimer->pStateNext->pStatePrev = pTimer->pStatePrev;
+
+		pTimer->pStateNext = NULL;
+		pTimer->pStatePrev = NULL;
+	}
+}
+
+/**************************************************************************************************/
+// Cancel every timer armed in a state. FsmStateDefaultHandler calls this when the state exits.
+void FsmTimerCancelState (FsmState *pState)
+{
+	while (pState->pTimers != NULL)
+		FsmTimerCancel(pState->pTimers);
+}
+
+/**************************************************************************************************/
+bool FsmTimerArmed (const FsmTimer *pTimer)
+{
+	return pTimer->ppSlot != NULL;
+}
+
+/**************************************************************************************************/
+// Move the timers in a level's slot down to the levels below
+static void FsmTimerCascade (FsmTimerWheel *pWheel, int level, int index)
+{
+	FsmTimer	*pTimer = pWheel->slot[level][index];
+
+	pWheel->slot[level][index] = NULL;
+	pWheel->occupied[level] &= ~((uint64_t)1 << index);
+
+	while (pTimer != NULL)
+	{
+		FsmTimer	*pNext = pTimer->pNext;
+
+		FsmTimerInsert(pWheel, pTimer);
+		pTimer = pNext;
+	}
+}
+
+/**************************************************************************************************/
+// Advance the wheel one tick and run the timers that expire on it
+static int FsmTimerTick (FsmTimerWheel *pWheel)
+{
+	FsmTimer	**ppSlot;
+	int			expired = 0;
+	int			level;
+
+	pWheel->now++;
+
+	// at the start of each level's slot, move its timers down
+	for (level=1; level<FSM_TIMER_LEVELS; level++)
+	{
+		if (pWheel->now & (((uint64_t)1 << LEVEL_SHIFT(level)) - 1))
+			break;
+		FsmTimerCascade(pWheel, level, (int)((pWheel->now >> LEVEL_SHIFT(level)) & SLOT_MASK));
+	}
+
+	// Run the slot one timer at a time: an event may cancel or arm other timers. Timers armed
+	// now expire on a later tick, so they never go in this slot.
+	ppSlot = &pWheel->slot[0][pWheel->now & SLOT_MASK];
+	while (*ppSlot != NULL)
+	{
+		FsmTimer	*pTimer = *ppSlot;
+		Fsm			*pFsm = pTimer->pFsm;
+		int			eventId = pTimer->eventId;
+
+		if (pTimer->expires > pWheel->now)
+		{
+			// placed at the top level for a delay longer than the wheel; place it again
+			FsmTimerRemove(pWheel, pTimer);
+			FsmTimerInsert(pWheel, pTimer);
+			continue;
+		}
+
+		if (pTimer->period != 0)
+		{
+			FsmTimerRemove(pWheel, pTimer);
+			pTimer->expires = pWheel->now + pTimer->period;
+			FsmTimerInsert(pWheel, pTimer);
+		}
+		else
+			FsmTimerCancel(pTimer);
+
+		FsmRun(FsmTop(pFsm), eventId);
+		expired++;
+	}
+
+	return expired;
+}
+
+/**************************************************************************************************/
+// Advance the wheel by ticks, running each expired timer's event as it comes due.
+// Returns the number of timers that expired.
+int FsmTimerAdvance (FsmTimerWheel *pWheel, uint64_t ticks)
+{
+	int	expired = 0;
+
+	while (ticks > 0)
+	{
+		if (0 == pWheel->count)
+		{
+			pWheel->now += ticks;	// nothing armed, nothing to run
+			break;
+		}
+
+		expired += FsmTimerTick(pWheel);
+		ticks--;
+	}
+
+	return expired;
+}
+
+/**************************************************************************************************/
+// Advance the wheel to tick now (does nothing if now is in the past)
+int FsmTimerAdvanceTo (FsmTimerWheel *pWheel, uint64_t now)
+{
+	if (now <= pWheel->now)
+		return 0;
+
+	return FsmTimerAdvance(pWheel, now - pWheel->now);
+}
+
+/**************************************************************************************************/
+// Ticks from now until the next tick that can run a timer, or move timers down a level.
+// Exact for timers due within FSM_TIMER_SLOTS ticks; use it as a sleep time.
+uint64_t FsmTimerNextExpiry (const FsmTimerWheel *pWheel)
+{
+	uint64_t	next = FSM_TIMER_NEVER;
+	int			level;
+
+	if (0 == pWheel->count)
+		return FSM_TIMER_NEVER;
+
+	for (level=0; level<FSM_TIMER_LEVELS; level++)
+	{
+		uint64_t	occupied = pWheel->occupied[level];
+		uint64_t	block = pWheel->now >> LEVEL_SHIFT(level);
+		int			index = (int)(block & SLOT_MASK);
+		uint64_t	rotated;
+		int			distance;
+		uint64_t	ticks;
+
+		if (0 == occupied)
+			continue;
+
+		// distance (1..FSM_TIMER_SLOTS) to the next occupied slot after the current one
+		rotated = (index == SLOT_MASK) ? occupied : ((occupied >> (index + 1)) | (occupied << (SLOT_MASK - index)));
+		distance = FsmCtz64(rotated) + 1;
+
+		ticks = ((block + (uint64_t)distance) << LEVEL_SHIFT(level)) - pWheel->now;
+		if (ticks < next)
+			next = ticks;
+	}
+
+	return next;
+
+} // FsmTimerNextExpiry
@@ -0,0 +1,108 @@
+/*
+ *
+ * File: fsm_timer.h
+ *
+ * Time events: timers that run an event on an FSM, on a hierarchical timing wheel
+ *
+ *
+ */
+
+#ifndef _FSM_TIMER_H_
+#define _FSM_TIMER_H_
+
+#include <stdint.h>
+
+#include "fsm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**************************************************************************************************/
+// FSM timers
+/**************************************************************************************************/
+
+// A timer runs an event on an FSM after a delay. Time is counted in ticks of a timer wheel;
+// the wheel only moves when the thread that runs the FSMs advances it, so expired timers run
+// their events on that thread, the same as FsmRun:
+//
+//       FsmTimerWheel   timerWheel;
+//       FsmTimer        timer_Connecting;
+//       ...
+//       FsmTimerWheelInit(&timerWheel);
+//       ...
+//       FSM_EVENT_HANDLER( Connecting_Entry )
+//       {
+//           // EVT_TIMEOUT in 500 ticks, unless the state exits first
+//           FsmTimerArm(&timerWheel, &timer_Connecting, pState, EVT_TIMEOUT, 500, 0);
+//           return NULL;
+//       }
+//       ...
+//       FsmTimerAdvance(&timerWheel, 1);		// from a periodic tick, or
+//       FsmTimerAdvanceTo(&timerWheel, now);	// from the thread's own clock
+//
+// A timer armed with FsmTimerArm belongs to a state: it is cancelled when the state exits
+// (FsmStateDefaultHandler, EVT_FSM_EXIT or EVT_FSM_SUPERSTATE_EXIT). FsmTimerPost is a delayed
+// post that no state exit cancels. A delay of 0 is one tick. The event runs on the top level
+// FSM above the timer's (FsmTop), so a state in a nested FSM gets it as it would from FsmRun on
+// the whole machine.
+//
+// The wheel isn't locked: arm, cancel and advance it on the thread that runs its FSMs. So a
+// state in the nested FSMs of a parallel state (FsmSetParallel, fsm_pool.h) can't own timers:
+// its exit would cancel them on a pool worker. FsmTimerArm logs an error and doesn't arm them.
+//
+// The wheel has FSM_TIMER_LEVELS levels of FSM_TIMER_SLOTS slots. Level 0 slots are one tick
+// wide, each level up is FSM_TIMER_SLOTS times wider. Timers are intrusive, so arming and
+// cancelling are O(1) list operations with no allocation. A timer moves down a level when its
+// slot comes due, at most FSM_TIMER_LEVELS - 1 times over its life.
+//
+// Tests and benchmarks advance the wheel by hand, so timer expiry is deterministic.
+
+#define FSM_TIMER_BITS		6
+#define FSM_TIMER_SLOTS		(1 << FSM_TIMER_BITS)
+#define FSM_TIMER_LEVELS	6			// range is 2^36 ticks; longer delays wait at the top level
+#define FSM_TIMER_NEVER		UINT64_MAX
+
+typedef struct FsmTimerWheel FsmTimerWheel;
+
+struct FsmTimer
+{
+	FsmTimer *		pNext;			// wheel slot list
+	FsmTimer *		pPrev;
+	FsmTimer **		ppSlot;			// list head, NULL if the timer is not armed
+	FsmTimer *		pStateNext;		// owning state's timers
+	FsmTimer *		pStatePrev;
+	FsmTimerWheel *	pWheel;
+	Fsm *			pFsm;			// FSM to run the event on
+	FsmState *		pState;			// state that cancels the timer when it exits, NULL if none
+	uint64_t		expires;		// tick
+	uint64_t		period;			// ticks between repeats, 0 for one shot
+	int				eventId;
+};
+
+struct FsmTimerWheel
+{
+	uint64_t		now;			// current tick
+	int				count;			// armed timers
+	uint64_t		occupied[FSM_TIMER_LEVELS];		// bit per non-empty slot
+	FsmTimer *		slot[FSM_TIMER_LEVELS][FSM_TIMER_SLOTS];
+};
+
+// ... Timer objects (must start zeroed; a static FsmTimer is)
+#define FSM_TIMER(obj)		FsmTimer obj = { NULL }
+
+void FsmTimerWheelInit (FsmTimerWheel *pWheel);
+void FsmTimerArm (FsmTimerWheel *pWheel, FsmTimer *pTimer, FsmState *pState, int eventId, uint64_t delay, uint64_t period);
+void FsmTimerPost (FsmTimerWheel *pWheel, FsmTimer *pTimer, Fsm *pFsm, int eventId, uint64_t delay, uint64_t period);
+void FsmTimerCancel (FsmTimer *pTimer);
+void FsmTimerCancelState (FsmState *pState);
+bool FsmTimerArmed (const FsmTimer *pTimer);
+int  FsmTimerAdvance (FsmTimerWheel *pWheel, uint64_t ticks);	// returns number of timers that expired
+int  FsmTimerAdvanceTo (FsmTimerWheel *pWheel, uint64_t now);
+uint64_t FsmTimerNextExpiry (const FsmTimerWheel *pWheel);		// ticks until a timer may expire, FSM_TIMER_NEVER if none
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _FSM_TIMER_H_
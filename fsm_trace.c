@@ -0,0 +1,439 @@
+/*
+ *
+ * File: fsm_trace.c
+ *
+ * Binary FSM trace: per-thread lock-free record rings and a background file writer
+ *
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "fsm_trace.h"
+
+// Records are written by the owning thread and read by whichever thread drains the rings
+typedef struct FsmTraceRing FsmTraceRing;
+struct FsmTraceRing
+{
+	FsmTraceRing *			pNext;		// list of all rings
+	bool					exited;		// the owning thread has exited, under gDrainLock
+	_Alignas(64) atomic_size_t	tail;	// written by the owning thread
+	_Alignas(64) atomic_size_t	head;	// written by the drainer
+	FsmTraceRecord			record[FSM_TRACE_RING_SIZE];
+};
+
+// Name table: open addressed on the name pointer, so a name costs one hash probe per record
+typedef struct
+{
+	_Atomic(const char *)	key;
+	atomic_uint_least16_t	index;		// 0 until published
+} FsmTraceNameSlot;
+
+static FsmTraceNameSlot			gNameSlot[FSM_TRACE_MAX_NAMES];
+static _Atomic(const char *)	gNameString[FSM_TRACE_MAX_NAMES];
+static atomic_int				gNameCount;
+
+static _Atomic(FsmTraceRing *)	gRingList;
+static _Thread_local FsmTraceRing *	tRing;
+static atomic_uint_least64_t	gDropped;
+static atomic_bool				gDisabled;
+
+static pthread_mutex_t			gDrainLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t			gRingKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t			gRingKey;		// the thread's ring, to free it when the thread exits
+
+// file writer
+static FILE *					gTraceFile;
+static pthread_t				gWriterThread;
+static atomic_bool				gWriterRun;
+static int						gNamesWritten;
+
+/**************************************************************************************************/
+static uint64_t FsmTraceNow (void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/**************************************************************************************************/
+// Returns the index for a name, adding it to the name table the first time it is seen.
+// Names are matched by pointer; the same text at two addresses gets two indices.
+uint16_t FsmTraceName (const char *name)
+{
+	uintptr_t	hash = (uintptr_t)name;
+	int			i;
+	int			probe;
+
+	if (NULL == name)
+		return 0;
+
+	hash ^= hash >> 17;
+	hash *= 0x9E3779B1u;
+	i = (int)((hash >> 7) & (FSM_TRACE_MAX_NAMES - 1));
+
+	for (probe=0; probe<FSM_TRACE_MAX_NAMES; probe++, i = (i + 1) & (FSM_TRACE_MAX_NAMES - 1))
+	{
+		FsmTraceNameSlot	*pSlot = &gNameSlot[i];
+		const char			*key = atomic_load_explicit(&pSlot->key, memory_order_acquire);
+		uint16_t			index;
+
+		if (NULL == key)
+		{
+			const char	*expected = NULL;
+
+			if (!atomic_compare_exchange_strong_explicit(&pSlot->key, &expected, name,
+					memory_order_acq_rel, memory_order_acquire))
+			{
+				if (expected != name)
+					continue;			// another name took the slot
+			}
+			else
+			{
+				index = (uint16_t)(atomic_fetch_add_explicit(&gNameCount, 1, memory_order_relaxed) + 1);
+				if (index >= FSM_TRACE_MAX_NAMES)
+					index = 0;			// table full, name shows as unknown
+				else
+					atomic_store_explicit(&gNameString[index], name, memory_order_release);
+				atomic_store_explicit(&pSlot->index, index ? index : FSM_TRACE_MAX_NAMES, memory_order_release);
+			}
+		}
+		else if (key != name)
+			continue;
+
+		// wait for the thread that added the name to publish its index
+		while ((index = atomic_load_explicit(&pSlot->index, memory_order_acquire)) == 0)
+			;
+
+		return (index == FSM_TRACE_MAX_NAMES) ? 0 : index;
+	}
+
+	return 0;
+
+} // FsmTraceName
+
+/**************************************************************************************************/
+const char * FsmTraceNameString (uint16_t index)
+{
+	if ( (0 == index) || (index >= FSM_TRACE_MAX_NAMES) )
+		return "?";
+
+	return atomic_load_explicit(&gNameString[index], memory_order_acquire);
+}
+
+/**************************************************************************************************/
+int FsmTraceNameCount (void)
+{
+	int	count = atomic_load_explicit(&gNameCount, memory_order_relaxed);
+
+	return (count < FSM_TRACE_MAX_NAMES) ? count : FSM_TRACE_MAX_NAMES - 1;
+}
+
+/**************************************************************************************************/
+// Take a ring off the list and free it. Called with gDrainLock held, so only threads adding
+// rings at the head run meanwhile. Returns false if a ring was added in front of it just now;
+// the next drain frees it.
+static bool FsmTraceRingFree (FsmTraceRing *pRing)
+{
+	FsmTraceRing	*pHead = pRing;
+	FsmTraceRing	*pPrev;
+
+	if (!atomic_compare_exchange_strong_explicit(&gRingList, &pHead, pRing->pNext,
+			memory_order_acq_rel, memory_order_acquire))
+	{
+		for (pPrev = pHead; (pPrev != NULL) && (pPrev->pNext != pRing); pPrev = pPrev->pNext)
+			;
+		if (NULL == pPrev)
+			return false;
+		pPrev->pNext = pRing->pNext;
+	}
+
+	free(pRing);
+	return true;
+}
+
+/**************************************************************************************************/
+// Thread exit: free the thread's ring now if it's empty, else once FsmTraceDrain has emptied it
+static void FsmTraceRingExit (void *pArg)
+{
+	FsmTraceRing	*pRing = (FsmTraceRing *)pArg;
+
+	tRing = NULL;		// a later destructor that traces gets a new ring
+	pthread_mutex_lock(&gDrainLock);
+
+	pRing->exited = true;
+	if (atomic_load_explicit(&pRing->head, memory_order_relaxed) == atomic_load_explicit(&pRing->tail, memory_order_relaxed))
+		FsmTraceRingFree(pRing);
+
+	pthread_mutex_unlock(&gDrainLock);
+}
+
+/**************************************************************************************************/
+static void FsmTraceRingKeyCreate (void)
+{
+	pthread_key_create(&gRingKey, FsmTraceRingExit);
+}
+
+/**************************************************************************************************/
+// First record on a thread allocates its ring
+static FsmTraceRing * FsmTraceRingCreate (void)
+{
+	FsmTraceRing	*pRing = (FsmTraceRing *)aligned_alloc(_Alignof(FsmTraceRing), sizeof(FsmTraceRing));
+
+	if (NULL == pRing)
+		return NULL;
+
+	memset(pRing, 0, sizeof(FsmTraceRing));
+
+	pthread_once(&gRingKeyOnce, FsmTraceRingKeyCreate);
+	pthread_setspecific(gRingKey, pRing);
+
+	pRing->pNext = atomic_load_explicit(&gRingList, memory_order_relaxed);
+	while (!atomic_compare_exchange_weak_explicit(&gRingList, &pRing->pNext, pRing,
+				memory_order_release, memory_order_relaxed))
+		;
+
+	return pRing;
+}
+
+/**************************************************************************************************/
+// Append a record to the calling thread's ring. Drops the record if the ring is full.
+void FsmTraceWrite (uint16_t site, int phase, const char *fsmName, const char *stateName,
+					int eventId, bool consumed)
+{
+	FsmTraceRing	*pRing = tRing;
+	FsmTraceRecord	*pRecord;
+	size_t			tail;
+
+	if (atomic_load_explicit(&gDisabled, memory_order_relaxed))
+		return;
+
+	if (NULL == pRing)
+	{
+		pRing = tRing = FsmTraceRingCreate();
+		if (NULL == pRing)
+			return;
+	}
+
+	tail = atomic_load_explicit(&pRing->tail, memory_order_relaxed);
+	if (tail - atomic_load_explicit(&pRing->head, memory_order_acquire) >= FSM_TRACE_RING_SIZE)
+	{
+		atomic_fetch_add_explicit(&gDropped, 1, memory_order_relaxed);
+		return;
+	}
+
+	pRecord = &pRing->record[tail & (FSM_TRACE_RING_SIZE - 1)];
+	pRecord->timestamp = FsmTraceNow();
+	pRecord->eventId = eventId;
+	pRecord->fsm = FsmTraceName(fsmName);
+	pRecord->state = FsmTraceName(stateName);
+	pRecord->site = site;
+	pRecord->phase = (uint8_t)phase;
+	pRecord->consumed = consumed ? 1 : 0;
+
+	atomic_store_explicit(&pRing->tail, tail + 1, memory_order_release);
+
+} // FsmTraceWrite
+
+/**************************************************************************************************/
+// Hand every record waiting in every thread's ring to pfnSink, oldest first for each thread.
+// The rings of threads that have exited are freed once they're drained.
+// Returns the number of records drained.
+int FsmTraceDrain (FsmTraceSink pfnSink, void *pContext)
+{
+	FsmTraceRing	*pRing;
+	FsmTraceRing	*pNext;
+	int				total = 0;
+
+	pthread_mutex_lock(&gDrainLock);
+
+	for (pRing = atomic_load_explicit(&gRingList, memory_order_acquire); pRing != NULL; pRing = pNext)
+	{
+		size_t	head = atomic_load_explicit(&pRing->head, memory_order_relaxed);
+		size_t	tail = atomic_load_explicit(&pRing->tail, memory_order_acquire);
+
+		while (head != tail)
+		{
+			size_t	first = head & (FSM_TRACE_RING_SIZE - 1);
+			size_t	count = tail - head;
+
+			if (first + count > FSM_TRACE_RING_SIZE)	// stop at the end of the ring
+				count = FSM_TRACE_RING_SIZE - first;
+
+			(*pfnSink)(pContext, &pRing->record[first], (int)count);
+
+			head += count;
+			total += (int)count;
+			atomic_store_explicit(&pRing->head, head, memory_order_release);
+		}
+
+		pNext = pRing->pNext;
+		if (pRing->exited)
+			FsmTraceRingFree(pRing);
+	}
+
+	pthread_mutex_unlock(&gDrainLock);
+
+	return total;
+
+} // FsmTraceDrain
+
+/**************************************************************************************************/
+uint64_t FsmTraceDropped (void)
+{
+	return atomic_load_explicit(&gDropped, memory_order_relaxed);
+}
+
+/**************************************************************************************************/
+void FsmTraceEnable (bool enable)
+{
+	atomic_store_explicit(&gDisabled, !enable, memory_order_relaxed);
+}
+
+/**************************************************************************************************/
+// file writer
+/**************************************************************************************************/
+
+/**************************************************************************************************/
+static void FsmTraceWriteChunk (uint32_t tag, const void *pData, uint32_t length)
+{
+	fwrite(&tag, sizeof(tag), 1, gTraceFile);
+	fwrite(&length, sizeof(length), 1, gTraceFile);
+	fwrite(pData, 1, length, gTraceFile);
+}
+
+/**************************************************************************************************/
+// Write the names added since the last call. Every name a drained record refers to was
+// added before the record was written, so writing the names first keeps the file decodable.
+static void FsmTraceWriteNames (int nameCount)
+{
+	char	buf[2 + 256];
+
+	while (gNamesWritten < nameCount)
+	{
+		uint16_t	index = (uint16_t)(gNamesWritten + 1);
+		const char	*name;
+		size_t		len;
+
+		while ((name = FsmTraceNameString(index)) == NULL)
+			;					// another thread is between taking the index and storing the name
+
+		len = strlen(name);
+		if (len > sizeof(buf) - 2)
+			len = sizeof(buf) - 2;
+
+		memcpy(buf, &index, 2);
+		memcpy(buf + 2, name, len);
+		FsmTraceWriteChunk(FSM_TRACE_CHUNK_NAME, buf, (uint32_t)(2 + len));
+
+		gNamesWritten++;
+	}
+}
+
+/**************************************************************************************************/
+static void FsmTraceFileSink (void *pContext, const FsmTraceRecord *pRecords, int count)
+{
+	(void)pContext;
+
+	FsmTraceWriteNames(FsmTraceNameCount());
+	FsmTraceWriteChunk(FSM_TRACE_CHUNK_RECORDS, pRecords, (uint32_t)(count * sizeof(FsmTraceRecord)));
+}
+
+/**************************************************************************************************/
+static void FsmTraceFlushFile (void)
+{
+	FsmTraceDrain(FsmTraceFileSink, NULL);
+	fflush(gTraceFile);
+}
+
+/**************************************************************************************************/
+static void * FsmTraceWriterThread (void *pArg)
+{
+	struct timespec	period = { FSM_TRACE_DRAIN_MS / 1000, (FSM_TRACE_DRAIN_MS % 1000) * 1000000L };
+
+	(void)pArg;
+
+	while (atomic_load(&gWriterRun))
+	{
+		nanosleep(&period, NULL);
+		FsmTraceFlushFile();
+	}
+
+	return NULL;
+}
+
+/**************************************************************************************************/
+// Open the trace file and start the writer thread
+// Returns -1 if the file can't be opened or the writer is already running, else 0
+int FsmTraceStart (const char *path)
+{
+	uint32_t	header[2] = { FSM_TRACE_FILE_VERSION, sizeof(FsmTraceRecord) };
+	char		*pNames;
+	size_t		len = 0;
+	int			i;
+
+	if (gTraceFile != NULL)
+		return -1;
+
+	gTraceFile = fopen(path, "wb");
+	if (NULL == gTraceFile)
+	{
+		FSM_LOG("!!!! FSM ERROR !!!! can't open trace file %s", path);
+		return -1;
+	}
+
+	fwrite(FSM_TRACE_FILE_MAGIC, 1, 8, gTraceFile);
+	fwrite(header, sizeof(header), 1, gTraceFile);
+
+	// event id names, so the decoder doesn't need this build's fsm_events.h
+	for (i=0; i<EVT_FSM_EOL; i++)
+		len += strlen(FSM_EVT_NAME(i)) + 1;
+
+	pNames = (char *)malloc(len ? len : 1);
+	if (pNames != NULL)
+	{
+		len = 0;
+		for (i=0; i<EVT_FSM_EOL; i++)
+		{
+			strcpy(pNames + len, FSM_EVT_NAME(i));
+			len += strlen(FSM_EVT_NAME(i)) + 1;
+		}
+		FsmTraceWriteChunk(FSM_TRACE_CHUNK_EVENTS, pNames, (uint32_t)len);
+		free(pNames);
+	}
+
+	gNamesWritten = 0;
+	atomic_store(&gWriterRun, true);
+
+	if (pthread_create(&gWriterThread, NULL, FsmTraceWriterThread, NULL) != 0)
+	{
+		atomic_store(&gWriterRun, false);
+		fclose(gTraceFile);
+		gTraceFile = NULL;
+		return -1;
+	}
+
+	return 0;
+
+} // FsmTraceStart
+
+/**************************************************************************************************/
+// Stop the writer thread, write any records still in the rings and close the file
+void FsmTraceStop (void)
+{
+	if (NULL == gTraceFile)
+		return;
+
+	atomic_store(&gWriterRun, false);
+	pthread_join(gWriterThread, NULL);
+
+	FsmTraceFlushFile();
+
+	fclose(gTraceFile);
+	gTraceFile = NULL;
+}
@@ -0,0 +1,112 @@
+/*
+ *
+ * File: fsm_trace.h
+ *
+ * Binary FSM trace: per-thread lock-free record rings and a background file writer
+ *
+ *
+ */
+
+#ifndef _FSM_TRACE_H_
+#define _FSM_TRACE_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "fsm.h"
+
+/**************************************************************************************************/
+// Binary trace
+/**************************************************************************************************/
+
+// #define FSM_TRACE 2 (FSM_TRACE_BINARY) in a .c module before including fsm.h to send that
+// module's FSM_TRACE_ENTER/FSM_TRACE_EXIT/FSM_TRACE_RUN trace points to the binary trace instead
+// of formatting them with FSM_LOG. Build fsm.c with -DFSM_TRACE=2 to record ignored events too.
+//
+// Each trace point writes one fixed size record to a ring owned by the calling thread, with no
+// locks and no formatting. Names (FSMs, states, functions, run tags) are recorded as indices into
+// a name table that is filled in the first time each name is seen. If a ring fills up before it
+// is drained, new records are dropped and counted.
+//
+// FsmTraceStart starts a thread that periodically drains every ring to a file; FsmTraceStop
+// drains what's left and closes the file. tools/fsm_trace_decode turns the file back into the
+// same CSV layout FSM_LOG produces (see docs/fsm-trace.csv).
+//
+// File layout (native byte order):
+//       header:  "FSMTRACE", uint32 version, uint32 sizeof(FsmTraceRecord)
+//       chunks:  uint32 tag, uint32 length, length bytes
+//                FSM_TRACE_CHUNK_EVENTS  event id names, '\0' separated, index = event id
+//                FSM_TRACE_CHUNK_NAME    uint16 name index, name text
+//                FSM_TRACE_CHUNK_RECORDS array of FsmTraceRecord
+// A name chunk always comes before the first record that refers to it.
+
+#define FSM_TRACE_FILE_MAGIC		"FSMTRACE"
+#define FSM_TRACE_FILE_VERSION		1
+
+#define FSM_TRACE_CHUNK_EVENTS		0x53545645u		// "EVTS"
+#define FSM_TRACE_CHUNK_NAME		0x454D414Eu		// "NAME"
+#define FSM_TRACE_CHUNK_RECORDS		0x53434552u		// "RECS"
+
+#ifndef FSM_TRACE_RING_SIZE
+	#define FSM_TRACE_RING_SIZE		8192		// records per thread, must be a power of 2
+#endif
+
+#ifndef FSM_TRACE_MAX_NAMES
+	#define FSM_TRACE_MAX_NAMES		4096		// must be a power of 2
+#endif
+
+#ifndef FSM_TRACE_DRAIN_MS
+	#define FSM_TRACE_DRAIN_MS		10			// file writer period
+#endif
+
+typedef enum
+{
+	FSM_TRACE_PHASE_ENTER,		// state handler called
+	FSM_TRACE_PHASE_EXIT,		// state handler returned
+	FSM_TRACE_PHASE_RUN,		// application trace point, eventId is the name index of the tag
+	FSM_TRACE_PHASE_IGNORED		// event not consumed by the FSM
+} eFsmTracePhase;
+
+typedef struct FsmTraceRecord
+{
+	uint64_t	timestamp;	// ns, CLOCK_MONOTONIC
+	int32_t		eventId;
+	uint16_t	fsm;		// name index of the FSM
+	uint16_t	state;		// name index of the state
+	uint16_t	site;		// name index of the function with the trace point
+	uint8_t		phase;		// eFsmTracePhase
+	uint8_t		consumed;	// FSM_TRACE_PHASE_EXIT only
+} FsmTraceRecord;
+
+typedef void (*FsmTraceSink)(void *pContext, const FsmTraceRecord *pRecords, int count);
+
+uint16_t		FsmTraceName (const char *name);	// name index, 0 if the name table is full
+const char *	FsmTraceNameString (uint16_t index);
+int				FsmTraceNameCount (void);			// highest name index in use
+void			FsmTraceWrite (uint16_t site, int phase, const char *fsmName, const char *stateName,
+								int eventId, bool consumed);
+int				FsmTraceDrain (FsmTraceSink pfnSink, void *pContext);	// returns records drained
+uint64_t		FsmTraceDropped (void);
+void			FsmTraceEnable (bool enable);		// trace points record nothing while disabled
+
+int				FsmTraceStart (const char *path);	// returns -1 if the file can't be opened
+void			FsmTraceStop (void);
+
+// Trace points used by the FSM_TRACE_xxx macros in fsm.h. The site name (the function name for
+// FSM_TRACE_POINT) is looked up once per call site.
+#define FSM_TRACE_POINT(phase,fsm_name,state_name,event_id,consumed)						\
+	FSM_TRACE_POINT_AT(__func__, phase, fsm_name, state_name, event_id, consumed)
+
+#define FSM_TRACE_POINT_AT(site_name,phase,fsm_name,state_name,event_id,consumed)		\
+	{																					\
+		static atomic_uint_least16_t	fsmTraceSite;									\
+		uint16_t	site = atomic_load_explicit(&fsmTraceSite, memory_order_relaxed);	\
+		if (0 == site)																	\
+		{																				\
+			site = FsmTraceName(site_name);												\
+			atomic_store_explicit(&fsmTraceSite, site, memory_order_relaxed);			\
+		}																				\
+		FsmTraceWrite(site, (phase), (fsm_name), (state_name), (event_id), (consumed));	\
+	}
+
+#endif // _FSM_TRACE_H_
@@ -0,0 +1,942 @@
+/*
+ *
+ * File: fsm_check.c
+ *
+ * Regression checks for the framework: event queues, mailboxes, payloads, transitions, history
+ * and images, definitions (fsm_def.c), and coroutine handlers (fsm_check_co.cpp)
+ *
+ *     usage: fsm_check [name_prefix ...]
+ *
+ * Each check builds what it needs, runs it and compares the result with what it should be.
+ * Transitions are checked against a log of the Entry, Superstate Entry and Exit actions they run. Every failed
+ * comparison is printed with its line; the exit status is 1 if any failed. The framework logs the
+ * errors some checks provoke on purpose (a full queue, an empty slab) as usual.
+ *
+ * make check builds this twice, once as is and once with FSM_DISPATCH_DEPTH 0, so the same
+ * machines run on both the recursive dispatch and the dispatch engine (fsm.c). Both builds have
+ * the counters (FSM_STATS) on.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "fsm.h"
+#include "fsm_mailbox.h"
+#include "fsm_payload.h"
+#include "fsm_image.h"
+#include "fsm_def.h"
+#include "fsm_stats.h"
+#include "fsm_check.h"
+
+#define CHECK_LOG_SIZE		256
+#define CHECK_RECORD_MAX	16
+#define CHECK_STATE_EVENTS	10
+
+static int		gChecks;
+static int		gFailed;
+
+#define CHECK_LOG(expected)		CheckLog((expected), __LINE__)
+
+/**************************************************************************************************/
+void CheckResult (bool ok, const char *pText, int line)
+{
+	gChecks++;
+
+	if (!ok)
+	{
+		gFailed++;
+		printf("    line %d: CHECK(%s) failed\n", line, pText);
+	}
+}
+
+/**************************************************************************************************/
+// Log of Entry ("name+"), Superstate Entry ("name^") and Exit ("name-") actions, and of the
+// events CheckRecord saw
+/**************************************************************************************************/
+static char		gLog[CHECK_LOG_SIZE];
+static int		gRecord[CHECK_RECORD_MAX];
+static int		gRecordData[CHECK_RECORD_MAX];
+static int		gRecordCount;
+
+static void CheckLogClear (void)
+{
+	gLog[0] = '\0';
+	gRecordCount = 0;
+}
+
+static void CheckLogAdd (const char *pName, char action)
+{
+	size_t	len = strlen(gLog);
+
+	snprintf(gLog + len, sizeof(gLog) - len, "%s%s%c", len ? " " : "", pName, action);
+}
+
+// Compare the log with what it should be, and start a new one
+static void CheckLog (const char *pExpected, int line)
+{
+	gChecks++;
+
+	if (strcmp(gLog, pExpected))
+	{
+		gFailed++;
+		printf("    line %d: log \"%s\", expected \"%s\"\n", line, gLog, pExpected);
+	}
+
+	CheckLogClear();
+}
+
+/**************************************************************************************************/
+// Machines are built at run time: each state logs its Entry and Exit actions, and its user
+// events go to one handler for the whole machine
+/**************************************************************************************************/
+
+// A transition: eventId in state pFrom goes to pTo
+typedef struct
+{
+	FsmState *		pFrom;
+	int				eventId;
+	FsmState *		pTo;
+} CheckGoto;
+
+typedef struct
+{
+	FsmEvent		evt[CHECK_STATE_EVENTS];
+	FsmEvent *		list[CHECK_STATE_EVENTS + 1];
+} CheckEvents;
+
+static const CheckGoto *	gGoto;		// transitions of the machine being checked
+static int					gGotoCount;
+
+FSM_EVENT_HANDLER( CheckEntry )		{ CheckLogAdd(pState->name, '+'); pEvent->consumed = true; return NULL; }
+FSM_EVENT_HANDLER( CheckSuperEntry )	{ CheckLogAdd(pState->name, '^'); pEvent->consumed = true; return NULL; }
+FSM_EVENT_HANDLER( CheckExit )		{ CheckLogAdd(pState->name, '-'); pEvent->consumed = false; return NULL; }
+
+// Take the transition gGoto has for the event in this state, if any
+FSM_EVENT_HANDLER( CheckTransition )
+{
+	int		i;
+
+	for (i=0; i<gGotoCount; i++)
+	{
+		if ( (gGoto[i].pFrom == pState) && (gGoto[i].eventId == pEvent->id) )
+		{
+			pEvent->consumed = true;
+			return gGoto[i].pTo;
+		}
+	}
+
+	pEvent->consumed = false;
+	return NULL;
+}
+
+// Save the event and its payload (an int, -1 if none)
+FSM_EVENT_HANDLER( CheckRecord )
+{
+	int		*pData = (int *)FSM_EVENT_DATA(pEvent);
+
+	if (gRecordCount < CHECK_RECORD_MAX)
+	{
+		gRecord[gRecordCount] = pEvent->id;
+		gRecordData[gRecordCount++] = (NULL == pData) ? -1 : *pData;
+	}
+
+	pEvent->consumed = true;
+	return NULL;
+}
+
+/**************************************************************************************************/
+static void CheckFsmInit (Fsm *pFsm, const char *pName, FsmState *pInitialState, int history)
+{
+	memset(pFsm, 0, sizeof(Fsm));
+	pFsm->name = pName;
+	pFsm->pInitialState = pInitialState;
+	pFsm->history = history;
+}
+
+/**************************************************************************************************/
+// A state that logs its Entry and Exit actions and handles EVT_1..EVT_4 with pfnHandler
+static void CheckStateInit (FsmState *pState, CheckEvents *pEvents, Fsm *pFsm, Fsm **nestedFsmList,
+							const char *pName, FsmEvtHandler pfnHandler)
+{
+	static const int			entryExit[] = { EVT_FSM_ENTRY, EVT_FSM_SUPERSTATE_ENTRY, EVT_FSM_EXIT, EVT_FSM_SUPERSTATE_EXIT };
+	static const FsmEvtHandler	entryExitHandler[] = { CheckEntry, CheckSuperEntry, CheckExit, CheckExit };
+	int							n = 0;
+	int							i;
+
+	for (i=0; i<4; i++, n++)
+	{
+		pEvents->evt[n].id = entryExit[i];
+		pEvents->evt[n].pfnEvtHandler = entryExitHandler[i];
+	}
+	for (i=EVT_1; i<=EVT_4; i++, n++)
+	{
+		pEvents->evt[n].id = i;
+		pEvents->evt[n].pfnEvtHandler = pfnHandler;
+	}
+	for (i=0; i<n; i++)
+		pEvents->list[i] = &pEvents->evt[i];
+	pEvents->list[n] = &fsmNullEvent;
+
+	memset(pState, 0, sizeof(FsmState));
+	pState->pFsm = pFsm;
+	pState->nestedFsmList = nestedFsmList;
+	pState->eventList = pEvents->list;
+	pState->name = pName;
+	pState->pfnStateHandler = FsmStateDefaultHandler;
+	pState->notifyEventId = EVT_FSM_NULL;
+}
+
+/**************************************************************************************************/
+// Payloads
+/**************************************************************************************************/
+FSM_SLAB(slab_Check, sizeof(int), 8);
+
+static FsmPayload * CheckPayload (int value)
+{
+	FsmPayload	*pPayload = FsmPayloadAlloc(&slab_Check);
+
+	if (pPayload != NULL)
+		*(int *)FsmPayloadData(pPayload) = value;
+
+	return pPayload;
+}
+
+static int CheckPayloadValue (FsmPayload *pPayload)
+{
+	return (NULL == pPayload) ? -1 : *(int *)FsmPayloadData(pPayload);
+}
+
+// Free blocks in the slab: every reference has been released when it's slab_Check.nBlocks
+static int CheckSlabFree (void)
+{
+	int		next = (int)(atomic_load(&slab_Check.freeHead) & 0xFFFFFFFF);
+	int		count = 0;
+
+	while ( (next > 0) && (count <= slab_Check.nBlocks) )
+	{
+		FsmPayload	*pPayload = (FsmPayload *)(slab_Check.pool + (size_t)(next - 1) * slab_Check.blockSize);
+
+		next = atomic_load(&pPayload->nextFree);
+		count++;
+	}
+
+	return count;
+}
+
+/**************************************************************************************************/
+// Event recorder: a flat machine whose one state records every user event
+/**************************************************************************************************/
+static Fsm			fsm_Rec;
+static FsmState		state_Rec;
+static CheckEvents	events_Rec;
+
+FSM_PQ(q_RecDefer, 8);
+
+static void RecBuild (void)
+{
+	CheckFsmInit(&fsm_Rec, "Rec", NULL, FSM_HISTORY_NONE);
+	CheckStateInit(&state_Rec, &events_Rec, &fsm_Rec, NULL, "R", CheckRecord);
+
+	FSM_Q_INIT(q_RecDefer);
+	fsm_Rec.deferQ = (FsmQ *)&q_RecDefer;
+
+	FsmInit(&fsm_Rec, &state_Rec);
+	CheckLogClear();
+}
+
+/**************************************************************************************************/
+// LCA machine
+//     Top: T1 (nests A), T2 (nests C)
+//     A:   A1 (nests B), A2		B: B1, B2		C: C1, C2
+// A and B enter their first state each time their parent is entered. C has no initial state: a
+// transition sets it, and entering T2 again enters that state with EVT_FSM_SUPERSTATE_ENTRY.
+/**************************************************************************************************/
+static Fsm			fsm_LcaTop, fsm_LcaA, fsm_LcaB, fsm_LcaC;
+static FsmState		state_T1, state_T2, state_A1, state_A2, state_B1, state_B2, state_C1, state_C2;
+static CheckEvents	events_Lca[8];
+static Fsm *		nested_T1[] = { &fsm_LcaA, NULL };
+static Fsm *		nested_T2[] = { &fsm_LcaC, NULL };
+static Fsm *		nested_A1[] = { &fsm_LcaB, NULL };
+
+FSM_PQ(q_LcaDefer, 8);
+
+static const CheckGoto	gLcaGoto[] = {
+	{ &state_B1, EVT_1, &state_B2 },		// in B
+	{ &state_B2, EVT_2, &state_A2 },		// out of B, up to A
+	{ &state_A2, EVT_3, &state_C2 },		// across the top, into a state that isn't C's first
+	{ &state_C2, EVT_4, &state_B1 },		// across the top, two levels down
+	{ &state_A1, EVT_3, &state_T2 },		// to the top state that holds C
+};
+
+static Fsm *		gLcaFsms[] = { &fsm_LcaTop, &fsm_LcaA, &fsm_LcaB, &fsm_LcaC };
+static FsmState *	gLcaStates[] = { &state_T1, &state_T2, &state_A1, &state_A2, &state_B1, &state_B2, &state_C1, &state_C2 };
+static FsmSlab *	gLcaSlabs[] = { &slab_Check };
+
+static void LcaBuild (void)
+{
+	CheckFsmInit(&fsm_LcaTop, "Top", NULL,       FSM_HISTORY_NONE);
+	CheckFsmInit(&fsm_LcaA,   "A",   &state_A1,  FSM_HISTORY_NONE);
+	CheckFsmInit(&fsm_LcaB,   "B",   &state_B1,  FSM_HISTORY_NONE);
+	CheckFsmInit(&fsm_LcaC,   "C",   NULL,       FSM_HISTORY_NONE);
+
+	CheckStateInit(&state_T1, &events_Lca[0], &fsm_LcaTop, nested_T1, "T1", CheckTransition);
+	CheckStateInit(&state_T2, &events_Lca[1], &fsm_LcaTop, nested_T2, "T2", CheckTransition);
+	CheckStateInit(&state_A1, &events_Lca[2], &fsm_LcaA,   nested_A1, "A1", CheckTransition);
+	CheckStateInit(&state_A2, &events_Lca[3], &fsm_LcaA,   NULL,      "A2", CheckTransition);
+	CheckStateInit(&state_B1, &events_Lca[4], &fsm_LcaB,   NULL,      "B1", CheckTransition);
+	CheckStateInit(&state_B2, &events_Lca[5], &fsm_LcaB,   NULL,      "B2", CheckTransition);
+	CheckStateInit(&state_C1, &events_Lca[6], &fsm_LcaC,   NULL,      "C1", CheckTransition);
+	CheckStateInit(&state_C2, &events_Lca[7], &fsm_LcaC,   NULL,      "C2", CheckTransition);
+
+	// C2 and B1 are targets before their FSMs have been entered
+	FsmLinkState(&state_T1);
+	FsmLinkState(&state_T2);
+	FsmLinkState(&state_A1);
+
+	FSM_Q_INIT(q_LcaDefer);
+	fsm_LcaTop.deferQ = (FsmQ *)&q_LcaDefer;
+
+	gGoto = gLcaGoto;
+	gGotoCount = sizeof(gLcaGoto)/sizeof(gLcaGoto[0]);
+
+	CheckLogClear();
+	FsmInit(&fsm_LcaTop, &state_T1);
+}
+
+/**************************************************************************************************/
+// History machine
+//     Top: H1 (nests S), H2 (nests D)
+//     S:   S1, S2 (nests I), shallow history		I: I1, I2, no history
+//     D:   D1, D2 (nests J), deep history			J: J1, J2, shallow history
+/**************************************************************************************************/
+static Fsm			fsm_HistTop, fsm_HistS, fsm_HistI, fsm_HistD, fsm_HistJ;
+static FsmState		state_H1, state_H2, state_S1, state_S2, state_I1, state_I2, state_D1, state_D2, state_J1, state_J2;
+static CheckEvents	events_Hist[10];
+static Fsm *		nested_H1[] = { &fsm_HistS, NULL };
+static Fsm *		nested_H2[] = { &fsm_HistD, NULL };
+static Fsm *		nested_S2[] = { &fsm_HistI, NULL };
+static Fsm *		nested_D2[] = { &fsm_HistJ, NULL };
+
+static const CheckGoto	gHistGoto[] = {
+	{ &state_H1, EVT_4, &state_H2 }, { &state_H2, EVT_4, &state_H1 },
+	{ &state_S1, EVT_2, &state_S2 }, { &state_S2, EVT_2, &state_S1 },
+	{ &state_D1, EVT_2, &state_D2 }, { &state_D2, EVT_2, &state_D1 },
+	{ &state_I1, EVT_3, &state_I2 }, { &state_I2, EVT_3, &state_I1 },
+	{ &state_J1, EVT_3, &state_J2 }, { &state_J2, EVT_3, &state_J1 },
+	{ &state_D1, EVT_1, &state_S2 },
+};
+
+static void HistBuild (void)
+{
+	CheckFsmInit(&fsm_HistTop, "Top", NULL,       FSM_HISTORY_NONE);
+	CheckFsmInit(&fsm_HistS,   "S",   &state_S1,  FSM_HISTORY_SHALLOW);
+	CheckFsmInit(&fsm_HistI,   "I",   &state_I1,  FSM_HISTORY_NONE);
+	CheckFsmInit(&fsm_HistD,   "D",   &state_D1,  FSM_HISTORY_DEEP);
+	CheckFsmInit(&fsm_HistJ,   "J",   &state_J1,  FSM_HISTORY_SHALLOW);
+
+	CheckStateInit(&state_H1, &events_Hist[0], &fsm_HistTop, nested_H1, "H1", CheckTransition);
+	CheckStateInit(&state_H2, &events_Hist[1], &fsm_HistTop, nested_H2, "H2", CheckTransition);
+	CheckStateInit(&state_S1, &events_Hist[2], &fsm_HistS,   NULL,      "S1", CheckTransition);
+	CheckStateInit(&state_S2, &events_Hist[3], &fsm_HistS,   nested_S2, "S2", CheckTransition);
+	CheckStateInit(&state_I1, &events_Hist[4], &fsm_HistI,   NULL,      "I1", CheckTransition);
+	CheckStateInit(&state_I2, &events_Hist[5], &fsm_HistI,   NULL,      "I2", CheckTransition);
+	CheckStateInit(&state_D1, &events_Hist[6], &fsm_HistD,   NULL,      "D1", CheckTransition);
+	CheckStateInit(&state_D2, &events_Hist[7], &fsm_HistD,   nested_D2, "D2", CheckTransition);
+	CheckStateInit(&state_J1, &events_Hist[8], &fsm_HistJ,   NULL,      "J1", CheckTransition);
+	CheckStateInit(&state_J2, &events_Hist[9], &fsm_HistJ,   NULL,      "J2", CheckTransition);
+
+	FsmLinkState(&state_H1);		// S2 is a target from D1
+
+	gGoto = gHistGoto;
+	gGotoCount = sizeof(gHistGoto)/sizeof(gHistGoto[0]);
+
+	CheckLogClear();
+	FsmInit(&fsm_HistTop, &state_H1);
+}
+
+/**************************************************************************************************/
+// Definition (fsm_def.h)
+//     Top: Idle, Busy (nests Work), starts in Busy		Work: A, B, starts in A
+/**************************************************************************************************/
+enum { ST_IDLE, ST_BUSY, ST_A, ST_B };
+enum { RG_TOP, RG_WORK };
+
+// CheckGoto with state indices
+static const struct { uint16_t from; int eventId; uint16_t to; }	gDefGoto[] = {
+	{ ST_IDLE, EVT_1, ST_B },		// into Work, not at its initial state
+	{ ST_IDLE, EVT_4, ST_BUSY },
+	{ ST_BUSY, EVT_2, ST_IDLE },
+	{ ST_B,    EVT_3, ST_A },
+};
+
+static int DefEntry (FsmInst *pInst, FsmInstEvent *pEvent)
+{
+	CheckLogAdd(pInst->pDef->states[pEvent->state].name, '+');
+	return FSM_DEF_NONE;
+}
+
+static int DefSuperEntry (FsmInst *pInst, FsmInstEvent *pEvent)
+{
+	CheckLogAdd(pInst->pDef->states[pEvent->state].name, '^');
+	return FSM_DEF_NONE;
+}
+
+static int DefExit (FsmInst *pInst, FsmInstEvent *pEvent)
+{
+	CheckLogAdd(pInst->pDef->states[pEvent->state].name, '-');
+	return FSM_DEF_NONE;
+}
+
+// CheckTransition for the definition
+static int DefTransition (FsmInst *pInst, FsmInstEvent *pEvent)
+{
+	size_t	i;
+
+	(void)pInst;
+	for (i=0; i<sizeof(gDefGoto)/sizeof(gDefGoto[0]); i++)
+	{
+		if ( (gDefGoto[i].from == pEvent->state) && (gDefGoto[i].eventId == pEvent->id) )
+		{
+			pEvent->consumed = true;
+			return gDefGoto[i].to;
+		}
+	}
+
+	return FSM_DEF_NONE;
+}
+
+static const FsmDefEvent	defEvents[] = {
+	FSM_DEF_EVENT(EVT_FSM_ENTRY, DefEntry),
+	FSM_DEF_EVENT(EVT_FSM_SUPERSTATE_ENTRY, DefSuperEntry),
+	FSM_DEF_EVENT(EVT_FSM_EXIT, DefExit),
+	FSM_DEF_EVENT(EVT_FSM_SUPERSTATE_EXIT, DefExit),
+	FSM_DEF_EVENT(EVT_1, DefTransition),
+	FSM_DEF_EVENT(EVT_2, DefTransition),
+	FSM_DEF_EVENT(EVT_3, DefTransition),
+	FSM_DEF_EVENT(EVT_4, DefTransition),
+	FSM_DEF_EVENT_EOL
+};
+static const uint16_t		nested_Busy[] = { RG_WORK, FSM_DEF_NONE };
+
+static const FsmDefState	states_Def[] = {
+	FSM_DEF_STATE("Idle", RG_TOP,  NULL,        defEvents),
+	FSM_DEF_STATE("Busy", RG_TOP,  nested_Busy, defEvents),
+	FSM_DEF_STATE("A",    RG_WORK, NULL,        defEvents),
+	FSM_DEF_STATE("B",    RG_WORK, NULL,        defEvents),
+};
+static const FsmDefRegion	regions_Def[] = {
+	FSM_DEF_REGION("Top",  FSM_DEF_NONE, ST_BUSY),
+	FSM_DEF_REGION("Work", ST_BUSY,      ST_A),
+};
+static FSM_DEF( def_Check, "Def", states_Def, regions_Def );
+
+/**************************************************************************************************/
+// Checks
+/**************************************************************************************************/
+
+// Queue order, and the three overflow policies
+static void CheckQueueOverflow (void)
+{
+	FSM_Q(q_Main, 4);
+	FSM_Q(q_Spill, 4);
+	FsmQExt	ext;
+	int		i;
+
+	// drop newest: the put fails, the queue keeps what it had
+	for (i=0; i<4; i++)
+		CHECK(0 == FsmPutEvent((FsmQ *)&q_Main, 10 + i));
+	CHECK(-1 == FsmPutEvent((FsmQ *)&q_Main, 14));
+	CHECK( (4 == q_Main.count) && (1 == q_Main.drops) && (4 == q_Main.hwm) );
+	for (i=0; i<4; i++)
+		CHECK(10 + i == FsmGetEvent((FsmQ *)&q_Main));
+	CHECK(EVT_FSM_NULL == FsmGetEvent((FsmQ *)&q_Main));
+
+	// drop oldest: the put succeeds, the oldest events go
+	q_Main.drops = 0;
+	FsmQSetExt((FsmQ *)&q_Main, &ext);
+	FsmQSetOverflow((FsmQ *)&q_Main, FSM_Q_DROP_OLDEST, NULL);
+	for (i=0; i<6; i++)
+		CHECK(0 == FsmPutEvent((FsmQ *)&q_Main, 10 + i));
+	CHECK( (4 == q_Main.count) && (2 == q_Main.drops) );
+	for (i=2; i<6; i++)
+		CHECK(10 + i == FsmGetEvent((FsmQ *)&q_Main));
+
+	// spill: the events come back in order, and the spill queue drops newest when it fills
+	q_Main.drops = 0;
+	FsmQSetOverflow((FsmQ *)&q_Main, FSM_Q_SPILL, (FsmQ *)&q_Spill);
+	for (i=0; i<8; i++)
+		CHECK(0 == FsmPutEvent((FsmQ *)&q_Main, 10 + i));
+	CHECK(-1 == FsmPutEvent((FsmQ *)&q_Main, 18));
+	CHECK( (4 == q_Main.count) && (4 == q_Spill.count) && (1 == q_Spill.drops) );
+
+	CHECK(10 == FsmGetEvent((FsmQ *)&q_Main));
+	CHECK(0 == FsmPutEvent((FsmQ *)&q_Main, 18));		// goes after the spilled events
+	for (i=11; i<19; i++)
+		CHECK(i == FsmGetEvent((FsmQ *)&q_Main));
+	CHECK( (0 == q_Main.count) && (0 == q_Spill.count) );
+}
+
+// Coalesced events are queued once; a new payload replaces the pending one
+static void CheckQueueCoalesce (void)
+{
+	FSM_PQ(q_Coalesce, 8);
+	FsmQExt		ext;
+	FsmEventSet	coalesce;
+	FsmPayload	*pPayload;
+	int			slabFree = CheckSlabFree();
+
+	memset(&coalesce, 0, sizeof(coalesce));
+	FSM_EVENT_SET_ADD(coalesce, EVT_1);
+	FsmQSetExt((FsmQ *)&q_Coalesce, &ext);
+	FsmQSetCoalesce((FsmQ *)&q_Coalesce, &coalesce);
+
+	CHECK(0 == FsmPutEvent((FsmQ *)&q_Coalesce, EVT_1));
+	CHECK(0 == FsmPutEvent((FsmQ *)&q_Coalesce, EVT_2));
+	CHECK(0 == FsmPutEvent((FsmQ *)&q_Coalesce, EVT_1));
+	CHECK(0 == FsmPutEvent((FsmQ *)&q_Coalesce, EVT_2));
+	CHECK( (3 == q_Coalesce.count) && (1 == ext.coalesced) );
+
+	CHECK(EVT_1 == FsmGetEvent((FsmQ *)&q_Coalesce));
+	CHECK(0 == FsmPutEvent((FsmQ *)&q_Coalesce, EVT_1));		// no longer pending
+	CHECK(EVT_2 == FsmGetEvent((FsmQ *)&q_Coalesce));
+	CHECK(EVT_2 == FsmGetEvent((FsmQ *)&q_Coalesce));
+	CHECK(EVT_1 == FsmGetEvent((FsmQ *)&q_Coalesce));
+	CHECK(0 == q_Coalesce.count);
+
+	CHECK(0 == FsmPutEventData((FsmQ *)&q_Coalesce, EVT_1, CheckPayload(1)));
+	CHECK(0 == FsmPutEventData((FsmQ *)&q_Coalesce, EVT_1, CheckPayload(2)));
+	CHECK( (1 == q_Coalesce.count) && (2 == ext.coalesced) );
+	CHECK(slabFree - 1 == CheckSlabFree());						// the first payload was released
+
+	CHECK(EVT_1 == FsmGetEventData((FsmQ *)&q_Coalesce, &pPayload));
+	CHECK(2 == CheckPayloadValue(pPayload));
+	FsmPayloadRelease(pPayload);
+	CHECK(slabFree == CheckSlabFree());
+}
+
+// References through the slab, a queue, dispatch and the defer queue
+static void CheckPayloadRefs (void)
+{
+	FSM_PQ(q_Payload, 4);
+	FsmPayload	*pPayload;
+	FsmPayload	*pOut;
+	int			slabFree = CheckSlabFree();
+	int			eventId;
+
+	CHECK(slab_Check.nBlocks == slabFree);
+
+	// a queue takes the caller's reference
+	pPayload = CheckPayload(7);
+	CHECK(1 == atomic_load(&pPayload->refCount));
+	CHECK(0 == FsmPutEventData((FsmQ *)&q_Payload, EVT_1, pPayload));
+	CHECK(1 == atomic_load(&pPayload->refCount));
+	CHECK(EVT_1 == FsmGetEventData((FsmQ *)&q_Payload, &pOut));
+	CHECK( (pOut == pPayload) && (7 == CheckPayloadValue(pOut)) );
+	FsmPayloadRelease(pOut);
+	CHECK(slabFree == CheckSlabFree());
+
+	// FsmGetEvent drops the reference of an event it returns without its payload
+	CHECK(0 == FsmPutEventData((FsmQ *)&q_Payload, EVT_2, CheckPayload(8)));
+	CHECK(EVT_2 == FsmGetEvent((FsmQ *)&q_Payload));
+	CHECK(slabFree == CheckSlabFree());
+
+	// a queue that has no payload slots refuses the event, the caller keeps its reference
+	{
+		FSM_Q(q_NoPayload, 4);
+
+		pPayload = CheckPayload(9);
+		CHECK(-1 == FsmPutEventData((FsmQ *)&q_NoPayload, EVT_1, pPayload));
+		CHECK(1 == atomic_load(&pPayload->refCount));
+		FsmPayloadRelease(pPayload);
+	}
+
+	// dispatch borrows the reference, deferring adds one
+	RecBuild();
+	pPayload = CheckPayload(11);
+	FsmRunData(&fsm_Rec, EVT_3, pPayload);
+	CHECK( (1 == gRecordCount) && (EVT_3 == gRecord[0]) && (11 == gRecordData[0]) );
+	CHECK(1 == atomic_load(&pPayload->refCount));
+
+	CHECK(0 == FsmDeferEventData(&fsm_Rec, EVT_4, pPayload));
+	CHECK(2 == atomic_load(&pPayload->refCount));
+	FsmPayloadRelease(pPayload);
+	CHECK(slabFree - 1 == CheckSlabFree());
+
+	eventId = FsmGetEventData(fsm_Rec.deferQ, &pOut);
+	CHECK( (EVT_4 == eventId) && (pOut == pPayload) && (1 == atomic_load(&pOut->refCount)) );
+	FsmPayloadRelease(pOut);
+	CHECK(slabFree == CheckSlabFree());
+
+	// the slab runs out, and a released block can be allocated again
+	{
+		FsmPayload	*pAll[64];
+		int			count = 0;
+
+		while ( (count < 64) && ((pAll[count] = FsmPayloadAlloc(&slab_Check)) != NULL) )
+			count++;
+		CHECK(slab_Check.nBlocks == count);
+		CHECK(NULL == FsmPayloadAlloc(&slab_Check));
+		FsmPayloadRelease(pAll[0]);
+		pAll[0] = FsmPayloadAlloc(&slab_Check);
+		CHECK(pAll[0] != NULL);
+		while (count > 0)
+			FsmPayloadRelease(pAll[--count]);
+		CHECK(slabFree == CheckSlabFree());
+	}
+}
+
+// Mailbox order, full mailbox, and FsmDrain running the events in order
+FSM_MAILBOX(mailbox_Check, 8);
+
+static void CheckMailboxOrder (void)
+{
+	static const int	posted[] = { EVT_1, EVT_2, EVT_3, EVT_4, EVT_1 };
+	FsmPayload			*pPayload;
+	int					i;
+
+	CHECK(-1 == FsmMailboxInit((FsmMailbox *)&mailbox_Check, 6));
+	CHECK(0 == FSM_MAILBOX_INIT(mailbox_Check));
+
+	for (i=0; i<8; i++)
+		CHECK(0 == FsmMailboxPut((FsmMailbox *)&mailbox_Check, 100 + i));
+	CHECK(-1 == FsmMailboxPut((FsmMailbox *)&mailbox_Check, 108));
+	CHECK(8 == FsmMailboxCount((FsmMailbox *)&mailbox_Check));
+	for (i=0; i<8; i++)
+		CHECK(100 + i == FsmMailboxGet((FsmMailbox *)&mailbox_Check));
+	CHECK(EVT_FSM_NULL == FsmMailboxGet((FsmMailbox *)&mailbox_Check));
+
+	// payloads come out with their events, and the mailbox hands over its reference
+	CHECK(0 == FsmMailboxPutData((FsmMailbox *)&mailbox_Check, EVT_2, CheckPayload(5)));
+	CHECK(EVT_2 == FsmMailboxGetData((FsmMailbox *)&mailbox_Check, &pPayload));
+	CHECK(5 == CheckPayloadValue(pPayload));
+	FsmPayloadRelease(pPayload);
+
+	RecBuild();
+	fsm_Rec.mailbox = (FsmMailbox *)&mailbox_Check;
+	for (i=0; i<5; i++)
+		CHECK(0 == FsmPost(&fsm_Rec, posted[i]));
+	CHECK(0 == FsmPostData(&fsm_Rec, EVT_3, CheckPayload(6)));
+
+	CHECK(2 == FsmDrain(&fsm_Rec, 2));
+	CHECK(4 == FsmDrain(&fsm_Rec, 0));
+	CHECK(6 == gRecordCount);
+	for (i=0; (i<5) && (i<gRecordCount); i++)
+		CHECK( (posted[i] == gRecord[i]) && (-1 == gRecordData[i]) );
+	CHECK( (EVT_3 == gRecord[5]) && (6 == gRecordData[5]) );
+	CHECK(slab_Check.nBlocks == CheckSlabFree());
+
+	fsm_Rec.mailbox = NULL;
+}
+
+// Two producers: each one's events come out in the order it posted them
+#define CHECK_PRODUCER_EVENTS	200000
+
+FSM_MAILBOX(mailbox_Producers, 1024);
+
+static void * CheckProducer (void *pArg)
+{
+	int		base = *(int *)pArg;
+	int		i;
+
+	for (i=0; i<CHECK_PRODUCER_EVENTS; i++)
+		while (FsmMailboxPut((FsmMailbox *)&mailbox_Producers, base + i) != 0)
+			sched_yield();
+
+	return NULL;
+}
+
+static void CheckMailboxProducers (void)
+{
+	static int	base[2] = { 0, CHECK_PRODUCER_EVENTS };
+	pthread_t	thread[2];
+	int			next[2] = { 0, CHECK_PRODUCER_EVENTS };
+	int			received = 0;
+	bool		ordered = true;
+	int			i;
+
+	FSM_MAILBOX_INIT(mailbox_Producers);
+
+	for (i=0; i<2; i++)
+		pthread_create(&thread[i], NULL, CheckProducer, &base[i]);
+
+	while (received < 2 * CHECK_PRODUCER_EVENTS)
+	{
+		int		eventId = FsmMailboxGet((FsmMailbox *)&mailbox_Producers);
+		int		producer = (eventId >= CHECK_PRODUCER_EVENTS);
+
+		if (EVT_FSM_NULL == eventId)
+		{
+			sched_yield();
+			continue;
+		}
+
+		ordered = ordered && (eventId == next[producer]);
+		next[producer] = eventId + 1;
+		received++;
+	}
+
+	for (i=0; i<2; i++)
+		pthread_join(thread[i], NULL);
+
+	CHECK(ordered);
+	CHECK( (CHECK_PRODUCER_EVENTS == next[0]) && (2 * CHECK_PRODUCER_EVENTS == next[1]) );
+	CHECK(EVT_FSM_NULL == FsmMailboxGet((FsmMailbox *)&mailbox_Producers));
+}
+
+// Transitions exit up to the least common ancestor and enter down to the target
+static void CheckLcaTransitions (void)
+{
+	LcaBuild();
+	CHECK_LOG("T1+ A1+ B1+");
+
+	FsmRun(&fsm_LcaTop, EVT_1);
+	CHECK_LOG("B1- B2+");
+	CHECK( (&state_T1 == fsm_LcaTop.pState) && (&state_A1 == fsm_LcaA.pState) && (&state_B2 == fsm_LcaB.pState) );
+
+	FsmRun(&fsm_LcaTop, EVT_2);
+	CHECK_LOG("B2- A1- A2+");
+	CHECK( (&state_T1 == fsm_LcaTop.pState) && (&state_A2 == fsm_LcaA.pState) );
+
+	// the target and the states on the path get Entry
+	FsmRun(&fsm_LcaTop, EVT_3);
+	CHECK_LOG("A2- T1- T2+ C2+");
+	CHECK( (&state_T2 == fsm_LcaTop.pState) && (&state_C2 == fsm_LcaC.pState) );
+
+	// a mailbox on the nested FSM: FsmDrain runs the event on the top FSM
+	FSM_MAILBOX_INIT(mailbox_Check);
+	fsm_LcaC.mailbox = (FsmMailbox *)&mailbox_Check;
+	CHECK(0 == FsmPost(&fsm_LcaC, EVT_4));
+	CHECK(1 == FsmDrain(&fsm_LcaC, 0));
+	fsm_LcaC.mailbox = NULL;
+	CHECK_LOG("C2- T2- T1+ A1+ B1+");
+	CHECK( (&state_T1 == fsm_LcaTop.pState) && (&state_A1 == fsm_LcaA.pState) && (&state_B1 == fsm_LcaB.pState) );
+
+	// C isn't on the path, its state gets Superstate Entry
+	FsmRun(&fsm_LcaTop, EVT_3);
+	CHECK_LOG("B1- A1- T1- T2+ C2^");
+	CHECK( (&state_T2 == fsm_LcaTop.pState) && (&state_C2 == fsm_LcaC.pState) );
+
+	// an event nothing handles changes nothing
+	FsmRun(&fsm_LcaTop, EVT_1);
+	CHECK_LOG("");
+	CHECK(&state_C2 == fsm_LcaC.pState);
+}
+
+// Shallow history resumes the FSM's state, deep history everything below it too
+static void CheckHistory (void)
+{
+	HistBuild();
+	CHECK_LOG("H1+ S1+");
+
+	FsmRun(&fsm_HistTop, EVT_2);
+	CHECK_LOG("S1- S2+ I1+");
+	FsmRun(&fsm_HistTop, EVT_3);
+	CHECK_LOG("I1- I2+");
+
+	FsmRun(&fsm_HistTop, EVT_4);
+	CHECK_LOG("I2- S2- H1- H2+ D1+");
+	FsmRun(&fsm_HistTop, EVT_2);
+	CHECK_LOG("D1- D2+ J1+");
+	FsmRun(&fsm_HistTop, EVT_3);
+	CHECK_LOG("J1- J2+");
+
+	// S resumes S2 without entering it; I has no history and enters I1
+	FsmRun(&fsm_HistTop, EVT_4);
+	CHECK_LOG("J2- D2- H2- H1+ I1+");
+	CHECK( (&state_S2 == fsm_HistS.pState) && (&state_I1 == fsm_HistI.pState) );
+
+	// D resumes D2, and J resumes J2 under it
+	FsmRun(&fsm_HistTop, EVT_4);
+	CHECK_LOG("I1- S2- H1- H2+");
+	CHECK( (&state_D2 == fsm_HistD.pState) && (&state_J2 == fsm_HistJ.pState) );
+
+	// the resumed configuration runs events
+	FsmRun(&fsm_HistTop, EVT_3);
+	CHECK_LOG("J2- J1+");
+	FsmRun(&fsm_HistTop, EVT_2);
+	CHECK_LOG("J1- D2- D1+");
+
+	// a transition into S enters its target rather than resuming it
+	FsmRun(&fsm_HistTop, EVT_1);
+	CHECK_LOG("D1- H2- H1+ S2+ I1+");
+	CHECK( (&state_H1 == fsm_HistTop.pState) && (&state_S2 == fsm_HistS.pState) );
+}
+
+// Definitions enter the state each region is in with Entry, at init and on transitions
+static void CheckDefEntry (void)
+{
+	FSM_INST(inst_Check, 2);
+	FsmInst	*pInst = (FsmInst *)&inst_Check;
+
+	CHECK(0 == FsmDefCheck(&def_Check));
+
+	CheckLogClear();
+	FsmInstInit(pInst, &def_Check, NULL, NULL, NULL);
+	CHECK_LOG("Busy+ A+");
+
+	FsmInstRun(pInst, EVT_2);
+	CHECK_LOG("A- Busy- Idle+");
+
+	// the target and the state above it get Entry
+	FsmInstRun(pInst, EVT_1);
+	CHECK_LOG("Idle- Busy+ B+");
+	CHECK( (ST_BUSY == pInst->state[RG_TOP]) && (ST_B == pInst->state[RG_WORK]) );
+
+	FsmInstRun(pInst, EVT_3);
+	CHECK_LOG("B- A+");
+	FsmInstRun(pInst, EVT_3);
+	CHECK_LOG("");
+
+	// left in B, Work starts again from A
+	FsmInstRun(pInst, EVT_2);
+	FsmInstRun(pInst, EVT_1);
+	FsmInstRun(pInst, EVT_2);
+	CHECK_LOG("A- Busy- Idle+ Idle- Busy+ B+ B- Busy- Idle+");
+	FsmInstRun(pInst, EVT_4);
+	CHECK_LOG("Idle- Busy+ A+");
+}
+
+// A thread's counter table is taken over by the next thread once it exits, counts and all
+static void * CheckStatsThread (void *pArg)
+{
+	(void)pArg;
+	FsmRun(&fsm_Rec, EVT_1);
+	return NULL;
+}
+
+static void CheckStatsThreads (void)
+{
+#if FSM_STATS
+	FsmStatsSnapshot	snap;
+	pthread_t			thread;
+	int					threads;
+	uint64_t			count;
+	int					i;
+
+	RecBuild();
+	CHECK(0 == FsmStatsSnapshotTake(&snap));
+	count = FsmStatsDispatchCount(&snap, &state_Rec, EVT_1);
+	FsmStatsSnapshotFree(&snap);
+
+	for (i=0; i<3; i++)
+	{
+		pthread_create(&thread, NULL, CheckStatsThread, NULL);
+		pthread_join(thread, NULL);
+
+		CHECK(0 == FsmStatsSnapshotTake(&snap));
+		if (0 == i)
+			threads = snap.threads;
+		CHECK(threads == snap.threads);
+		CHECK(count + (uint64_t)i + 1 == FsmStatsDispatchCount(&snap, &state_Rec, EVT_1));
+		FsmStatsSnapshotFree(&snap);
+	}
+#endif
+}
+
+// An image restores the states and the queued events, payloads included
+static void CheckImageRoundTrip (void)
+{
+	static const FsmImageMap	map = FSM_IMAGE_MAP_PAYLOADS(gLcaFsms, gLcaStates, gLcaSlabs);
+	unsigned char				image[512];
+	FsmPayload					*pPayload;
+	long						size;
+	int							slabFree = CheckSlabFree();
+
+	LcaBuild();
+	FsmRun(&fsm_LcaTop, EVT_1);
+	pPayload = CheckPayload(33);
+	CHECK(0 == FsmDeferEventData(&fsm_LcaTop, EVT_3, pPayload));
+	FsmPayloadRelease(pPayload);
+	CHECK(0 == FsmDeferEvent(&fsm_LcaTop, EVT_4));
+
+	size = FsmImageSave(&map, image, sizeof(image));
+	CHECK( (size > 0) && (size == FsmImageSize(&map)) );
+	CHECK(-1 == FsmImageSave(&map, image, sizeof(FsmImageHeader)));		// too small
+
+	// move on: other states, other events in the queue
+	FsmRun(&fsm_LcaTop, EVT_2);
+	FsmRun(&fsm_LcaTop, EVT_3);
+	CHECK(EVT_3 == FsmGetEvent(fsm_LcaTop.deferQ));
+	CHECK(0 == FsmDeferEventData(&fsm_LcaTop, EVT_1, (pPayload = CheckPayload(44))));
+	FsmPayloadRelease(pPayload);
+	CheckLogClear();
+
+	CHECK(0 == FsmImageRestore(&map, image, (size_t)size));
+	CHECK_LOG("");				// no Entry or Exit actions
+	CHECK( (&state_T1 == fsm_LcaTop.pState) && (&state_A1 == fsm_LcaA.pState) && (&state_B2 == fsm_LcaB.pState) );
+	CHECK(NULL == fsm_LcaC.pState);
+	CHECK(2 == fsm_LcaTop.deferQ->count);
+	CHECK(EVT_3 == FsmGetEventData(fsm_LcaTop.deferQ, &pPayload));
+	CHECK(33 == CheckPayloadValue(pPayload));
+	FsmPayloadRelease(pPayload);
+	CHECK(EVT_4 == FsmGetEventData(fsm_LcaTop.deferQ, &pPayload));
+	CHECK(NULL == pPayload);
+	CHECK(slabFree == CheckSlabFree());
+
+	// the restored machine runs as if it had got there itself
+	FsmRun(&fsm_LcaTop, EVT_2);
+	CHECK_LOG("B2- A1- A2+");
+
+	// an image of another machine doesn't restore
+	image[offsetof(FsmImageHeader, layout)] ^= 1;
+	CHECK(-1 == FsmImageRestore(&map, image, (size_t)size));
+	CHECK(&state_A2 == fsm_LcaA.pState);
+}
+
+/**************************************************************************************************/
+typedef struct
+{
+	const char *	name;
+	void			(*pfnCheck)(void);
+} FsmCheck;
+
+static const FsmCheck gCheck[] =
+{
+	{ "queue_overflow",		CheckQueueOverflow },
+	{ "queue_coalesce",		CheckQueueCoalesce },
+	{ "payload_refs",		CheckPayloadRefs },
+	{ "mailbox_order",		CheckMailboxOrder },
+	{ "mailbox_producers",	CheckMailboxProducers },
+	{ "lca_transitions",	CheckLcaTransitions },
+	{ "history",			CheckHistory },
+	{ "image_round_trip",	CheckImageRoundTrip },
+	{ "def_entry",			CheckDefEntry },
+	{ "stats_threads",		CheckStatsThreads },
+	{ "co_backlog",			CheckCoBacklog },
+	{ "co_repark",			CheckCoRepark },
+	{ "co_recall",			CheckCoRecall },
+};
+
+/**************************************************************************************************/
+int main (int argc, char *argv[])
+{
+	size_t	i;
+
+	FSM_SLAB_INIT(slab_Check);
+
+	for (i=0; i<sizeof(gCheck)/sizeof(gCheck[0]); i++)
+	{
+		int		arg;
+		int		failed = gFailed;
+		bool	selected = (argc < 2);
+
+		for (arg=1; arg<argc; arg++)
+			if (!strncmp(gCheck[i].name, argv[arg], strlen(argv[arg])))
+				selected = true;
+
+		if (!selected)
+			continue;
+
+		printf("%s\n", gCheck[i].name);
+		gCheck[i].pfnCheck();
+		if (gFailed > failed)
+			printf("    %d failed\n", gFailed - failed);
+	}
+
+	printf("%d checks, %d failed (FSM_DISPATCH_DEPTH %d)\n", gChecks, gFailed, FSM_DISPATCH_DEPTH);
+
+	return (gFailed > 0) ? 1 : 0;
+}
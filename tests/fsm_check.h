@@ -0,0 +1,32 @@
+/*
+ *
+ * File: fsm_check.h
+ *
+ * Shared by the fsm_check sources: the check macro, and the checks that aren't in fsm_check.c
+ *
+ *
+ */
+
+#ifndef _FSM_CHECK_H_
+#define _FSM_CHECK_H_
+
+#include "fsm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHECK(cond)		CheckResult((cond), #cond, __LINE__)
+
+void CheckResult (bool ok, const char *pText, int line);
+
+// fsm_check_co.cpp
+void CheckCoBacklog (void);
+void CheckCoRepark (void);
+void CheckCoRecall (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _FSM_CHECK_H_
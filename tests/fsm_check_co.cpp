@@ -0,0 +1,161 @@
+/*
+ *
+ * File: fsm_check_co.cpp
+ *
+ * fsm_check checks for coroutine handlers (fsm_co.hpp): the events that wait for a parked
+ * machine, a machine that parks again while they run, and recalled events
+ *
+ */
+#include <deque>
+#include <vector>
+
+#include "fsm_co.hpp"
+#include "fsm_check.h"
+
+/**************************************************************************************************/
+// Co machine: EVT_1 in A and EVT_4 in B wait for a reply, then go to B and C. A defers EVT_3 and
+// EVT_4, B recalls the events it handles when it's entered, and B and C record EVT_2 and EVT_3.
+/**************************************************************************************************/
+static std::deque<fsm::Reply<int> *>	gReplies;	// replies the suspended handlers wait for
+static std::vector<int>					gCoRecord;
+
+extern FsmState	state_CoA;
+extern FsmState	state_CoB;
+extern FsmState	state_CoC;
+
+static fsm::CoHandler CoWaitGo (FsmState *pState, FsmEvent *pEvent)
+{
+	fsm::Reply<int>	reply;
+
+	pEvent->consumed = true;
+	gReplies.push_back(&reply);
+	(void)co_await reply;
+	co_return (pState == &state_CoA) ? &state_CoB : &state_CoC;
+}
+
+FSM_EVENT_HANDLER( CoDefer )		{ FsmDeferEvent(pState->pFsm, pEvent->id); pEvent->consumed = true; return NULL; }
+FSM_EVENT_HANDLER( CoRecall )		{ FsmRecallHandled(pState->pFsm); pEvent->consumed = true; return NULL; }
+FSM_EVENT_HANDLER( CoRecord )		{ gCoRecord.push_back(pEvent->id); pEvent->consumed = true; return NULL; }
+
+FSM_Q( q_CoDefer, 8 );
+FSM_Q( q_CoRecall, 8 );
+FSM(fsm_Co, "Co", NULL, &q_CoDefer, &q_CoRecall);
+
+FSM_EVENT( evt_CoA_Wait,   EVT_1,         FSM_CO_HANDLER(CoWaitGo) );
+FSM_EVENT( evt_CoA_Defer3, EVT_3,         CoDefer );
+FSM_EVENT( evt_CoA_Defer4, EVT_4,         CoDefer );
+static FsmEvent *	coEventList_A[] = { &evt_CoA_Wait, &evt_CoA_Defer3, &evt_CoA_Defer4, &fsmNullEvent };
+
+FSM_EVENT( evt_CoB_Entry,  EVT_FSM_ENTRY, CoRecall );
+FSM_EVENT( evt_CoB_Wait,   EVT_4,         FSM_CO_HANDLER(CoWaitGo) );
+FSM_EVENT( evt_CoB_2,      EVT_2,         CoRecord );
+FSM_EVENT( evt_CoB_3,      EVT_3,         CoRecord );
+static FsmEvent *	coEventList_B[] = { &evt_CoB_Entry, &evt_CoB_Wait, &evt_CoB_2, &evt_CoB_3, &fsmNullEvent };
+
+FSM_EVENT( evt_CoC_2,      EVT_2,         CoRecord );
+FSM_EVENT( evt_CoC_3,      EVT_3,         CoRecord );
+static FsmEvent *	coEventList_C[] = { &evt_CoC_2, &evt_CoC_3, &fsmNullEvent };
+
+FSM_STATE( state_CoA, &fsm_Co, NULL, coEventList_A, "A", FsmStateDefaultHandler );
+FSM_STATE( state_CoB, &fsm_Co, NULL, coEventList_B, "B", FsmStateDefaultHandler );
+FSM_STATE( state_CoC, &fsm_Co, NULL, coEventList_C, "C", FsmStateDefaultHandler );
+
+static void CoBuild (void)
+{
+	FSM_Q_INIT(q_CoDefer);
+	FSM_Q_INIT(q_CoRecall);
+	gReplies.clear();
+	gCoRecord.clear();
+
+	FsmInit(&fsm_Co, &state_CoA);
+}
+
+// Reply to the oldest suspended handler, and resume it
+static int CoComplete (fsm::Executor &executor)
+{
+	if (gReplies.empty())
+		return 0;
+
+	gReplies.front()->Complete(0);
+	gReplies.pop_front();
+
+	return executor.Poll();
+}
+
+/**************************************************************************************************/
+// Events Run on a parked machine wait, and run in order after the handler's transition
+void CheckCoBacklog (void)
+{
+	fsm::Executor	executor;
+
+	CoBuild();
+
+	executor.Run(&fsm_Co, EVT_1);
+	CHECK(executor.Parked(&fsm_Co));
+	CHECK(&state_CoA == fsm_Co.pState);
+
+	executor.Run(&fsm_Co, EVT_2);
+	executor.Run(&fsm_Co, EVT_3);
+	executor.Run(&fsm_Co, EVT_2);
+	CHECK(gCoRecord.empty());
+
+	CHECK(1 == CoComplete(executor));
+	CHECK(!executor.Parked(&fsm_Co));
+	CHECK(&state_CoB == fsm_Co.pState);
+	CHECK( (gCoRecord == std::vector<int>{ EVT_2, EVT_3, EVT_2 }) );
+}
+
+// A waiting event that parks the machine again holds up the rest, and they stay ahead of
+// events Run since
+void CheckCoRepark (void)
+{
+	fsm::Executor	executor;
+
+	CoBuild();
+
+	executor.Run(&fsm_Co, EVT_1);
+	executor.Run(&fsm_Co, EVT_4);		// parks again in B
+	executor.Run(&fsm_Co, EVT_2);
+
+	CHECK(1 == CoComplete(executor));
+	CHECK(executor.Parked(&fsm_Co));
+	CHECK(&state_CoB == fsm_Co.pState);
+	CHECK(gCoRecord.empty());
+	CHECK(1 == (int)gReplies.size());
+
+	executor.Run(&fsm_Co, EVT_3);
+
+	CHECK(1 == CoComplete(executor));
+	CHECK(!executor.Parked(&fsm_Co));
+	CHECK(&state_CoC == fsm_Co.pState);
+	CHECK( (gCoRecord == std::vector<int>{ EVT_2, EVT_3 }) );
+}
+
+// Events recalled by the handler's transition run before the waiting events. A recalled event
+// that parks the machine leaves the rest in the recall queue until it finishes.
+void CheckCoRecall (void)
+{
+	fsm::Executor	executor;
+
+	CoBuild();
+
+	executor.Run(&fsm_Co, EVT_4);		// deferred in A
+	executor.Run(&fsm_Co, EVT_3);
+	CHECK(2 == q_CoDefer.count);
+
+	executor.Run(&fsm_Co, EVT_1);
+	executor.Run(&fsm_Co, EVT_2);
+
+	// B recalls EVT_4 and EVT_3; EVT_4 parks the machine again
+	CHECK(1 == CoComplete(executor));
+	CHECK(executor.Parked(&fsm_Co));
+	CHECK(&state_CoB == fsm_Co.pState);
+	CHECK( (0 == q_CoDefer.count) && (1 == q_CoRecall.count) );
+	CHECK(gCoRecord.empty());
+
+	CHECK(1 == CoComplete(executor));
+	CHECK(!executor.Parked(&fsm_Co));
+	CHECK(&state_CoC == fsm_Co.pState);
+	CHECK(0 == q_CoRecall.count);
+	CHECK( (gCoRecord == std::vector<int>{ EVT_3, EVT_2 }) );
+}
@@ -0,0 +1,743 @@
+/*
+ *
+ * File: fsm_gen.c
+ *
+ * Generate the C objects of a state machine (fsm.h) from a text description
+ *
+ *     usage: fsm_gen [-t events] [-s stubs.c] machine.fsm out
+ *
+ *     writes out.h and out.c; -s also writes stubs for the handlers the description names,
+ *     -t sets the number of events that gets a state a dispatch table (default 1, 0 for none)
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+// The description is one declaration per line, names in any order, # starts a comment:
+//
+//     machine  Example                                   C prefix for everything generated
+//     region   Top      -         State1                 top region: no parent state, initial state
+//     state    State1   Top       "State1"               state, its region, optional display name
+//     region   Nested1  State1    Nested1_State1 [reset] region nested in a state, initial state
+//     on       State1   EVT_1     -> State2              transition: consume and go to State2
+//     on       State1   EVT_2     consume                consume, no transition
+//     on       State1   EVT_FSM_ENTRY  State1_Entry      user handler (FSM_EVENT_HANDLER)
+//
+// The first region is the top level. A nested region resumes its last state when its parent
+// state is entered again (the framework's default), or starts over at its initial state if it
+// is marked reset.
+//
+// The generated machine is ordinary fsm.h objects, run with FsmRun, laid out for the cache:
+// the Fsm of every region in one array, the states in one array ordered by region, their
+// events and event lists in two more, and one shared handler for all the transitions, which
+// looks its target up by the event's index. Each state with at least -t events gets a
+// dispatch table that only spans its own event ids (FsmCompileStateRange), all of them in
+// one more array. Its size is worked out by the C compiler, which knows the ids' values.
+
+#define GEN_MAX_NAME		64
+#define GEN_MAX_STATES		1024
+#define GEN_MAX_REGIONS		1024
+#define GEN_MAX_EVENTS		8192
+#define GEN_NONE			(-1)
+
+typedef struct
+{
+	char	name[GEN_MAX_NAME];
+	char	parent[GEN_MAX_NAME];		// parent state, "-" for the top region
+	char	initial[GEN_MAX_NAME];
+	int		parentIndex;
+	int		initialIndex;
+	int		reset;
+	int		line;
+} GenRegion;
+
+typedef struct
+{
+	char	name[GEN_MAX_NAME];
+	char	display[GEN_MAX_NAME];
+	char	region[GEN_MAX_NAME];
+	int		regionIndex;
+	int		order;						// index in the generated state array
+	int		line;
+} GenState;
+
+typedef struct
+{
+	char	state[GEN_MAX_NAME];
+	char	eventId[GEN_MAX_NAME];
+	char	handler[GEN_MAX_NAME];		// user handler, "" if generated
+	char	target[GEN_MAX_NAME];		// transition target, "" if none
+	int		stateIndex;
+	int		targetIndex;
+	int		line;
+} GenEvent;
+
+static char			gMachine[GEN_MAX_NAME];
+static GenRegion	gRegion[GEN_MAX_REGIONS];
+static GenState		gState[GEN_MAX_STATES];
+static GenEvent		gEvent[GEN_MAX_EVENTS];
+static int			gRegionCount;
+static int			gStateCount;
+static int			gEventCount;
+static int			gStateOrder[GEN_MAX_STATES];	// state index by position in the generated array
+static const char *	gPath;
+static int			gErrors;
+
+/**************************************************************************************************/
+static void Error (int line, const char *message, const char *name)
+{
+	fprintf(stderr, "%s:%d: %s%s%s\n", gPath, line, message, name ? " " : "", name ? name : "");
+	gErrors++;
+}
+
+/**************************************************************************************************/
+// Split a line into words. A quoted word keeps its spaces. Returns the number of words.
+static int SplitLine (char *pLine, char **pWords, int maxWords)
+{
+	int	count = 0;
+
+	while (count < maxWords)
+	{
+		while (isspace((unsigned char)*pLine))
+			pLine++;
+
+		if ( ('\0' == *pLine) || ('#' == *pLine) )
+			break;
+
+		if ('"' == *pLine)
+		{
+			pWords[count++] = ++pLine;
+			while ( (*pLine != '\0') && (*pLine != '"') )
+				pLine++;
+		}
+		else
+		{
+			pWords[count++] = pLine;
+			while ( (*pLine != '\0') && !isspace((unsigned char)*pLine) )
+				pLine++;
+		}
+
+		if ('\0' == *pLine)
+			break;
+		*pLine++ = '\0';
+	}
+
+	return count;
+}
+
+/**************************************************************************************************/
+static void CopyName (char *pDest, const char *pSrc, int line)
+{
+	if (strlen(pSrc) >= GEN_MAX_NAME)
+		Error(line, "name too long:", pSrc);
+
+	strncpy(pDest, pSrc, GEN_MAX_NAME - 1);
+	pDest[GEN_MAX_NAME - 1] = '\0';
+}
+
+/**************************************************************************************************/
+static int FindState (const char *pName)
+{
+	int	i;
+
+	for (i=0; i<gStateCount; i++)
+		if (!strcmp(gState[i].name, pName))
+			return i;
+
+	return GEN_NONE;
+}
+
+static int FindRegion (const char *pName)
+{
+	int	i;
+
+	for (i=0; i<gRegionCount; i++)
+		if (!strcmp(gRegion[i].name, pName))
+			return i;
+
+	return GEN_NONE;
+}
+
+/**************************************************************************************************/
+static void ParseLine (char *pLine, int line)
+{
+	char	*pWord[8];
+	int		n = SplitLine(pLine, pWord, 8);
+
+	if (0 == n)
+		return;
+
+	if (!strcmp(pWord[0], "machine") && (2 == n))
+		CopyName(gMachine, pWord[1], line);
+
+	else if (!strcmp(pWord[0], "region") && ( (4 == n) || ( (5 == n) && !strcmp(pWord[4], "reset") ) ))
+	{
+		GenRegion	*pRegion = &gRegion[gRegionCount];
+
+		if (gRegionCount >= GEN_MAX_REGIONS)
+		{
+			Error(line, "too many regions", NULL);
+			return;
+		}
+		if (FindRegion(pWord[1]) != GEN_NONE)
+			Error(line, "region defined twice:", pWord[1]);
+
+		CopyName(pRegion->name, pWord[1], line);
+		CopyName(pRegion->parent, pWord[2], line);
+		CopyName(pRegion->initial, pWord[3], line);
+		pRegion->reset = (5 == n);
+		pRegion->line = line;
+		gRegionCount++;
+	}
+
+	else if (!strcmp(pWord[0], "state") && ( (3 == n) || (4 == n) ))
+	{
+		GenState	*pState = &gState[gStateCount];
+
+		if (gStateCount >= GEN_MAX_STATES)
+		{
+			Error(line, "too many states", NULL);
+			return;
+		}
+		if (FindState(pWord[1]) != GEN_NONE)
+			Error(line, "state defined twice:", pWord[1]);
+
+		CopyName(pState->name, pWord[1], line);
+		CopyName(pState->region, pWord[2], line);
+		CopyName(pState->display, (4 == n) ? pWord[3] : pWord[1], line);
+		pState->line = line;
+		gStateCount++;
+	}
+
+	else if (!strcmp(pWord[0], "on") && ( (4 == n) || ( (5 == n) && !strcmp(pWord[3], "->") ) ))
+	{
+		GenEvent	*pEvent = &gEvent[gEventCount];
+
+		if (gEventCount >= GEN_MAX_EVENTS)
+		{
+			Error(line, "too many events", NULL);
+			return;
+		}
+
+		memset(pEvent, 0, sizeof(GenEvent));
+		CopyName(pEvent->state, pWord[1], line);
+		CopyName(pEvent->eventId, pWord[2], line);
+		if (5 == n)
+			CopyName(pEvent->target, pWord[4], line);
+		else if (strcmp(pWord[3], "consume") != 0)
+			CopyName(pEvent->handler, pWord[3], line);
+		pEvent->line = line;
+		gEventCount++;
+	}
+
+	else
+		Error(line, "can't parse:", pWord[0]);
+
+} // ParseLine
+
+/**************************************************************************************************/
+// Resolve names to indices and check the machine
+static void Resolve (void)
+{
+	int	i, r;
+	int	order = 0;
+
+	if ('\0' == gMachine[0])
+		Error(1, "no machine name", NULL);
+
+	if ( (0 == gRegionCount) || strcmp(gRegion[0].parent, "-") )
+		Error(gRegionCount ? gRegion[0].line : 1, "the first region must be the top level, with parent -", NULL);
+
+	for (i=0; i<gStateCount; i++)
+	{
+		gState[i].regionIndex = FindRegion(gState[i].region);
+		if (GEN_NONE == gState[i].regionIndex)
+			Error(gState[i].line, "undefined region", gState[i].region);
+	}
+
+	for (r=0; r<gRegionCount; r++)
+	{
+		GenRegion	*pRegion = &gRegion[r];
+
+		pRegion->parentIndex = strcmp(pRegion->parent, "-") ? FindState(pRegion->parent) : GEN_NONE;
+		if ( (r > 0) && (GEN_NONE == pRegion->parentIndex) )
+			Error(pRegion->line, "undefined parent state", pRegion->parent);
+
+		pRegion->initialIndex = FindState(pRegion->initial);
+		if ( (GEN_NONE == pRegion->initialIndex) || (gState[pRegion->initialIndex].regionIndex != r) )
+			Error(pRegion->line, "initial state not in the region:", pRegion->initial);
+	}
+
+	// states ordered by region, so each region's states are together
+	for (r=0; r<gRegionCount; r++)
+		for (i=0; i<gStateCount; i++)
+			if (gState[i].regionIndex == r)
+			{
+				gState[i].order = order;
+				gStateOrder[order++] = i;
+			}
+
+	for (i=0; i<gEventCount; i++)
+	{
+		GenEvent	*pEvent = &gEvent[i];
+
+		pEvent->stateIndex = FindState(pEvent->state);
+		if (GEN_NONE == pEvent->stateIndex)
+			Error(pEvent->line, "undefined state", pEvent->state);
+
+		pEvent->targetIndex = pEvent->target[0] ? FindState(pEvent->target) : GEN_NONE;
+		if ( pEvent->target[0] && (GEN_NONE == pEvent->targetIndex) )
+			Error(pEvent->line, "undefined target state", pEvent->target);
+	}
+
+	// a reset region's parent needs an entry event to reset it from
+	for (r=1; r<gRegionCount; r++)
+	{
+		int	parent = gRegion[r].parentIndex;
+		int	found = 0;
+
+		if ( !gRegion[r].reset || (GEN_NONE == parent) )
+			continue;
+
+		for (i=0; i<gEventCount; i++)
+			if ( (gEvent[i].stateIndex == parent) && !strcmp(gEvent[i].eventId, "EVT_FSM_ENTRY") )
+				found = 1;
+
+		if ( !found && (gEventCount < GEN_MAX_EVENTS) )
+		{
+			GenEvent	*pEvent = &gEvent[gEventCount++];
+
+			memset(pEvent, 0, sizeof(GenEvent));
+			strcpy(pEvent->state, gState[parent].name);
+			strcpy(pEvent->eventId, "EVT_FSM_ENTRY");
+			pEvent->stateIndex = parent;
+			pEvent->targetIndex = GEN_NONE;
+			pEvent->line = gRegion[r].line;
+		}
+	}
+
+} // Resolve
+
+/**************************************************************************************************/
+static int EventCount (int state)
+{
+	int	i, count = 0;
+
+	for (i=0; i<gEventCount; i++)
+		if (gEvent[i].stateIndex == state)
+			count++;
+
+	return count;
+}
+
+static int HasResetRegion (int state)
+{
+	int	r;
+
+	for (r=1; r<gRegionCount; r++)
+		if ( (gRegion[r].parentIndex == state) && gRegion[r].reset )
+			return 1;
+
+	return 0;
+}
+
+// A reset region's parent gets a generated entry handler; returns the user's entry handler event, if any
+static int EntryEvent (int state)
+{
+	int	i;
+
+	for (i=0; i<gEventCount; i++)
+		if ( (gEvent[i].stateIndex == state) && !strcmp(gEvent[i].eventId, "EVT_FSM_ENTRY") )
+			return i;
+
+	return GEN_NONE;
+}
+
+// Was this handler name already seen in an earlier event?
+static int FirstHandler (int event)
+{
+	int	i;
+
+	for (i=0; i<event; i++)
+		if (!strcmp(gEvent[i].handler, gEvent[event].handler))
+			return 0;
+
+	return 1;
+}
+
+static void Upper (char *pDest, const char *pSrc)
+{
+	while (*pSrc)
+		*pDest++ = (char)toupper((unsigned char)*pSrc++);
+	*pDest = '\0';
+}
+
+/**************************************************************************************************/
+static void WriteHeader (FILE *out, const char *pBase, const char *pPrefix)
+{
+	const char	*pFile = strrchr(pBase, '/') ? strrchr(pBase, '/') + 1 : pBase;
+	char		guard[GEN_MAX_NAME * 2];
+	int			i;
+
+	Upper(guard, pFile);
+	for (i=0; guard[i]; i++)
+		if (!isalnum((unsigned char)guard[i]))
+			guard[i] = '_';
+
+	fprintf(out, "/*\n *\n * File: %s.h\n *\n * Generated by fsm_gen from %s. Do not edit.\n *\n */\n\n", pFile, gPath);
+	fprintf(out, "#ifndef _%s_H_\n#define _%s_H_\n\n#include \"fsm.h\"\n\n", guard, guard);
+
+	fprintf(out, "// States, in the order of %s_state\nenum\n{\n", gMachine);
+	for (i=0; i<gStateCount; i++)
+		fprintf(out, "\t%s_%s,\n", pPrefix, gState[gStateOrder[i]].name);
+	fprintf(out, "\t%s_STATE_COUNT\n};\n\n", pPrefix);
+
+	fprintf(out, "// Regions, in the order of %s_fsm\nenum\n{\n", gMachine);
+	for (i=0; i<gRegionCount; i++)
+		fprintf(out, "\t%s_REGION_%s,\n", pPrefix, gRegion[i].name);
+	fprintf(out, "\t%s_REGION_COUNT\n};\n\n", pPrefix);
+
+	fprintf(out, "#define %s_STATE(name)\t(&%s_state[%s_##name])\n\n", pPrefix, gMachine, pPrefix);
+
+	fprintf(out, "extern Fsm\t\t%s_fsm[%s_REGION_COUNT];\n", gMachine, pPrefix);
+	fprintf(out, "extern FsmState\t%s_state[%s_STATE_COUNT];\n\n", gMachine, pPrefix);
+
+	fprintf(out, "// Event handlers, written by the user\n");
+	for (i=0; i<gEventCount; i++)
+		if ( gEvent[i].handler[0] && FirstHandler(i) )
+			fprintf(out, "FSM_EVENT_HANDLER( %s );\n", gEvent[i].handler);
+
+	fprintf(out, "\nvoid %sInit (void);\t\t\t// every region to its initial state, then enter the top level\n", gMachine);
+	fprintf(out, "void %sRun (int eventId);\n\n", gMachine);
+	fprintf(out, "#endif // _%s_H_\n", guard);
+
+} // WriteHeader
+
+/**************************************************************************************************/
+static void WriteSource (FILE *out, const char *pBase, int threshold, const char *pPrefix)
+{
+	const char	*pFile = strrchr(pBase, '/') ? strrchr(pBase, '/') + 1 : pBase;
+	int			eventIndex[GEN_MAX_EVENTS];		// position of each event in the generated array
+	int			listStart[GEN_MAX_STATES];
+	int			nestedStart[GEN_MAX_STATES];
+	int			tableIndex[GEN_MAX_STATES];
+	int			tables = 0;
+	int			nestedCount = 0;
+	int			position = 0;
+	int			i, s, r;
+
+	fprintf(out, "/*\n *\n * File: %s.c\n *\n * Generated by fsm_gen from %s. Do not edit.\n *\n */\n", pFile, gPath);
+	fprintf(out, "#include \"%s.h\"\n\n", pFile);
+
+	// events grouped by state, in state order
+	for (s=0; s<gStateCount; s++)
+	{
+		listStart[gStateOrder[s]] = position + s;		// each list also has its terminator
+		for (i=0; i<gEventCount; i++)
+			if (gEvent[i].stateIndex == gStateOrder[s])
+				eventIndex[position++] = i;
+
+		tableIndex[gStateOrder[s]] = ( (threshold > 0) && (EventCount(gStateOrder[s]) >= threshold) ) ? tables++ : GEN_NONE;
+	}
+
+	fprintf(out, "static FSM_EVENT_HANDLER( %s_Goto );\n", gMachine);
+	fprintf(out, "static FSM_EVENT_HANDLER( %s_Consume );\n", gMachine);
+	for (s=0; s<gStateCount; s++)
+		if (HasResetRegion(s))
+			fprintf(out, "static FSM_EVENT_HANDLER( %s_%s_Entry );\n", gMachine, gState[s].name);
+
+	// regions
+	fprintf(out, "\n// Regions, top level first\nFsm %s_fsm[%s_REGION_COUNT] = {\n", gMachine, pPrefix);
+	for (r=0; r<gRegionCount; r++)
+		fprintf(out, "\t{ DESIG_INIT(name,\"%s\") },\n", gRegion[r].name);
+	fprintf(out, "};\n\n");
+
+	// events
+	fprintf(out, "// Events, grouped by state\nstatic FsmEvent %s_event[%d] = {\n", gMachine, gEventCount ? gEventCount : 1);
+	for (i=0; i<gEventCount; i++)
+	{
+		GenEvent	*pEvent = &gEvent[eventIndex[i]];
+		char		handler[GEN_MAX_NAME * 2 + 8];
+		int			s = pEvent->stateIndex;
+
+		if ( HasResetRegion(s) && !strcmp(pEvent->eventId, "EVT_FSM_ENTRY") )
+			snprintf(handler, sizeof(handler), "%s_%s_Entry", gMachine, gState[s].name);
+		else if (pEvent->handler[0])
+			snprintf(handler, sizeof(handler), "%s", pEvent->handler);
+		else if (pEvent->target[0])
+			snprintf(handler, sizeof(handler), "%s_Goto", gMachine);
+		else
+			snprintf(handler, sizeof(handler), "%s_Consume", gMachine);
+
+		fprintf(out, "\t{ DESIG_INIT(id,%s), DESIG_INIT(pfnEvtHandler,%s) },\t// %s\n", pEvent->eventId, handler, gState[s].name);
+	}
+	if (0 == gEventCount)
+		fprintf(out, "\t{ DESIG_INIT(id,EVT_FSM_NULL) },\n");
+	fprintf(out, "};\n\n");
+
+	// transition targets
+	fprintf(out, "// Target state of each transition event, by index in %s_event\n", gMachine);
+	fprintf(out, "static const unsigned short %s_target[%d] = {", gMachine, gEventCount ? gEventCount : 1);
+	for (i=0; i<gEventCount; i++)
+	{
+		GenEvent	*pEvent = &gEvent[eventIndex[i]];
+
+		fprintf(out, "%s%d,", (i % 16) ? " " : "\n\t", (pEvent->targetIndex != GEN_NONE) ? gState[pEvent->targetIndex].order : 0);
+	}
+	fprintf(out, "%s\n};\n\n", gEventCount ? "" : "\n\t0");
+
+	// event lists
+	fprintf(out, "// Event lists: each state's events, then the terminator\n");
+	fprintf(out, "static FsmEvent * %s_eventList[%d] = {\n", gMachine, gEventCount + gStateCount);
+	for (s=0, position=0; s<gStateCount; s++)
+	{
+		int	count = EventCount(gStateOrder[s]);
+
+		fprintf(out, "\t");
+		for (i=0; i<count; i++)
+			fprintf(out, "&%s_event[%d], ", gMachine, position++);
+		fprintf(out, "&fsmNullEvent,\t// %s\n", gState[gStateOrder[s]].name);
+	}
+	fprintf(out, "};\n\n");
+
+	// nested region lists
+	fprintf(out, "// Nested regions of each state that has them\nstatic Fsm * %s_nested[] = {\n", gMachine);
+	for (s=0; s<gStateCount; s++)
+	{
+		int	state = gStateOrder[s];
+		int	any = 0;
+
+		nestedStart[state] = GEN_NONE;
+		for (r=1; r<gRegionCount; r++)
+		{
+			if (gRegion[r].parentIndex != state)
+				continue;
+			if (!any)
+			{
+				fprintf(out, "\t");
+				nestedStart[state] = nestedCount;
+				any = 1;
+			}
+			fprintf(out, "&%s_fsm[%d], ", gMachine, r);
+			nestedCount++;
+		}
+		if (any)
+		{
+			fprintf(out, "NULL,\t// %s\n", gState[state].name);
+			nestedCount++;
+		}
+	}
+	if (0 == nestedCount)
+		fprintf(out, "\tNULL\n");
+	fprintf(out, "};\n\n");
+
+	// states
+	fprintf(out, "// States, grouped by region\nFsmState %s_state[%s_STATE_COUNT] = {\n", gMachine, pPrefix);
+	for (s=0; s<gStateCount; s++)
+	{
+		int		state = gStateOrder[s];
+		char	nested[GEN_MAX_NAME * 2];
+
+		if (nestedStart[state] != GEN_NONE)
+			snprintf(nested, sizeof(nested), "&%s_nested[%d]", gMachine, nestedStart[state]);
+		else
+			snprintf(nested, sizeof(nested), "NULL");
+
+		fprintf(out, "\t{ DESIG_INIT(pFsm,&%s_fsm[%d]), DESIG_INIT(nestedFsmList,%s), DESIG_INIT(eventList,&%s_eventList[%d]),\n",
+				gMachine, gState[state].regionIndex, nested, gMachine, listStart[state]);
+		fprintf(out, "\t  DESIG_INIT(name,\"%s\"), DESIG_INIT(pfnStateHandler,FsmStateDefaultHandler), DESIG_INIT(notifyEventId,EVT_FSM_NULL) },\n",
+				gState[state].display);
+	}
+	fprintf(out, "};\n\n");
+
+	// dispatch tables: state s's table starts at _at<s>; it spans its lowest to highest event id,
+	// plus the entry for the ids outside that
+	if (tables > 0)
+	{
+		fprintf(out, "// Dispatch tables of the states with at least %d events, each spanning its event ids\nenum\n{\n\t%s_at0 = 0,\n",
+				threshold, gMachine);
+		for (s=0, position=0; s<gStateCount; s++)
+		{
+			int	count = EventCount(gStateOrder[s]);
+
+			if (tableIndex[gStateOrder[s]] != GEN_NONE)
+			{
+				for (i=0; i<count; i++)
+				{
+					const char	*pId = gEvent[eventIndex[position + i]].eventId;
+
+					if (0 == i)
+						fprintf(out, "	%s_lo%d_0 = %s, %s_hi%d_0 = %s,\n", gMachine, s, pId, gMachine, s, pId);
+					else
+						fprintf(out, "	%s_lo%d_%d = (%s < %s_lo%d_%d) ? %s : %s_lo%d_%d, %s_hi%d_%d = (%s > %s_hi%d_%d) ? %s : %s_hi%d_%d,\n",
+								gMachine, s, i, pId, gMachine, s, i - 1, pId, gMachine, s, i - 1,
+								gMachine, s, i, pId, gMachine, s, i - 1, pId, gMachine, s, i - 1);
+				}
+				fprintf(out, "	%s_at%d = %s_at%d + %s_hi%d_%d - %s_lo%d_%d + 2,\n", gMachine, s + 1, gMachine, s,
+						gMachine, s, count - 1, gMachine, s, count - 1);
+			}
+			else
+				fprintf(out, "	%s_at%d = %s_at%d,\n", gMachine, s + 1, gMachine, s);
+
+			position += count;
+		}
+		fprintf(out, "};\n\nstatic FsmEvent * %s_dispatch[%s_at%d];\n\n", gMachine, gMachine, gStateCount);
+	}
+
+	// generated handlers
+	fprintf(out, "/**************************************************************************************************/\n");
+	fprintf(out, "static FSM_EVENT_HANDLER( %s_Goto )\n{\n", gMachine);
+	fprintf(out, "\tpEvent->consumed = true;\n");
+	fprintf(out, "\treturn &%s_state[%s_target[pEvent - %s_event]];\n}\n\n", gMachine, gMachine, gMachine);
+	fprintf(out, "static FSM_EVENT_HANDLER( %s_Consume )\t{ pEvent->consumed = true; return NULL; }\n", gMachine);
+
+	for (s=0; s<gStateCount; s++)
+	{
+		int	entry;
+
+		if (!HasResetRegion(s))
+			continue;
+
+		entry = EntryEvent(s);
+		fprintf(out, "\n// Reset regions start over at their initial state\n");
+		fprintf(out, "static FSM_EVENT_HANDLER( %s_%s_Entry )\n{\n", gMachine, gState[s].name);
+		for (r=1; r<gRegionCount; r++)
+			if ( (gRegion[r].parentIndex == s) && gRegion[r].reset )
+				fprintf(out, "\t%s_fsm[%d].pState = &%s_state[%d];\n", gMachine, r, gMachine, gState[gRegion[r].initialIndex].order);
+
+		if ( (entry != GEN_NONE) && gEvent[entry].handler[0] )
+			fprintf(out, "\treturn %s(pState, pEvent);\n}\n", gEvent[entry].handler);
+		else if ( (entry != GEN_NONE) && gEvent[entry].target[0] )
+			fprintf(out, "\treturn %s_Goto(pState, pEvent);\n}\n", gMachine);
+		else
+			fprintf(out, "\treturn %s_Consume(pState, pEvent);\n}\n", gMachine);
+	}
+
+	// init and run
+	fprintf(out, "\n/**************************************************************************************************/\n");
+	fprintf(out, "void %sInit (void)\n{\n", gMachine);
+	for (s=0; s<gStateCount; s++)
+		if (tableIndex[gStateOrder[s]] != GEN_NONE)
+			fprintf(out, "\tFsmCompileStateRange(&%s_state[%d], &%s_dispatch[%s_at%d], %s_at%d - %s_at%d);\n",
+					gMachine, s, gMachine, gMachine, s, gMachine, s + 1, gMachine, s);
+	for (r=1; r<gRegionCount; r++)
+		fprintf(out, "\t%s_fsm[%d].pState = &%s_state[%d];\n", gMachine, r, gMachine, gState[gRegion[r].initialIndex].order);
+	fprintf(out, "\n\tFsmInit(&%s_fsm[0], &%s_state[%d]);\n}\n\n", gMachine, gMachine, gState[gRegion[0].initialIndex].order);
+
+	fprintf(out, "/**************************************************************************************************/\n");
+	fprintf(out, "void %sRun (int eventId)\n{\n\tFsmRun(&%s_fsm[0], eventId);\n}\n", gMachine, gMachine);
+
+} // WriteSource
+
+/**************************************************************************************************/
+static void WriteStubs (FILE *out, const char *pBase)
+{
+	const char	*pFile = strrchr(pBase, '/') ? strrchr(pBase, '/') + 1 : pBase;
+	int			i;
+
+	fprintf(out, "/*\n *\n * Event handlers for %s, generated by fsm_gen from %s\n *\n */\n", gMachine, gPath);
+	fprintf(out, "#include \"%s.h\"\n", pFile);
+
+	for (i=0; i<gEventCount; i++)
+	{
+		if ( !gEvent[i].handler[0] || !FirstHandler(i) )
+			continue;
+
+		fprintf(out, "\n// %s %s\n", gEvent[i].state, gEvent[i].eventId);
+		fprintf(out, "FSM_EVENT_HANDLER( %s )\n{\n\tpEvent->consumed = true;\n\treturn NULL;\n}\n", gEvent[i].handler);
+	}
+}
+
+/**************************************************************************************************/
+static FILE * OpenOut (const char *pBase, const char *pExt)
+{
+	char	path[1024];
+	FILE	*out;
+
+	snprintf(path, sizeof(path), "%s%s", pBase, pExt);
+	out = fopen(path, "w");
+	if (NULL == out)
+		perror(path);
+
+	return out;
+}
+
+/**************************************************************************************************/
+int main (int argc, char *argv[])
+{
+	FILE		*in;
+	FILE		*out;
+	const char	*pStubs = NULL;
+	const char	*pThreshold = "1";
+	const char	*pBase;
+	char		prefix[GEN_MAX_NAME];
+	char		line[1024];
+	int			lineNumber = 0;
+	int			arg = 1;
+
+	while ( (arg + 1 < argc) && ('-' == argv[arg][0]) )
+	{
+		if (!strcmp(argv[arg], "-s"))
+			pStubs = argv[arg + 1];
+		else if (!strcmp(argv[arg], "-t"))
+			pThreshold = argv[arg + 1];
+		else
+			break;
+		arg += 2;
+	}
+
+	if (arg + 2 != argc)
+	{
+		fprintf(stderr, "usage: %s [-t events] [-s stubs.c] machine.fsm out\n", argv[0]);
+		return 2;
+	}
+
+	gPath = argv[arg];
+	pBase = argv[arg + 1];
+
+	in = fopen(gPath, "r");
+	if (NULL == in)
+	{
+		perror(gPath);
+		return 1;
+	}
+
+	while (fgets(line, sizeof(line), in) != NULL)
+		ParseLine(line, ++lineNumber);
+	fclose(in);
+
+	Resolve();
+	if (gErrors > 0)
+		return 1;
+
+	Upper(prefix, gMachine);
+
+	out = OpenOut(pBase, ".h");
+	if (NULL == out)
+		return 1;
+	WriteHeader(out, pBase, prefix);
+	fclose(out);
+
+	out = OpenOut(pBase, ".c");
+	if (NULL == out)
+		return 1;
+	WriteSource(out, pBase, atoi(pThreshold), prefix);
+	fclose(out);
+
+	if (pStubs != NULL)
+	{
+		out = fopen(pStubs, "w");
+		if (NULL == out)
+		{
+			perror(pStubs);
+			return 1;
+		}
+		WriteStubs(out, pBase);
+		fclose(out);
+	}
+
+	return 0;
+
+} // main
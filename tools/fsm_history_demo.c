@@ -0,0 +1,159 @@
+/*
+ *
+ * File: fsm_history_demo.c
+ *
+ * Nested FSM history (FSM_HISTORY): the same two level machine under a deep and a shallow
+ * history FSM, run through an event sequence that leaves and re-enters both
+ *
+ *     usage: fsm_history_demo
+ *
+ * fsm_Top state 1 holds fsm_Deep (FSM_HISTORY_DEEP) and state 2 holds fsm_Shallow
+ * (FSM_HISTORY_SHALLOW). Each of them has states A and B, and B holds an inner FSM with states X
+ * and Y, entered at X. EVT_1 and EVT_2 move fsm_Top between its states, EVT_3 moves the outer
+ * FSM that is active between A and B, and EVT_4 the inner one between X and Y.
+ *
+ * Both halves are left in B/Y. Back in state 1, fsm_Deep resumes B and its inner FSM resumes Y;
+ * back in state 2, fsm_Shallow resumes B but its inner FSM (FSM_HISTORY_NONE) is entered at X.
+ *
+ */
+#include <stdio.h>
+
+#include "fsm.h"
+
+//==================
+//Define Fsm Objects
+//==================
+
+extern FsmState state_Deep_A, state_DeepInner_X;
+extern FsmState state_Shallow_A, state_ShallowInner_X;
+
+FSM(fsm_Top, "Top", NULL, NULL, NULL );
+FSM_HISTORY(fsm_Deep,         "Deep",         &state_Deep_A,         FSM_HISTORY_DEEP,    NULL, NULL );
+FSM_HISTORY(fsm_DeepInner,    "DeepInner",    &state_DeepInner_X,    FSM_HISTORY_SHALLOW, NULL, NULL );
+FSM_HISTORY(fsm_Shallow,      "Shallow",      &state_Shallow_A,      FSM_HISTORY_SHALLOW, NULL, NULL );
+FSM_HISTORY(fsm_ShallowInner, "ShallowInner", &state_ShallowInner_X, FSM_HISTORY_NONE,    NULL, NULL );
+
+//==============================
+//Define Event objects and lists
+//==============================
+
+// Method prototypes
+FSM_EVENT_HANDLER( Top_State1_EVT1 );
+FSM_EVENT_HANDLER( Top_State2_EVT2 );
+FSM_EVENT_HANDLER( Deep_A_EVT3 );
+FSM_EVENT_HANDLER( Deep_B_EVT3 );
+FSM_EVENT_HANDLER( DeepInner_X_EVT4 );
+FSM_EVENT_HANDLER( DeepInner_Y_EVT4 );
+FSM_EVENT_HANDLER( Shallow_A_EVT3 );
+FSM_EVENT_HANDLER( Shallow_B_EVT3 );
+FSM_EVENT_HANDLER( ShallowInner_X_EVT4 );
+FSM_EVENT_HANDLER( ShallowInner_Y_EVT4 );
+
+// Objects
+FSM_EVENT( evt_Top_State1_EVT1,      EVT_1, Top_State1_EVT1      );
+FSM_EVENT( evt_Top_State2_EVT2,      EVT_2, Top_State2_EVT2      );
+FSM_EVENT( evt_Deep_A_EVT3,          EVT_3, Deep_A_EVT3          );
+FSM_EVENT( evt_Deep_B_EVT3,          EVT_3, Deep_B_EVT3          );
+FSM_EVENT( evt_DeepInner_X_EVT4,     EVT_4, DeepInner_X_EVT4     );
+FSM_EVENT( evt_DeepInner_Y_EVT4,     EVT_4, DeepInner_Y_EVT4     );
+FSM_EVENT( evt_Shallow_A_EVT3,       EVT_3, Shallow_A_EVT3       );
+FSM_EVENT( evt_Shallow_B_EVT3,       EVT_3, Shallow_B_EVT3       );
+FSM_EVENT( evt_ShallowInner_X_EVT4,  EVT_4, ShallowInner_X_EVT4  );
+FSM_EVENT( evt_ShallowInner_Y_EVT4,  EVT_4, ShallowInner_Y_EVT4  );
+
+// Event list arrays
+FsmEvent* eventList_Top_State1[]      = { &evt_Top_State1_EVT1,     &fsmNullEvent };
+FsmEvent* eventList_Top_State2[]      = { &evt_Top_State2_EVT2,     &fsmNullEvent };
+FsmEvent* eventList_Deep_A[]          = { &evt_Deep_A_EVT3,         &fsmNullEvent };
+FsmEvent* eventList_Deep_B[]          = { &evt_Deep_B_EVT3,         &fsmNullEvent };
+FsmEvent* eventList_DeepInner_X[]     = { &evt_DeepInner_X_EVT4,    &fsmNullEvent };
+FsmEvent* eventList_DeepInner_Y[]     = { &evt_DeepInner_Y_EVT4,    &fsmNullEvent };
+FsmEvent* eventList_Shallow_A[]       = { &evt_Shallow_A_EVT3,      &fsmNullEvent };
+FsmEvent* eventList_Shallow_B[]       = { &evt_Shallow_B_EVT3,      &fsmNullEvent };
+FsmEvent* eventList_ShallowInner_X[]  = { &evt_ShallowInner_X_EVT4, &fsmNullEvent };
+FsmEvent* eventList_ShallowInner_Y[]  = { &evt_ShallowInner_Y_EVT4, &fsmNullEvent };
+
+//====================
+//Define State Objects
+//====================
+
+//++++ inner states ++++
+FSM_STATE( state_DeepInner_X,    &fsm_DeepInner,    NULL, eventList_DeepInner_X,    "X", FsmStateDefaultHandler );
+FSM_STATE( state_DeepInner_Y,    &fsm_DeepInner,    NULL, eventList_DeepInner_Y,    "Y", FsmStateDefaultHandler );
+FSM_STATE( state_ShallowInner_X, &fsm_ShallowInner, NULL, eventList_ShallowInner_X, "X", FsmStateDefaultHandler );
+FSM_STATE( state_ShallowInner_Y, &fsm_ShallowInner, NULL, eventList_ShallowInner_Y, "Y", FsmStateDefaultHandler );
+
+//++++ outer states ++++
+Fsm* nestedFsmList_Deep_B[]    = { &fsm_DeepInner,    NULL };
+Fsm* nestedFsmList_Shallow_B[] = { &fsm_ShallowInner, NULL };
+
+FSM_STATE( state_Deep_A,    &fsm_Deep,    NULL,                    eventList_Deep_A,    "A", FsmStateDefaultHandler );
+FSM_STATE( state_Deep_B,    &fsm_Deep,    nestedFsmList_Deep_B,    eventList_Deep_B,    "B", FsmStateDefaultHandler );
+FSM_STATE( state_Shallow_A, &fsm_Shallow, NULL,                    eventList_Shallow_A, "A", FsmStateDefaultHandler );
+FSM_STATE( state_Shallow_B, &fsm_Shallow, nestedFsmList_Shallow_B, eventList_Shallow_B, "B", FsmStateDefaultHandler );
+
+//++++ top states ++++
+Fsm* nestedFsmList_Top_State1[] = { &fsm_Deep,    NULL };
+Fsm* nestedFsmList_Top_State2[] = { &fsm_Shallow, NULL };
+
+FSM_STATE( state_Top_State1, &fsm_Top, nestedFsmList_Top_State1, eventList_Top_State1, "State1", FsmStateDefaultHandler );
+FSM_STATE( state_Top_State2, &fsm_Top, nestedFsmList_Top_State2, eventList_Top_State2, "State2", FsmStateDefaultHandler );
+
+//===============
+// Event Handlers
+//===============
+
+FSM_EVENT_HANDLER( Top_State1_EVT1 )      { pEvent->consumed = true; return &state_Top_State2; }
+FSM_EVENT_HANDLER( Top_State2_EVT2 )      { pEvent->consumed = true; return &state_Top_State1; }
+FSM_EVENT_HANDLER( Deep_A_EVT3 )          { pEvent->consumed = true; return &state_Deep_B; }
+FSM_EVENT_HANDLER( Deep_B_EVT3 )          { pEvent->consumed = true; return &state_Deep_A; }
+FSM_EVENT_HANDLER( DeepInner_X_EVT4 )     { pEvent->consumed = true; return &state_DeepInner_Y; }
+FSM_EVENT_HANDLER( DeepInner_Y_EVT4 )     { pEvent->consumed = true; return &state_DeepInner_X; }
+FSM_EVENT_HANDLER( Shallow_A_EVT3 )       { pEvent->consumed = true; return &state_Shallow_B; }
+FSM_EVENT_HANDLER( Shallow_B_EVT3 )       { pEvent->consumed = true; return &state_Shallow_A; }
+FSM_EVENT_HANDLER( ShallowInner_X_EVT4 )  { pEvent->consumed = true; return &state_ShallowInner_Y; }
+FSM_EVENT_HANDLER( ShallowInner_Y_EVT4 )  { pEvent->consumed = true; return &state_ShallowInner_X; }
+
+/**************************************************************************************************/
+// Active states from fsm_Top down, e.g. "Top:State1 Deep:B DeepInner:Y"
+static void PrintStates (const char *pStep)
+{
+	Fsm		*pFsm = &fsm_Top;
+
+	printf("%-12s", pStep);
+
+	while (pFsm != NULL)
+	{
+		printf(" %s:%s", pFsm->name, pFsm->pState->name);
+		pFsm = (NULL == pFsm->pState->nestedFsmList) ? NULL : pFsm->pState->nestedFsmList[0];
+	}
+
+	printf("\n");
+}
+
+/**************************************************************************************************/
+int main (void)
+{
+	static const struct { int eventId; const char *pStep; } steps[] = {
+		{ EVT_3, "EVT_3" },
+		{ EVT_4, "EVT_4" },
+		{ EVT_1, "EVT_1" },
+		{ EVT_3, "EVT_3" },
+		{ EVT_4, "EVT_4" },
+		{ EVT_2, "EVT_2" },		// fsm_Deep resumes B, fsm_DeepInner resumes Y
+		{ EVT_1, "EVT_1" },		// fsm_Shallow resumes B, fsm_ShallowInner enters X
+	};
+	int		i;
+
+	FsmInit(&fsm_Top, &state_Top_State1);
+	PrintStates("init");
+
+	for (i=0; i<(int)(sizeof(steps)/sizeof(steps[0])); i++)
+	{
+		FsmRun(&fsm_Top, steps[i].eventId);
+		PrintStates(steps[i].pStep);
+	}
+
+	return 0;
+
+} // main
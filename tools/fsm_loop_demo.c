@@ -0,0 +1,312 @@
+/*
+ *
+ * File: fsm_loop_demo.c
+ *
+ * Linux port of the fsm_test console demo (compilers/vse2013/fsm_test.cpp): the example machine
+ * runs on an event loop thread, and the menu and two more threads post events to it
+ *
+ *     usage: fsm_loop_demo [-t ticks]                       menu, as fsm_test
+ *            fsm_loop_demo -n events [-b burst] [-t ticks]  load: threads 2 and 3 post events each
+ *
+ * The FSM thread is an FsmLoop in place of the GetMessage loop of TopFsmThread. Posts from the
+ * other threads go through fsm_Top's mailbox, and the loop is only woken through its eventfd
+ * when it is asleep. -t runs EVT_3 on fsm_Top every ticks ms from the loop's timer wheel.
+ *
+ * In the load mode threads 2 and 3 post events, burst events at a time with a short pause
+ * between bursts (burst 0: no pauses), then the loop's counters are printed: with more than
+ * one event waiting per wakeup, there are fewer wakeups than events. The two threads' events
+ * interleave, so the machine ignores some of them, and FsmRun logs each one it ignores.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "fsm_loop.h"
+
+#define DEMO_PAUSE_US	100		// between bursts
+
+void MyFsmInit (void);
+void PrintMyEventMenu (void);
+
+extern Fsm	fsm_Top, fsm_Nested1, fsm_Nested2;
+
+FSM_MAILBOX(mailbox_Top, 1024);
+
+static FsmLoop			gTopLoop;
+static FsmTimerWheel	gTimerWheel;
+static FsmTimer			gTickTimer;
+static int				gTickPeriod;		// ms, 0 for no timer
+static int				gLoadEvents;		// per thread
+static int				gLoadBurst;
+static atomic_uint_least64_t	gPosted;
+
+static pthread_t		hTopFsmThread;
+static pthread_t		hThread2;
+static pthread_t		hThread3;
+
+/**************************************************************************************************/
+static void * TopFsmThread (void *pArg)
+{
+	MyFsmInit();
+
+	if (gTickPeriod > 0)
+		FsmTimerPost(&gTimerWheel, &gTickTimer, &fsm_Top, EVT_3, gTickPeriod, gTickPeriod);
+
+	FsmLoopRun(&gTopLoop);
+
+	return NULL;
+}
+
+/**************************************************************************************************/
+// Threads 2 and 3 post EVT_1..EVT_4 to the FSM thread
+static void * PostThread (void *pArg)
+{
+	static const int	events[] = { EVT_1, EVT_3, EVT_2, EVT_4 };
+	int					i;
+
+	for (i=0; i<gLoadEvents; i++)
+	{
+		FsmLoopPostWait(&gTopLoop, &fsm_Top, events[i & 3]);
+
+		if ( (gLoadBurst > 0) && (0 == (i + 1) % gLoadBurst) )
+			usleep(DEMO_PAUSE_US);
+	}
+
+	atomic_fetch_add(&gPosted, (uint64_t)gLoadEvents);
+
+	return NULL;
+}
+
+/**************************************************************************************************/
+// Wait for the FSM thread to run everything posted so far
+static void WaitIdle (void)
+{
+	FsmLoopStats	stats;
+
+	do
+	{
+		usleep(1000);
+		FsmLoopGetStats(&gTopLoop, &stats);
+
+	} while (stats.events < atomic_load(&gPosted));
+}
+
+/**************************************************************************************************/
+static void SendMsgTopFsmThreadEvent (int eventId)
+{
+	if (FsmLoopPost(&gTopLoop, &fsm_Top, eventId) != 0)
+	{
+		printf("%s post failed\n", __func__);
+		return;
+	}
+
+	atomic_fetch_add(&gPosted, 1);
+}
+
+/**************************************************************************************************/
+static void PrintStates (void)
+{
+	WaitIdle();
+
+	printf("%s:%s %s:%s %s:%s\n",
+		   fsm_Top.name, fsm_Top.pState->name,
+		   fsm_Nested1.name, fsm_Nested1.pState->name,
+		   fsm_Nested2.name, fsm_Nested2.pState->name);
+}
+
+/**************************************************************************************************/
+static int GetChoice (void)
+{
+	int	choice;
+
+	do
+	{
+		choice = getchar();
+		if (EOF == choice)
+			return '.';
+
+	} while (isspace(choice));
+
+	return choice;
+}
+
+/**************************************************************************************************/
+// menu character from PrintMyEventMenu to event, EVT_FSM_EOL if it isn't one
+static int ChoiceEvent (int choice)
+{
+	if (isdigit(choice))
+		return choice - '0';
+	if (isalpha(choice))
+		return (choice < 'a') ? (choice - 'A' + 36) : (choice - 'a' + 10);
+	return EVT_FSM_EOL;
+}
+
+/**************************************************************************************************/
+static void EventMenu (void)
+{
+	bool	done = false;
+	int		choice;
+	int		eventId;
+
+	while (!done)
+	{
+		printf("\n");
+		printf("==================\n");
+		printf("**  Event Menu  **\n");
+		printf("==================\n");
+
+		printf("\nChoose option:\n");
+
+		printf("[.] Exit this menu\n");
+
+		PrintMyEventMenu();
+
+		choice = GetChoice();
+
+		printf(" %c\n", choice);
+
+		eventId = ChoiceEvent(choice);
+		if ( (eventId < EVT_FSM_EOL) && IS_MY_EVENT(eventId) )
+		{
+			SendMsgTopFsmThreadEvent(eventId);
+			PrintStates();
+		}
+		else if ('.' == choice)
+			done = true;
+	}
+
+} // EventMenu
+
+/**************************************************************************************************/
+// TestFsm's events, posted to the FSM thread
+static void PostTestFsm (void)
+{
+	static const int	events[] = { EVT_3, EVT_1, EVT_3, EVT_2, EVT_4, EVT_1, EVT_4 };
+	int					i;
+
+	for (i=0; i<(int)(sizeof(events)/sizeof(events[0])); i++)
+		SendMsgTopFsmThreadEvent(events[i]);
+
+	PrintStates();
+}
+
+/**************************************************************************************************/
+static void Menu (void)
+{
+	bool	done = false;
+	int		choice;
+
+	while (!done)
+	{
+		printf("\nChoose option:\n");
+
+		printf("[.] Exit this menu\n");
+		printf("[0] Simple FSM test\n");
+		printf("[1] Send FSM event\n");
+
+		choice = GetChoice();
+
+		switch (choice)
+		{
+			case '0':
+				PostTestFsm();
+				break;
+
+			case '1':
+				EventMenu();
+				break;
+
+			case '.':
+				done = true;
+				break;
+		}
+	}
+}
+
+/**************************************************************************************************/
+static double Seconds (void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/**************************************************************************************************/
+static void Load (void)
+{
+	FsmLoopStats	stats;
+	double			start = Seconds();
+	double			elapsed;
+
+	pthread_create(&hThread2, NULL, PostThread, NULL);
+	pthread_create(&hThread3, NULL, PostThread, NULL);
+	pthread_join(hThread2, NULL);
+	pthread_join(hThread3, NULL);
+
+	WaitIdle();
+	elapsed = Seconds() - start;
+
+	FsmLoopGetStats(&gTopLoop, &stats);
+
+	printf("events          %llu\n", (unsigned long long)stats.events);
+	printf("wakeups         %llu\n", (unsigned long long)stats.wakeups);
+	printf("eventfd writes  %llu\n", (unsigned long long)stats.signals);
+	printf("passes          %llu\n", (unsigned long long)stats.passes);
+	printf("timers          %llu\n", (unsigned long long)stats.timers);
+	printf("wakeups/event   %.4f\n", (stats.events > 0) ? (double)stats.wakeups / (double)stats.events : 0.0);
+	printf("events/pass     %.1f\n", (stats.passes > 0) ? (double)stats.events / (double)stats.passes : 0.0);
+	printf("events/s        %.0f\n", (elapsed > 0) ? (double)stats.events / elapsed : 0.0);
+}
+
+/**************************************************************************************************/
+int main (int argc, char *argv[])
+{
+	int	arg;
+
+	for (arg=1; arg + 1 < argc; arg += 2)
+	{
+		if (0 == strcmp(argv[arg], "-n"))
+			gLoadEvents = atoi(argv[arg + 1]);
+		else if (0 == strcmp(argv[arg], "-b"))
+			gLoadBurst = atoi(argv[arg + 1]);
+		else if (0 == strcmp(argv[arg], "-t"))
+			gTickPeriod = atoi(argv[arg + 1]);
+		else
+			break;
+	}
+
+	if (arg < argc)
+	{
+		fprintf(stderr, "usage: %s [-n events] [-b burst] [-t ticks]\n", argv[0]);
+		return 2;
+	}
+
+	if (FSM_MAILBOX_INIT(mailbox_Top) != 0)
+		return 1;
+	fsm_Top.mailbox = (FsmMailbox *)&mailbox_Top;
+
+	FsmTimerWheelInit(&gTimerWheel);
+	if ( (FsmLoopInit(&gTopLoop, &gTimerWheel, 1000000) != 0) || (FsmLoopAdd(&gTopLoop, &fsm_Top) != 0) )
+		return 1;
+
+	pthread_create(&hTopFsmThread, NULL, TopFsmThread, NULL);
+
+	if (gLoadEvents > 0)
+		Load();
+	else
+		Menu();
+
+	FsmLoopStop(&gTopLoop);
+	pthread_join(hTopFsmThread, NULL);
+	FsmLoopClose(&gTopLoop);
+
+	return 0;
+
+} // main
@@ -0,0 +1,526 @@
+/*
+ *
+ * File: fsm_replay.c
+ *
+ * Replay a recorded FSM trace: run its input events through FsmRun, check the trace the machine
+ * produces against the recorded one, and time the replay
+ *
+ *     usage: fsm_replay [-p passes] trace.csv|trace.bin
+ *
+ * The trace is the CSV layout of the FSM_LOG trace (docs/fsm-trace.csv) or a binary trace file
+ * (fsm_trace.h). The input events are the events the FSM returned by FsmReplayInit got from
+ * outside: the Enter records at the top of the FSM's handler nesting whose event passes
+ * FsmReplayIsInput. A deferred event the machine recalls also looks like an input event, so
+ * machines that defer input events replay one extra event per recall.
+ *
+ * The check pass runs the events one at a time with the binary trace on, and compares each
+ * record with the recorded one. It reports the first record that differs, and the event that
+ * produced it. Then the timed passes run all the events again with tracing off, from the
+ * configuration after FsmReplayInit (see fsm_replay.h), and report throughput.
+ *
+ * Exit status: 0 if the traces match, 1 if they differ, 2 if the trace can't be read.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "fsm_trace.h"
+#include "fsm_replay.h"
+
+#define REPLAY_MAX_LINE		512
+#define REPLAY_MAX_FIELDS	8
+#define REPLAY_PASSES		10
+
+typedef struct
+{
+	int				eventId;
+	int				line;		// trace line of its Enter record
+} ReplayInput;
+
+// the recorded trace
+static char **			gLines;
+static int				gLineCount;
+static int				gLineSize;
+static ReplayInput *	gInputs;
+static int				gInputCount;
+
+// check pass
+static int				gAt;			// next recorded line to compare
+static int				gInput;			// input event being run, -1 during FsmReplayInit
+static int				gDiverged = -1;	// first line that differs
+static int				gDivergedInput;
+static char				gProduced[REPLAY_MAX_LINE];
+
+// names from a binary trace file
+static char *			gFileEvents[EVT_FSM_EOL > 1024 ? EVT_FSM_EOL : 1024];
+static int				gFileEventCount;
+static char *			gFileNames[FSM_TRACE_MAX_NAMES];
+
+/**************************************************************************************************/
+static uint64_t ReplayNow (void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/**************************************************************************************************/
+static void AddLine (const char *line)
+{
+	if (gLineCount == gLineSize)
+	{
+		gLineSize = gLineSize ? gLineSize * 2 : 1024;
+		gLines = (char **)realloc(gLines, gLineSize * sizeof(char *));
+		if (NULL == gLines)
+		{
+			fprintf(stderr, "fsm_replay: out of memory\n");
+			exit(2);
+		}
+	}
+
+	gLines[gLineCount++] = strdup(line);
+}
+
+/**************************************************************************************************/
+// Split a line at the commas. Returns the number of fields.
+static int SplitLine (char *line, char *fields[])
+{
+	int		count = 0;
+
+	fields[count++] = line;
+	for ( ; *line != '\0'; line++)
+	{
+		if ( (',' == *line) && (count < REPLAY_MAX_FIELDS) )
+		{
+			*line = '\0';
+			fields[count++] = line + 1;
+		}
+	}
+
+	return count;
+}
+
+/**************************************************************************************************/
+// A line of an FSM_LOG trace in the layout fsm_trace_decode writes: begin/end become enter/exit,
+// and FsmRun's ignored event lines lose their empty column. Lines that aren't trace points are
+// dropped.
+static void AddCsvLine (char *line)
+{
+	char	*fields[REPLAY_MAX_FIELDS];
+	char	out[REPLAY_MAX_LINE];
+	char	*phase;
+	int		count;
+	int		i;
+
+	line[strcspn(line, "\r\n")] = '\0';
+	count = SplitLine(line, fields);
+	if (count < 5)
+		return;
+
+	if (0 == strcmp(fields[count - 1], "ignored"))
+	{
+		if ('\0' == fields[1][0])		// FSM_LOG(",%s,...")
+		{
+			for (i=1; i<count-1; i++)
+				fields[i] = fields[i + 1];
+			count--;
+		}
+		snprintf(out, sizeof(out), "FsmRun,%s,%s,%s,ignored", fields[1], fields[2], fields[3]);
+		AddLine(out);
+		return;
+	}
+
+	phase = fields[1];
+	if (0 == strcmp(phase, "begin"))
+		phase = "enter";
+	else if (0 == strcmp(phase, "end"))
+		phase = "exit";
+	else if ( strcmp(phase, "enter") && strcmp(phase, "exit") && strcmp(phase, "run") )
+		return;
+
+	snprintf(out, sizeof(out), "%s,%s", fields[0], phase);
+	for (i=2; i<count; i++)
+		snprintf(out + strlen(out), sizeof(out) - strlen(out), ",%s", fields[i]);
+
+	AddLine(out);
+}
+
+/**************************************************************************************************/
+// Same columns as fsm_trace_decode
+static void FormatRecord (char *out, size_t size, const FsmTraceRecord *pRec,
+						  const char * (*pfnName)(uint16_t), const char * (*pfnEvent)(int, char *))
+{
+	char	event[16];
+
+	switch (pRec->phase)
+	{
+		case FSM_TRACE_PHASE_ENTER:
+			snprintf(out, size, "%s,enter,%s,%s,%s", (*pfnName)(pRec->site), (*pfnName)(pRec->fsm),
+					 (*pfnName)(pRec->state), (*pfnEvent)(pRec->eventId, event));
+			break;
+
+		case FSM_TRACE_PHASE_EXIT:
+			snprintf(out, size, "%s,exit,%s,%s,%s,%sconsumed", (*pfnName)(pRec->site), (*pfnName)(pRec->fsm),
+					 (*pfnName)(pRec->state), (*pfnEvent)(pRec->eventId, event), pRec->consumed ? "" : "not_");
+			break;
+
+		case FSM_TRACE_PHASE_RUN:
+			snprintf(out, size, "%s,run,%s,%s,%s", (*pfnName)(pRec->site), (*pfnName)(pRec->fsm),
+					 (*pfnName)(pRec->state), (*pfnName)((uint16_t)pRec->eventId));
+			break;
+
+		case FSM_TRACE_PHASE_IGNORED:
+			snprintf(out, size, "%s,%s,%s,%s,ignored", (*pfnName)(pRec->site), (*pfnName)(pRec->fsm),
+					 (*pfnName)(pRec->state), (*pfnEvent)(pRec->eventId, event));
+			break;
+
+		default:
+			snprintf(out, size, "?,%d", pRec->phase);
+			break;
+	}
+}
+
+/**************************************************************************************************/
+// Names in a binary trace file
+static const char * FileName (uint16_t index)
+{
+	if ( (index >= FSM_TRACE_MAX_NAMES) || (NULL == gFileNames[index]) )
+		return "?";
+
+	return gFileNames[index];
+}
+
+static const char * FileEvent (int eventId, char *buffer)
+{
+	if ( (eventId >= 0) && (eventId < gFileEventCount) )
+		return gFileEvents[eventId];
+
+	sprintf(buffer, "%d", eventId);
+	return buffer;
+}
+
+// Names in this process
+static const char * LiveName (uint16_t index)
+{
+	const char	*name = FsmTraceNameString(index);
+
+	return (NULL == name) ? "?" : name;
+}
+
+static const char * LiveEvent (int eventId, char *buffer)
+{
+	if ( (eventId >= 0) && (eventId < EVT_FSM_EOL) )
+		return FSM_EVT_NAME(eventId);
+
+	sprintf(buffer, "%d", eventId);
+	return buffer;
+}
+
+/**************************************************************************************************/
+// Read a binary trace file into lines (fsm_trace_decode's reader)
+static int ReadBinary (FILE *in, const char *path)
+{
+	uint32_t	header[2];
+	uint32_t	chunk[2];
+	char		*pData = NULL;
+	size_t		dataSize = 0;
+
+	if ( (fread(header, sizeof(header), 1, in) != 1)
+	  || (header[0] != FSM_TRACE_FILE_VERSION) || (header[1] != sizeof(FsmTraceRecord)) )
+	{
+		fprintf(stderr, "%s: unsupported trace version\n", path);
+		return -1;
+	}
+
+	while (fread(chunk, sizeof(chunk), 1, in) == 1)
+	{
+		if (chunk[1] + 1 > dataSize)
+		{
+			dataSize = chunk[1] + 1;
+			pData = (char *)realloc(pData, dataSize);
+			if (NULL == pData)
+				return -1;
+		}
+
+		if (fread(pData, 1, chunk[1], in) != chunk[1])
+		{
+			fprintf(stderr, "%s: truncated chunk\n", path);
+			break;
+		}
+		pData[chunk[1]] = '\0';
+
+		if (FSM_TRACE_CHUNK_EVENTS == chunk[0])
+		{
+			char	*p = pData;
+
+			gFileEventCount = 0;
+			while ( (p < pData + chunk[1]) && (gFileEventCount < (int)(sizeof(gFileEvents)/sizeof(gFileEvents[0]))) )
+			{
+				gFileEvents[gFileEventCount++] = strdup(p);
+				p += strlen(p) + 1;
+			}
+		}
+		else if (FSM_TRACE_CHUNK_NAME == chunk[0])
+		{
+			uint16_t	index;
+
+			memcpy(&index, pData, 2);
+			if (index < FSM_TRACE_MAX_NAMES)
+			{
+				free(gFileNames[index]);
+				gFileNames[index] = strdup(pData + 2);
+			}
+		}
+		else if (FSM_TRACE_CHUNK_RECORDS == chunk[0])
+		{
+			uint32_t		i;
+			FsmTraceRecord	rec;
+			char			line[REPLAY_MAX_LINE];
+
+			for (i=0; i + sizeof(rec) <= chunk[1]; i += sizeof(rec))
+			{
+				memcpy(&rec, pData + i, sizeof(rec));
+				FormatRecord(line, sizeof(line), &rec, FileName, FileEvent);
+				AddLine(line);
+			}
+		}
+	}
+
+	free(pData);
+
+	return 0;
+}
+
+/**************************************************************************************************/
+static int ReadTrace (const char *path)
+{
+	FILE	*in = fopen(path, "rb");
+	char	magic[8];
+	char	line[REPLAY_MAX_LINE];
+	int		result = 0;
+
+	if (NULL == in)
+	{
+		perror(path);
+		return -1;
+	}
+
+	if ( (fread(magic, 1, 8, in) == 8) && (0 == memcmp(magic, FSM_TRACE_FILE_MAGIC, 8)) )
+		result = ReadBinary(in, path);
+	else
+	{
+		rewind(in);
+		while (fgets(line, sizeof(line), in) != NULL)
+			AddCsvLine(line);
+	}
+
+	fclose(in);
+
+	return result;
+}
+
+/**************************************************************************************************/
+static int EventId (const char *name)
+{
+	char	*end;
+	long	id;
+	int		i;
+
+	for (i=0; i<EVT_FSM_EOL; i++)
+		if (0 == strcmp(name, FSM_EVT_NAME(i)))
+			return i;
+
+	id = strtol(name, &end, 10);
+	if ( (end != name) && ('\0' == *end) )
+		return (int)id;
+
+	return EVT_FSM_NULL;
+}
+
+/**************************************************************************************************/
+// Find the input events: Enter records of the FSM at the top of the handler nesting
+static int FindInputs (const char *fsmName)
+{
+	char	*fields[REPLAY_MAX_FIELDS];
+	char	line[REPLAY_MAX_LINE];
+	int		depth = 0;
+	int		i;
+
+	gInputs = (ReplayInput *)malloc((gLineCount + 1) * sizeof(ReplayInput));
+	if (NULL == gInputs)
+		return -1;
+
+	for (i=0; i<gLineCount; i++)
+	{
+		int		count;
+
+		snprintf(line, sizeof(line), "%s", gLines[i]);
+		count = SplitLine(line, fields);
+		if (count < 5)
+			continue;
+
+		if (0 == strcmp(fields[1], "exit"))
+			depth--;
+		else if (0 == strcmp(fields[1], "enter"))
+		{
+			int	eventId = EventId(fields[4]);
+
+			if ( (0 == depth) && (0 == strcmp(fields[2], fsmName)) && (EVT_FSM_NULL == eventId) )
+			{
+				fprintf(stderr, "fsm_replay: line %d: event %s isn't in this build's event list\n", i + 1, fields[4]);
+				return -1;
+			}
+			else if ( (0 == depth) && (0 == strcmp(fields[2], fsmName)) && FsmReplayIsInput(eventId) )
+			{
+				gInputs[gInputCount].eventId = eventId;
+				gInputs[gInputCount].line = i;
+				gInputCount++;
+			}
+			depth++;
+		}
+	}
+
+	return 0;
+}
+
+/**************************************************************************************************/
+// Compare the machine's trace records with the recorded lines
+static void CheckSink (void *pContext, const FsmTraceRecord *pRecords, int count)
+{
+	int		i;
+
+	(void)pContext;
+
+	for (i=0; i<count; i++)
+	{
+		char	line[REPLAY_MAX_LINE];
+
+		if (gDiverged >= 0)
+			return;
+
+		FormatRecord(line, sizeof(line), &pRecords[i], LiveName, LiveEvent);
+
+		if ( (gAt >= gLineCount) || strcmp(line, gLines[gAt]) )
+		{
+			gDiverged = gAt;
+			gDivergedInput = gInput;
+			snprintf(gProduced, sizeof(gProduced), "%s", line);
+			return;
+		}
+		gAt++;
+	}
+}
+
+/**************************************************************************************************/
+static void ReportDivergence (void)
+{
+	const char	*expected = (gDiverged < gLineCount) ? gLines[gDiverged] : "(end of trace)";
+	char		event[16];
+
+	printf("first divergence at trace line %d", gDiverged + 1);
+	if (gDivergedInput >= 0)
+		printf(", event %d (%s, trace line %d)", gDivergedInput + 1,
+			   LiveEvent(gInputs[gDivergedInput].eventId, event), gInputs[gDivergedInput].line + 1);
+	else
+		printf(", during FsmReplayInit");
+	printf("\n    recorded: %s\n    replayed: %s\n", expected, gProduced[0] ? gProduced : "(no record)");
+}
+
+/**************************************************************************************************/
+int main (int argc, char *argv[])
+{
+	const FsmImageMap	*pMap;
+	Fsm					*pFsm;
+	void				*pImage = NULL;
+	long				imageSize = 0;
+	int					passes = REPLAY_PASSES;
+	uint64_t			start;
+	uint64_t			elapsed;
+	int					arg = 1;
+	int					i;
+	int					p;
+
+	if ( (arg + 1 < argc) && (0 == strcmp(argv[arg], "-p")) )
+	{
+		passes = atoi(argv[arg + 1]);
+		arg += 2;
+	}
+
+	if (arg + 1 != argc)
+	{
+		fprintf(stderr, "usage: %s [-p passes] trace.csv|trace.bin\n", argv[0]);
+		return 2;
+	}
+
+	if (ReadTrace(argv[arg]) != 0)
+		return 2;
+
+	// check pass
+	gInput = -1;
+	pFsm = FsmReplayInit();
+	FsmTraceDrain(CheckSink, NULL);
+
+	pMap = FsmReplayImageMap();
+	if (pMap != NULL)
+	{
+		imageSize = FsmImageSize(pMap);
+		pImage = malloc(imageSize);
+		if ( (NULL == pImage) || (FsmImageSave(pMap, pImage, imageSize) < 0) )
+			return 2;
+	}
+
+	if (FindInputs(pFsm->name) != 0)
+		return 2;
+
+	start = ReplayNow();
+	for (gInput=0; (gInput<gInputCount) && (gDiverged < 0); gInput++)
+	{
+		FsmRun(pFsm, gInputs[gInput].eventId);
+		FsmTraceDrain(CheckSink, NULL);
+	}
+	elapsed = ReplayNow() - start;
+
+	if ( (gDiverged < 0) && (gAt < gLineCount) )
+	{
+		gDiverged = gAt;
+		gDivergedInput = gInputCount - 1;
+	}
+
+	printf("%s: %d trace records, %d input events on %s\n", argv[arg], gLineCount, gInputCount, pFsm->name);
+	printf("check:  %d events, %.0f ev/s with tracing, ", gInput, elapsed ? gInput * 1e9 / elapsed : 0.0);
+	if (gDiverged < 0)
+		printf("traces match\n");
+	else
+		ReportDivergence();
+
+	if (FsmTraceDropped() != 0)
+		printf("warning: %llu trace records dropped\n", (unsigned long long)FsmTraceDropped());
+
+	// timed passes
+	FsmTraceEnable(false);
+	elapsed = 0;
+	for (p=0; (p<passes) && (gInputCount > 0); p++)
+	{
+		if ( (pImage != NULL) && (FsmImageRestore(pMap, pImage, imageSize) != 0) )
+			return 2;
+
+		start = ReplayNow();
+		for (i=0; i<gInputCount; i++)
+			FsmRun(pFsm, gInputs[i].eventId);
+		elapsed += ReplayNow() - start;
+	}
+	FsmTraceEnable(true);
+
+	if (passes > 0)
+		printf("replay: %d passes, %.0f ev/s, %.1f ns/event\n", passes,
+			   elapsed ? (double)passes * gInputCount * 1e9 / elapsed : 0.0,
+			   gInputCount ? (double)elapsed / ((double)passes * gInputCount) : 0.0);
+
+	free(pImage);
+
+	return (gDiverged < 0) ? 0 : 1;
+}
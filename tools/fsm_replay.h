@@ -0,0 +1,32 @@
+/*
+ *
+ * File: fsm_replay.h
+ *
+ * Machine hooks for fsm_replay: the application's side of the replay tool
+ *
+ *
+ */
+
+#ifndef _FSM_REPLAY_H_
+#define _FSM_REPLAY_H_
+
+#include "fsm.h"
+#include "fsm_image.h"
+
+// fsm_replay is linked with the machine it replays. Build the machine, fsm.c and the replay
+// tool with FSM_TRACE 2 (binary trace), and supply:
+
+// Build and enter the machine, as the application does at startup. Returns the FSM the trace's
+// input events are run on.
+Fsm *				FsmReplayInit (void);
+
+// True for the events the application sends the machine from outside, the input events of a
+// trace. Enter records of any other event at the top of the handler nesting are the framework's
+// or the machine's own, and aren't replayed.
+bool				FsmReplayIsInput (int eventId);
+
+// The machine's FSMs and states (see fsm_image.h), or NULL. With a map each timed pass starts
+// from the configuration FsmReplayInit left; without one each pass carries on from the last.
+const FsmImageMap *	FsmReplayImageMap (void);
+
+#endif // _FSM_REPLAY_H_
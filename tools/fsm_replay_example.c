@@ -0,0 +1,44 @@
+/*
+ *
+ * File: fsm_replay_example.c
+ *
+ * fsm_replay hooks for the example machine (fsm_example.c), so docs/fsm-trace.csv can be replayed
+ *
+ * The input events are the ones EventMenu in compilers/vse2013/fsm_test.cpp sends: SendEvent runs
+ * the IS_MY_EVENT events (fsm_events.h) on fsm_Top through MyFsmRun.
+ *
+ */
+#include "fsm_replay.h"
+
+void MyFsmInit (void);
+
+extern Fsm		fsm_Top, fsm_Nested1, fsm_Nested2;
+extern FsmState	state_Top_State1, state_Top_State2;
+extern FsmState	state_Nested1_State1, state_Nested1_State2, state_Nested2_State1, state_Nested2_State2;
+
+static Fsm *		gFsmList[] = { &fsm_Top, &fsm_Nested1, &fsm_Nested2 };
+static FsmState *	gStateList[] = {
+	&state_Top_State1, &state_Top_State2,
+	&state_Nested1_State1, &state_Nested1_State2,
+	&state_Nested2_State1, &state_Nested2_State2
+};
+static const FsmImageMap	gMap = FSM_IMAGE_MAP(gFsmList, gStateList);
+
+/**************************************************************************************************/
+Fsm * FsmReplayInit (void)
+{
+	MyFsmInit();
+	return &fsm_Top;
+}
+
+/**************************************************************************************************/
+bool FsmReplayIsInput (int eventId)
+{
+	return IS_MY_EVENT(eventId);
+}
+
+/**************************************************************************************************/
+const FsmImageMap * FsmReplayImageMap (void)
+{
+	return &gMap;
+}
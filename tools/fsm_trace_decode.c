@@ -0,0 +1,180 @@
+/*
+ *
+ * File: fsm_trace_decode.c
+ *
+ * Convert a binary FSM trace file (fsm_trace.h) to the CSV layout of the FSM_LOG trace
+ *
+ *     usage: fsm_trace_decode trace.bin [out.csv]
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "fsm_trace.h"
+
+static char *	gEventNames[EVT_FSM_EOL > 1024 ? EVT_FSM_EOL : 1024];
+static int		gEventCount;
+static char *	gNames[FSM_TRACE_MAX_NAMES];
+
+/**************************************************************************************************/
+static const char * Name (uint16_t index)
+{
+	if ( (index >= FSM_TRACE_MAX_NAMES) || (NULL == gNames[index]) )
+		return "?";
+
+	return gNames[index];
+}
+
+/**************************************************************************************************/
+static void PrintEvent (FILE *out, int eventId)
+{
+	if ( (eventId >= 0) && (eventId < gEventCount) )
+		fprintf(out, "%s", gEventNames[eventId]);
+	else
+		fprintf(out, "%d", eventId);
+}
+
+/**************************************************************************************************/
+// Same columns as FSM_TRACE_ENTER/EXIT/RUN/IGNORED with FSM_TRACE 1
+static void PrintRecord (FILE *out, const FsmTraceRecord *pRec)
+{
+	switch (pRec->phase)
+	{
+		case FSM_TRACE_PHASE_ENTER:
+			fprintf(out, "%s,enter,%s,%s,", Name(pRec->site), Name(pRec->fsm), Name(pRec->state));
+			PrintEvent(out, pRec->eventId);
+			break;
+
+		case FSM_TRACE_PHASE_EXIT:
+			fprintf(out, "%s,exit,%s,%s,", Name(pRec->site), Name(pRec->fsm), Name(pRec->state));
+			PrintEvent(out, pRec->eventId);
+			fprintf(out, ",%sconsumed", pRec->consumed ? "" : "not_");
+			break;
+
+		case FSM_TRACE_PHASE_RUN:
+			fprintf(out, "%s,run,%s,%s,%s", Name(pRec->site), Name(pRec->fsm), Name(pRec->state),
+					Name((uint16_t)pRec->eventId));
+			break;
+
+		case FSM_TRACE_PHASE_IGNORED:
+			fprintf(out, "%s,%s,%s,", Name(pRec->site), Name(pRec->fsm), Name(pRec->state));
+			PrintEvent(out, pRec->eventId);
+			fprintf(out, ",ignored");
+			break;
+
+		default:
+			fprintf(out, "?,%d", pRec->phase);
+			break;
+	}
+
+	fprintf(out, "\n");
+}
+
+/**************************************************************************************************/
+int main (int argc, char *argv[])
+{
+	FILE		*in;
+	FILE		*out = stdout;
+	char		magic[8];
+	uint32_t	header[2];
+	uint32_t	chunk[2];
+	char		*pData = NULL;
+	size_t		dataSize = 0;
+
+	if ( (argc < 2) || (argc > 3) )
+	{
+		fprintf(stderr, "usage: %s trace.bin [out.csv]\n", argv[0]);
+		return 2;
+	}
+
+	in = fopen(argv[1], "rb");
+	if (NULL == in)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+
+	if ( (fread(magic, 1, 8, in) != 8) || memcmp(magic, FSM_TRACE_FILE_MAGIC, 8)
+	  || (fread(header, sizeof(header), 1, in) != 1) )
+	{
+		fprintf(stderr, "%s: not an FSM trace file\n", argv[1]);
+		return 1;
+	}
+
+	if ( (header[0] != FSM_TRACE_FILE_VERSION) || (header[1] != sizeof(FsmTraceRecord)) )
+	{
+		fprintf(stderr, "%s: unsupported trace version %u, record size %u\n", argv[1], header[0], header[1]);
+		return 1;
+	}
+
+	if (3 == argc)
+	{
+		out = fopen(argv[2], "w");
+		if (NULL == out)
+		{
+			perror(argv[2]);
+			return 1;
+		}
+	}
+
+	while (fread(chunk, sizeof(chunk), 1, in) == 1)
+	{
+		if (chunk[1] + 1 > dataSize)
+		{
+			dataSize = chunk[1] + 1;
+			pData = (char *)realloc(pData, dataSize);
+			if (NULL == pData)
+				return 1;
+		}
+
+		if (fread(pData, 1, chunk[1], in) != chunk[1])
+		{
+			fprintf(stderr, "%s: truncated chunk\n", argv[1]);
+			break;
+		}
+		pData[chunk[1]] = '\0';
+
+		if (FSM_TRACE_CHUNK_EVENTS == chunk[0])
+		{
+			char	*p = pData;
+
+			gEventCount = 0;
+			while ( (p < pData + chunk[1]) && (gEventCount < (int)(sizeof(gEventNames)/sizeof(gEventNames[0]))) )
+			{
+				gEventNames[gEventCount++] = strdup(p);
+				p += strlen(p) + 1;
+			}
+		}
+		else if (FSM_TRACE_CHUNK_NAME == chunk[0])
+		{
+			uint16_t	index;
+
+			memcpy(&index, pData, 2);
+			if (index < FSM_TRACE_MAX_NAMES)
+			{
+				free(gNames[index]);
+				gNames[index] = strdup(pData + 2);
+			}
+		}
+		else if (FSM_TRACE_CHUNK_RECORDS == chunk[0])
+		{
+			uint32_t		i;
+			FsmTraceRecord	rec;
+
+			for (i=0; i + sizeof(rec) <= chunk[1]; i += sizeof(rec))
+			{
+				memcpy(&rec, pData + i, sizeof(rec));
+				PrintRecord(out, &rec);
+			}
+		}
+	}
+
+	free(pData);
+	fclose(in);
+	if (out != stdout)
+		fclose(out);
+
+	return 0;
+}